@@ -17,11 +17,21 @@ LOCAL_SRC_FILES:= \
 	ifconfig.c \
 	wifconf.c \
 	utils.c \
+	log.c \
+	drbg.c \
 	fwpaths.c \
 	net.c \
 	thread.c \
 	iplist.c \
 	msgbuf.c \
+	msglog.c \
+	trace.c \
+	stats.c \
+	filter.c \
+	client.c \
+	ring.c \
+	replay.c \
+	channel.c \
 	libbfish/keyinit.c \
 	libbfish/encrypt.c \
 	libbfish/decrypt.c \
@@ -33,6 +43,7 @@ LOCAL_SRC_FILES:= \
 	chat_crypto.c \
 	chat_proc.c \
 	chat_client.c \
+	chat_load.c \
 	chat_mcast.c
 
 LOCAL_CFLAGS := -O2 -Wall
@@ -43,3 +54,30 @@ LOCAL_LDFLAGS += -Wl,--no-fatal-warnings -llog
 
 include $(BUILD_EXECUTABLE)
 
+
+# Crypto micro benchmark
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	bench/cryptobench.c \
+	chat_crypto.c \
+	drbg.c \
+	utils.c \
+	log.c \
+	thread.c \
+	libbfish/keyinit.c \
+	libbfish/encrypt.c \
+	libbfish/decrypt.c \
+	libbfish/cbc_encrypt.c \
+	libbfish/cbc_decrypt.c \
+	libbfish/ofb.c \
+	libbfish/cfb.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)
+LOCAL_CFLAGS := -O2 -Wall
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE := cryptobench
+LOCAL_LDFLAGS += -Wl,--no-fatal-warnings -llog
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,350 @@
+/*
+ *    File: cryptobench.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Micro benchmark for libbfish and the chat crypto wrappers.
+ * Reports nano seconds per operation and throughput for single
+ * 100 byte chat messages and for bulk buffers, using one or
+ * more threads.
+ *
+ * Usage: cryptobench [-n <iterations>] [-t <threads>] [-b <bulk-kB>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ibsschat.h"
+#include "libbfish/bfish.h"
+
+/* Defaults */
+#define BENCH_ITERATIONS	100000
+#define BENCH_THREADS		4
+#define BENCH_BULK_KB		64
+
+/* Benchmark key */
+#define BENCH_KEY	"cryptokey"
+
+/* The operation to benchmark, run n times */
+struct bench {
+	const char *name;
+	void (*func)(struct bench *, uint8_t *, size_t, unsigned long);
+	int size;
+		#define SIZE_NONE	0	/* No data */
+		#define SIZE_KEY	5	/* Cached key setup */
+		#define SIZE_IV		1	/* One IV */
+		#define SIZE_MSG	2	/* Whole chat message */
+		#define SIZE_DATA	3	/* Encrypted part of chat message */
+		#define SIZE_BULK	4	/* Bulk buffer */
+};
+
+/* Arguments for a benchmark thread */
+struct worker {
+	pthread_t thread;
+	struct bench *b;
+	unsigned long n;
+	size_t len;
+	uint8_t *buf;
+	double sec;
+};
+
+/* Local routines */
+static double now(void);
+static void run(struct bench *, int, unsigned long, size_t);
+
+/* Local variables */
+static struct bfish_key *bk;
+
+
+/*
+ * Monotonic time in seconds.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+/*
+ * The benchmarks
+ */
+static void
+b_keyinit(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	while (n-- > 0)
+		free(bfish_keyinit((u_char *)BENCH_KEY, strlen(BENCH_KEY)));
+}
+
+static void
+b_set_key(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	/* Alternate between two keys, served by the key cache */
+	while (n-- > 0)
+		chat_crypto_set_key(CHAT_CHAN_DEFAULT, (uint8_t *)((n & 1) ? BENCH_KEY : "otherkey"),
+			(n & 1) ? strlen(BENCH_KEY) : 8, 0);
+}
+
+static void
+b_cbc_encrypt(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	uint8_t iv[8];
+
+	memset(iv, 0x41, sizeof(iv));
+	while (n-- > 0)
+		bfish_cbc_encrypt(buf, len, iv, bk);
+}
+
+static void
+b_cbc_decrypt(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	uint8_t iv[8];
+
+	memset(iv, 0x41, sizeof(iv));
+	while (n-- > 0)
+		bfish_cbc_decrypt(buf, len, iv, bk);
+}
+
+static void
+b_ofb8(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	uint8_t iv[8];
+
+	memset(iv, 0x41, sizeof(iv));
+	while (n-- > 0)
+		bfish_ofb_encrypt(buf, len, iv, 8, bk);
+}
+
+static void
+b_ofb32(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	uint8_t iv[8];
+
+	memset(iv, 0x41, sizeof(iv));
+	while (n-- > 0)
+		bfish_ofb_encrypt(buf, len & ~3UL, iv, 32, bk);
+}
+
+static void
+b_cfb8(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	uint8_t iv[8];
+
+	memset(iv, 0x41, sizeof(iv));
+	while (n-- > 0)
+		bfish_cfb_encrypt(buf, len, iv, 8, bk);
+}
+
+static void
+b_cfb32(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	uint8_t iv[8];
+
+	memset(iv, 0x41, sizeof(iv));
+	while (n-- > 0)
+		bfish_cfb_encrypt(buf, len & ~3UL, iv, 32, bk);
+}
+
+static void
+b_drbg_iv(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	uint8_t iv[8];
+
+	while (n-- > 0)
+		drbg_bytes(iv, sizeof(iv));
+}
+
+static void
+b_chat_encrypt(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	struct message m;
+
+	memset(&m, 0x41, sizeof(m));
+	m.channel = CHAT_CHAN_DEFAULT;
+	while (n-- > 0)
+		chat_crypto_encrypt(&m);
+}
+
+static void
+b_chat_decrypt(struct bench *b, uint8_t *buf, size_t len, unsigned long n)
+{
+	struct message m;
+
+	memset(&m, 0x41, sizeof(m));
+	m.channel = CHAT_CHAN_DEFAULT;
+	chat_crypto_encrypt(&m);
+	while (n-- > 0)
+		chat_crypto_decrypt(&m);
+}
+
+
+static struct bench benches[] = {
+	{ "bfish_keyinit", b_keyinit, SIZE_NONE },
+	{ "chat_crypto_set_key", b_set_key, SIZE_KEY },
+	{ "drbg_bytes", b_drbg_iv, SIZE_IV },
+	{ "chat_crypto_encrypt", b_chat_encrypt, SIZE_MSG },
+	{ "chat_crypto_decrypt", b_chat_decrypt, SIZE_MSG },
+	{ "bfish_cbc_encrypt", b_cbc_encrypt, SIZE_DATA },
+	{ "bfish_cbc_decrypt", b_cbc_decrypt, SIZE_DATA },
+	{ "bfish_ofb(8)", b_ofb8, SIZE_DATA },
+	{ "bfish_ofb(32)", b_ofb32, SIZE_DATA },
+	{ "bfish_cfb(8)", b_cfb8, SIZE_DATA },
+	{ "bfish_cfb(32)", b_cfb32, SIZE_DATA },
+	{ "bfish_cbc_encrypt", b_cbc_encrypt, SIZE_BULK },
+	{ "bfish_cbc_decrypt", b_cbc_decrypt, SIZE_BULK },
+	{ "bfish_ofb(8)", b_ofb8, SIZE_BULK },
+	{ "bfish_ofb(32)", b_ofb32, SIZE_BULK },
+	{ "bfish_cfb(8)", b_cfb8, SIZE_BULK },
+	{ "bfish_cfb(32)", b_cfb32, SIZE_BULK },
+	{ NULL, NULL, 0 }
+};
+
+
+/*
+ * Thread entry point.
+ * Run benchmark on private buffer.
+ */
+static void *
+worker_run(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	double start;
+
+	start = now();
+	w->b->func(w->b, w->buf, w->len, w->n);
+	w->sec = now() - start;
+	return NULL;
+}
+
+
+/*
+ * Run benchmark in threads and print result.
+ */
+static void
+run(struct bench *b, int threads, unsigned long n, size_t len)
+{
+	struct worker *w;
+	double sec = 0;
+	double ns;
+	double mbs;
+	int i;
+
+	if ( (w = calloc(threads, sizeof(struct worker))) == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i=0; i < threads; i++) {
+		w[i].b = b;
+		w[i].n = n;
+		w[i].len = len;
+		if ( (w[i].buf = malloc(len)) == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		memset(w[i].buf, 0x41, len);
+	}
+
+	for (i=0; i < threads; i++) {
+		if (pthread_create(&w[i].thread, NULL, worker_run, &w[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i=0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (w[i].sec > sec)
+			sec = w[i].sec;
+		free(w[i].buf);
+	}
+	free(w);
+
+	/* Time per operation as seen by one thread,
+	 * throughput for all threads together */
+	ns = (sec * 1e9) / n;
+	mbs = ((double)len * n * threads) / (sec * 1024 * 1024);
+	printf("%-22s %8lu %3d %12.1f %10.2f\n", b->name,
+		(unsigned long)len, threads, ns, mbs);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	unsigned long n = BENCH_ITERATIONS;
+	int threads = BENCH_THREADS;
+	size_t bulk = BENCH_BULK_KB * 1024;
+	struct bench *b;
+	int c;
+
+	while ( (c = getopt(argc, argv, "n:t:b:")) != -1) {
+		switch (c) {
+			case 'n': n = strtoul(optarg, NULL, 0); break;
+			case 't': threads = atoi(optarg); break;
+			case 'b': bulk = strtoul(optarg, NULL, 0) * 1024; break;
+			default:
+				fprintf(stderr, "Usage: %s [-n <iterations>] [-t <threads>] "
+					"[-b <bulk-kB>]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((n == 0) || (threads < 1) || (bulk < 8)) {
+		fprintf(stderr, "** Error: Invalid arguments\n");
+		exit(EXIT_FAILURE);
+	}
+
+	chat_crypto_init();
+	if (chat_crypto_set_key(CHAT_CHAN_DEFAULT, (uint8_t *)BENCH_KEY, strlen(BENCH_KEY), 0) < 0)
+		exit(EXIT_FAILURE);
+
+	if ( (bk = bfish_keyinit((u_char *)BENCH_KEY, strlen(BENCH_KEY))) == NULL)
+		exit(EXIT_FAILURE);
+
+	printf("%-22s %8s %3s %12s %10s\n", "# operation", "bytes",
+		"thr", "ns/op", "MB/s");
+
+	for (b=benches; b->name != NULL; b++) {
+		unsigned long iter = n;
+		size_t len = 0;
+
+		switch (b->size) {
+			case SIZE_NONE: 
+				/* Key setup is slow, run fewer */
+				iter = n / 100;
+				break;
+			case SIZE_KEY: break;
+			case SIZE_IV: len = 8; break;
+			case SIZE_MSG: len = sizeof(struct message); break;
+			case SIZE_DATA: len = MSGSIZE - MSGHDRSIZE; break;
+			case SIZE_BULK:
+				/* Keep bulk runs about as long as message runs */
+				len = bulk;
+				iter = (n * (MSGSIZE - MSGHDRSIZE)) / bulk;
+				break;
+		}
+
+		if (iter == 0)
+			iter = 1;
+
+		run(b, 1, iter, len);
+		if (threads > 1)
+			run(b, threads, iter, len);
+	}
+
+	free(bk);
+	return 0;
+}
@@ -0,0 +1,528 @@
+/*
+ *    File: msgbench.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Micro benchmark for the message buffer (msgbuf.c).
+ *
+ * Each operation is run with the buffer filled with 10, 1000
+ * and 100000 messages before the run (a fill above the capacity
+ * of the buffer, set in bytes with -m, leave it full, with the
+ * oldest messages dropped),
+ * with a duplicate heavy and a unique heavy mix, and from 1 up to
+ * the given number of threads (in powers of two) sharing the buffer:
+ *
+ *  - add     msgbuf_add(), duplicates are messages in the buffer
+ *            seen again, the others are new and appended
+ *  - exist   msgbuf_exist(), duplicates are hits, the others misses
+ *  - delete  msgbuf_delete(), duplicates are hits, the others misses.
+ *            The deleted messages are added again between batches,
+ *            outside of the measured time
+ *  - query   msgbuf_query() of the whole buffer to /dev/null
+ *  - sync    msgbuf_sync_read() of encrypted messages from a file,
+ *            duplicates are messages already in the buffer
+ *
+ * Nano seconds per operation is the time of one thread, operations
+ * per second is for all threads together. Lines not starting with
+ * '#' are "<op> <fill> <mix> <threads> <held> <ns/op> <ops/s>", so
+ * the output can be kept as a baseline, and a later run given the
+ * baseline with -b print the change in ns/op of each line.
+ *
+ * Usage: msgbench [-n <iterations>] [-t <threads>] [-m <bytes>] [-b <baseline>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ibsschat.h"
+
+/* Defaults */
+#define BENCH_ITERATIONS	100000
+#define BENCH_THREADS		8
+#define BENCH_BYTES			(64 * 1024 * 1024)
+
+/* Benchmark key */
+#define BENCH_KEY	"cryptokey"
+
+/* Percent of operations on messages in the buffer */
+#define MIX_DUP		90
+#define MIX_UNIQUE	10
+
+/* Sender address of the messages filling the buffer, and of the
+ * new messages from each thread (BENCH_IP + 1 + thread) */
+#define BENCH_IP	0x0a000001
+
+/* Messages deleted between restores */
+#define DELETE_BATCH	64
+
+/* Arguments for a benchmark thread */
+struct worker {
+	pthread_t thread;
+	struct bench *b;
+	int id;
+	int mix;
+	unsigned long n;
+	unsigned int seed;
+	uint32_t next;		/* Next new message */
+	int fd;				/* Query output or sync input */
+	int timed;			/* The benchmark measured sec itself */
+	double sec;
+};
+
+/* The operation to benchmark */
+struct bench {
+	const char *name;
+	void (*func)(struct worker *);
+	int mixed;			/* Run with both mixes */
+	int div;			/* Fewer iterations for slow operations */
+};
+
+/* A baseline result */
+struct baseline {
+	char op[16];
+	uint32_t fill;
+	char mix[8];
+	int threads;
+	double ns;
+};
+
+/* Local routines */
+static double now(void);
+static void message(struct message *, uint32_t, uint32_t);
+static uint32_t fill(uint32_t);
+static int sync_file(struct worker *);
+static void run(struct bench *, uint32_t, int, int, unsigned long);
+static int baseline_load(const char *);
+
+/* Local variables */
+static uint32_t held;			/* Messages in the buffer after fill */
+static uint32_t filled;			/* Messages added by fill */
+static struct baseline *base;
+static int nbase;
+
+
+/*
+ * Monotonic time in seconds.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+/*
+ * Set up chat message number n from sender ip.
+ */
+static void
+message(struct message *m, uint32_t ip, uint32_t n)
+{
+	struct chatmsg *cm = (struct chatmsg *)m;
+
+	memset(m, 0x00, sizeof(struct message));
+	cm->type = CHAT_MSG;
+	cm->channel = CHAT_CHAN_DEFAULT;
+	cm->id.ip = htonl(ip);
+	cm->id.sec = htonl(n);
+	cm->id.usec = htons(n & 0xffff);
+	snprintf(cm->txt.msg, sizeof(cm->txt.msg), "%u_benchmark", n);
+	msgbuf_setsum(m);
+}
+
+
+/*
+ * Empty the buffer and add n messages.
+ * Return the number of messages held by the buffer.
+ */
+static uint32_t
+fill(uint32_t n)
+{
+	struct chatquery q;
+	struct message m;
+	uint32_t i;
+	int fd;
+	int ret;
+
+	msgbuf_flush(CHAT_CHAN_DEFAULT);
+	for (i = 0; i < n; i++) {
+		message(&m, BENCH_IP, i);
+		msgbuf_add(&m);
+	}
+	filled = n;
+
+	if ( (fd = open("/dev/null", O_WRONLY)) < 0) {
+		perror("/dev/null");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&q, 0x00, sizeof(q));
+	q.channels = 1 << CHAT_CHAN_DEFAULT;
+	ret = msgbuf_query(fd, 0, &q, NULL, 0);
+	close(fd);
+	return (ret < 0) ? 0 : ret;
+}
+
+
+/*
+ * A message in the buffer, the newest held messages of the fill.
+ */
+#define held_msg(w, m) \
+	message((m), BENCH_IP, filled - 1 - (rand_r(&(w)->seed) % held))
+
+/*
+ * A new message from the thread.
+ */
+#define new_msg(w, m) \
+	message((m), BENCH_IP + 1 + (w)->id, (w)->next++)
+
+/* The operation is on a message in the buffer */
+#define is_dup(w) \
+	((int)(rand_r(&(w)->seed) % 100) < (w)->mix)
+
+
+/*
+ * The benchmarks
+ */
+static void
+b_add(struct worker *w)
+{
+	struct message m;
+	unsigned long n;
+
+	for (n = 0; n < w->n; n++) {
+		if (is_dup(w))
+			held_msg(w, &m);
+		else
+			new_msg(w, &m);
+		msgbuf_add(&m);
+	}
+}
+
+static void
+b_exist(struct worker *w)
+{
+	struct message m;
+	unsigned long n;
+
+	for (n = 0; n < w->n; n++) {
+		if (is_dup(w))
+			held_msg(w, &m);
+		else
+			new_msg(w, &m);
+		msgbuf_exist(&m);
+	}
+}
+
+static void
+b_delete(struct worker *w)
+{
+	struct message m[DELETE_BATCH];
+	int deleted[DELETE_BATCH];
+	unsigned long n;
+	double start;
+	int i;
+
+	for (n = 0; n < w->n; n += DELETE_BATCH) {
+		int batch = DELETE_BATCH;
+
+		if (w->n - n < DELETE_BATCH)
+			batch = w->n - n;
+
+		for (i = 0; i < batch; i++) {
+			if (is_dup(w))
+				held_msg(w, &m[i]);
+			else
+				new_msg(w, &m[i]);
+		}
+
+		start = now();
+		for (i = 0; i < batch; i++)
+			deleted[i] = msgbuf_delete(&m[i]);
+		w->sec += now() - start;
+
+		/* Restore the deleted messages */
+		for (i = 0; i < batch; i++) {
+			if (deleted[i] == 1)
+				msgbuf_add(&m[i]);
+		}
+	}
+	w->timed = 1;
+}
+
+static void
+b_query(struct worker *w)
+{
+	struct chatquery q;
+	unsigned long n;
+
+	memset(&q, 0x00, sizeof(q));
+	q.channels = 1 << CHAT_CHAN_DEFAULT;
+	for (n = 0; n < w->n; n++)
+		msgbuf_query(w->fd, 0, &q, NULL, 0);
+}
+
+static void
+b_sync(struct worker *w)
+{
+	msgbuf_sync_read(w->fd, 1 << CHAT_CHAN_DEFAULT);
+}
+
+
+static struct bench benches[] = {
+	{ "add", b_add, 1, 1 },
+	{ "exist", b_exist, 1, 1 },
+	{ "delete", b_delete, 1, 1 },
+	{ "query", b_query, 0, 1000 },
+	{ "sync", b_sync, 1, 1 },
+	{ NULL, NULL, 0, 0 }
+};
+
+
+/*
+ * Write the encrypted messages that thread read
+ * with msgbuf_sync_read() to a temporary file.
+ * Return 0 on success, -1 on error.
+ */
+static int
+sync_file(struct worker *w)
+{
+	struct message m;
+	unsigned long n;
+	FILE *fp;
+
+	if ( (fp = tmpfile()) == NULL) {
+		perror("tmpfile");
+		return -1;
+	}
+
+	for (n = 0; n < w->n; n++) {
+		if (is_dup(w))
+			held_msg(w, &m);
+		else
+			new_msg(w, &m);
+
+		if ((chat_crypto_encrypt(&m) < 0) ||
+				(fwrite(&m, sizeof(m), 1, fp) != 1)) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	fflush(fp);
+
+	w->fd = dup(fileno(fp));
+	fclose(fp);
+	lseek(w->fd, 0, SEEK_SET);
+	return 0;
+}
+
+
+/*
+ * Thread entry point.
+ * Run benchmark.
+ */
+static void *
+worker_run(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	double start;
+
+	start = now();
+	w->b->func(w);
+	if (w->timed == 0)
+		w->sec = now() - start;
+	return NULL;
+}
+
+
+/*
+ * Run benchmark in threads on buffer filled with
+ * fill messages, and print result.
+ */
+static void
+run(struct bench *b, uint32_t nfill, int mix, int threads, unsigned long n)
+{
+	struct worker *w;
+	const char *mixname;
+	double sec = 0;
+	double ns;
+	double ops;
+	int i;
+
+	mixname = (b->mixed == 0) ? "-" : (mix == MIX_DUP) ? "dup" : "unique";
+
+	if ( (w = calloc(threads, sizeof(struct worker))) == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	held = fill(nfill);
+
+	for (i=0; i < threads; i++) {
+		w[i].b = b;
+		w[i].id = i;
+		w[i].mix = mix;
+		w[i].n = n;
+		w[i].seed = i + 1;
+		w[i].fd = -1;
+
+		if (b->func == b_query) {
+			if ( (w[i].fd = open("/dev/null", O_WRONLY)) < 0) {
+				perror("/dev/null");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (b->func == b_sync) {
+			if (sync_file(&w[i]) < 0) {
+				fprintf(stderr, "** Error: Failed to write sync messages\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	for (i=0; i < threads; i++) {
+		if (pthread_create(&w[i].thread, NULL, worker_run, &w[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i=0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (w[i].sec > sec)
+			sec = w[i].sec;
+		if (w[i].fd >= 0)
+			close(w[i].fd);
+	}
+	free(w);
+
+	/* Time per operation as seen by one thread,
+	 * throughput for all threads together */
+	ns = (sec * 1e9) / n;
+	ops = ((double)n * threads) / sec;
+	printf("%-8s %7u %-6s %3d %7u %12.1f %12.0f", b->name,
+		nfill, mixname, threads, held, ns, ops);
+
+	for (i = 0; i < nbase; i++) {
+		if ((strcmp(base[i].op, b->name) == 0) && (base[i].fill == nfill) &&
+				(strcmp(base[i].mix, mixname) == 0) &&
+				(base[i].threads == threads)) {
+			printf(" %+7.1f%%", 100.0 * (ns - base[i].ns) / base[i].ns);
+			break;
+		}
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+
+/*
+ * Read baseline results written by an earlier run.
+ * Return 0 on success, -1 on error.
+ */
+static int
+baseline_load(const char *path)
+{
+	char line[256];
+	FILE *fp;
+
+	if ( (fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "** Error: Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		struct baseline b;
+		unsigned int h;
+
+		if ((line[0] == '#') || (sscanf(line, "%15s %u %7s %d %u %lf",
+				b.op, &b.fill, b.mix, &b.threads, &h, &b.ns) != 6) || (b.ns <= 0))
+			continue;
+
+		if ( (base = realloc(base, (nbase + 1) * sizeof(struct baseline))) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		base[nbase++] = b;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	static const uint32_t fills[] = { 10, 1000, 100000 };
+	static const int mixes[] = { MIX_DUP, MIX_UNIQUE };
+	unsigned long n = BENCH_ITERATIONS;
+	int threads = BENCH_THREADS;
+	size_t bytes = BENCH_BYTES;
+	struct bench *b;
+	int f;
+	int m;
+	int t;
+	int c;
+
+	while ( (c = getopt(argc, argv, "n:t:m:b:")) != -1) {
+		switch (c) {
+			case 'n': n = strtoul(optarg, NULL, 0); break;
+			case 't': threads = atoi(optarg); break;
+			case 'm': bytes = size_parse(optarg); break;
+			case 'b':
+				if (baseline_load(optarg) < 0)
+					exit(EXIT_FAILURE);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n <iterations>] [-t <threads>] "
+					"[-m <bytes>] [-b <baseline>]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((n == 0) || (threads < 1)) {
+		fprintf(stderr, "** Error: Invalid arguments\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Own address differ from every benchmark sender */
+	if ((msgbuf_config(bytes) < 0) || (msgbuf_init(htonl(BENCH_IP - 1)) < 0))
+		exit(EXIT_FAILURE);
+	if ((client_init() < 0) || (chat_crypto_init() < 0) ||
+			(chat_crypto_set_key(CHAT_CHAN_DEFAULT, (uint8_t *)BENCH_KEY,
+			strlen(BENCH_KEY), 0) < 0))
+		exit(EXIT_FAILURE);
+
+	printf("# %-6s %7s %-6s %3s %7s %12s %12s%s\n", "op", "fill", "mix",
+		"thr", "held", "ns/op", "ops/s", nbase ? "   change" : "");
+
+	for (b=benches; b->name != NULL; b++) {
+		unsigned long iter = n / b->div;
+
+		if (iter == 0)
+			iter = 1;
+
+		for (f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+			for (m = 0; m < (b->mixed ? 2 : 1); m++) {
+				for (t = 1; t <= threads; t *= 2)
+					run(b, fills[f], mixes[m], t, iter);
+			}
+		}
+	}
+
+	free(base);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ *    File: channel.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * The table of chat channels.
+ * Each channel is mapped to its own multicast group so that
+ * a node only receive traffic for the channels it has joined,
+ * everything else is dropped by the multicast filter of the
+ * network interface.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ibsschat.h"
+
+/* A channel */
+struct channel {
+	char name[CHAT_CHAN_NAMELEN];
+	uint8_t joined;
+};
+
+/* Local variables */
+static lock_t chanlock;
+static struct channel channels[CHAT_MAXCHANNELS];
+
+
+/*
+ * Initialize the channel table with the
+ * default channel joined.
+ */
+void
+channel_init(void)
+{
+	thread_memlock_init(&chanlock);
+	memset(channels, 0x00, sizeof(channels));
+
+	snprintf(channels[CHAT_CHAN_DEFAULT].name, CHAT_CHAN_NAMELEN, "main");
+	channels[CHAT_CHAN_DEFAULT].joined = 1;
+}
+
+
+/*
+ * Join channel.
+ * Return 0 on success, -1 on error.
+ */
+int
+channel_join(uint8_t id, const char *name)
+{
+	if (id >= CHAT_MAXCHANNELS) {
+		anderr("** Error: Invalid channel %u\n", id);
+		return -1;
+	}
+
+	thread_memlock_lock(&chanlock);
+	snprintf(channels[id].name, CHAT_CHAN_NAMELEN, "%s", name);
+	channels[id].joined = 1;
+	thread_memlock_unlock(&chanlock);
+	return 0;
+}
+
+
+/*
+ * Leave channel, the default channel can not be left.
+ * Return 0 on success, -1 on error.
+ */
+int
+channel_leave(uint8_t id)
+{
+	if ((id >= CHAT_MAXCHANNELS) || (id == CHAT_CHAN_DEFAULT)) {
+		anderr("** Error: Can not leave channel %u\n", id);
+		return -1;
+	}
+
+	thread_memlock_lock(&chanlock);
+	channels[id].joined = 0;
+	thread_memlock_unlock(&chanlock);
+	return 0;
+}
+
+
+/*
+ * Return 1 if channel is joined, 0 otherwise.
+ */
+int
+channel_joined(uint8_t id)
+{
+	if (id >= CHAT_MAXCHANNELS)
+		return 0;
+
+	return channels[id].joined;
+}
+
+
+/*
+ * Return the multicast group of the channel
+ * in network byte order.
+ */
+uint32_t
+channel_group(uint8_t id)
+{
+	return htonl(ntohl(inet_addr(CHAT_GROUP)) + id);
+}
+
+
+/*
+ * Return a bit mask of the joined channels.
+ */
+uint32_t
+channel_mask(void)
+{
+	uint32_t mask = 0;
+	int i;
+
+	thread_memlock_lock(&chanlock);
+	for (i=0; i < CHAT_MAXCHANNELS; i++) {
+		if (channels[i].joined)
+			mask |= (1 << i);
+	}
+	thread_memlock_unlock(&chanlock);
+	return mask;
+}
+
+
+/*
+ * Copy the name of the channel to buf.
+ * Return a pointer to buf.
+ */
+const char *
+channel_name(uint8_t id, char *buf, size_t len)
+{
+	buf[0] = '\0';
+	if (id >= CHAT_MAXCHANNELS)
+		return buf;
+
+	thread_memlock_lock(&chanlock);
+	snprintf(buf, len, "%s", channels[id].name);
+	thread_memlock_unlock(&chanlock);
+	return buf;
+}
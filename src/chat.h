@@ -35,6 +35,10 @@ struct msgid {
  */
 #define MSGSIZE	100
 
+/* Size of the cleartext message header
+ * (type, key epoch, channel, message ID and IV) */
+#define MSGHDRSIZE (1+1+1+sizeof(struct msgid)+8)
+
 /* The basic message */
 struct message {
 
@@ -43,31 +47,42 @@ struct message {
 		#define CHAT_DISCOVER 1
 		#define CHAT_MSG 2
 
+	/* Epoch of the key used to encrypt the message */
+	uint8_t epoch;
+
+	/* The channel the message belong to */
+	uint8_t channel;
+
 	struct msgid id;
 
 	/* Crypto IV */
 	uint8_t iv[8];
 
-	char pad[MSGSIZE - (sizeof(struct msgid)+1+8)]; 
+	char pad[MSGSIZE - MSGHDRSIZE]; 
 } __attribute__((packed));
 
 
 /* Chat Discovery Message */
 struct discover {
 	uint8_t type;
+	uint8_t epoch;
+	uint8_t channel;
 	struct msgid id;
-    char pad[MSGSIZE - (sizeof(struct msgid)+1)]; 
+	uint8_t iv[8];
+    char pad[MSGSIZE - MSGHDRSIZE]; 
 } __attribute__((packed));
 
 
 struct chatxt {
-	char msg[MSGSIZE - (sizeof(struct msgid)+1+8)];  
+	char msg[MSGSIZE - MSGHDRSIZE];  
 } __attribute__((packed)); 
 
 
 /* A single chat message (100 bytes) */
 struct chatmsg {
 	uint8_t type;
+	uint8_t epoch;
+	uint8_t channel;
 	struct msgid id;
 	uint8_t iv[8];
 	struct chatxt txt;
@@ -78,26 +93,158 @@ struct chatmsg {
 	(((m)->type == CHAT_DISCOVER) || \
 	((m)->type == CHAT_MSG))
 
+/* Local client sockets (SOCK_SEQPACKET) in the abstract namespace */
+#define CHAT_UNIX_SEND "ibsschat-send"
+#define CHAT_UNIX_RECV "ibsschat-recv"
+
 /* For multicast and discovery */
 #define CHAT_SEND_PORT 11012
 #define CHAT_RECV_PORT 11013
-#define CHAT_GROUP  "239.0.0.1"
 #define CHAT_GROUP_PORT 11011
 
+/* 
+ * Channels.
+ * Each channel has its own multicast group, CHAT_GROUP + channel ID,
+ * key and message buffer. Channel zero is the default channel 
+ * which is always joined and carry the discovery messages.
+ */
+#define CHAT_GROUP  "239.0.0.1"
+#define CHAT_MAXCHANNELS 16
+#define CHAT_CHAN_DEFAULT 0
+#define CHAT_CHAN_NAMELEN 16
+#define CHAT_CHAN_ALL 0x0000ffff
+
+#define msgchan_valid(m) \
+	((m)->channel < CHAT_MAXCHANNELS)
+
+/* Request written by local clients to CHAT_SEND_PORT */
+struct chatreq {
+	uint8_t channel;
+	struct chatxt txt;
+} __attribute__((packed));
+
+/* 
+ * Pipelined send session on CHAT_SEND_PORT.
+ * The client write CHAT_SESSION in place of the channel of
+ * a single request, followed by any number of chatsendreq. 
+ * Each request is answered with a chatsendres when the message
+ * has been acknowledged (or failed), in the order they complete.
+ */
+#define CHAT_SESSION 0xff
+
+struct chatsendreq {
+	uint32_t reqid;
+	struct chatreq req;
+} __attribute__((packed));
+
+struct chatsendres {
+	uint32_t reqid;
+	int32_t ret;	/* Network byte order, 0 on success */
+} __attribute__((packed));
+
+/* Client end of a send session */
+struct chatsession {
+	int sock;
+	uint32_t reqid;	/* Last request ID used */
+};
+
+/* Subscription written by clients connecting to CHAT_RECV_PORT */
+struct chatsub {
+	uint32_t channels; /* Bit mask of channels */
+} __attribute__((packed));
+
+/* Subscription flag, only dump the buffered messages and 
+ * disconnect, new messages are read from the message ring */
+#define CHAT_SUB_NOLIVE 0x80000000
+
+/* Subscription flag, the rest of a struct chatquery follow */
+#define CHAT_SUB_QUERY 0x40000000
+
+/* History query written by clients connecting to CHAT_RECV_PORT,
+ * an extended subscription. All fields are in network byte order
+ * and zero means no limit. */
+struct chatquery {
+	uint32_t channels;	/* Bit mask of channels, with CHAT_SUB_QUERY */
+	uint32_t cursor;	/* Messages stored after this cursor */
+	uint32_t since;		/* Messages first seen at or after (UTC seconds) */
+	uint32_t until;		/* Messages first seen before (UTC seconds) */
+	uint32_t sender;	/* Messages from this IPv4 address */
+	uint32_t max;		/* Only the newest max messages */
+} __attribute__((packed));
+
+/* Subscription flag, a struct chatfilter follow the
+ * subscription, or the query if CHAT_SUB_QUERY is set */
+#define CHAT_SUB_FILTER 0x20000000
+
+#define CHAT_FILTER_KEYLEN 32
+
+/* Filter on messages sent to a receive client, evaluated
+ * by the chat process. Zero or empty fields match all. */
+struct chatfilter {
+	uint16_t types;		/* Bit mask of message types, (1 << CHAT_MSG) */
+	uint8_t prefixlen;	/* Number of bits in sender prefix */
+	uint32_t prefix;	/* Sender address prefix */
+	char keyword[CHAT_FILTER_KEYLEN]; /* Text contain keyword */
+} __attribute__((packed));
+
+/* Written before the messages answering a query */
+struct chatqueryres {
+	uint32_t count;		/* Number of messages that follow */
+	uint32_t cursor;	/* Cursor to resume from */
+} __attribute__((packed));
+
 /* chat_proc.c */
-extern void chat_proc_run(char *);
+extern void chat_proc_run(char *, int);
 
 /* chat_mcast.c */
 extern int chat_mcast_reader_start(uint32_t, uint32_t);
+extern int chat_mcast_join(uint8_t);
+extern int chat_mcast_leave(uint8_t);
 extern void iplist_reset(void);
 extern void iplist_clean(uint32_t *);
 extern int mcast_send(struct message *, int);
+extern int mcast_forward(int, int);
+extern useconds_t mcast_resend_delay(int);
+
+/* channel.c */
+extern void channel_init(void);
+extern int channel_join(uint8_t, const char *);
+extern int channel_leave(uint8_t);
+extern int channel_joined(uint8_t);
+extern uint32_t channel_group(uint8_t);
+extern uint32_t channel_mask(void);
+extern const char *channel_name(uint8_t, char *, size_t);
+
+/* replay.c */
+
+/* Messages that are this many seconds older than the newest 
+ * message seen from the same sender are dropped as replays */
+#define REPLAY_WINDOW 300
+
+/* The window is not moved further than this many 
+ * seconds ahead of the local clock */
+#define REPLAY_FUTURE 300
+
+/* Senders that have not moved their window for this
+ * many seconds are forgotten */
+#define REPLAY_STALE 3600
+
+extern void replay_init(void);
+extern int replay_check(struct msgid *);
+extern void replay_update(struct msgid *);
 
 /* chat_crypto.c */
 #define CRYPTO_KEY_MAXLEN 60
+
+/* Number of seconds that the previous key is accepted
+ * for decryption after rolling over to a new key epoch */
+#define CRYPTO_KEY_GRACE 600
+
 extern int chat_crypto_init(void);
-extern int chat_crypto_set_key(uint8_t *, size_t);
-extern size_t chat_crypto_get_key(uint8_t *);
+extern int chat_crypto_set_key(uint8_t, uint8_t *, size_t, uint8_t);
+extern int chat_crypto_rotate_key(uint8_t, uint8_t *, size_t, uint8_t);
+extern size_t chat_crypto_get_key(uint8_t, uint8_t *, uint8_t *);
+extern void chat_crypto_clear_key(uint8_t);
 extern int chat_crypto_encrypt(struct message *);
 extern int chat_crypto_decrypt(struct message *);
 
@@ -105,18 +252,195 @@ extern int chat_crypto_decrypt(struct message *);
 extern int msgbuf_add(struct message *);
 extern int msgbuf_exist(struct message *);
 extern void msgbuf_setid(struct message *);
-extern void msgbuf_init(uint32_t);
-extern int msgbuf_dump(int, int);
-extern int msgbuf_addsock(int);
-extern int msgbuf_delsock(int);
+extern void msgbuf_setsum(struct message *);
+extern int msgbuf_verify(struct message *);
+extern int msgbuf_config(size_t);
+extern int msgbuf_init(uint32_t);
+extern int msgbuf_query(int, int, struct chatquery *, struct chatfilter *, int);
 extern void msgbuf_print(struct message *);
 extern int msgbuf_delete(struct message *);
-extern int msgbuf_sync(uint32_t, uint16_t);
+extern int msgbuf_sync(uint32_t, uint16_t, uint32_t, uint32_t);
+extern int msgbuf_sync_read(int, uint32_t);
+extern void msgbuf_flush(uint8_t);
+extern int msgbuf_restore(struct message *, struct timeval *, uint32_t);
+extern uint32_t msgbuf_capacity(void);
+
+/* msglog.c */
+#define MSGLOG_MAGIC	0x4942534c	/* "IBSL" */
+#define MSGLOG_VERSION	1
+
+/* Number of records in a segment of the log */
+#define MSGLOG_RECORDS	4096
+
+/* Log operations */
+#define MSGLOG_ADD		1	/* Message stored */
+#define MSGLOG_DELETE	2	/* Message deleted */
+#define MSGLOG_FLUSH	3	/* Channel flushed */
+
+/* After a restore, messages first seen by other nodes this many
+ * seconds before the newest restored message are synchronized,
+ * to cover the difference between the clocks of the nodes */
+#define MSGLOG_SYNC_SLACK	300
+
+/* Header of log segment, followed by the records */
+struct msglog_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t records;
+	uint32_t recsize;
+	uint32_t number;		/* Number of the segment */
+	volatile uint32_t count;	/* Number of records written */
+};
+
+/* A log record */
+struct msglog_rec {
+	uint32_t sec;			/* Time stamp when first seen */
+	uint32_t usec;
+	uint32_t count;			/* Number of times seen */
+	uint8_t op;
+	uint8_t pad[3];
+	struct message msg;
+};
+
+#define MSGLOG_SIZE \
+	(sizeof(struct msglog_hdr) + (MSGLOG_RECORDS * sizeof(struct msglog_rec)))
+
+extern void msglog_config(const char *);
+extern int msglog_open(void);
+extern uint32_t msglog_since(void);
+extern void msglog_add(struct message *, struct timeval *, uint32_t);
+extern void msglog_delete(struct message *);
+extern void msglog_flush(uint8_t);
+
+/* client.c */
+extern int client_init(void);
+extern int client_add(int, uint32_t, struct chatfilter *, int);
+extern int client_resume(int);
+extern int client_del(int);
+extern int client_queue(struct message *);
+
+/* filter.c */
+extern int filter_valid(struct chatfilter *);
+extern int filter_match(struct chatfilter *, struct message *);
+
+/* ring.c */
+struct ringhdr;
+struct ringbell;
+struct ringreader {
+	struct ringhdr *hdr;
+	struct ringbell *bell;
+	size_t size;
+	uint32_t seq;	/* Next message to read */
+	uint32_t lost;	/* Messages overwritten before read */
+};
+
+extern int ring_init(void);
+extern void ring_publish(struct message *);
+extern int ring_attach(struct ringreader *);
+extern void ring_detach(struct ringreader *);
+extern int ring_read(struct ringreader *, struct message *, int);
+
+/* trace.c */
+#define TRACE_MAGIC		0x49425354	/* "IBST" */
+#define TRACE_VERSION	1
+
+/* Number of records in trace file, must be a power of two */
+#define TRACE_RECORDS	65536
+
+/* Trace events */
+#define TRACE_SEND		1	/* Local message sent (n = attempt) */
+#define TRACE_NOACK		2	/* Local message never acked */
+#define TRACE_RECV		3	/* Message received (n = times seen) */
+#define TRACE_FWD		4	/* Message forwarded */
+#define TRACE_DROP		5	/* Message dropped */
+#define TRACE_DELIVER	6	/* New message queued (n = clients) */
+
+/* Reason of forward */
+#define TRACE_FWD_FIRST		1	/* First time seen */
+#define TRACE_FWD_ORIGIN	2	/* Echo from the sender of the message */
+#define TRACE_FWD_PROB		3	/* Probabilistic re-broadcast */
+
+/* Reason of drop */
+#define TRACE_DROP_SIZE		1	/* Truncated message */
+#define TRACE_DROP_CHANNEL	2	/* Not member of channel */
+#define TRACE_DROP_REPLAY	3	/* Outside replay window */
+#define TRACE_DROP_DECRYPT	4	/* Decryption or checksum failed */
+#define TRACE_DROP_TYPE		5	/* Unknown message type */
+#define TRACE_DROP_SELF		6	/* Own message */
+
+/* Header of trace file, followed by the records */
+struct tracehdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t records;
+	uint32_t recsize;
+	uint32_t node;			/* IPv4 address of traced node */
+	volatile uint32_t next;	/* Number of records written */
+	uint64_t start;			/* Micro seconds since epoch */
+};
+
+/* A trace record */
+struct tracerec {
+	uint64_t usec;			/* Micro seconds since epoch */
+	struct msgid id;
+	uint32_t from;			/* Forwarder of received message */
+	volatile uint32_t seq;	/* Record number + 1, zero while written */
+	uint16_t n;
+	uint8_t event;
+	uint8_t reason;
+	uint8_t channel;
+	uint8_t type;
+	uint8_t pad[6];
+};
+
+#define TRACE_SIZE \
+	(sizeof(struct tracehdr) + (TRACE_RECORDS * sizeof(struct tracerec)))
+
+extern void trace_config(const char *);
+extern int trace_open(uint32_t);
+extern void trace_event(uint8_t, uint8_t, struct message *, uint32_t, uint32_t);
+
+/* stats.c */
+
+/* Counters */
+#define STATS_RECV			0	/* Packets received */
+#define STATS_SENT			1	/* Transmissions of local messages */
+#define STATS_FWD			2	/* Messages forwarded */
+#define STATS_DUP			3	/* Duplicates not forwarded */
+#define STATS_REPLAY		4	/* Replayed messages dropped */
+#define STATS_DECRYPT		5	/* Decryption failures */
+#define STATS_NOACK			6	/* Local messages never acked */
+#define STATS_SYNC_RX		7	/* Bytes read when synchronizing */
+#define STATS_SYNC_TX		8	/* Bytes written to synchronizing nodes */
+#define STATS_CLIENT_DROP	9	/* Messages not queued for slow clients */
+#define STATS_EXPIRED		10	/* Messages expired from the buffer */
+#define STATS_COUNTERS		11
+
+/* Histograms */
+#define STATS_ACK_USEC		0	/* Acknowledge latency */
+#define STATS_XMITS			1	/* Transmissions per local message */
+#define STATS_QDEPTH		2	/* Client queue depth */
+#define STATS_HISTS			3
+
+extern int stats_init(void);
+extern void stats_add(int, uint64_t);
+extern void stats_record(int, uint32_t);
+extern int stats_print(void);
 
 /* chat_client.c */
 extern int chat_prompt(const char *);
-extern int chat_send(const char *, const char *);
+extern int chat_send(const char *, uint8_t, const char *);
+extern int chat_history(const char *, uint32_t, uint32_t, const char *);
+extern int chat_listen(const char *, int, char **);
+extern int chat_session_open(struct chatsession *, const char *);
+extern int chat_session_send(struct chatsession *, uint8_t, const char *, uint32_t *);
+extern int chat_session_result(struct chatsession *, uint32_t *, int *);
+extern void chat_session_close(struct chatsession *);
 extern int chat_send_rand(const char *, int, int);
 extern int chat_status(const char *);
 
+/* chat_load.c */
+extern int chat_load(const char *, double, int, int, int, int, int);
+extern int chat_load_recv(const char *, int);
+
 #endif /* _CHAT_H */
@@ -23,8 +23,24 @@
 
 #include "ibsschat.h"
 
+/* IDs of the messages read in the dump, with an open 
+ * addressing index for skipping them in the ring */
+struct dumpset {
+	struct msgid *id;
+	uint32_t n;
+	uint32_t size;
+	uint32_t *index;	/* Index + 1 of ID, zero for free slot */
+	uint32_t mask;
+};
+
 /* Local routines */
 static void *client_read_messages(void *iface);
+static void client_message(struct message *);
+static void *client_read_results(void *);
+static uint32_t dump_hash(struct msgid *);
+static void dump_add(struct dumpset *, struct msgid *);
+static void dump_index(struct dumpset *);
+static int dump_has(struct dumpset *, struct msgid *);
 
 /* Number of messages read */
 static uint32_t msgcount = 0;
@@ -36,51 +52,214 @@ static uint32_t ips = 0;
 /* Lock */
 lock_t statlock;
 
+/* Text of the last messages sent from the prompt, 
+ * indexed by request ID, for reporting failures */
+#define PENDING_MAX 64
+static char pending[PENDING_MAX][sizeof(((struct chatxt *)0)->msg)];
+
+/*
+ * Count and print received message.
+ */
+static void
+client_message(struct message *msg)
+{
+	/* Statistics */
+	thread_memlock_lock(&statlock);
+	msgcount++;
+	if (iplist_add(htonl(msg->id.ip), &iplist, ips))
+		ips++;
+	thread_memlock_unlock(&statlock);
+
+	/* Print message */
+	msgbuf_print(msg);
+}
+
+
+/*
+ * Hash of message ID for the dump index.
+ */
+static uint32_t
+dump_hash(struct msgid *id)
+{
+	uint32_t h;
+
+	h = id->ip * 2654435761U;
+	h ^= id->sec * 2246822519U;
+	h ^= ((((uint32_t)id->usec) << 16) | id->sum) * 3266489917U;
+	return h ^ (h >> 15);
+}
+
+
+/*
+ * Remember message ID of the dump, the array 
+ * is doubled when it is full.
+ */
+static void
+dump_add(struct dumpset *ds, struct msgid *id)
+{
+	if (ds->n == ds->size) {
+		uint32_t size = ds->size ? (ds->size << 1) : 64;
+		struct msgid *p;
+
+		if ( (p = realloc(ds->id, size * sizeof(struct msgid))) == NULL)
+			return;
+		ds->id = p;
+		ds->size = size;
+	}
+	memcpy(&ds->id[ds->n++], id, sizeof(struct msgid));
+}
+
+
+/*
+ * Index the IDs of the dump, at most half of the slots are used.
+ * If the index can not be allocated, no ID is found in it.
+ */
+static void
+dump_index(struct dumpset *ds)
+{
+	uint32_t slots = 16;
+	uint32_t i;
+
+	while (slots < (ds->n << 1))
+		slots <<= 1;
+
+	if ( (ds->index = calloc(slots, sizeof(uint32_t))) == NULL)
+		return;
+	ds->mask = slots - 1;
+
+	for (i=0; i < ds->n; i++) {
+		uint32_t h = dump_hash(&ds->id[i]) & ds->mask;
+
+		while (ds->index[h] != 0)
+			h = (h + 1) & ds->mask;
+		ds->index[h] = i + 1;
+	}
+}
+
+
+/*
+ * Return 1 if message ID was read in the dump, 0 otherwise.
+ */
+static int
+dump_has(struct dumpset *ds, struct msgid *id)
+{
+	uint32_t h;
+
+	if (ds->index == NULL)
+		return 0;
+
+	for (h = dump_hash(id) & ds->mask; ds->index[h] != 0; 
+			h = (h + 1) & ds->mask) {
+		if (memcmp(&ds->id[ds->index[h] - 1], id, sizeof(struct msgid)) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+
 /*
  * Thread entry point.
  * Thread that read incoming messages and print them
  * to the terminal.
+ * New messages are read from the shared message ring of
+ * the chat process when available, the receive socket is
+ * then only used for the messages already in the buffer.
  */
 static void *
 client_read_messages(void *iface)
 {
+	struct ringreader rr;
 	struct message msg;
+	struct chatsub sub;
+	struct dumpset dumped;
 	int sock;
-	uint32_t ip;
-	uint32_t mask;
-
-	
+	int ring;
 
-	if (ifconfig_get((char *)iface, &ip, &mask) < 0) {
-		fprintf(stderr, "**Error: Failed to get IPv4 address of interface %s: %s", 
-			(char *)iface, strerror(errno));
+	/* Connect to daemon */
+	if ( (sock = unix_socket_connect(NULL, CHAT_UNIX_RECV, 
+			SOCK_SEQPACKET)) < 0) {
+		exit(EXIT_FAILURE);
 		return NULL;
 	}
 
-	/* Connect to daemon */
-	if ( (sock = tcp_connect(ip, htons(CHAT_RECV_PORT), 0, 0)) < 0) {
-		fprintf(stderr, "Failed to connect to daemon (is it running?): %s\n",
+	/* Attach to the ring before the dump so that no
+	 * message is lost between the two */
+	ring = (ring_attach(&rr) == 0);
+	memset(&dumped, 0x00, sizeof(dumped));
+
+	/* Subscribe to all joined channels */
+	sub.channels = htonl(CHAT_CHAN_ALL | (ring ? CHAT_SUB_NOLIVE : 0));
+	if (writen(sock, &sub, sizeof(sub)) != sizeof(sub)) {
+		fprintf(stderr, "Failed to write subscription to daemon: %s\n",
 			strerror(errno));
 		exit(EXIT_FAILURE);
-		return NULL;
 	}
 
-	 /* Read messages forever and print them on terminal */
+	 /* Read messages and print them on terminal, forever
+	  * unless new messages are read from the ring */
 	while (readn(sock, &msg, sizeof(msg)) == sizeof(msg)) {
+		client_message(&msg);
 
-		/* Statistics */
-		thread_memlock_lock(statlock);
-		msgcount++;
-		if (iplist_add(htonl(msg.id.ip), &iplist, ips))
-			ips++;
-		thread_memlock_unlock(statlock);
+		/* Remember the ID for skipping messages that
+		 * were published to the ring during the dump */
+		if (ring)
+			dump_add(&dumped, &msg.id);
+	}
+	close(sock);
 
-		/* Print message */
-		msgbuf_print(&msg);
+	if (ring == 0) {
+		fprintf(stderr, "Message reader thread terminating\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Messages published before the dump was finished */
+	dump_index(&dumped);
+	while (ring_read(&rr, &msg, 0) == 1) {
+		if (dump_has(&dumped, &msg.id) == 0)
+			client_message(&msg);
+	}
+	free(dumped.index);
+	free(dumped.id);
+
+	/* New messages */
+	while (ring_read(&rr, &msg, 1) == 1) {
+		client_message(&msg);
+		if (rr.lost != 0) {
+			printf("[+] %u messages lost\n", rr.lost);
+			rr.lost = 0;
+		}
 	}
 
 	fprintf(stderr, "Message reader thread terminating\n");
-	close(sock);
+	ring_detach(&rr);
+	exit(EXIT_FAILURE);
+	return NULL;
+}
+
+
+/*
+ * Thread entry point.
+ * Read the results of messages sent from the
+ * prompt and report the ones that failed.
+ */
+static void *
+client_read_results(void *arg)
+{
+	struct chatsession *cs = (struct chatsession *)arg;
+	uint32_t reqid;
+	int ret;
+
+	while (chat_session_result(cs, &reqid, &ret) == 0) {
+		if (ret == 0)
+			continue;
+
+		thread_memlock_lock(&statlock);
+		fprintf(stderr, "** Error: No ACK received! Failed to send message '%s'\n", 
+			pending[reqid % PENDING_MAX]);
+		thread_memlock_unlock(&statlock);
+	}
+
+	fprintf(stderr, "Send session closed by daemon\n");
 	exit(EXIT_FAILURE);
 	return NULL;
 }
@@ -93,9 +272,12 @@ client_read_messages(void *iface)
 int
 chat_prompt(const char *iface)
 {
+	struct chatsession cs;
 	struct chatxt txt;
 	struct in_addr ina;
 	uint32_t mask;
+	uint32_t reqid;
+	uint8_t chan = CHAT_CHAN_DEFAULT;
 	int i=0;
 
 
@@ -108,7 +290,16 @@ chat_prompt(const char *iface)
 	}
 
 	/* Initialize lock */
-	thread_memlock_init(statlock);
+	thread_memlock_init(&statlock);
+
+	/* Open send session */
+	if (chat_session_open(&cs, iface) < 0)
+		return -1;
+
+	if (thread_spawn(client_read_results, (void *)&cs) < 0) {
+		anderrs("Failed to spawn thread");
+		return -1;
+	}
 
 	printf("[Connected to local chat server]\n");
 	printf("[Type .help for help]\n");
@@ -146,12 +337,27 @@ chat_prompt(const char *iface)
 
 			/* Help */
 			if (strcmp(txt.msg, ".help") == 0) {
+				printf("[+] .chan <id> - Send messages to channel\n");
 				printf("[+] .quit - Quit prompt\n");
 				printf("[+] .stat - Print statistics\n");
 				printf("[+] .ver - Print %s\n", IBSSCHAT_VERSION);
 				continue;
 			}
 
+			/* Switch channel */
+			if (strncmp(txt.msg, ".chan ", 6) == 0) {
+				int c = atoi(&txt.msg[6]);
+
+				if ((c < 0) || (c >= CHAT_MAXCHANNELS)) {
+					printf("[+] Invalid channel, must be 0-%d\n", 
+						CHAT_MAXCHANNELS-1);
+					continue;
+				}
+				chan = c;
+				printf("[+] Sending to channel %u\n", chan);
+				continue;
+			}
+
 			/* Quit */
 			if (strcmp(txt.msg, ".quit") == 0) {
 				printf("[+] Bye, bye!\n");
@@ -162,7 +368,7 @@ chat_prompt(const char *iface)
 			if (strcmp(txt.msg, ".stat") == 0) {
 				uint32_t n = 0;
 			
-				thread_memlock_lock(statlock);
+				thread_memlock_lock(&statlock);
 				printf("[+] Received %u messages from %u different IPs\n", 
 					msgcount, ips);
 
@@ -176,7 +382,7 @@ chat_prompt(const char *iface)
 					}
 					printf("\n");
 				}
-				thread_memlock_unlock(statlock);
+				thread_memlock_unlock(&statlock);
 				continue;
 			}
 
@@ -190,9 +396,16 @@ chat_prompt(const char *iface)
 			continue;
 		}
 
-		/* Send message */
-		if (chat_send(iface, txt.msg) < 0)
+		/* Send message, the result is read by 
+		 * client_read_results() when it is done */
+		thread_memlock_lock(&statlock);
+		if (chat_session_send(&cs, chan, txt.msg, &reqid) < 0) {
+			thread_memlock_unlock(&statlock);
 			return -1;
+		}
+		snprintf(pending[reqid % PENDING_MAX], sizeof(pending[0]), 
+			"%s", txt.msg);
+		thread_memlock_unlock(&statlock);
 
 		/* Display message Read */
 		//printf("%s\n", txt.msg);
@@ -207,25 +420,35 @@ chat_prompt(const char *iface)
 }
 
 /*
- * Send random chat message for testing
+ * Send random chat message for testing.
+ * The messages are pipelined on one send session.
  * Returns the number of messages send
  */
 int
 chat_send_rand(const char *iface, int count, int delay)
 {
+	struct chatsession cs;
 	struct chatxt txt;
 	unsigned int seed;
 	unsigned int len;
 	unsigned int i;
+	uint32_t reqid;
+	int failed = 0;
+	int sent = 0;
+	int ret;
 	int c;
 
 	#define CHARS \
 		"ABCDEFGHIKLMNOPQRSTUVVXYZ0123456" \
 		"789abcdefghijklmnopqrstuvwxyz"
 
-	getrand_nonblock((uint8_t *)&seed, sizeof(seed));
+	if (drbg_bytes((uint8_t *)&seed, sizeof(seed)) < 0)
+		return -1;
 	srand(seed);
 
+	if (chat_session_open(&cs, iface) < 0)
+		return -1;
+
 	for (c=0; c < count; c++) {
 
 		/* Create the random message */
@@ -238,74 +461,165 @@ chat_send_rand(const char *iface, int count, int delay)
 			txt.msg[i] = CHARS[rand() % 60];
 
 		printf("[+] Sending (%d out of %d) %s\n", c+1, count, txt.msg);
-		chat_send(iface, txt.msg);
+		if (chat_session_send(&cs, CHAT_CHAN_DEFAULT, txt.msg, &reqid) < 0)
+			break;
+		sent++;
+
+		/* Collect results that are already done */
+		while (data_to_read(cs.sock) > 0) {
+			if (chat_session_result(&cs, &reqid, &ret) < 0)
+				break;
+			sent--;
+			if (ret != 0) {
+				fprintf(stderr, "** Error: No ACK received for message %u\n", reqid);
+				failed++;
+			}
+		}
+
 		if (delay)
 			sleep(delay);
 	}
 
+	/* Wait for the rest */
+	while (sent > 0) {
+		if (chat_session_result(&cs, &reqid, &ret) < 0)
+			break;
+		sent--;
+		if (ret != 0) {
+			fprintf(stderr, "** Error: No ACK received for message %u\n", reqid);
+			failed++;
+		}
+	}
+
+	if (failed)
+		printf("[+] %d out of %d messages failed\n", failed, count);
+
+	chat_session_close(&cs);
 	return count;
 }
 
 
 /*
- * Send chat message
+ * Open a send session to the local chat process.
+ * The session is on the CHAT_UNIX_SEND socket which does
+ * not depend on the configuration of the interface.
  * Returns 0 on success, -1 on error.
  */
 int
-chat_send(const char *iface, const char *str)
+chat_session_open(struct chatsession *cs, const char *iface)
 {
-	struct chatxt txt;
-	int ret;
-	int sock;
-	uint32_t ip;
-	uint32_t mask;
+	memset(cs, 0x00, sizeof(struct chatsession));
 
-	if (str == NULL || strlen(str) == 0) {
-		fprintf(stderr, "** Error: Invalid chat message!\n");
+	/* Connect to daemon */
+	if ( (cs->sock = unix_socket_connect(NULL, CHAT_UNIX_SEND, 
+			SOCK_SEQPACKET)) < 0)
 		return -1;
-	}
 
-	if (wiface_adhoc(iface) != 1) {
-		andlog("** Error: Interface is not up and running in ad-hoc mode\n", iface);
-		fprintf(stderr, "** Error: Interface %s has not been configured\n",
-			iface);
+	return 0;
+}
+
+
+/*
+ * Queue chat message to channel on send session without
+ * waiting for the result. The request ID is saved in reqid.
+ * Returns 0 on success, -1 on error.
+ */
+int
+chat_session_send(struct chatsession *cs, uint8_t chan, 
+	const char *str, uint32_t *reqid)
+{
+	struct chatsendreq r;
+
+	if (str == NULL || strlen(str) == 0) {
+		fprintf(stderr, "** Error: Invalid chat message!\n");
 		return -1;
 	}
 
 	/* Make sure message size is OK */
-	if (strlen(str) > (sizeof(txt.msg)-1)) {
+	if (strlen(str) > (sizeof(r.req.txt.msg)-1)) {
 		fprintf(stderr, "** Error: Message exceeds maximum length!\n");
 		return -1;
 	}
 
-	/* Copy message to buffer */
-	snprintf(txt.msg, sizeof(txt.msg), "%s", str);
-
-	if (ifconfig_get(iface, &ip, &mask) < 0) {
-		fprintf(stderr, "**Error: Failed to get IPv4 address of interface %s: %s", iface, strerror(errno));
+	if (chan >= CHAT_MAXCHANNELS) {
+		fprintf(stderr, "** Error: Invalid channel!\n");
 		return -1;
 	}
 
-	/* Connect to daemon */
-	if ( (sock = tcp_connect(ip, htons(CHAT_SEND_PORT), 0, 0)) < 0) {
-		fprintf(stderr, "Failed to connect to daemon (is it running?): %s\n",
+	memset(&r, 0x00, sizeof(r));
+	cs->reqid++;
+	r.reqid = htonl(cs->reqid);
+	r.req.channel = chan;
+	snprintf(r.req.txt.msg, sizeof(r.req.txt.msg), "%s", str);
+
+	if (writen(cs->sock, &r, sizeof(r)) != sizeof(r)) {
+		fprintf(stderr, "** Error: Failed to write message to socket: %s\n", 
 			strerror(errno));
 		return -1;
 	}
 
-	/* Write message */
-	if (writen(sock, &txt, sizeof(txt)) != sizeof(txt)) {
-		fprintf(stderr, "** Error: Failed to write message to socket: %s\n", 
-			strerror(errno));
-		close(sock);
+	if (reqid != NULL)
+		*reqid = cs->reqid;
+	return 0;
+}
+
+
+/*
+ * Wait for the result of the next completed request.
+ * Returns 0 on success, -1 on error or if the 
+ * session was closed.
+ */
+int
+chat_session_result(struct chatsession *cs, uint32_t *reqid, int *ret)
+{
+	struct chatsendres res;
+
+	if (readn(cs->sock, &res, sizeof(res)) != sizeof(res))
+		return -1;
+
+	*reqid = ntohl(res.reqid);
+	*ret = (int32_t)ntohl(res.ret);
+	return 0;
+}
+
+
+/*
+ * Close send session.
+ */
+void
+chat_session_close(struct chatsession *cs)
+{
+	if (cs->sock >= 0)
+		close(cs->sock);
+	cs->sock = -1;
+}
+
+
+/*
+ * Send chat message to channel and wait for it
+ * to be acknowledged.
+ * Returns 0 on success, -1 on error.
+ */
+int
+chat_send(const char *iface, uint8_t chan, const char *str)
+{
+	struct chatsession cs;
+	uint32_t reqid;
+	int ret;
+
+	if (chat_session_open(&cs, iface) < 0)
+		return -1;
+
+	if (chat_session_send(&cs, chan, str, &reqid) < 0) {
+		chat_session_close(&cs);
 		return -1;
 	}
 
 	/* Read response */
-	if (readn(sock, &ret, sizeof(ret)) != sizeof(ret)) {
+	if (chat_session_result(&cs, &reqid, &ret) < 0) {
 		fprintf(stderr, "** Error: Failed to read return value: %s\n",
 			strerror(errno));
-		close(sock);
+		chat_session_close(&cs);
 		return -1;
 	}
 
@@ -313,8 +627,150 @@ chat_send(const char *iface, const char *str)
 		fprintf(stderr, "** Error: No ACK received! Failed to send message '%s'\n", str);
 	}
 
-	close(sock);
+	chat_session_close(&cs);
 	return 0;
 }
 
 
+/*
+ * Print buffered and new messages matching the filter
+ * given as a list of "type <msg|discover>", "from <prefix/len>",
+ * "match <keyword>" and "chan <id>", until the daemon disconnects.
+ * The filter is evaluated by the daemon.
+ * Returns -1 on error.
+ */
+int
+chat_listen(const char *iface, int argc, char **argv)
+{
+	struct chatfilter filter;
+	struct chatsub sub;
+	struct message msg;
+	uint32_t chans = 0;
+	int sock;
+	int i;
+
+	memset(&filter, 0x00, sizeof(filter));
+	for (i=0; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "type") == 0) {
+			if (strcmp(argv[i+1], "msg") == 0)
+				filter.types |= (1 << CHAT_MSG);
+			else if (strcmp(argv[i+1], "discover") == 0)
+				filter.types |= (1 << CHAT_DISCOVER);
+			else
+				break;
+		}
+		else if (strcmp(argv[i], "from") == 0) {
+			char *p;
+
+			filter.prefixlen = 32;
+			if ( (p = strchr(argv[i+1], '/')) != NULL) {
+				*p++ = '\0';
+				filter.prefixlen = atoi(p);
+			}
+			if (((filter.prefix = inet_addr(argv[i+1])) == INADDR_NONE) ||
+					(filter.prefixlen > 32))
+				break;
+		}
+		else if (strcmp(argv[i], "match") == 0)
+			snprintf(filter.keyword, sizeof(filter.keyword), "%s", argv[i+1]);
+		else if (strcmp(argv[i], "chan") == 0) {
+			if (atoi(argv[i+1]) >= CHAT_MAXCHANNELS)
+				break;
+			chans |= (1 << atoi(argv[i+1]));
+		}
+		else
+			break;
+	}
+
+	if (i != argc) {
+		fprintf(stderr, "** Error: Invalid filter at '%s'\n", argv[i]);
+		return -1;
+	}
+
+	if (chans == 0)
+		chans = CHAT_CHAN_ALL;
+
+	if ( (sock = unix_socket_connect(NULL, CHAT_UNIX_RECV, 
+			SOCK_SEQPACKET)) < 0)
+		return -1;
+
+	sub.channels = htonl(chans | CHAT_SUB_FILTER);
+	if ((writen(sock, &sub, sizeof(sub)) != sizeof(sub)) ||
+			(writen(sock, &filter, sizeof(filter)) != sizeof(filter))) {
+		fprintf(stderr, "Failed to write filter to daemon: %s\n",
+			strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	while (readn(sock, &msg, sizeof(msg)) == sizeof(msg)) {
+		msgbuf_print(&msg);
+		fflush(stdout);
+	}
+
+	fprintf(stderr, "Daemon closed connection\n");
+	close(sock);
+	return -1;
+}
+
+
+/*
+ * Print the newest max messages in the buffer stored after
+ * cursor, from sender if not NULL, followed by the cursor to
+ * resume from. Zero means no limit.
+ * Returns 0 on success, -1 on error.
+ */
+int
+chat_history(const char *iface, uint32_t max, uint32_t cursor,
+	const char *sender)
+{
+	struct chatqueryres res;
+	struct chatquery q;
+	struct message msg;
+	uint32_t i;
+	int sock;
+
+	memset(&q, 0x00, sizeof(q));
+	q.channels = htonl(CHAT_CHAN_ALL | CHAT_SUB_NOLIVE | CHAT_SUB_QUERY);
+	q.cursor = htonl(cursor);
+	q.max = htonl(max);
+	if ((sender != NULL) && ((q.sender = inet_addr(sender)) == INADDR_NONE)) {
+		fprintf(stderr, "** Error: Invalid sender address '%s'\n", sender);
+		return -1;
+	}
+
+	if ( (sock = unix_socket_connect(NULL, CHAT_UNIX_RECV, 
+			SOCK_SEQPACKET)) < 0)
+		return -1;
+
+	/* The subscription and the rest of the query are read
+	 * separately, so they are written as separate packets */
+	if ((writen(sock, &q, sizeof(struct chatsub)) != sizeof(struct chatsub)) ||
+			(writen(sock, &q.cursor, sizeof(q) - sizeof(struct chatsub)) !=
+			sizeof(q) - sizeof(struct chatsub))) {
+		fprintf(stderr, "Failed to write query to daemon: %s\n",
+			strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	if (readn(sock, &res, sizeof(res)) != sizeof(res)) {
+		fprintf(stderr, "Failed to read query result from daemon: %s\n",
+			strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	for (i=0; i < ntohl(res.count); i++) {
+		if (readn(sock, &msg, sizeof(msg)) != sizeof(msg)) {
+			fprintf(stderr, "** Error: Query result truncated\n");
+			close(sock);
+			return -1;
+		}
+		msgbuf_print(&msg);
+	}
+	close(sock);
+
+	printf("[cursor %u]\n", ntohl(res.cursor));
+	return 0;
+}
@@ -22,21 +22,71 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include "ibsschat.h"
 #include "libbfish/bfish.h"
 
 /* Local routines */
+static uint32_t keyhash(uint8_t *, size_t);
+static struct keyslot *keycache_get(uint16_t, uint8_t *, size_t);
+static struct bfish_key *chat_crypto_lookup(uint8_t, uint8_t);
+static void chat_crypto_iv(struct message *, struct bfish_key *, uint8_t *);
 
 /* Local Variables */
 static lock_t keylock;
 
-static uint8_t key[CRYPTO_KEY_MAXLEN+1];
-static size_t keylen = 0;
-static int key_set = 0;
+/*
+ * Cache of expanded Blowfish key schedules, indexed
+ * by the hash of the key and the group ID.
+ * The slots are allocated once at startup so that setting
+ * a key that has been used before, or switching between
+ * the keys of different groups, never expand the key 
+ * schedule again or allocate memory.
+ */
+#define KEYCACHE_SLOTS	64	/* Must be a power of two */
+
+struct keyslot {
+	uint32_t hash;		/* Hash of key */
+	uint16_t group;		/* Group the key belong to */
+	uint8_t used;		/* Slot contain a key schedule */
+	uint8_t refs;		/* Number of epoch keys using slot */
+	uint32_t lastuse;	/* For replacing the least recently used */
+	uint8_t keylen;
+	uint8_t key[CRYPTO_KEY_MAXLEN];
+	struct bfish_key bk;
+};
+
+static struct keyslot *keycache = NULL;
+static uint32_t keyclock = 0;
+
+/*
+ * A Blowfish key for one key epoch.
+ * The current key is used for encryption and the
+ * previous key is kept for decryption of messages
+ * still in flight until the grace period expires.
+ */
+struct epochkey {
+	uint8_t epoch;
+	time_t expire;	/* Zero for the current key */
+	struct keyslot *ks;
+};
 
-/* The blowfish key */
-struct bfish_key *bkey;
+#define KEY_CURRENT		0
+#define KEY_PREVIOUS	1
+
+/*
+ * The keys of a channel, the channel number
+ * is used as group in the key cache.
+ */
+struct chankey {
+	uint8_t set;
+	uint8_t keylen;
+	uint8_t key[CRYPTO_KEY_MAXLEN+1];
+	struct epochkey ek[2];
+};
+
+static struct chankey keys[CHAT_MAXCHANNELS];
 
 /*
  * Initialize the crypto system
@@ -45,19 +95,110 @@ struct bfish_key *bkey;
 int
 chat_crypto_init(void)
 {
-	thread_memlock_init(keylock);
+	thread_memlock_init(&keylock);
+
+	if ( (keycache = calloc(KEYCACHE_SLOTS, sizeof(struct keyslot))) == NULL) {
+		anderrs("Failed to allocate key cache");
+		return -1;
+	}
 	return 0;
 }
 
 
 /*
- * Set the encryption key.
+ * FNV-1a hash of key.
+ */
+static uint32_t
+keyhash(uint8_t *k, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i=0; i < len; i++) {
+		h ^= k[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+/*
+ * Get the expanded key schedule for key in group from 
+ * the cache, expand it into the least recently used 
+ * unreferenced slot if it is not cached.
+ * Return a pointer to the slot on success, NULL on error.
+ * Key lock must be held when calling this function.
+ */
+static struct keyslot *
+keycache_get(uint16_t group, uint8_t *k, size_t len)
+{
+	struct keyslot *victim = NULL;
+	struct keyslot *ks;
+	uint32_t h;
+	uint32_t i;
+	uint32_t n;
+
+	h = keyhash(k, len);
+	i = (h ^ (group * 2654435761U)) & (KEYCACHE_SLOTS - 1);
+	keyclock++;
+
+	for (n=0; n < KEYCACHE_SLOTS; n++) {
+		ks = &keycache[(i + n) & (KEYCACHE_SLOTS - 1)];
+
+		if ((ks->used != 0) && (ks->hash == h) && (ks->group == group) &&
+				(ks->keylen == len) && (memcmp(ks->key, k, len) == 0)) {
+			ks->lastuse = keyclock;
+			return ks;
+		}
+
+		/* Remember a free or the least recently used slot */
+		if (ks->refs == 0) {
+			if ((victim == NULL) || (ks->used == 0) || 
+					((victim->used != 0) && (ks->lastuse < victim->lastuse)))
+				victim = ks;
+		}
+	}
+
+	if (victim == NULL) {
+		anderr("** Error: Key cache full\n");
+		return NULL;
+	}
+
+	/* Expand key into slot */
+	victim->used = 0;
+	if (bfish_keyinit_r(&victim->bk, k, len) != 0) {
+		anderr("** Error: Failed to initialize Blowfish key\n");
+		return NULL;
+	}
+
+	victim->hash = h;
+	victim->group = group;
+	victim->keylen = len;
+	memset(victim->key, 0x00, sizeof(victim->key));
+	memcpy(victim->key, k, len);
+	victim->lastuse = keyclock;
+	victim->used = 1;
+	return victim;
+}
+
+
+/*
+ * Install a new current key for epoch in channel.
+ * If keep is non zero, the current key is kept
+ * as previous key during the grace period.
  * Return 0 on succes, -1 on error.
  */
-extern int
-chat_crypto_set_key(uint8_t *newkey, size_t len)
+static int
+chat_crypto_install(uint8_t chan, uint8_t *newkey, size_t len, 
+	uint8_t epoch, int keep)
 {
-	struct bfish_key *bk;
+	struct epochkey *ek;
+	struct keyslot *ks;
+
+	if (chan >= CHAT_MAXCHANNELS) {
+		anderr("** Error: Invalid channel %u\n", chan);
+		return -1;
+	}
 
 	if (len > CRYPTO_KEY_MAXLEN) {
 		fprintf(stderr, "** Error: Key exceed maximum length\n");
@@ -65,40 +206,119 @@ chat_crypto_set_key(uint8_t *newkey, size_t len)
 		return -1;
 	}
 
-	if ( (bk = bfish_keyinit(newkey, len)) == NULL) {
-		anderr("** Error: Failed to initialize Blowfish key\n");
+	thread_memlock_lock(&keylock);
+	ek = keys[chan].ek;
+
+	if ((keep != 0) && (keys[chan].set != 0) && 
+			(ek[KEY_CURRENT].epoch == epoch)) {
+		thread_memlock_unlock(&keylock);
+		anderr("** Error: Key epoch %u is already in use\n", epoch);
 		return -1;
 	}
 
-	thread_memlock_lock(keylock);
+	if ( (ks = keycache_get(chan, newkey, len)) == NULL) {
+		thread_memlock_unlock(&keylock);
+		return -1;
+	}
+	ks->refs++;
 
-	if (bkey != NULL)
-		free(bkey);
-	bkey = bk;
+	if (ek[KEY_PREVIOUS].ks != NULL)
+		ek[KEY_PREVIOUS].ks->refs--;
+	memset(&ek[KEY_PREVIOUS], 0x00, sizeof(struct epochkey));
 
-	memset(key, 0x00, sizeof(key));
-	memcpy(key, newkey, len);
-	keylen = len;
-	key_set = 1;
+	/* Roll current key over to previous */
+	if ((keep != 0) && (ek[KEY_CURRENT].ks != NULL)) {
+		ek[KEY_PREVIOUS] = ek[KEY_CURRENT];
+		ek[KEY_PREVIOUS].expire = time(NULL) + CRYPTO_KEY_GRACE;
+	}
+	else if (ek[KEY_CURRENT].ks != NULL)
+		ek[KEY_CURRENT].ks->refs--;
+
+	ek[KEY_CURRENT].epoch = epoch;
+	ek[KEY_CURRENT].expire = 0;
+	ek[KEY_CURRENT].ks = ks;
 
-	thread_memlock_unlock(keylock);
+	memset(keys[chan].key, 0x00, sizeof(keys[chan].key));
+	memcpy(keys[chan].key, newkey, len);
+	keys[chan].keylen = len;
+	keys[chan].set = 1;
 
+	thread_memlock_unlock(&keylock);
 	return 0;
 }
 
+
+/*
+ * Set the encryption key of channel for epoch, 
+ * discarding any previous keys.
+ * Return 0 on succes, -1 on error.
+ */
+extern int
+chat_crypto_set_key(uint8_t chan, uint8_t *newkey, size_t len, uint8_t epoch)
+{
+	return chat_crypto_install(chan, newkey, len, epoch, 0);
+}
+
+
+/*
+ * Forget the keys of channel.
+ */
+void
+chat_crypto_clear_key(uint8_t chan)
+{
+	int i;
+
+	if (chan >= CHAT_MAXCHANNELS)
+		return;
+
+	thread_memlock_lock(&keylock);
+	for (i=0; i < 2; i++) {
+		if (keys[chan].ek[i].ks != NULL)
+			keys[chan].ek[i].ks->refs--;
+	}
+	memset(&keys[chan], 0x00, sizeof(struct chankey));
+	thread_memlock_unlock(&keylock);
+}
+
+
 /*
- * Get the encryption key.
+ * Roll over to a new key epoch without interrupting
+ * the chat. Messages encrypted with the previous key
+ * are accepted for CRYPTO_KEY_GRACE seconds.
+ * Return 0 on succes, -1 on error.
+ */
+extern int
+chat_crypto_rotate_key(uint8_t chan, uint8_t *newkey, size_t len, uint8_t epoch)
+{
+	return chat_crypto_install(chan, newkey, len, epoch, 1);
+}
+
+/*
+ * Get the encryption key of channel and its epoch.
  * Return the length of the key on success, 0 on error
  * or if the key has not been set.
  * The memory pointed to by buf must be at least CRYPTO_KEY_MAXLEN
  * bytes long.
  */
 size_t
-chat_crypto_get_key(uint8_t *buf)
+chat_crypto_get_key(uint8_t chan, uint8_t *buf, uint8_t *epoch)
 {
-	if (key_set != 0) {
-		memcpy(buf, key, CRYPTO_KEY_MAXLEN);
-		return keylen;
+	size_t len;
+
+	if (chan < CHAT_MAXCHANNELS) {
+
+		/* The key may be cleared by a concurrent leave,
+		 * so it is only checked with the lock held */
+		thread_memlock_lock(&keylock);
+		if (keys[chan].set != 0) {
+			memcpy(buf, keys[chan].key, CRYPTO_KEY_MAXLEN);
+			if (epoch != NULL)
+				*epoch = keys[chan].ek[KEY_CURRENT].epoch;
+			len = keys[chan].keylen;
+			thread_memlock_unlock(&keylock);
+			return len;
+		}
+		thread_memlock_unlock(&keylock);
 	}
 
 	andlog("** Error: Encryption key not set\n");
@@ -107,63 +327,140 @@ chat_crypto_get_key(uint8_t *buf)
 
 
 /*
- * Encrypt chat message.
+ * Find the key of channel for epoch.
+ * Return the key on success, NULL if there
+ * is no valid key for the epoch.
+ * Key lock must be held when calling this function.
+ */
+static struct bfish_key *
+chat_crypto_lookup(uint8_t chan, uint8_t epoch)
+{
+	struct epochkey *ek = keys[chan].ek;
+
+	if (keys[chan].set == 0)
+		return NULL;
+
+	if ((ek[KEY_CURRENT].ks != NULL) && (ek[KEY_CURRENT].epoch == epoch))
+		return &ek[KEY_CURRENT].ks->bk;
+
+	if ((ek[KEY_PREVIOUS].ks != NULL) && 
+			(ek[KEY_PREVIOUS].epoch == epoch)) {
+
+		if (time(NULL) < ek[KEY_PREVIOUS].expire)
+			return &ek[KEY_PREVIOUS].ks->bk;
+
+		/* Grace period is over, the schedule stay
+		 * in the cache until the slot is needed */
+		andlog("Key for epoch %u in channel %u expired\n", epoch, chan);
+		ek[KEY_PREVIOUS].ks->refs--;
+		memset(&ek[KEY_PREVIOUS], 0x00, sizeof(struct epochkey));
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Derive the IV of the message body by encrypting the cleartext
+ * header in CBC mode in front of it, so that a header changed in
+ * transit decrypts the body into garbage that fail the checksum.
+ * Key lock must be held when calling this function.
+ */
+static void
+chat_crypto_iv(struct message *m, struct bfish_key *bk, uint8_t *iv)
+{
+	uint32_t hdr[4];
+	uint8_t *p = (uint8_t *)hdr;
+
+	memset(hdr, 0x00, sizeof(hdr));
+	memcpy(p, &m->id, sizeof(struct msgid));
+	p[sizeof(struct msgid)] = m->type;
+	p[sizeof(struct msgid)+1] = m->channel;
+	p[sizeof(struct msgid)+2] = m->epoch;
+
+	bfish_cbc_encrypt(p, sizeof(hdr), m->iv, bk);
+	memcpy(iv, &hdr[2], 8);
+}
+
+
+/*
+ * Encrypt chat message with the current key
+ * of the channel in the message header.
  * Return 0 on success, -1 on error.
  */
 int
 chat_crypto_encrypt(struct message *m)
 {
+	struct epochkey *ek;
+	uint8_t iv[8];
 	uint8_t *buf;
 	size_t len;
 
-	if (key_set == 0) {
-		andlog("** Error: encryption key not set\n");
+	if (!msgchan_valid(m)) {
+		andlog("** Error: Invalid channel %u\n", m->channel);
 		return -1;
 	}
 
-    /* Generate a random IV for this message.
-     * Use non-blocking random just for this example
-     * program to avoid non blocking, should use 
-     * /dev/random for better security though */
-	getrand_nonblock(m->iv, sizeof(m->iv));
+	/* Generate a random IV for this message */
+	if (drbg_bytes(m->iv, sizeof(m->iv)) < 0) {
+		anderr("** Error: Failed to generate IV\n");
+		return -1;
+	}
 
-	/* Encrypt message */
-	thread_memlock_lock(keylock);
+	/* Encrypt message, the key may have been cleared 
+	 * by a leave until the lock is held */
+	thread_memlock_lock(&keylock);
+	ek = keys[m->channel].ek;
+	if ((keys[m->channel].set == 0) || (ek[KEY_CURRENT].ks == NULL)) {
+		thread_memlock_unlock(&keylock);
+		andlog("** Error: encryption key not set for channel %u\n", m->channel);
+		return -1;
+	}
+	m->epoch = ek[KEY_CURRENT].epoch;
 	buf = (uint8_t *)m;
-	buf += (sizeof(m->type) + sizeof(struct msgid) + sizeof(m->iv));
-	len = sizeof(struct message);
-	len -= (sizeof(m->type) + sizeof(struct msgid) + sizeof(m->iv));
-	bfish_cbc_encrypt(buf, len, m->iv, bkey);
-	thread_memlock_unlock(keylock);
+	buf += MSGHDRSIZE;
+	len = sizeof(struct message) - MSGHDRSIZE;
+	chat_crypto_iv(m, &ek[KEY_CURRENT].ks->bk, iv);
+	bfish_cbc_encrypt(buf, len, iv, &ek[KEY_CURRENT].ks->bk);
+	thread_memlock_unlock(&keylock);
 
 	return 0;
 }
 
 
 /*
- * Decrypt chat message.
+ * Decrypt chat message using the key of the
+ * channel and epoch in the message header.
  * Return 0 on success, -1 on error.
  */
 int
 chat_crypto_decrypt(struct message *m)
 {
+	struct bfish_key *bk;
+	uint8_t iv[8];
 	uint8_t *buf;
 	size_t len;
 
-	if (key_set == 0) {
-		andlog("** Error: encryption key not set\n");
+	if (!msgchan_valid(m)) {
+		andlog("** Error: Invalid channel %u\n", m->channel);
 		return -1;
 	}
 
-
 	/* Decrypt message */
-	thread_memlock_lock(keylock);
+	thread_memlock_lock(&keylock);
+	if ( (bk = chat_crypto_lookup(m->channel, m->epoch)) == NULL) {
+		thread_memlock_unlock(&keylock);
+		andlog("** Error: No key for epoch %u in channel %u\n", 
+			m->epoch, m->channel);
+		return -1;
+	}
+
 	buf = (uint8_t *)m;
-	buf += (sizeof(m->type) + sizeof(struct msgid) + sizeof(m->iv));
-	len = sizeof(struct message);
-	len -= (sizeof(m->type) + sizeof(struct msgid) + sizeof(m->iv));
-	bfish_cbc_decrypt(buf, len, m->iv, bkey);
-	thread_memlock_unlock(keylock);
+	buf += MSGHDRSIZE;
+	len = sizeof(struct message) - MSGHDRSIZE;
+	chat_crypto_iv(m, bk, iv);
+	bfish_cbc_decrypt(buf, len, iv, bk);
+	thread_memlock_unlock(&keylock);
 
 	return 0;
 }
@@ -0,0 +1,551 @@
+/*
+ *    File: chat_load.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Open loop load generator and end-to-end latency meter.
+ *
+ * The generator send messages at a fixed rate, with constant
+ * or exponentially distributed (Poisson) intervals, spread over
+ * a number of logical senders that each have their own pipelined
+ * send session. A message is sent at its scheduled time whether
+ * earlier messages have been acknowledged or not, so the offered
+ * load does not back off when the network saturates.
+ *
+ * Each message start with a header holding the logical sender,
+ * its sequence number and the scheduled send time (UTC):
+ *
+ *   ~L<sender>:<seq>@<sec>.<usec>:
+ *
+ * which the latency meter on the receiving nodes use to compute
+ * the end-to-end latency and the number of messages lost. The
+ * clocks of the nodes must be synchronized for the latency to
+ * make sense.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "ibsschat.h"
+
+/* Text that start the header of load messages */
+#define LOAD_TAG "~L"
+
+/* Largest text of a message, excluding the NUL */
+#define LOAD_MAXLEN (sizeof(((struct chatxt *)0)->msg) - 1)
+
+/* Logical sender */
+struct loadsender {
+	struct chatsession cs;
+	uint64_t *sent;		/* Send time of request, indexed by request ID */
+	uint32_t size;		/* Slots in sent */
+	uint32_t inflight;	/* Requests not answered */
+};
+
+/* Latency samples in micro seconds */
+struct samples {
+	uint64_t *v;
+	size_t n;
+	size_t size;
+};
+
+/* Messages received from a logical sender on a node */
+struct loadorigin {
+	uint32_t ip;
+	uint32_t sender;
+	uint32_t maxseq;
+	uint32_t count;
+	uint32_t dups;
+	uint8_t *seen;		/* Bit per sequence number */
+	uint32_t seensize;	/* Bytes in seen */
+};
+
+/* Local routines */
+static uint64_t clock_usec(int);
+static void sleep_until(uint64_t);
+static int sample_add(struct samples *, uint64_t);
+static void sample_print(const char *, struct samples *);
+static int u64cmp(const void *, const void *);
+static int load_result(struct loadsender *, struct samples *, uint32_t *);
+static struct loadorigin *origin_get(uint32_t, uint32_t);
+
+/* Local variables */
+static struct loadorigin *origins = NULL;
+static uint32_t norigins = 0;
+
+
+/*
+ * Current time of clock in micro seconds.
+ */
+static uint64_t
+clock_usec(int clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * Sleep until the monotonic clock reach usec.
+ */
+static void
+sleep_until(uint64_t usec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+
+/*
+ * Add latency sample.
+ * Return 0 on success, -1 on error.
+ */
+static int
+sample_add(struct samples *s, uint64_t v)
+{
+	if (s->n == s->size) {
+		size_t size = s->size ? s->size * 2 : 1024;
+		uint64_t *p;
+
+		if ( (p = realloc(s->v, size * sizeof(uint64_t))) == NULL)
+			return -1;
+		s->v = p;
+		s->size = size;
+	}
+	s->v[s->n++] = v;
+	return 0;
+}
+
+
+static int
+u64cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+/*
+ * Print percentiles of samples in milli seconds.
+ */
+static void
+sample_print(const char *name, struct samples *s)
+{
+	if (s->n == 0) {
+		printf("%-20s %8u samples\n", name, 0);
+		return;
+	}
+
+	qsort(s->v, s->n, sizeof(uint64_t), u64cmp);
+	printf("%-20s %8lu samples  p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n",
+		name, (unsigned long)s->n,
+		s->v[(s->n - 1) * 50 / 100] / 1000.0,
+		s->v[(s->n - 1) * 90 / 100] / 1000.0,
+		s->v[(s->n - 1) * 99 / 100] / 1000.0,
+		s->v[s->n - 1] / 1000.0);
+}
+
+
+/*
+ * Read the result of a request on the session of sender
+ * and record the time it took to be acknowledged.
+ * The number of failed requests is counted in failed.
+ * Return 0 on success, -1 on error.
+ */
+static int
+load_result(struct loadsender *ls, struct samples *acks, uint32_t *failed)
+{
+	uint32_t reqid;
+	int ret;
+
+	if (chat_session_result(&ls->cs, &reqid, &ret) < 0) {
+		fprintf(stderr, "** Error: Failed to read result from session\n");
+		return -1;
+	}
+	ls->inflight--;
+
+	if (ret != 0)
+		(*failed)++;
+	else if ((reqid > 0) && (reqid <= ls->size))
+		sample_add(acks, clock_usec(CLOCK_MONOTONIC) - ls->sent[reqid - 1]);
+	return 0;
+}
+
+
+/*
+ * Send messages at rate messages per second during seconds,
+ * from senders logical senders, with Poisson or constant
+ * arrivals, and text of random length between minlen and maxlen,
+ * where a maxlen of zero is the largest possible.
+ * Print the achieved rate and the latency of acknowledges.
+ * Returns 0 on success, -1 on error.
+ */
+int
+chat_load(const char *iface, double rate, int seconds, int senders,
+	int poisson, int minlen, int maxlen)
+{
+	struct loadsender *ls;
+	struct pollfd *pfd;
+	struct samples acks;
+	struct chatxt txt;
+	uint64_t start;
+	uint64_t wall;
+	uint64_t end;
+	uint64_t next;
+	uint64_t now;
+	uint64_t maxlag = 0;
+	uint32_t failed = 0;
+	uint32_t late = 0;
+	uint32_t sent = 0;
+	uint32_t inflight;
+	unsigned int seed;
+	double at = 0;
+	int ret = -1;
+	int i;
+
+	#define CHARS \
+		"ABCDEFGHIKLMNOPQRSTUVVXYZ0123456" \
+		"789abcdefghijklmnopqrstuvwxyz"
+
+	if (maxlen <= 0)
+		maxlen = LOAD_MAXLEN;
+
+	if ((rate <= 0) || (seconds <= 0) || (senders <= 0) ||
+			(minlen > maxlen) || (maxlen > (int)LOAD_MAXLEN)) {
+		fprintf(stderr, "** Error: Invalid load parameters\n");
+		return -1;
+	}
+
+	if (drbg_bytes((uint8_t *)&seed, sizeof(seed)) < 0)
+		return -1;
+	srand(seed);
+
+	memset(&acks, 0x00, sizeof(acks));
+	ls = calloc(senders, sizeof(struct loadsender));
+	pfd = calloc(senders, sizeof(struct pollfd));
+	if ((ls == NULL) || (pfd == NULL)) {
+		fprintf(stderr, "** Error: Out of memory\n");
+		free(ls);
+		free(pfd);
+		return -1;
+	}
+
+	for (i=0; i < senders; i++) {
+		if (chat_session_open(&ls[i].cs, iface) < 0) {
+			senders = i;
+			goto finished;
+		}
+		pfd[i].fd = ls[i].cs.sock;
+		pfd[i].events = POLLIN;
+	}
+
+	printf("[+] Offering %.1f messages/s for %d seconds from %d senders (%s)\n",
+		rate, seconds, senders, poisson ? "poisson" : "constant");
+
+	wall = clock_usec(CLOCK_REALTIME);
+	start = clock_usec(CLOCK_MONOTONIC);
+	end = start + (uint64_t)seconds * 1000000;
+
+	for (;;) {
+		struct loadsender *s;
+		uint32_t reqid;
+		int len;
+		int n;
+
+		/* Next arrival */
+		if (poisson)
+			at += -log((rand() + 1.0) / (RAND_MAX + 2.0)) / rate;
+		else
+			at = (sent + 1) / rate;
+		next = start + (uint64_t)(at * 1000000);
+		if (next >= end)
+			break;
+
+		/* Collect results until it is time to send */
+		while ((now = clock_usec(CLOCK_MONOTONIC)) + 1000 < next) {
+			if ( (n = poll(pfd, senders, (next - now) / 1000)) <= 0)
+				continue;
+			for (i=0; i < senders; i++) {
+				if ((pfd[i].revents & POLLIN) &&
+						(load_result(&ls[i], &acks, &failed) < 0))
+					goto finished;
+			}
+		}
+		sleep_until(next);
+
+		/* Behind schedule, the message is still stamped
+		 * with the scheduled time */
+		if ( (now = clock_usec(CLOCK_MONOTONIC)) > next + 1000) {
+			late++;
+			if (now - next > maxlag)
+				maxlag = now - next;
+		}
+
+		/* The arrivals are independent of the sender for
+		 * Poisson load, which make every sender Poisson too */
+		s = &ls[poisson ? rand() % senders : sent % senders];
+		reqid = s->cs.reqid + 1;
+
+		memset(&txt, 0x00, sizeof(txt));
+		snprintf(txt.msg, sizeof(txt.msg), LOAD_TAG "%u:%u@%llu.%06llu:",
+			(unsigned int)(s - ls), reqid,
+			(unsigned long long)((wall + next - start) / 1000000),
+			(unsigned long long)((wall + next - start) % 1000000));
+
+		len = minlen + rand() % (maxlen - minlen + 1);
+		for (i=strlen(txt.msg); i < len; i++)
+			txt.msg[i] = CHARS[rand() % 60];
+
+		if (reqid > s->size) {
+			uint32_t size = s->size ? s->size * 2 : 1024;
+			uint64_t *p;
+
+			if ( (p = realloc(s->sent, size * sizeof(uint64_t))) == NULL) {
+				fprintf(stderr, "** Error: Out of memory\n");
+				goto finished;
+			}
+			s->sent = p;
+			s->size = size;
+		}
+		s->sent[reqid - 1] = next;
+
+		if (chat_session_send(&s->cs, CHAT_CHAN_DEFAULT, txt.msg, &reqid) < 0)
+			goto finished;
+		s->inflight++;
+		sent++;
+	}
+
+	now = clock_usec(CLOCK_MONOTONIC);
+	printf("[+] Sent %u messages in %.3f s (%.1f messages/s), waiting for results\n",
+		sent, (now - start) / 1000000.0, sent * 1000000.0 / (now - start));
+
+	/* Wait for the rest */
+	for (;;) {
+		for (inflight=0, i=0; i < senders; i++) {
+			pfd[i].events = ls[i].inflight ? POLLIN : 0;
+			inflight += ls[i].inflight;
+		}
+		if (inflight == 0)
+			break;
+
+		if (poll(pfd, senders, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		for (i=0; i < senders; i++) {
+			if ((pfd[i].revents & (POLLIN | POLLHUP)) &&
+					(load_result(&ls[i], &acks, &failed) < 0))
+				goto finished;
+		}
+	}
+	ret = 0;
+
+	finished:
+	for (inflight=0, i=0; i < senders; i++)
+		inflight += ls[i].inflight;
+
+	printf("Offered rate          %8.1f messages/s\n", rate);
+	printf("Sent                  %8u\n", sent);
+	printf("Acknowledged          %8lu\n", (unsigned long)acks.n);
+	printf("Not acknowledged      %8u\n", failed);
+	printf("No result             %8u\n", inflight);
+	printf("Late sends            %8u (max %.3f ms behind)\n", late, maxlag / 1000.0);
+	sample_print("Ack latency", &acks);
+
+	for (i=0; i < senders; i++) {
+		chat_session_close(&ls[i].cs);
+		free(ls[i].sent);
+	}
+	free(acks.v);
+	free(pfd);
+	free(ls);
+	return ((ret == 0) && (inflight == 0)) ? 0 : -1;
+}
+
+
+/*
+ * Find logical sender, or add it.
+ * Return NULL on error.
+ */
+static struct loadorigin *
+origin_get(uint32_t ip, uint32_t sender)
+{
+	struct loadorigin *o;
+	uint32_t i;
+
+	for (i=0; i < norigins; i++) {
+		if ((origins[i].ip == ip) && (origins[i].sender == sender))
+			return &origins[i];
+	}
+
+	if ( (o = realloc(origins, (norigins + 1) * sizeof(struct loadorigin))) == NULL)
+		return NULL;
+	origins = o;
+	o = &origins[norigins++];
+	memset(o, 0x00, sizeof(struct loadorigin));
+	o->ip = ip;
+	o->sender = sender;
+	return o;
+}
+
+
+/*
+ * Read load messages sent after start for seconds and print
+ * the end-to-end latency, from the scheduled send time to the
+ * time the message was read, and the number of messages that
+ * were never received (gaps in the sequence numbers).
+ * Returns 0 on success, -1 on error.
+ */
+int
+chat_load_recv(const char *iface, int seconds)
+{
+	struct chatfilter filter;
+	struct samples lat;
+	struct chatsub sub;
+	struct message msg;
+	struct pollfd pfd;
+	uint64_t first = 0;
+	uint64_t last = 0;
+	uint64_t start;
+	uint64_t end;
+	uint64_t now;
+	uint32_t received = 0;
+	uint32_t lost = 0;
+	uint32_t dups = 0;
+	uint32_t skew = 0;
+	uint32_t i;
+	int sock;
+
+	memset(&lat, 0x00, sizeof(lat));
+	memset(&filter, 0x00, sizeof(filter));
+	filter.types = (1 << CHAT_MSG);
+	snprintf(filter.keyword, sizeof(filter.keyword), "%s", LOAD_TAG);
+
+	if ( (sock = unix_socket_connect(NULL, CHAT_UNIX_RECV,
+			SOCK_SEQPACKET)) < 0)
+		return -1;
+
+	sub.channels = htonl(CHAT_CHAN_ALL | CHAT_SUB_FILTER);
+	if ((writen(sock, &sub, sizeof(sub)) != sizeof(sub)) ||
+			(writen(sock, &filter, sizeof(filter)) != sizeof(filter))) {
+		fprintf(stderr, "Failed to write filter to daemon: %s\n",
+			strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	start = clock_usec(CLOCK_REALTIME);
+	end = clock_usec(CLOCK_MONOTONIC) + (uint64_t)seconds * 1000000;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+
+	while ((now = clock_usec(CLOCK_MONOTONIC)) < end) {
+		struct chatmsg *cm = (struct chatmsg *)&msg;
+		struct loadorigin *o;
+		unsigned long long sec;
+		unsigned int usec;
+		unsigned int sender;
+		unsigned int seq;
+		uint64_t sched;
+		uint64_t t;
+
+		if (poll(&pfd, 1, (end - now) / 1000 + 1) <= 0)
+			continue;
+		if (readn(sock, &msg, sizeof(msg)) != sizeof(msg)) {
+			fprintf(stderr, "Daemon closed connection\n");
+			break;
+		}
+		t = clock_usec(CLOCK_REALTIME);
+
+		cm->txt.msg[sizeof(cm->txt.msg) - 1] = '\0';
+		if (sscanf(cm->txt.msg, LOAD_TAG "%u:%u@%llu.%u:",
+				&sender, &seq, &sec, &usec) != 4 || (seq == 0))
+			continue;
+
+		/* Buffered messages from an earlier run */
+		sched = sec * 1000000 + usec;
+		if (sched + 1000000 < start)
+			continue;
+
+		if ( (o = origin_get(cm->id.ip, sender)) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			break;
+		}
+
+		if (seq / 8 >= o->seensize) {
+			uint32_t size = (seq / 8) * 2 + 64;
+			uint8_t *p;
+
+			if ( (p = realloc(o->seen, size)) == NULL) {
+				fprintf(stderr, "** Error: Out of memory\n");
+				break;
+			}
+			memset(&p[o->seensize], 0x00, size - o->seensize);
+			o->seen = p;
+			o->seensize = size;
+		}
+
+		if (o->seen[seq / 8] & (1 << (seq % 8))) {
+			o->dups++;
+			continue;
+		}
+		o->seen[seq / 8] |= (1 << (seq % 8));
+		o->count++;
+		if (seq > o->maxseq)
+			o->maxseq = seq;
+
+		if (first == 0)
+			first = t;
+		last = t;
+		received++;
+
+		if (t < sched)
+			skew++;
+		else
+			sample_add(&lat, t - sched);
+	}
+	close(sock);
+
+	for (i=0; i < norigins; i++) {
+		lost += origins[i].maxseq - origins[i].count;
+		dups += origins[i].dups;
+		free(origins[i].seen);
+	}
+	free(origins);
+	origins = NULL;
+
+	printf("Senders               %8u\n", norigins);
+	printf("Received              %8u\n", received);
+	printf("Duplicates            %8u\n", dups);
+	printf("Lost                  %8u\n", lost);
+	printf("Clock skew            %8u\n", skew);
+	if (last > first)
+		printf("Receive rate          %8.1f messages/s\n",
+			(received - 1) * 1000000.0 / (last - first));
+	sample_print("End-to-end latency", &lat);
+	norigins = 0;
+
+	free(lat.v);
+	return 0;
+}
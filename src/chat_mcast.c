@@ -29,6 +29,7 @@
 /* Local routines */
 static void *mcast_read(void *);
 static void *mcast_sync_thread(void *);
+static int mcast_membership(int, uint8_t, int);
 
 /* The chat clients */
 struct clients {
@@ -49,6 +50,10 @@ static uint32_t mymask;
 static lock_t statlock;
 static struct clients r;
 
+/* The socket receiving multicast messages,
+ * member of the groups of all joined channels */
+static int msock = -1;
+
 /* Initial discovery message */
 static struct discover d;
 static struct discover dc; /* Encrypted discovery */
@@ -60,16 +65,69 @@ static struct discover dc; /* Encrypted discovery */
 void
 iplist_reset(void)
 {
-    thread_memlock_lock(statlock);
+    thread_memlock_lock(&statlock);
     free(r.iplist);
 	r.iplist = NULL;
 	r.num_ips = 0;
-    thread_memlock_unlock(statlock);
+    thread_memlock_unlock(&statlock);
 }
 
 
 
 
+/*
+ * Time to wait for an acknowledge after sending a
+ * message for the retry:th time, in micro seconds.
+ * The time increase with the number of re-sends.
+ */
+useconds_t
+mcast_resend_delay(int retry)
+{
+	useconds_t usec;
+
+	usec = retry * 100000; /* 100 milliseconds */
+	if (retry > 3)
+		usec  *= 2;
+	return usec;
+}
+
+
+/*
+ * Forwarding policy for a message received from another node, 
+ * that has been seen (as in added to the buffer) seen times.
+ * fromorigin is non zero if this copy was sent by the original
+ * sender of the message.
+ * Return the reason to forward the message (TRACE_FWD_*),
+ * zero if it should not be forwarded.
+ */
+int
+mcast_forward(int seen, int fromorigin)
+{
+	/* Always forward message the first time it is seen */
+	if ((seen >= 1) && (seen <= 5))
+		return TRACE_FWD_FIRST;
+
+	/* Always forward messages from the original sender since it is 
+	 * a retransmission for a lost ACK */
+	if ((seen > 1) && fromorigin)
+		return TRACE_FWD_ORIGIN;
+
+	/*
+	 * Forward a message which have been seen before
+	 * with decreasing probability based on the number
+	 * of times it has been seen.
+	 */
+	if ((seen > 1) && (seen <= MSG_RESEND_TIMES)) {
+		int p = (seen * 10);
+
+		if ((rand() % 100) <= p)
+			return TRACE_FWD_PROB;
+	}
+
+	return 0;
+}
+
+
 /*
  * Send multicast message
  */
@@ -82,6 +140,7 @@ mcast_send(struct message *m, int wantack)
 	int sock;
 	int ret = 0;
 	int retry = 0;
+	int sent = 0;
 
 	if ( (sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
 		anderrs("mcast_send(): Failed to create socket");
@@ -101,13 +160,16 @@ mcast_send(struct message *m, int wantack)
 
 	memset(&addr, 0x00, sizeof(addr));
 	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = inet_addr(CHAT_GROUP);
+	addr.sin_addr.s_addr = channel_group(m->channel);
 	addr.sin_port = htons(CHAT_GROUP_PORT);
 	addrlen = sizeof(addr);
 
 	/* Copy and encrypt message */
 	memcpy(&mc, m, sizeof(struct message));
-	chat_crypto_encrypt(&mc);
+	if (chat_crypto_encrypt(&mc) < 0) {
+		close(sock);
+		return -1;
+	}
 
 #ifdef DONT_WAIT_FOR_ACK
 	/* For testing */
@@ -120,12 +182,15 @@ mcast_send(struct message *m, int wantack)
 	while (retry < (MSG_RESEND_TIMES+1)) {
 		useconds_t usec;
 
-		andlog("mcast_send(): Sending message type %d\n", mc.type);
+		anddebug("mcast_send(): Sending message type %d\n", mc.type);
 		if (sendto(sock, &mc, sizeof(struct message), 0, 
 				(struct sockaddr *)&addr, addrlen) < 0) {
 			anderrs("Failed to send multicast message");
 			break;
 		}
+		trace_event(TRACE_SEND, 0, m, 0, retry);
+		stats_add(STATS_SENT, 1);
+		sent++;
 
 		/* No need to wait for an ACK */
 		if (wantack == 0) {
@@ -133,11 +198,8 @@ mcast_send(struct message *m, int wantack)
 			break;
 		}
 
-		/* Wait for response and increase time 
-         * based on the number of re-sends */
-		usec = retry * 100000; /* 100 milliseconds */
-		if (retry > 3)
-			usec  *= 2;
+		/* Wait for response */
+		usec = mcast_resend_delay(retry);
 
 		//andlog("[++] Sleeping for  %lu micro seconds\n", usec);
 		usleep(usec);
@@ -151,8 +213,13 @@ mcast_send(struct message *m, int wantack)
 		retry++;
 	}
 
+	if (wantack)
+		stats_record(STATS_XMITS, sent);
+
 	if (ret < 0) {
 		andlog("Failed to send message, no acknowledge seen\n");	
+		stats_add(STATS_NOACK, 1);
+		trace_event(TRACE_NOACK, 0, m, 0, sent);
 		msgbuf_delete(m);
 	}
 
@@ -162,6 +229,54 @@ mcast_send(struct message *m, int wantack)
 
 
 
+/*
+ * Add (add non zero) or drop membership of the multicast
+ * group of channel on socket.
+ * Return 0 on success, -1 on error.
+ */
+static int
+mcast_membership(int sock, uint8_t chan, int add)
+{
+	struct ip_mreq mreq;
+
+	mreq.imr_multiaddr.s_addr = channel_group(chan);
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(sock, IPPROTO_IP, add ? IP_ADD_MEMBERSHIP : 
+			IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		anderrs(add ? "Failed to join multicast group" : 
+			"Failed to leave multicast group");
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Join the multicast group of channel.
+ * Return 0 on success, -1 on error.
+ */
+int
+chat_mcast_join(uint8_t chan)
+{
+	if (msock < 0)
+		return 0;
+	return mcast_membership(msock, chan, 1);
+}
+
+
+/*
+ * Leave the multicast group of channel.
+ * Return 0 on success, -1 on error.
+ */
+int
+chat_mcast_leave(uint8_t chan)
+{
+	if (msock < 0)
+		return 0;
+	return mcast_membership(msock, chan, 0);
+}
+
+
 /*
  * Thread entry point.
  * Read ring discovery broadcasts and update status.
@@ -173,8 +288,8 @@ mcast_read(void *arg)
 	struct sockaddr_in addr;
 	struct sockaddr_in sendaddr;
 	struct sockaddr_in toaddr;
-	struct ip_mreq mreq;
 	socklen_t optlen;
+	uint32_t mask;
 	int sendbuff;
 	int recvbuff;
 	struct message m;
@@ -183,6 +298,7 @@ mcast_read(void *arg)
 	int sock;
 	int s_sock; /* Socket for sending */
 	int n;
+	int i;
 
 	andlog("Multicast Read Thread running\n");
 	sock = 0;
@@ -232,14 +348,18 @@ mcast_read(void *arg)
 		goto finished;
 	}
 
-	/* Join group */
-	mreq.imr_multiaddr.s_addr = inet_addr(CHAT_GROUP);
-	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-	if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-			&mreq, sizeof(mreq)) < 0) {
-		anderrs("Failed to join multicast group");
-		goto finished;
-	}	
+	/* Join the group of every joined channel */
+	mask = channel_mask();
+	for (i=0; i < CHAT_MAXCHANNELS; i++) {
+		if ((mask & (1 << i)) == 0)
+			continue;
+
+		if (mcast_membership(sock, i, 1) < 0) {
+			if (i == CHAT_CHAN_DEFAULT)
+				goto finished;
+		}
+	}
+	msock = sock;
 
 
 	/* Create the socket for sending */
@@ -258,10 +378,11 @@ mcast_read(void *arg)
 		anderrs("Failed to bind ip on multicast sending socket");
 	}
 
-	/* Set up destination address for sending with sendto() */
+	/* Set up destination address for sending with sendto(),
+	 * the group is set from the channel of each message */
 	memset(&toaddr, 0x00, sizeof(addr));
 	toaddr.sin_family = AF_INET;
-	toaddr.sin_addr.s_addr = inet_addr(CHAT_GROUP);
+	toaddr.sin_addr.s_addr = channel_group(CHAT_CHAN_DEFAULT);
 	toaddr.sin_port = htons(CHAT_GROUP_PORT);
 	addrlen = sizeof(addr);
 
@@ -270,15 +391,36 @@ mcast_read(void *arg)
 	andlog("Listening for chat messages\n");
 	while ( (n = recvfrom(sock, &m, sizeof(struct message), 
 			0, (struct sockaddr *)&addr, (socklen_t *)&addrlen)) > 0) {
-		struct in_addr sad;
 		int seen = 0;
 		int fromself = 0;
 		int send_discover = 0;
 		int fwd = 0;
+		uint32_t from = addr.sin_addr.s_addr;
+
+		stats_add(STATS_RECV, 1);
 
 		/* Ignore short message */
 		if (n != sizeof(struct message)) {
-			andlog("Ignored multicast message of different size (%u bytes)\n", n);
+			anddebug("Ignored multicast message of different size (%u bytes)\n", n);
+			if (n >= MSGHDRSIZE)
+				trace_event(TRACE_DROP, TRACE_DROP_SIZE, &m, from, 0);
+			continue;
+		}
+
+		/* Drop messages for channels we are not in, the socket
+		 * may see groups joined by other sockets on the host */
+		if (!msgchan_valid(&m) || !channel_joined(m.channel)) {
+			trace_event(TRACE_DROP, TRACE_DROP_CHANNEL, &m, from, 0);
+			continue;
+		}
+
+		/* Drop old messages from the cleartext message ID
+		 * before spending time on them */
+		if (replay_check(&m.id)) {
+			anddebug("Dropped replayed message %08x%08x%04x%04x\n",
+				m.id.ip, m.id.sec, m.id.usec, m.id.sum);
+			trace_event(TRACE_DROP, TRACE_DROP_REPLAY, &m, from, 0);
+			stats_add(STATS_REPLAY, 1);
 			continue;
 		}
 
@@ -288,6 +430,19 @@ mcast_read(void *arg)
 		/* Decrypt message */
 		if (chat_crypto_decrypt(&m) < 0) {
 			anderr("** Error: Failed to decrypt message\n");
+			trace_event(TRACE_DROP, TRACE_DROP_DECRYPT, &mc, from, 0);
+			stats_add(STATS_DECRYPT, 1);
+			continue;
+		}
+
+		/* Verify the checksum, which also cover the cleartext
+		 * header chained into the encryption, before anything
+		 * in the message is trusted */
+		if (msgbuf_verify(&m) == 0) {
+			anddebug("Dropped message %08x%08x%04x%04x with bad checksum\n",
+				m.id.ip, m.id.sec, m.id.usec, m.id.sum);
+			trace_event(TRACE_DROP, TRACE_DROP_DECRYPT, &mc, from, 0);
+			stats_add(STATS_DECRYPT, 1);
 			continue;
 		}
 
@@ -295,84 +450,75 @@ mcast_read(void *arg)
 		if (msgtype_valid(&m) == 0) {
 			andlog("** Error: Received message of unknown type: %u\n",
 				 m.type);
+			trace_event(TRACE_DROP, TRACE_DROP_TYPE, &mc, from, 0);
 			continue;
 		}
 
+		/* Valid message, move replay window of sender */
+		replay_update(&m.id);
+
 		/* Shut up compiler */
 		fromself++; fromself = 0;
 
-		/* Save original source ip from within the message */
-		sad.s_addr = m.id.ip;
-
 		/* Flag message sent by us */
 		if (ntohl(addr.sin_addr.s_addr) == r.myip) 
 			fromself = 1;
 
 		/* Ignore messages sent by us the second time to
-		 * keep track of acknowledgements from other clients */
+		 * keep track of acknowledgements from other clients.
+		 * New messages are ruled out by the filter of the
+		 * buffer without taking its lock. The ID is only
+		 * looked up once the checksum is verified above, so
+		 * a forged ID can not fake an acknowledgement */
 		if (msgbuf_exist(&m) > 0) {
-			if ( (fromself == 1) && (ntohl(m.id.ip) == r.myip)) 
+			if ( (fromself == 1) && (ntohl(m.id.ip) == r.myip)) {
+				trace_event(TRACE_DROP, TRACE_DROP_SELF, &m, from, 0);
 				continue;
+			}
 		}
 
 		/* Add the message or get the number of times
          * it has been seen */
 		seen = msgbuf_add((struct message *)&m);
+		trace_event(TRACE_RECV, 0, &m, from, (seen > 0) ? seen : 0);
 
-		/* Always forward message the first time it is seen */
-		if ((seen >= 1) && (seen <= 5)) {
-			fwd = 1;
-			andlog("Forwarding (first time seen) message %08x%08x%04x%04x\n",
-				mc.id.ip, mc.id.sec, mc.id.usec, mc.id.sum);
-		}
-
-		/* Always forward messages from the original sender since it is 
-         * a retransmission for a lost ACK */
-		if (fwd == 0) {
-			if ((seen > 1) && (addr.sin_addr.s_addr == m.id.ip)) {
-				andlog("[++] Re-sending original message %08x%08x%04x%04x\n",
-					mc.id.ip, mc.id.sec, mc.id.usec, mc.id.sum);
-				fwd = 1;
-			}
-		}
-
-		/*
-         * Forward a message which have been seen before
-         * with decreasing probability based on the number
-		 * of times it has been seen.
-         */
-		if (fwd == 0) {
-			if ((seen > 1) && (seen <= MSG_RESEND_TIMES)) {
-				int p = (seen * 10);
-				int r = rand() % 100;
-
-				if (r <= p) {
-					andlog("Forwarding (p=%d) message %08x%08x%04x%04x\n", 
-						p, mc.id.ip, mc.id.sec, mc.id.usec, mc.id.sum);
-					fwd = 1;
-				}
-			}
+		/* Decide if message should be forwarded */
+		if ( (fwd = mcast_forward(seen, addr.sin_addr.s_addr == m.id.ip)) != 0) {
+			anddebug("Forwarding (reason %d, seen %d) message %08x%08x%04x%04x\n",
+				fwd, seen, mc.id.ip, mc.id.sec, mc.id.usec, mc.id.sum);
 		}
 
-
 		/* Only forward messages from other nodes */
 		if (fromself == 1)
 			fwd = 0;
 
-		if (1) {
+#if ANDLOG_LEVEL >= ANDLOG_DEBUG
+		{
+			struct in_addr sad;
 			char buf[1024];
+
+			/* Original source ip from within the message */
+			sad.s_addr = m.id.ip;
 			snprintf(buf, sizeof(buf), "%s", inet_ntoa(sad));
-			andlog("Received message from %s forwarded by %s\n",
+			anddebug("Received message from %s forwarded by %s\n",
 				buf, inet_ntoa(addr.sin_addr));
 		}
+#endif
 
 		/* Forward message */
 		if (fwd) {
+			toaddr.sin_addr.s_addr = channel_group(mc.channel);
 			if (sendto(s_sock, &mc, sizeof(struct message), 0, 
 					(struct sockaddr *)&toaddr, addrlen) < 0) {
 				anderrs("Failed to forward multicast message");
 			}	
+			else {
+				trace_event(TRACE_FWD, fwd, &m, from, seen);
+				stats_add(STATS_FWD, 1);
+			}
 		}
+		else if ((seen > 1) && (fromself == 0))
+			stats_add(STATS_DUP, 1);
 
 	   /* If this was a discovery message, respond with our
    	   	* initial discovery message so that new clients can
@@ -385,18 +531,19 @@ mcast_read(void *arg)
          * if it is a neighbour (we see the source IPv4) */
 		if (ntohl(addr.sin_addr.s_addr) != r.myip) {
 		
-			thread_memlock_lock(statlock);
+			thread_memlock_lock(&statlock);
 			if (iplist_add(addr.sin_addr.s_addr, &r.iplist, r.num_ips)) {
 				andlog("Added new IPv4 %s address to neighbor list\n", inet_ntoa(addr.sin_addr));
 				r.num_ips = r.num_ips + 1;
 				//iplist_print(r.iplist, r.num_ips);
 			}
-			thread_memlock_unlock(statlock);
+			thread_memlock_unlock(&statlock);
 		}
 
 		/* Send discover to new client */
 		if (send_discover)  {
-			andlog("Sending discovery message\n");
+			anddebug("Sending discovery message\n");
+			toaddr.sin_addr.s_addr = channel_group(CHAT_CHAN_DEFAULT);
 			if (sendto(s_sock, &dc, sizeof(struct message), 0, 
 					(struct sockaddr *)&toaddr, addrlen) < 0) {
 				anderrs("Failed to send multicast discover message");
@@ -406,6 +553,7 @@ mcast_read(void *arg)
 
 
 	finished:
+		msock = -1;
 		if (sock > 0)
 			close(sock);
 		if (s_sock > 0)
@@ -428,11 +576,15 @@ chat_mcast_reader_start(uint32_t ipv4, uint32_t mask)
 	memset(&d, 0x00, sizeof(struct discover));
 
 	/* Seed the random number generator */
-	getrand_nonblock((uint8_t *)&seed, sizeof(seed));
+	if (drbg_bytes((uint8_t *)&seed, sizeof(seed)) < 0)
+		return -1;
 	srand(seed);
 
 	/* Initialize locks */
-	thread_memlock_init(statlock);
+	thread_memlock_init(&statlock);
+
+	/* Initialize replay protection */
+	replay_init();
 
 	/* Set our ip as an integer in host byte order */
 	r.myip = ntohl(ipv4);
@@ -447,12 +599,14 @@ chat_mcast_reader_start(uint32_t ipv4, uint32_t mask)
 
 	usleep(200000);
 	d.type = CHAT_DISCOVER;
+	d.channel = CHAT_CHAN_DEFAULT;
 	msgbuf_setid((struct message *)&d);
 
 	/* Encrypt discovery message for sending later
      * in response to clients */
 	memcpy(&dc, &d, sizeof(struct message));	
-	chat_crypto_encrypt((struct message *)&dc);
+	if (chat_crypto_encrypt((struct message *)&dc) < 0)
+		return -1;
 
 	/* Send initial discover message */
 	if (mcast_send((struct message *)&d, 0) != 0)
@@ -467,7 +621,8 @@ chat_mcast_reader_start(uint32_t ipv4, uint32_t mask)
 	/* Give clients some time to respond */
 	sleep(1);
 
-	/* Spawn the synchronization thread */
+	/* Spawn the synchronization thread, which only ask for
+	 * the messages missing if the history was restored */
 	thread_spawn(mcast_sync_thread, NULL);
 	sleep(1);
 	return 0;
@@ -476,10 +631,13 @@ chat_mcast_reader_start(uint32_t ipv4, uint32_t mask)
 void *
 mcast_sync_thread(void *arg)
 {
+	uint32_t since;
 	uint32_t ip = 0;
 	int i = 0;
 
-	/* Attempt to synchronize from another client */
+	/* Attempt to synchronize from another client, from 
+	 * the newest message restored from the log if any */
+	since = msglog_since();
 	andlog("[SYNC] Sync thread started\n");
 	i = 0;
 
@@ -488,19 +646,19 @@ mcast_sync_thread(void *arg)
 		sleep(1);
 
 	do {
-		thread_memlock_lock(statlock);
+		thread_memlock_lock(&statlock);
 		if (i < r.num_ips) 
 			ip = htonl(r.iplist[i]);
 		else
 			ip = 0;
-		thread_memlock_unlock(statlock);
+		thread_memlock_unlock(&statlock);
 
 		/* Avoid our IP if that for some weird reason
 		 * ended up in the list */
 		if ((ip != myipv4) && (ip > 0)) {
 
 			/* Attempt to connect to client and synchronize */
-			if (msgbuf_sync(ip, ntohs(CHAT_RECV_PORT)) > 0) 
+			if (msgbuf_sync(ip, ntohs(CHAT_RECV_PORT), channel_mask(), since) > 0) 
 				return NULL;
 		}
 
@@ -27,10 +27,34 @@
 
 #include "ibsschat.h"
 
+/* Maximum number of messages in flight per send session */
+#define SESSION_MAXINFLIGHT 32
+
+/* A pipelined send session */
+struct session {
+	int sock;
+	lock_t lock;
+	pthread_cond_t cond;
+	int inflight;	/* Requests being sent */
+	int closed;		/* Client has stopped sending requests */
+};
+
+/* A request in a send session */
+struct sendjob {
+	struct session *s;
+	struct chatsendreq r;
+};
+
 /* Local routines */
+static int chat_proc_send(struct chatreq *);
+static void handle_session(int);
+static void *session_send(void *);
 static void *handle_client_sending(void *);
+static void *handle_unix_session(void *);
+static void *chat_client_accept_unix(void *);
 static void *chat_client_accept_sending(void *);
 static void *chat_client_accept_receive(void *);
+static void *chat_ctl_read(void *);
 
 /* Local variables */
 static struct in_addr ina;
@@ -39,36 +63,186 @@ static struct in_addr inm;
 
 
 /*
- * Thread entry point.
- * Handle connected client.
+ * Send chat message requested by a client and wait for
+ * it to be acknowledged.
+ * Return 0 on success, -1 on error.
  */
-static void *
-handle_client_sending(void *sock)
+static int
+chat_proc_send(struct chatreq *req)
 {
 	struct chatmsg cm;
-	int cfd = *((int *)sock);
-	int ret = 0;
 
-	/* Read the message from the unix socket */
-	if (readn(cfd, &cm.txt, 
-			sizeof(struct chatxt)) != sizeof(struct chatxt)) {
-		anderrs("Failed to read chat text from socket");
-		goto finished;
-	}
-
-	andlog("[+] handle_client_sending: Sending \"%s\"\n", 
-		cm.txt.msg);
+	andlog("[+] handle_client_sending: Sending \"%s\" to channel %u\n", 
+		req->txt.msg, req->channel);
 
 	/* Set up message */
+	memset(&cm, 0x00, sizeof(cm));
 	cm.type = CHAT_MSG;
+	cm.channel = req->channel;
+	memcpy(&cm.txt, &req->txt, sizeof(struct chatxt));
+	cm.txt.msg[sizeof(cm.txt.msg)-1] = '\0';
+
+	if (!channel_joined(cm.channel)) {
+		andlog("** Error: Channel %u is not joined\n", cm.channel);
+		return -1;
+	}
 	msgbuf_setid((struct message *)&cm);
 
 	/* Send it as a broadcast */
 	if (mcast_send((struct message *)&cm, 1) < 0) {
 		andlog("** Error: Failed to broadcast chat message\n");
-		ret = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Thread entry point.
+ * Send message of session request and write the 
+ * result back to the client when it is done.
+ */
+static void *
+session_send(void *arg)
+{
+	struct sendjob *job = (struct sendjob *)arg;
+	struct session *s = job->s;
+	struct chatsendres res;
+
+	res.reqid = job->r.reqid;
+	res.ret = htonl(chat_proc_send(&job->r.req));
+	free(job);
+
+	thread_memlock_lock(&s->lock);
+	if (writen(s->sock, &res, sizeof(res)) != sizeof(res))
+		anderrs("Failed to write send result to session");
+
+	s->inflight--;
+	pthread_cond_signal(&s->cond);
+
+	/* Last one out */
+	if ((s->closed != 0) && (s->inflight == 0)) {
+		thread_memlock_unlock(&s->lock);
+		close(s->sock);
+		pthread_cond_destroy(&s->cond);
+		thread_memlock_fini(&s->lock);
+		free(s);
+		return NULL;
+	}
+
+	thread_memlock_unlock(&s->lock);
+	return NULL;
+}
+
+
+/*
+ * Handle pipelined send session.
+ * Read requests until the client disconnects and send 
+ * each of them in its own thread, so that results are
+ * written back as soon as the message is acknowledged
+ * rather than in the order the requests were read.
+ */
+static void
+handle_session(int cfd)
+{
+	struct session *s;
+	struct sendjob *job;
+
+	if ( (s = calloc(1, sizeof(struct session))) == NULL) {
+		anderrs("Failed to allocate send session");
+		close(cfd);
+		return;
+	}
+	s->sock = cfd;
+	thread_memlock_init(&s->lock);
+	pthread_cond_init(&s->cond, NULL);
+
+	andlog("[+] Send session started on socket %d\n", cfd);
+	for (;;) {
+
+		if ( (job = calloc(1, sizeof(struct sendjob))) == NULL) {
+			anderrs("Failed to allocate send request");
+			break;
+		}
+		job->s = s;
+
+		if (readn(cfd, &job->r, sizeof(job->r)) != sizeof(job->r)) {
+			free(job);
+			break;
+		}
+
+		/* Stop reading requests while too many are in flight */
+		thread_memlock_lock(&s->lock);
+		while (s->inflight >= SESSION_MAXINFLIGHT)
+			pthread_cond_wait(&s->cond, &s->lock);
+		s->inflight++;
+		thread_memlock_unlock(&s->lock);
+
+		if (thread_spawn(session_send, job) != 0) {
+			struct chatsendres res;
+
+			res.reqid = job->r.reqid;
+			res.ret = htonl(-1);
+			free(job);
+
+			thread_memlock_lock(&s->lock);
+			writen(cfd, &res, sizeof(res));
+			s->inflight--;
+			thread_memlock_unlock(&s->lock);
+		}
+	}
+
+	andlog("[+] Send session on socket %d finished\n", cfd);
+
+	thread_memlock_lock(&s->lock);
+	s->closed = 1;
+	if (s->inflight == 0) {
+		thread_memlock_unlock(&s->lock);
+		close(cfd);
+		pthread_cond_destroy(&s->cond);
+		thread_memlock_fini(&s->lock);
+		free(s);
+		return;
+	}
+	thread_memlock_unlock(&s->lock);
+}
+
+
+/*
+ * Thread entry point.
+ * Handle connected client. The first byte is either
+ * CHAT_SESSION for a pipelined send session, or the channel
+ * of a single struct chatreq that is answered with an int.
+ */
+static void *
+handle_client_sending(void *sock)
+{
+	struct chatreq req;
+	int cfd = *((int *)sock);
+	int ret = 0;
+
+	/* Read the first byte */
+	if (readn(cfd, &req.channel, 1) != 1) {
+		anderrs("Failed to read chat request from socket");
+		goto finished;
+	}
+
+	if (req.channel == CHAT_SESSION) {
+		free(sock);
+		handle_session(cfd);
+		return NULL;
 	}
 
+	/* Read the message from the socket */
+	if (readn(cfd, &req.txt, 
+			sizeof(struct chatxt)) != sizeof(struct chatxt)) {
+		anderrs("Failed to read chat text from socket");
+		goto finished;
+	}
+
+	ret = chat_proc_send(&req);
+
 	/* Write status to client */
 	if (writen(cfd, &ret, sizeof(ret)) != sizeof(ret)) {
 		fprintf(stderr, "** Error: Failed to write return value to socket: %s\n",
@@ -143,33 +317,86 @@ chat_client_accept_sending(void *arg)
 struct recvarg {
 	int sock;
 	uint32_t ip;
+	int local;	/* Client on this node */
 };
 
+/*
+ * Thread entry point.
+ * Read the subscription, or query, and the filter of a receiving
+ * client and write the matching messages in the buffer. Local clients
+ * are then registered for new messages.
+ */
 static void *
 handle_client_receive(void *arg)
 {
 	struct recvarg *a = (struct recvarg *)arg;
+	struct chatfilter filter;
+	struct chatfilter *f = NULL;
+	struct chatquery q;
+	uint32_t flags;
+	int live = 1;
+	int n;
 	int enc = 0;
 
 	/* Encrypt if this is not a local client 
      * since it is transfered on the network */
-	if (a->ip != ina.s_addr)
+	if (a->local == 0)
 		enc = 1;
-	
-	/* Dump the buffered messages */
-	msgbuf_dump(a->sock, enc);
 
-	/* Disconnect remote client after synchronize */
-	if (a->ip != ina.s_addr) {
-		andlog("Disconnecting remote client (%08x) after synchronization\n", a->ip);
+	/* Read the channels that the client subscribe to */
+	memset(&q, 0x00, sizeof(q));
+	if (readn(a->sock, &q.channels, sizeof(struct chatsub)) != 
+			sizeof(struct chatsub)) {
+		anderrs("Failed to read channel subscription from client");
 		close(a->sock);
 		free(arg);
 		return NULL;
 	}
+	flags = ntohl(q.channels);
+
+	/* The rest of a query */
+	if (flags & CHAT_SUB_QUERY) {
+		if (readn(a->sock, &q.cursor, sizeof(q) - sizeof(struct chatsub)) !=
+				sizeof(q) - sizeof(struct chatsub)) {
+			anderrs("Failed to read query from client");
+			close(a->sock);
+			free(arg);
+			return NULL;
+		}
+		q.cursor = ntohl(q.cursor);
+		q.since = ntohl(q.since);
+		q.until = ntohl(q.until);
+		q.max = ntohl(q.max);
+	}
+	q.channels = (flags & channel_mask()) | (flags & CHAT_SUB_QUERY);
+
+	/* Filter on the messages */
+	if (flags & CHAT_SUB_FILTER) {
+		if ((readn(a->sock, &filter, sizeof(filter)) != sizeof(filter)) ||
+				(filter_valid(&filter) < 0)) {
+			anderrs("Failed to read filter from client");
+			close(a->sock);
+			free(arg);
+			return NULL;
+		}
+		f = &filter;
+	}
+
+	/* Clients reading new messages from the ring, and
+	 * remote clients synchronizing, are disconnected 
+	 * after the buffered messages */
+	if ((flags & CHAT_SUB_NOLIVE) || (a->local == 0))
+		live = 0;
+
+	n = msgbuf_query(a->sock, enc, &q, f, live);
+	if ((n > 0) && (a->local == 0))
+		stats_add(STATS_SYNC_TX, n * sizeof(struct message));
 
-	/* Register the socket for future messages */
-	if (msgbuf_addsock(a->sock) < 0)
+	if ((n < 0) || (live == 0)) {
+		if (a->local == 0)
+			andlog("Disconnecting remote client (%08x) after synchronization\n", a->ip);
 		close(a->sock);
+	}
 
 	free(arg);
 	return NULL;
@@ -218,6 +445,7 @@ chat_client_accept_receive(void *arg)
 		arg = calloc(1, sizeof(struct recvarg));
 		arg->sock = cfd;
 		arg->ip = sin.sin_addr.s_addr;
+		arg->local = (arg->ip == ina.s_addr);
 		thread_spawn(handle_client_receive, (void *)arg);
 
 		/* Continue and accept the next client */
@@ -239,12 +467,150 @@ chat_client_accept_receive(void *arg)
 }
 
 
+/*
+ * Thread entry point.
+ * Handle send session on UNIX socket.
+ */
+static void *
+handle_unix_session(void *sock)
+{
+	int cfd = *((int *)sock);
+
+	free(sock);
+	handle_session(cfd);
+	return NULL;
+}
+
+
+/*
+ * Thread entry point.
+ * Accept local clients on the UNIX socket named arg, 
+ * CHAT_UNIX_SEND or CHAT_UNIX_RECV. Every record on the
+ * sending socket is a chatsendreq of a send session, and
+ * receiving clients are handled as local clients of
+ * CHAT_RECV_PORT. The sockets are not bound to the address
+ * of the interface and survive reconfiguration.
+ */
+static void *
+chat_client_accept_unix(void *arg)
+{
+	const char *name = (const char *)arg;
+	int cfd;
+	int sd;
+
+	for (;;) {
+		if ( (sd = unix_socket_listen(NULL, name, SOCK_SEQPACKET)) >= 0)
+			break;
+		andlog("Failed to create UNIX socket @%s, retrying in 5 seconds\n",
+			name);
+		sleep(5);
+	}
+
+	andlog("[+] chat process accepting clients on @%s\n", name);
+	while ( (cfd = accept(sd, NULL, NULL)) >= 0) {
+
+		if (strcmp(name, CHAT_UNIX_SEND) == 0) {
+			int *spt;
+
+			spt = calloc(1, sizeof(int));
+			*spt = cfd;
+			thread_spawn(handle_unix_session, (void *)spt);
+		}
+		else {
+			struct recvarg *ra;
+
+			ra = calloc(1, sizeof(struct recvarg));
+			ra->sock = cfd;
+			ra->ip = ina.s_addr;
+			ra->local = 1;
+			thread_spawn(handle_client_receive, (void *)ra);
+		}
+	}
+
+	anderrs("Failed to accept clients on UNIX socket");
+	close(sd);
+	return NULL;
+}
+
+
+/*
+ * Thread entry point.
+ * Read key rotation and channel requests from the
+ * configuration daemon and apply them in place.
+ * Each request is a code byte followed by the
+ * structure for that code.
+ */
+static void *
+chat_ctl_read(void *arg)
+{
+	union msgbuf buf;
+	uint8_t code;
+	int fd = *((int *)arg);
+
+	free(arg);
+	while (readn(fd, &code, 1) == 1) {
+
+		memset(&buf, 0x00, sizeof(buf));
+		switch (code) {
+
+			case MSG_KEY_REQ_ROTATE:
+				if (readn(fd, &buf.key, sizeof(buf.key)) != sizeof(buf.key))
+					goto finished;
+				buf.key.key[CRYPTO_KEY_MAXLEN] = '\0';
+				andlog("[+] Rolling over to key epoch %u in channel %u\n", 
+					buf.key.epoch, buf.key.channel);
+				chat_crypto_rotate_key(buf.key.channel, buf.key.key, 
+					strlen((char *)buf.key.key), buf.key.epoch);
+				break;
+
+			case MSG_CHAN_REQ_JOIN:
+				if (readn(fd, &buf.chan, sizeof(buf.chan)) != sizeof(buf.chan))
+					goto finished;
+				buf.chan.key[CRYPTO_KEY_MAXLEN] = '\0';
+				buf.chan.name[CHAT_CHAN_NAMELEN-1] = '\0';
+				andlog("[+] Joining channel %u (%s)\n", 
+					buf.chan.channel, buf.chan.name);
+				if (chat_crypto_set_key(buf.chan.channel, buf.chan.key, 
+						strlen((char *)buf.chan.key), buf.chan.epoch) < 0)
+					break;
+				if (channel_join(buf.chan.channel, buf.chan.name) == 0)
+					chat_mcast_join(buf.chan.channel);
+				break;
+
+			case MSG_CHAN_REQ_LEAVE:
+				if (readn(fd, &buf.chan, sizeof(buf.chan)) != sizeof(buf.chan))
+					goto finished;
+				andlog("[+] Leaving channel %u\n", buf.chan.channel);
+				if (channel_leave(buf.chan.channel) == 0) {
+					chat_mcast_leave(buf.chan.channel);
+					msgbuf_flush(buf.chan.channel);
+					chat_crypto_clear_key(buf.chan.channel);
+				}
+				break;
+
+			default:
+				anderr("** Error: Unknown control code %u\n", code);
+				goto finished;
+		}
+		memset(&buf, 0x00, sizeof(buf));
+	}
+
+	finished:
+
+	/* The configuration daemon is gone */
+	andlog("[+] Chat process control channel closed\n");
+	close(fd);
+	return NULL;
+}
+
+
 /*
  * Start of the chat process.
+ * Key rotation and channel requests are read from ctlfd.
  * Returns -1 on error.
  */
 extern void
-chat_proc_run(char *iface)
+chat_proc_run(char *iface, int ctlfd)
 {
 	char tmp[256];
 
@@ -254,6 +620,9 @@ chat_proc_run(char *iface)
 		exit(EXIT_FAILURE);
     }
 
+	/* The log writer thread does not survive fork() */
+	log_init();
+
 	andlog("[+] Chat process %u up and running\n", getpid());
 
 	/* Add route for multicast */
@@ -272,7 +641,35 @@ chat_proc_run(char *iface)
 	andlog("%s has network mask %s\n", iface, inet_ntoa(inm));
 
 	/* Init the message buffer */
-	msgbuf_init(ina.s_addr);
+	if (msgbuf_init(ina.s_addr) < 0)
+		exit(EXIT_FAILURE);
+
+	/* Restore the messages of the log if a log directory was
+	 * given, and continue the log. Run without it on error */
+	msglog_open();
+
+	/* Trace messages if a trace file was given, run without it on error */
+	trace_open(ina.s_addr);
+
+	/* Start writing new messages to local clients */
+	if (client_init() < 0)
+		exit(EXIT_FAILURE);
+
+	/* Share new messages with local clients through memory,
+	 * clients fall back to the receive socket without it */
+	ring_init();
+
+	/* Serve metrics to local monitors */
+	stats_init();
+
+	/* Start thread that read new keys */
+	if (ctlfd >= 0) {
+		int *fdp;
+
+		fdp = calloc(1, sizeof(int));
+		*fdp = ctlfd;
+		thread_spawn(chat_ctl_read, (void *)fdp);
+	}
 
 	/* Start the multicast thread */
 	chat_mcast_reader_start(ina.s_addr, inm.s_addr);
@@ -280,6 +677,10 @@ chat_proc_run(char *iface)
 	/* Start thread for clients receiving messages */
 	thread_spawn(chat_client_accept_receive, NULL);
 
+	/* Local clients */
+	thread_spawn(chat_client_accept_unix, (void *)CHAT_UNIX_SEND);
+	thread_spawn(chat_client_accept_unix, (void *)CHAT_UNIX_RECV);
+
 	/* Run the chat send message service */
 	chat_client_accept_sending(NULL);
 
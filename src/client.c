@@ -0,0 +1,606 @@
+/*
+ *    File: client.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Local clients receiving new messages.
+ *
+ * New messages are added by the multicast reader thread, which
+ * must never block on a client, so every client has its own ring
+ * of outbound messages and a non-blocking socket. A single writer
+ * thread drain the rings when the sockets become writable.
+ * A client whose ring is full drops new messages, and is
+ * disconnected once it has dropped CLIENT_MAXDROPS messages.
+ * A client can be added paused, new messages are then queued
+ * but not written until the client is resumed, which let the
+ * chat process write the answer to a query first.
+ *
+ * Clients are kept in a growable slot table with a free list,
+ * and found from their socket through a table indexed on the
+ * descriptor, so adding and removing a client is O(1). Every
+ * channel has a dense list of the clients subscribing to it,
+ * so a new message only visit the clients that may want it.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include "ibsschat.h"
+
+/* Initial number of client slots, the table grow on demand */
+#define CLIENT_SLOTS	32
+
+/* Messages in the ring of each client, must be a power of two */
+#define CLIENT_QLEN		256
+
+/* Disconnect client after this many dropped messages */
+#define CLIENT_MAXDROPS	32
+
+/* The list of all clients, after the channel lists */
+#define CLIENT_ALL		CHAT_MAXCHANNELS
+
+/* A client */
+struct client {
+	int sock;
+	uint32_t slot;		/* Slot in client table */
+	uint32_t gen;		/* Generation, tell reused slots apart */
+	uint32_t chans;		/* Bit mask of subscribed channels */
+	uint32_t pos[CLIENT_ALL + 1]; /* Position in each list */
+	time_t connected;	/* Time when client was added */
+	uint64_t bytes;		/* Bytes written to client */
+	uint64_t msgs;		/* Messages written to client */
+	uint32_t head;		/* Next message to write */
+	uint32_t tail;		/* Next free slot */
+	size_t off;			/* Bytes written of message at head */
+	uint32_t drops;		/* Messages dropped since connected */
+	int paused;			/* Queue but do not write messages */
+	int filtered;		/* Only messages matching filter */
+	struct chatfilter filter;
+	struct message q[CLIENT_QLEN];
+};
+
+/* A dense list of client slots */
+struct clientlist {
+	uint32_t *slot;
+	uint32_t n;
+	uint32_t size;
+};
+
+/* Local routines */
+static void *client_writer(void *);
+static void client_close(struct client *);
+static void client_remove(struct client *);
+static struct client *client_find(int);
+static int client_flush(struct client *);
+static void client_wakeup(void);
+static void client_setfilter(struct client *, struct chatfilter *);
+static void client_subscribe(struct client *, uint32_t);
+static int list_add(struct clientlist *, int, struct client *);
+static void list_del(struct clientlist *, int, struct client *);
+static int grow(void *, uint32_t *, uint32_t, size_t);
+
+/* Local variables */
+static lock_t clientlock;
+static struct client **clients = NULL;	/* Slot table */
+static uint32_t nslots = 0;
+static uint32_t *freeslots = NULL;		/* Stack of free slots */
+static uint32_t freesize = 0;
+static uint32_t nfree = 0;
+static uint32_t clientgen = 0;			/* Generation of last client */
+static uint32_t *fdslot = NULL;			/* Slot + 1 by descriptor */
+static uint32_t nfds = 0;
+static struct clientlist lists[CLIENT_ALL + 1];
+static int wakefd[2] = { -1, -1 };
+
+
+/*
+ * Grow the array in *arr of elements of size esize
+ * to hold at least n elements, new elements are zeroed.
+ * The size is updated in *size.
+ * Return 0 on success, -1 on error.
+ */
+static int
+grow(void *arr, uint32_t *size, uint32_t n, size_t esize)
+{
+	uint32_t nsize = *size ? *size : CLIENT_SLOTS;
+	uint8_t *p;
+
+	if (n <= *size)
+		return 0;
+
+	while (nsize < n)
+		nsize <<= 1;
+
+	if ( (p = realloc(*(void **)arr, nsize * esize)) == NULL) {
+		anderrs("Failed to allocate memory");
+		return -1;
+	}
+	memset(p + (*size * esize), 0x00, (nsize - *size) * esize);
+	*(void **)arr = p;
+	*size = nsize;
+	return 0;
+}
+
+
+/*
+ * Add client to list l, its position is saved in
+ * the position of list number i of the client.
+ * Return 0 on success, -1 on error.
+ */
+static int
+list_add(struct clientlist *l, int i, struct client *c)
+{
+	if (grow(&l->slot, &l->size, l->n + 1, sizeof(uint32_t)) < 0)
+		return -1;
+
+	c->pos[i] = l->n;
+	l->slot[l->n++] = c->slot;
+	return 0;
+}
+
+
+/*
+ * Remove client from list l, list number i,
+ * by moving the last client into its position.
+ */
+static void
+list_del(struct clientlist *l, int i, struct client *c)
+{
+	uint32_t last = l->slot[--l->n];
+
+	l->slot[c->pos[i]] = last;
+	clients[last]->pos[i] = c->pos[i];
+}
+
+
+/*
+ * Initialize the client table and start the writer thread.
+ * Return 0 on success, -1 on error.
+ */
+int
+client_init(void)
+{
+	thread_memlock_init(&clientlock);
+	memset(lists, 0x00, sizeof(lists));
+
+	if (pipe(wakefd) < 0) {
+		anderrs("Failed to create client wakeup pipe");
+		return -1;
+	}
+	fcntl(wakefd[0], F_SETFL, fcntl(wakefd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(wakefd[1], F_SETFL, fcntl(wakefd[1], F_GETFL) | O_NONBLOCK);
+
+	if (thread_spawn(client_writer, NULL) != 0)
+		return -1;
+	return 0;
+}
+
+
+/*
+ * Wake up the writer thread.
+ */
+static void
+client_wakeup(void)
+{
+	uint8_t b = 0;
+
+	/* A full pipe means that the writer is already awake */
+	if (write(wakefd[1], &b, 1) < 0)
+		return;
+}
+
+
+/*
+ * Set the filter of client, NULL for none.
+ */
+static void
+client_setfilter(struct client *c, struct chatfilter *filter)
+{
+	c->filtered = (filter != NULL);
+	if (filter != NULL)
+		memcpy(&c->filter, filter, sizeof(struct chatfilter));
+}
+
+
+/*
+ * Move client to the lists of the channels in chans.
+ * Client lock must be held when calling this function.
+ */
+static void
+client_subscribe(struct client *c, uint32_t chans)
+{
+	int i;
+
+	for (i=0; i < CHAT_MAXCHANNELS; i++) {
+		if ((c->chans & (1 << i)) && !(chans & (1 << i)))
+			list_del(&lists[i], i, c);
+		else if (!(c->chans & (1 << i)) && (chans & (1 << i))) {
+			if (list_add(&lists[i], i, c) < 0)
+				chans &= ~(1 << i);
+		}
+	}
+	c->chans = chans & CHAT_CHAN_ALL;
+}
+
+
+/*
+ * Find client of socket.
+ * Return a pointer to the client, NULL if not found.
+ * Client lock must be held when calling this function.
+ */
+static struct client *
+client_find(int sock)
+{
+	if ((sock < 0) || ((uint32_t)sock >= nfds) || (fdslot[sock] == 0))
+		return NULL;
+	return clients[fdslot[sock] - 1];
+}
+
+
+/*
+ * Add client socket, the client receive new
+ * messages in the channels in chans that match filter,
+ * or all of them if filter is NULL. A paused client
+ * is not written to until client_resume() is called,
+ * and its socket is left blocking until then.
+ * Returns 0 on success, -1 on error.
+ */
+int
+client_add(int sock, uint32_t chans, struct chatfilter *filter, int paused)
+{
+	struct client *c;
+	int ret = -1;
+
+	if ((paused == 0) &&
+			(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0)) {
+		anderrs("Failed to set client socket non-blocking");
+		return -1;
+	}
+
+	thread_memlock_lock(&clientlock);
+
+	/* Check if socket already exist */
+	if ( (c = client_find(sock)) != NULL) {
+		client_subscribe(c, chans);
+		client_setfilter(c, filter);
+		ret = 0;
+		goto finished;
+	}
+
+	if (grow(&fdslot, &nfds, sock + 1, sizeof(uint32_t)) < 0)
+		goto finished;
+
+	/* Take a free slot, or add more */
+	if (nfree == 0) {
+		uint32_t old = nslots;
+		uint32_t n;
+
+		if ((grow(&clients, &nslots, old + 1, sizeof(struct client *)) < 0) ||
+				(grow(&freeslots, &freesize, nslots, sizeof(uint32_t)) < 0))
+			goto finished;
+
+		/* Lowest slot on top of the stack */
+		for (n = nslots; n > old; n--)
+			freeslots[nfree++] = n - 1;
+	}
+
+	if ( (c = calloc(1, sizeof(struct client))) == NULL) {
+		anderrs("Failed to allocate client");
+		goto finished;
+	}
+
+	c->sock = sock;
+	c->slot = freeslots[--nfree];
+	c->gen = ++clientgen;
+	c->paused = paused;
+	c->connected = time(NULL);
+	client_setfilter(c, filter);
+	clients[c->slot] = c;
+
+	if (list_add(&lists[CLIENT_ALL], CLIENT_ALL, c) < 0) {
+		clients[c->slot] = NULL;
+		freeslots[nfree++] = c->slot;
+		free(c);
+		goto finished;
+	}
+
+	client_subscribe(c, chans);
+	fdslot[sock] = c->slot + 1;
+	ret = 0;
+
+	andlog("Added client socket %d in slot %u (%u clients)\n",
+		sock, c->slot, lists[CLIENT_ALL].n);
+
+	finished:
+	thread_memlock_unlock(&clientlock);
+
+	if (ret == -1)
+		andlog("** Error: Could not add client socket %d\n", sock);
+
+	return ret;
+}
+
+
+/*
+ * Start writing queued messages to paused client.
+ * The client is removed, but the socket not closed,
+ * if it dropped too many messages while paused.
+ * Return 0 on success, -1 on error.
+ */
+int
+client_resume(int sock)
+{
+	struct client *c;
+	int ret = -1;
+
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+		anderrs("Failed to set client socket non-blocking");
+		client_del(sock);
+		return -1;
+	}
+
+	thread_memlock_lock(&clientlock);
+	if ( (c = client_find(sock)) != NULL) {
+		if (c->drops >= CLIENT_MAXDROPS) {
+			andlog("Dropping slow client %d\n", sock);
+			client_remove(c);
+		}
+		else {
+			c->paused = 0;
+			ret = 0;
+		}
+	}
+	thread_memlock_unlock(&clientlock);
+
+	if (ret == 0)
+		client_wakeup();
+	return ret;
+}
+
+
+/*
+ * Remove client from the table and free it.
+ * Client lock must be held when calling this function.
+ */
+static void
+client_remove(struct client *c)
+{
+	client_subscribe(c, 0);
+	list_del(&lists[CLIENT_ALL], CLIENT_ALL, c);
+	fdslot[c->sock] = 0;
+	clients[c->slot] = NULL;
+	freeslots[nfree++] = c->slot;
+	free(c);
+}
+
+
+/*
+ * Close and remove client.
+ * Client lock must be held when calling this function.
+ */
+static void
+client_close(struct client *c)
+{
+	andlog("Closing client socket %d after %lu seconds "
+		"(%llu messages, %llu bytes, %u dropped)\n", c->sock,
+		(unsigned long)(time(NULL) - c->connected),
+		(unsigned long long)c->msgs, (unsigned long long)c->bytes,
+		c->drops);
+	close(c->sock);
+	client_remove(c);
+}
+
+
+/*
+ * Remove client socket without closing it.
+ * Return 0 on success, -1 on error.
+ */
+int
+client_del(int sock)
+{
+	struct client *c;
+	int ret = -1;
+
+	thread_memlock_lock(&clientlock);
+	if ( (c = client_find(sock)) != NULL) {
+		client_remove(c);
+		ret = 0;
+	}
+	thread_memlock_unlock(&clientlock);
+
+	if (ret == -1)
+		andlog("** Error: Could not find client socket in list\n");
+	return ret;
+}
+
+
+/*
+ * Queue message for all clients subscribing to the channel
+ * of the message, whose filter match it. Never blocks.
+ * Return the number of clients the message was queued for.
+ */
+int
+client_queue(struct message *m)
+{
+	struct clientlist *l;
+	int wake = 0;
+	int ret = 0;
+	uint32_t i;
+
+	if (!msgchan_valid(m))
+		return 0;
+
+	thread_memlock_lock(&clientlock);
+	l = &lists[m->channel];
+
+	/* Walk backwards, closing a client move
+	 * the last one into its position */
+	for (i = l->n; i > 0; i--) {
+		struct client *c = clients[l->slot[i - 1]];
+
+		if (c->filtered && (filter_match(&c->filter, m) == 0))
+			continue;
+
+		/* Ring is full, the client is not keeping up */
+		if ((c->tail - c->head) >= CLIENT_QLEN) {
+			stats_add(STATS_CLIENT_DROP, 1);
+
+			/* A paused client is closed when resumed */
+			if ((++c->drops >= CLIENT_MAXDROPS) && (c->paused == 0)) {
+				andlog("Disconnecting slow client %d\n", c->sock);
+				client_close(c);
+			}
+			continue;
+		}
+
+		if (c->tail == c->head)
+			wake = 1;
+
+		memcpy(&c->q[c->tail & (CLIENT_QLEN - 1)], m, sizeof(struct message));
+		c->tail++;
+		ret++;
+		stats_record(STATS_QDEPTH, c->tail - c->head);
+	}
+	thread_memlock_unlock(&clientlock);
+
+	if (wake)
+		client_wakeup();
+	return ret;
+}
+
+
+/*
+ * Write queued messages to client until the ring
+ * is empty or the socket would block.
+ * Return 0 on success, -1 if the client should be closed.
+ * Client lock must be held when calling this function.
+ */
+static int
+client_flush(struct client *c)
+{
+	while (c->head != c->tail) {
+		uint8_t *p;
+		ssize_t n;
+
+		p = (uint8_t *)&c->q[c->head & (CLIENT_QLEN - 1)];
+		n = write(c->sock, p + c->off, sizeof(struct message) - c->off);
+
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return 0;
+			if (errno == EINTR)
+				continue;
+			anderrs("Failed to write to client socket");
+			return -1;
+		}
+
+		c->bytes += n;
+		c->off += n;
+		if (c->off == sizeof(struct message)) {
+			c->off = 0;
+			c->head++;
+			c->msgs++;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Thread entry point.
+ * Write queued messages to clients when their sockets
+ * are writable, and close clients that hang up.
+ */
+static void *
+client_writer(void *arg)
+{
+	struct pollfd *pfd = NULL;
+	uint32_t *pslot = NULL;		/* Slot of client polled in pfd */
+	uint32_t *pgen = NULL;		/* Generation of client polled in pfd */
+	uint32_t size = 0;
+	uint32_t ssize = 0;
+	uint32_t gsize = 0;
+	uint8_t buf[64];
+	uint32_t npfd;
+	uint32_t i;
+
+	for (;;) {
+		struct clientlist *l = &lists[CLIENT_ALL];
+
+		thread_memlock_lock(&clientlock);
+		if ((grow(&pfd, &size, l->n + 1, sizeof(struct pollfd)) < 0) ||
+				(grow(&pslot, &ssize, l->n + 1, sizeof(uint32_t)) < 0) ||
+				(grow(&pgen, &gsize, l->n + 1, sizeof(uint32_t)) < 0)) {
+			thread_memlock_unlock(&clientlock);
+			sleep(1);
+			continue;
+		}
+
+		/* Poll the wakeup pipe, and the clients for hang up
+		 * and for writing if they have pending messages */
+		pfd[0].fd = wakefd[0];
+		pfd[0].events = POLLIN;
+		npfd = 1;
+
+		for (i=0; i < l->n; i++) {
+			struct client *c = clients[l->slot[i]];
+
+			if (c->paused)
+				continue;
+			pfd[npfd].fd = c->sock;
+			pfd[npfd].events = POLLRDHUP;
+			if (c->head != c->tail)
+				pfd[npfd].events |= POLLOUT;
+			pslot[npfd] = c->slot;
+			pgen[npfd] = c->gen;
+			npfd++;
+		}
+		thread_memlock_unlock(&clientlock);
+
+		if (poll(pfd, npfd, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			anderrs("Client writer poll() failed");
+			return NULL;
+		}
+
+		/* Drain wakeup pipe */
+		if (pfd[0].revents & POLLIN) {
+			while (read(wakefd[0], buf, sizeof(buf)) > 0)
+				;
+		}
+
+		thread_memlock_lock(&clientlock);
+		for (i=1; i < npfd; i++) {
+			struct client *c;
+
+			if (pfd[i].revents == 0)
+				continue;
+
+			/* Client was removed while we were polling, and
+			 * its slot or descriptor may have been reused */
+			c = clients[pslot[i]];
+			if ((c == NULL) || (c->gen != pgen[i]))
+				continue;
+
+			if ((pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL | POLLRDHUP)) ||
+					((pfd[i].revents & POLLOUT) && (client_flush(c) < 0)))
+				client_close(c);
+		}
+		thread_memlock_unlock(&clientlock);
+	}
+
+	/* Unreached */
+	return NULL;
+}
@@ -43,6 +43,9 @@
 #define MSG_REQ_STATUS		2
 #define MSG_WI_REQ_CONF		3
 #define MSG_WI_STATUS		4
+#define MSG_KEY_REQ_ROTATE	5
+#define MSG_CHAN_REQ_JOIN	6
+#define MSG_CHAN_REQ_LEAVE	7
 
 /* Request for wireless interface status */
 struct msg_req_status {
@@ -67,6 +70,8 @@ struct wiface {
 	char essid[IW_ESSID_MAX_SIZE];
 	/* The encryption key for the chat protocol */
 	uint8_t key[CRYPTO_KEY_MAXLEN+1];
+	/* The epoch of the encryption key */
+	uint8_t key_epoch;
 } __attribute__((packed));
 
 /* Interface configuration request */
@@ -74,6 +79,23 @@ struct msg_req_conf {
 	struct wiface wi;
 } __attribute__((packed));
 
+/* Key rotation request, roll over to a new
+ * key epoch without restarting the chat process */
+struct msg_req_key {
+	uint8_t channel;
+	uint8_t key[CRYPTO_KEY_MAXLEN+1];
+	uint8_t epoch;
+} __attribute__((packed));
+
+/* Join or leave a chat channel, the name,
+ * key and epoch are only used when joining */
+struct msg_req_chan {
+	uint8_t channel;
+	char name[CHAT_CHAN_NAMELEN];
+	uint8_t key[CRYPTO_KEY_MAXLEN+1];
+	uint8_t epoch;
+} __attribute__((packed));
+
 /* Message with an error string */
 struct msg_err {
 	char str[1024];
@@ -89,6 +111,8 @@ union msgbuf {
 	struct msg_req_status req_status;
 	struct msg_wi_status wi_status;
 	struct msg_req_conf wi_conf;
+	struct msg_req_key key;
+	struct msg_req_chan chan;
 };
 
 
@@ -28,6 +28,7 @@ static int write_msg(int, uint8_t, void *, size_t);
 static int read_msg(int);
 //static int gotroot(int, union msgbuf *);
 static int parse_wifconf(union msgbuf *, int, char **);
+static int parse_chan(union msgbuf *, int, char **);
 static void mkbssid(uint8_t *, char *);
 
 
@@ -73,7 +74,7 @@ print_wiface(struct wiface *w)
 	printf("  ESSID: %s\n", w->essid);
 	printf("Channel: %d\n", w->channel);
 	printf("  BSSID: %s\n", net_macstr(w->mac_bssid));
-	printf("    Key: '%s'\n", (char *)w->key);
+	printf("    Key: '%s' (epoch %u)\n", (char *)w->key, w->key_epoch);
 	printf("\n");
 }
 
@@ -229,7 +230,7 @@ parse_wifconf(union msgbuf *buf, int argc, char **argv)
 
 	/* Should never happen since we check
 	 * this in main */
-	if (argc != 7) {
+	if ((argc != 7) && (argc != 8)) {
 		anderr("** Error: Invalid number of configuration arguments!\n");
 		return -1;
 	}
@@ -257,6 +258,10 @@ parse_wifconf(union msgbuf *buf, int argc, char **argv)
 	snprintf((char *)buf->wi_status.wi.key, 
 		sizeof(buf->wi_status.wi.key), "%s", argv[6]);
 
+	/* Optional key epoch */
+	if (argc == 8)
+		buf->wi_status.wi.key_epoch = atoi(argv[7]);
+
 	/* Since some devices seem to make up their own AP
 	 * in ad-hoc mode and not find each other, we
 	 * construct a BSSID based on the network name */
@@ -266,6 +271,63 @@ parse_wifconf(union msgbuf *buf, int argc, char **argv)
 }
 
 
+/*
+ * Parse command line for channel requests
+ * (--join, --leave and --rekey) and fill in the
+ * request structure. The request code is returned
+ * on success, -1 on error.
+ */
+static int
+parse_chan(union msgbuf *buf, int argc, char **argv)
+{
+	int chan;
+
+	memset(buf, 0x00, sizeof(union msgbuf));
+
+	/* --rekey <key> <epoch> [channel] */
+	if (strcmp(argv[0], "--rekey") == 0) {
+		if (strlen(argv[1]) > CRYPTO_KEY_MAXLEN) {
+			fprintf(stderr, "** Error: Key exceed maximum length\n");
+			return -1;
+		}
+
+		chan = (argc == 4) ? atoi(argv[3]) : CHAT_CHAN_DEFAULT;
+		if ((chan < 0) || (chan >= CHAT_MAXCHANNELS)) {
+			fprintf(stderr, "** Error: Invalid channel ID\n");
+			return -1;
+		}
+
+		snprintf((char *)buf->key.key, sizeof(buf->key.key), "%s", argv[1]);
+		buf->key.epoch = atoi(argv[2]);
+		buf->key.channel = chan;
+		return MSG_KEY_REQ_ROTATE;
+	}
+
+	chan = atoi(argv[1]);
+	if ((chan <= CHAT_CHAN_DEFAULT) || (chan >= CHAT_MAXCHANNELS)) {
+		fprintf(stderr, "** Error: Channel ID must be 1-%d\n", 
+			CHAT_MAXCHANNELS-1);
+		return -1;
+	}
+	buf->chan.channel = chan;
+
+	/* --leave <channel> */
+	if (strcmp(argv[0], "--leave") == 0)
+		return MSG_CHAN_REQ_LEAVE;
+
+	/* --join <channel> <name> <key> [epoch] */
+	if (strlen(argv[3]) > CRYPTO_KEY_MAXLEN) {
+		fprintf(stderr, "** Error: Key exceed maximum length\n");
+		return -1;
+	}
+	snprintf(buf->chan.name, sizeof(buf->chan.name), "%s", argv[2]);
+	snprintf((char *)buf->chan.key, sizeof(buf->chan.key), "%s", argv[3]);
+	if (argc == 5)
+		buf->chan.epoch = atoi(argv[4]);
+	return MSG_CHAN_REQ_JOIN;
+}
+
+
 /*
  * IBSS configuration client.
  * Returns 0 on success, -1 on error.
@@ -274,9 +336,17 @@ int
 conf_client(int argc, char **argv)
 {
 	union msgbuf buf;
+	int code = 0;
 	int sfd;
 
-	if (parse_wifconf(&buf, argc, argv) != 0)
+	/* Key rotation and channels */
+	if ((strcmp(argv[0], "--rekey") == 0) || 
+			(strcmp(argv[0], "--join") == 0) ||
+			(strcmp(argv[0], "--leave") == 0)) {
+		if ( (code = parse_chan(&buf, argc, argv)) < 0)
+			return -1;
+	}
+	else if (parse_wifconf(&buf, argc, argv) != 0)
 		return -1;
 
 	/*
@@ -308,8 +378,17 @@ conf_client(int argc, char **argv)
 		}
 	}	
 
+	/* Send key rotation or channel request */
+	if (code != 0) {
+		if (write_msg(sfd, code, &buf, (code == MSG_KEY_REQ_ROTATE) ? 
+				sizeof(buf.key) : sizeof(buf.chan)) < 0) {
+			close(sfd);
+			return -1;
+		}
+	}
+
 	/* Send configure request */
-	if (argc == 7) {
+	else if ((argc == 7) || (argc == 8)) {
 		if (write_msg(sfd, MSG_WI_REQ_CONF,
 				&buf, sizeof(buf.wi_status)) < 0) {
 			close(sfd);
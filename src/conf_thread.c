@@ -29,10 +29,14 @@
 static void *handle_client(void *);
 static int write_msg(int, uint8_t, void *, size_t);
 static void start_chat_process(char *);
+static int chat_ctl_write(uint8_t, void *, size_t);
 
 /* Local variables */
 static pid_t chatpid = 0;
 
+/* Control pipe for passing new keys and channels to the chat process */
+static int chatctl = -1;
+
 struct arg {
 	int cfd;
 	char *iface;
@@ -66,6 +70,30 @@ write_msg(int cfd, uint8_t code, void *buf, size_t len)
 }
 
 
+/*
+ * Pass request to the chat process if it is running.
+ * The code and structure are written in one write so 
+ * that requests from concurrent clients are not mixed.
+ * Return 0 on success, -1 on failure.
+ */
+static int
+chat_ctl_write(uint8_t code, void *buf, size_t len)
+{
+	uint8_t req[1 + sizeof(union msgbuf)];
+
+	if ((chatpid == 0) || (chatctl < 0))
+		return 0;
+
+	req[0] = code;
+	memcpy(&req[1], buf, len);
+	if (writen(chatctl, req, len + 1) != (len + 1)) {
+		anderrs("Failed to write to chat process control pipe");
+		return -1;
+	}
+	return 0;
+}
+
+
 /*
  * Handle connected client.
  * This function is called from a forked
@@ -120,6 +148,21 @@ handle_client(void *arg)
 			len = sizeof(struct msg_req_conf);
 			break;		
 
+		case MSG_KEY_REQ_ROTATE:
+			andlog("Read conf MSG_KEY_REQ_ROTATE [%d]\n", getpid());
+			len = sizeof(struct msg_req_key);
+			break;
+
+		case MSG_CHAN_REQ_JOIN:
+			andlog("Read conf MSG_CHAN_REQ_JOIN [%d]\n", getpid());
+			len = sizeof(struct msg_req_chan);
+			break;
+
+		case MSG_CHAN_REQ_LEAVE:
+			andlog("Read conf MSG_CHAN_REQ_LEAVE [%d]\n", getpid());
+			len = sizeof(struct msg_req_chan);
+			break;
+
 		default:
 			snprintf(buf.err.str, sizeof(buf.err.str), 
 				"unrecognized conf message code: %d", code);
@@ -174,6 +217,72 @@ handle_client(void *arg)
 
 			break;
 
+		/* Handle key rotation request. The chat process
+		 * roll over to the new key in place, keeping the
+		 * message buffer and connected clients */
+		case MSG_KEY_REQ_ROTATE:
+			buf.key.key[CRYPTO_KEY_MAXLEN] = '\0';
+			if (!channel_joined(buf.key.channel) || 
+					(chat_crypto_rotate_key(buf.key.channel, buf.key.key, 
+					strlen((char *)buf.key.key), buf.key.epoch) < 0)) {
+				snprintf(buf.err.str, sizeof(buf.err.str), 
+					"Failed to set key for epoch %u in channel %u", 
+					buf.key.epoch, buf.key.channel);
+				anderr("** Error: %s\n", buf.err.str);
+				goto err;
+			}
+
+			if (chat_ctl_write(code, &buf.key, sizeof(buf.key)) < 0) {
+				snprintf(buf.err.str, sizeof(buf.err.str), 
+					"Failed to pass key to chat process");
+				goto err;
+			}
+			len = 0;
+			code = MSG_CODE_OK;
+			break;
+
+		/* Handle channel join request. The channel is kept
+		 * here as well so that it survive a restart of the
+		 * chat process */
+		case MSG_CHAN_REQ_JOIN:
+			buf.chan.key[CRYPTO_KEY_MAXLEN] = '\0';
+			buf.chan.name[CHAT_CHAN_NAMELEN-1] = '\0';
+			if ((chat_crypto_set_key(buf.chan.channel, buf.chan.key, 
+					strlen((char *)buf.chan.key), buf.chan.epoch) < 0) ||
+					(channel_join(buf.chan.channel, buf.chan.name) < 0)) {
+				snprintf(buf.err.str, sizeof(buf.err.str), 
+					"Failed to join channel %u", buf.chan.channel);
+				anderr("** Error: %s\n", buf.err.str);
+				goto err;
+			}
+
+			if (chat_ctl_write(code, &buf.chan, sizeof(buf.chan)) < 0) {
+				snprintf(buf.err.str, sizeof(buf.err.str), 
+					"Failed to pass channel to chat process");
+				goto err;
+			}
+			len = 0;
+			code = MSG_CODE_OK;
+			break;
+
+		/* Handle channel leave request */
+		case MSG_CHAN_REQ_LEAVE:
+			if (channel_leave(buf.chan.channel) < 0) {
+				snprintf(buf.err.str, sizeof(buf.err.str), 
+					"Failed to leave channel %u", buf.chan.channel);
+				goto err;
+			}
+			chat_crypto_clear_key(buf.chan.channel);
+
+			if (chat_ctl_write(code, &buf.chan, sizeof(buf.chan)) < 0) {
+				snprintf(buf.err.str, sizeof(buf.err.str), 
+					"Failed to pass channel to chat process");
+				goto err;
+			}
+			len = 0;
+			code = MSG_CODE_OK;
+			break;
+
 		/* Should never happen since we check this above */
 		default:
 			snprintf(buf.err.str, sizeof(buf.err.str), 
@@ -242,6 +351,8 @@ sighandler(int signo)
 static void
 start_chat_process(char *iface)
 {
+	int ctl[2];
+
 	/* Kill current process */
 	if (chatpid != 0) {
 		int status;
@@ -251,21 +362,41 @@ start_chat_process(char *iface)
 		chatpid = 0;
 	}
 
+	if (chatctl >= 0) {
+		close(chatctl);
+		chatctl = -1;
+	}
+
+	/* Control pipe to chat process */
+	if (pipe(ctl) < 0) {
+		anderrs("Failed to create chat process control pipe");
+		return;
+	}
+
 	/* Start the chat process */
 	chatpid = fork();
 
-	if (chatpid < 0) 
+	if (chatpid < 0) {
 		anderrs("failed to fork the chat process");
+		chatpid = 0;
+		close(ctl[0]);
+		close(ctl[1]);
+		return;
+	}
 
 	/* Child process, call chat function */
 	if (chatpid == 0) {
+		close(ctl[1]);
 
 		/* Run chat process */
-		chat_proc_run(iface);
+		chat_proc_run(iface, ctl[0]);
 
 		/* Unreached */
 		exit(EXIT_SUCCESS);
 	}
+
+	close(ctl[0]);
+	chatctl = ctl[1];
 }
 
 
@@ -286,8 +417,9 @@ conf_thread_run(void *iface)
 		goto err;
 	}
 
-	/* Initialize the crypto system */
+	/* Initialize the crypto system and channels */
 	chat_crypto_init();
+	channel_init();
 
 	/* Listen on configuration port */
 	if ( (sd = tcp_listen(inet_addr("127.0.0.1"), 
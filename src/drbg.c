@@ -0,0 +1,279 @@
+/*
+ *    File: drbg.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Per-thread ChaCha20 based random bit generator.
+ *
+ * Each thread keep its own generator state, seeded from the
+ * kernel with getrandom(2) and reseeded after a number of
+ * bytes or seconds, so random bytes (such as the IV for every
+ * encrypted message) are produced without any system calls.
+ * The key is replaced by the first 32 bytes of every refill
+ * of the output buffer (fast key erasure), so a captured state
+ * can not be used to recover previous output.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "ibsschat.h"
+
+/* Reseed from kernel after this many bytes of output */
+#define DRBG_RESEED_BYTES	(1024*1024)
+
+/* Reseed from kernel after this many seconds */
+#define DRBG_RESEED_SEC		300
+
+/* Number of ChaCha20 blocks generated on each refill */
+#define DRBG_BLOCKS			8
+
+/* The generator state */
+struct drbg {
+	uint32_t key[8];
+	uint64_t counter;
+	uint8_t buf[DRBG_BLOCKS*64];
+	size_t pos;
+	size_t output;
+	time_t seeded;
+	unsigned int gen;
+	int init;
+};
+
+/* Local routines */
+static int drbg_seed(struct drbg *);
+static void drbg_refill(struct drbg *);
+static void chacha20_block(const uint32_t *, uint64_t, uint8_t *);
+static void drbg_atfork(void);
+static void drbg_atfork_register(void);
+
+/* Local variables */
+static __thread struct drbg rng;
+static volatile unsigned int forkgen = 0;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+
+/*
+ * Compute one 64 byte ChaCha20 block (RFC 7539)
+ * using a zero nonce and a 64 bit block counter.
+ */
+static void
+chacha20_block(const uint32_t *key, uint64_t counter, uint8_t *out)
+{
+	uint32_t in[16];
+	uint32_t x[16];
+	int i;
+
+	/* "expand 32-byte k" */
+	in[0] = 0x61707865;
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	for (i=0; i < 8; i++)
+		in[4+i] = key[i];
+	in[12] = (uint32_t)counter;
+	in[13] = (uint32_t)(counter >> 32);
+	in[14] = 0;
+	in[15] = 0;
+
+	memcpy(x, in, sizeof(x));
+	for (i=0; i < 10; i++) {
+		QROUND(x[0], x[4], x[8], x[12]);
+		QROUND(x[1], x[5], x[9], x[13]);
+		QROUND(x[2], x[6], x[10], x[14]);
+		QROUND(x[3], x[7], x[11], x[15]);
+		QROUND(x[0], x[5], x[10], x[15]);
+		QROUND(x[1], x[6], x[11], x[12]);
+		QROUND(x[2], x[7], x[8], x[13]);
+		QROUND(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i=0; i < 16; i++) {
+		uint32_t v = x[i] + in[i];
+		out[4*i] = v & 0xff;
+		out[4*i+1] = (v >> 8) & 0xff;
+		out[4*i+2] = (v >> 16) & 0xff;
+		out[4*i+3] = (v >> 24) & 0xff;
+	}
+}
+
+
+/*
+ * Called in the child after fork(), make every
+ * thread reseed since the state was copied from the parent.
+ */
+static void
+drbg_atfork(void)
+{
+	forkgen++;
+}
+
+static void
+drbg_atfork_register(void)
+{
+	pthread_atfork(NULL, NULL, drbg_atfork);
+}
+
+
+/*
+ * Read random bytes from the kernel.
+ * Uses getrandom(2) when available and falls back to
+ * /dev/urandom on kernels that lack the system call.
+ * Returns 0 on success, -1 on error.
+ */
+int
+drbg_kernel_random(uint8_t *buf, size_t len)
+{
+	size_t n = 0;
+	int fd;
+
+#ifdef SYS_getrandom
+	while (n < len) {
+		long r;
+
+		r = syscall(SYS_getrandom, buf + n, len - n, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		n += r;
+	}
+
+	if (n == len)
+		return 0;
+
+	if (errno != ENOSYS) {
+		anderrs("getrandom() failed");
+		return -1;
+	}
+#endif
+
+	if ( (fd = open("/dev/urandom", O_RDONLY)) < 0) {
+		anderrs("Failed to open /dev/urandom");
+		return -1;
+	}
+
+	if (readn(fd, buf, len) != len) {
+		anderrs("Failed to read from /dev/urandom");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+
+/*
+ * (Re)seed generator from the kernel.
+ * Return 0 on success, -1 on error.
+ */
+static int
+drbg_seed(struct drbg *d)
+{
+	uint32_t seed[8];
+	int i;
+
+	pthread_once(&atfork_once, drbg_atfork_register);
+
+	if (drbg_kernel_random((uint8_t *)seed, sizeof(seed)) < 0)
+		return -1;
+
+	/* Mix new seed into the current key */
+	for (i=0; i < 8; i++)
+		d->key[i] ^= seed[i];
+	memset(seed, 0x00, sizeof(seed));
+
+	d->pos = sizeof(d->buf);
+	d->output = 0;
+	d->seeded = time(NULL);
+	d->gen = forkgen;
+	d->init = 1;
+	return 0;
+}
+
+
+/*
+ * Generate a new output buffer and replace
+ * the key with the first 32 bytes of it.
+ */
+static void
+drbg_refill(struct drbg *d)
+{
+	int i;
+
+	for (i=0; i < DRBG_BLOCKS; i++)
+		chacha20_block(d->key, d->counter++, &d->buf[i*64]);
+
+	memcpy(d->key, d->buf, sizeof(d->key));
+	memset(d->buf, 0x00, sizeof(d->key));
+	d->pos = sizeof(d->key);
+}
+
+
+/*
+ * Fill buffer with random bytes from the
+ * generator of the calling thread.
+ * Return 0 on success, -1 on error.
+ */
+int
+drbg_bytes(uint8_t *buf, size_t len)
+{
+	struct drbg *d = &rng;
+
+	/* Seed on first use, after fork and periodically */
+	if ((d->init == 0) || (d->gen != forkgen) ||
+			(d->output >= DRBG_RESEED_BYTES)) {
+		if (drbg_seed(d) < 0)
+			return -1;
+	}
+
+	/* Only look at the clock once per refill */
+	if (d->pos >= sizeof(d->buf)) {
+		if ((time(NULL) - d->seeded) >= DRBG_RESEED_SEC) {
+			if (drbg_seed(d) < 0)
+				return -1;
+		}
+	}
+
+	while (len > 0) {
+		size_t n;
+
+		if (d->pos >= sizeof(d->buf))
+			drbg_refill(d);
+
+		n = sizeof(d->buf) - d->pos;
+		if (n > len)
+			n = len;
+
+		memcpy(buf, &d->buf[d->pos], n);
+		memset(&d->buf[d->pos], 0x00, n);
+		d->pos += n;
+		d->output += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ *    File: filter.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Filters of receive clients.
+ * A client can register a filter on message type, sender
+ * address prefix and keyword when it connects. The filter
+ * is evaluated by the chat process before a message is
+ * queued, so a client is never woken up for messages
+ * it would throw away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ibsschat.h"
+
+
+/*
+ * Check filter read from a client and terminate the keyword.
+ * Return 0 if the filter is valid, -1 otherwise.
+ */
+int
+filter_valid(struct chatfilter *f)
+{
+	f->keyword[CHAT_FILTER_KEYLEN - 1] = '\0';
+
+	if (f->prefixlen > 32) {
+		andlog("** Error: Invalid sender prefix length %u in filter\n",
+			f->prefixlen);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Return 1 if message match filter, 0 otherwise.
+ * A NULL filter match all messages.
+ */
+int
+filter_match(struct chatfilter *f, struct message *m)
+{
+	if (f == NULL)
+		return 1;
+
+	if ((f->types != 0) && ((m->type >= 16) ||
+			((f->types & (1 << m->type)) == 0)))
+		return 0;
+
+	if (f->prefixlen != 0) {
+		uint32_t mask = htonl(0xffffffff << (32 - f->prefixlen));
+
+		if ((m->id.ip & mask) != (f->prefix & mask))
+			return 0;
+	}
+
+	/* Keyword only match the text of chat messages */
+	if (f->keyword[0] != '\0') {
+		struct chatmsg *cm = (struct chatmsg *)m;
+		size_t klen = strlen(f->keyword);
+		size_t len;
+		size_t i;
+
+		if (m->type != CHAT_MSG)
+			return 0;
+
+		len = strnlen(cm->txt.msg, sizeof(cm->txt.msg));
+		for (i=0; i + klen <= len; i++) {
+			if (memcmp(&cm->txt.msg[i], f->keyword, klen) == 0)
+				return 1;
+		}
+		return 0;
+	}
+
+	return 1;
+}
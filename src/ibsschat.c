@@ -24,14 +24,19 @@
 
 /* Local routines*/
 static void usage(const char *);
-static int start_daemons(int, const char *);
+static int start_daemons(int, const char *, const char *, const char *,
+	const char *);
 
 /*
- * Start all the daemons.
+ * Start all the daemons, tracing messages to tracefile
+ * if it is not NULL or "-", with a message buffer of
+ * bufsize bytes if it is not NULL or "-", logging
+ * messages to logdir if it is not NULL.
  * Returns -1 on error.
  */
 extern int
-start_daemons(int dofork, const char *iface)
+start_daemons(int dofork, const char *iface, const char *tracefile,
+	const char *bufsize, const char *logdir)
 {
 	/* Make sure we got r00t! */
 	if (getuid() != 0) {
@@ -39,6 +44,11 @@ start_daemons(int dofork, const char *iface)
 		return -1;
 	}
 
+	/* Size of the message buffer of the chat process */
+	if ((bufsize != NULL) && (strcmp(bufsize, "-") != 0) &&
+			(msgbuf_config(size_parse(bufsize)) < 0))
+		return -1;
+
   	/* Fork twice to becoma a daemon.
      * When started as an Android service on LineageOS
      * we have already forked so we do not need to do that again */
@@ -49,6 +59,15 @@ start_daemons(int dofork, const char *iface)
         printf("[%u]\n", getpid());
     }
 
+	/* Log from a background thread */
+	log_init();
+
+	/* Opened by the chat process */
+	if ((tracefile != NULL) && (strcmp(tracefile, "-") == 0))
+		tracefile = NULL;
+	trace_config(tracefile);
+	msglog_config(logdir);
+
 	/* Run configuration thread */
 	conf_thread_run((void *)iface);
 	return 0;
@@ -65,13 +84,21 @@ usage(const char *pname)
 	printf("The IBSS Chat software, version %s\n", IBSSCHAT_VERSION);
 	printf("Author: Claes M. Nyberg <cnyberg@nps.edu>\n");
 	printf("Usage:\n");
-	printf("   %s --daemon-nofork <iface>\n", pname);
-	printf("   %s --daemon <iface>\n", pname);
+	printf("   %s --daemon-nofork <iface> [trace-file|-] [buffer-size|-] [log-dir]\n", pname);
+	printf("   %s --daemon <iface> [trace-file|-] [buffer-size|-] [log-dir]\n", pname);
 	printf("   %s --status <iface>\n", pname);
-	printf("   %s --conf <iface> <ipv4> <netmask> <network-name> <channel> <key>\n", pname);
-	printf("   %s --chat-send <iface> <message>\n", pname);
+	printf("   %s --conf <iface> <ipv4> <netmask> <network-name> <channel> <key> [key-epoch]\n", pname);
+	printf("   %s --rekey <key> <key-epoch> [channel-id]\n", pname);
+	printf("   %s --join <channel-id> <channel-name> <key> [key-epoch]\n", pname);
+	printf("   %s --leave <channel-id>\n", pname);
+	printf("   %s --chat-send <iface> <message> [channel-id]\n", pname);
 	printf("   %s --chat-send-rand <iface> <count> <delay-sec>\n", pname);
+	printf("   %s --chat-load <iface> <msgs/sec> <seconds> [senders] [poisson|constant] [min-len] [max-len]\n", pname);
+	printf("   %s --chat-load-recv <iface> <seconds>\n", pname);
+	printf("   %s --chat-history <iface> [max] [cursor] [sender-ipv4]\n", pname);
+	printf("   %s --chat-listen <iface> [type <msg|discover>] [from <ipv4/bits>] [match <word>] [chan <id>] ...\n", pname);
 	printf("   %s --chat-prompt <iface>\n", pname);
+	printf("   %s --metrics\n", pname);
 	exit(EXIT_SUCCESS);
 }
 
@@ -85,19 +112,39 @@ main(int argc, char **argv)
 
 	/* Start as an Android service (dont fork) */
 	if (strcmp(argv[1], "--daemon-nofork") == 0) {
-		if (argc == 3)
-			exit(start_daemons(0, argv[2]));
+		if ((argc >= 3) && (argc <= 6))
+			exit(start_daemons(0, argv[2], (argc >= 4) ? argv[3] : NULL,
+				(argc >= 5) ? argv[4] : NULL, (argc == 6) ? argv[5] : NULL));
 	}
 
 	/* Start daemon */
 	if (strcmp(argv[1], "--daemon") == 0) {
-		if (argc == 3)
-			exit(start_daemons(1, argv[2]));
+		if ((argc >= 3) && (argc <= 6))
+			exit(start_daemons(1, argv[2], (argc >= 4) ? argv[3] : NULL,
+				(argc >= 5) ? argv[4] : NULL, (argc == 6) ? argv[5] : NULL));
 	}
 
 	/* Run as client */	
 	if (strcmp(argv[1], "--conf") == 0) {
-		if (argc == 8)
+		if ((argc == 8) || (argc == 9))
+			exit(conf_client(argc-1, &argv[1]));
+	}
+
+	/* Roll over to a new key */
+	if (strcmp(argv[1], "--rekey") == 0) {
+		if ((argc == 4) || (argc == 5))
+			exit(conf_client(argc-1, &argv[1]));
+	}
+
+	/* Join chat channel */
+	if (strcmp(argv[1], "--join") == 0) {
+		if ((argc == 5) || (argc == 6))
+			exit(conf_client(argc-1, &argv[1]));
+	}
+
+	/* Leave chat channel */
+	if (strcmp(argv[1], "--leave") == 0) {
+		if (argc == 3)
 			exit(conf_client(argc-1, &argv[1]));
 	}
 
@@ -110,7 +157,9 @@ main(int argc, char **argv)
 	/* Chat client send message */	
 	if (strcmp(argv[1], "--chat-send") == 0) {
 		if (argc == 4)
-			exit(chat_send(argv[2], argv[3]));
+			exit(chat_send(argv[2], CHAT_CHAN_DEFAULT, argv[3]));
+		if (argc == 5)
+			exit(chat_send(argv[2], atoi(argv[4]), argv[3]));
 	}
 
 	/* Chat client send message */	
@@ -119,12 +168,49 @@ main(int argc, char **argv)
 			exit(chat_send_rand(argv[2], atoi(argv[3]), atoi(argv[4])));
 	}
 
+	/* Open loop load generator */
+	if (strcmp(argv[1], "--chat-load") == 0) {
+		if ((argc >= 5) && (argc <= 9))
+			exit(chat_load(argv[2], atof(argv[3]), atoi(argv[4]),
+				(argc > 5) ? atoi(argv[5]) : 1,
+				(argc > 6) ? (strcmp(argv[6], "constant") != 0) : 1,
+				(argc > 7) ? atoi(argv[7]) : 0,
+				(argc > 8) ? atoi(argv[8]) : 0));
+	}
+
+	/* End-to-end latency of load messages */
+	if (strcmp(argv[1], "--chat-load-recv") == 0) {
+		if (argc == 4)
+			exit(chat_load_recv(argv[2], atoi(argv[3])));
+	}
+
+	/* Chat client print buffered messages */
+	if (strcmp(argv[1], "--chat-history") == 0) {
+		if ((argc >= 3) && (argc <= 6))
+			exit(chat_history(argv[2], 
+				(argc > 3) ? strtoul(argv[3], NULL, 0) : 0,
+				(argc > 4) ? strtoul(argv[4], NULL, 0) : 0,
+				(argc > 5) ? argv[5] : NULL));
+	}
+
+	/* Chat client print filtered messages */
+	if (strcmp(argv[1], "--chat-listen") == 0) {
+		if ((argc >= 3) && ((argc % 2) == 1))
+			exit(chat_listen(argv[2], argc - 3, &argv[3]));
+	}
+
 	/* Chat client send message */	
 	if (strcmp(argv[1], "--chat-prompt") == 0) {
 		if (argc == 3)
 			exit(chat_prompt(argv[2]));
 	}
 
+	/* Print metrics of the chat process */
+	if (strcmp(argv[1], "--metrics") == 0) {
+		if (argc == 2)
+			exit(stats_print());
+	}
+
 	usage(argv[0]);	
 
 	/* Shut up the compiler */
@@ -37,9 +37,26 @@
 extern int iplist_add(uint32_t, uint32_t **, size_t);
 extern void iplist_print(uint32_t *, size_t);
 
+/* Log levels, debug messages are only compiled
+ * in when ANDLOG_LEVEL is ANDLOG_DEBUG */
+#define ANDLOG_ERROR	0
+#define ANDLOG_INFO		1
+#define ANDLOG_DEBUG	2
+
+#ifndef ANDLOG_LEVEL
+#define ANDLOG_LEVEL ANDLOG_INFO
+#endif
+
+#if ANDLOG_LEVEL >= ANDLOG_DEBUG
+#define anddebug andlog_debug
+#else
+#define anddebug(...) do { if (0) andlog_debug(__VA_ARGS__); } while (0)
+#endif
+
 /* utils.c */
 #define ANDROID_LOG_TAG "ibsschat"
 extern void andlog(const char *, ...);
+extern void andlog_debug(const char *, ...);
 extern void anderr(const char *, ...);
 extern void anderrs(const char *);
 extern ssize_t writen(int, void *, size_t);
@@ -47,7 +64,16 @@ extern ssize_t readn(int, void *, size_t);
 extern const char *net_macstr(const unsigned char *);
 extern int fork_twice();
 extern int data_to_read(int);
-extern int getrand_nonblock(uint8_t *, size_t);
+extern size_t size_parse(const char *);
+
+/* log.c */
+extern int log_init(void);
+extern int log_record(int, const char *, va_list);
+extern void log_flush(void);
+
+/* drbg.c */
+extern int drbg_kernel_random(uint8_t *, size_t);
+extern int drbg_bytes(uint8_t *, size_t);
 
 /* ifconfig.c */
 extern int socket_open(void);
@@ -73,8 +99,8 @@ extern int nv_setpath(const char *);
 extern int fw_setpath(const char *);
 
 /* net.c */
-extern int unix_socket_listen(const char *, const char *);
-extern int unix_socket_connect(const char *, const char *);
+extern int unix_socket_listen(const char *, const char *, int);
+extern int unix_socket_connect(const char *, const char *, int);
 extern int data_to_read(int);
 extern int tcp_connect(uint32_t, uint16_t, uint32_t, uint16_t);
 extern int tcp_listen(uint32_t, uint16_t);
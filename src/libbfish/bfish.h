@@ -45,34 +45,35 @@
  * The key structure
  */
 struct bfish_key {
-    u_long bk_pbox[18];    
-    u_long bk_sbox[4][256];
+    u_int32_t bk_pbox[18];    
+    u_int32_t bk_sbox[4][256];
 };
 
 /* bfish_keyinit.c */
 extern struct bfish_key *bfish_keyinit(u_char *, u_short);
+extern int bfish_keyinit_r(struct bfish_key *, u_char *, u_short);
 
 /* bfish_encrypt.c */
-extern void bfish_encrypt_swap(u_long *, u_long *, struct bfish_key *,int);
+extern void bfish_encrypt_swap(u_int32_t *, u_int32_t *, struct bfish_key *,int);
 #define bfish_encrypt(left,right,bk) \
     bfish_encrypt_swap((left), (right), (bk), SWAP_LIL_ENDIAN)
 
 /* bfish_decrypt.c */
-extern void bfish_decrypt(u_long *, u_long *, struct bfish_key *);
+extern void bfish_decrypt(u_int32_t *, u_int32_t *, struct bfish_key *);
 
 /* bfish_cbc_encrypt.c */
-extern void bfish_cbc_encrypt(u_char *, u_long, u_char *, struct bfish_key *);
+extern void bfish_cbc_encrypt(u_char *, u_int32_t, u_char *, struct bfish_key *);
 
 /* bfish_cbc_decrypt.c */
-extern void bfish_cbc_decrypt(u_char *, u_long, u_char *, struct bfish_key *);
+extern void bfish_cbc_decrypt(u_char *, u_int32_t, u_char *, struct bfish_key *);
 
 /* bfish_ofb.c */
-extern void bfish_ofb(u_char *, u_long, u_char *, u_char, struct bfish_key *);
+extern void bfish_ofb(u_char *, u_int32_t, u_char *, u_char, struct bfish_key *);
 #define bfish_ofb_encrypt(str, slen, iv, bsize, bk) bfish_ofb(str, slen, iv, bsize, bk)
 #define bfish_ofb_decrypt(str, slen, iv, bsize, bk) bfish_ofb(str, slen, iv, bsize, bk)
 
 /* bfish_cfb.c */
-extern void bfish_cfb(u_char *, u_long, u_char *, u_char, struct bfish_key *, u_char);
+extern void bfish_cfb(u_char *, u_int32_t, u_char *, u_char, struct bfish_key *, u_char);
 #define bfish_cfb_encrypt(str, slen, iv, bsize, bk) bfish_cfb(str, slen, iv, bsize, bk, 1)
 #define bfish_cfb_decrypt(str, slen, iv, bsize, bk) bfish_cfb(str, slen, iv, bsize, bk, 0)
 
@@ -47,12 +47,12 @@
  * bk    - The blowfish key initialized by bfish_keyinit()
  */
 void
-bfish_cbc_decrypt(u_char *str, u_long slen, u_char *iv, struct bfish_key *bk)
+bfish_cbc_decrypt(u_char *str, u_int32_t slen, u_char *iv, struct bfish_key *bk)
 {
-    register u_long *xl;
-    register u_long *xr;
-    u_long fedbk[6];    /* Feedback register */
-    u_long tmp;
+    register u_int32_t *xl;
+    register u_int32_t *xr;
+    u_int32_t fedbk[6];    /* Feedback register */
+    u_int32_t tmp;
 
     /* Special case, str is shorter than one block.
      * Fix this later. */
@@ -70,17 +70,17 @@ bfish_cbc_decrypt(u_char *str, u_long slen, u_char *iv, struct bfish_key *bk)
     if (tmp != 0) {
         
         if ((slen - tmp) >= 16) {
-            fedbk[4] = *((u_long *)&str[(slen - tmp) - 16]);
-            fedbk[5] = *((u_long *)&str[(slen - tmp) - 12]);
+            fedbk[4] = *((u_int32_t *)&str[(slen - tmp) - 16]);
+            fedbk[5] = *((u_int32_t *)&str[(slen - tmp) - 12]);
         }
         else {
-            fedbk[4] = *((u_long *)&iv[0]);
-            fedbk[5] = *((u_long *)&iv[4]);
+            fedbk[4] = *((u_int32_t *)&iv[0]);
+            fedbk[5] = *((u_int32_t *)&iv[4]);
         }
     }
     
-    xl = (u_long *)str;
-    xr = (u_long *)(str +4);
+    xl = (u_int32_t *)str;
+    xr = (u_int32_t *)(str +4);
 
     /* The next block needs the previous 
      * block unencrypted for XOR */
@@ -88,8 +88,8 @@ bfish_cbc_decrypt(u_char *str, u_long slen, u_char *iv, struct bfish_key *bk)
     fedbk[1] = *xr;
     
     bfish_decrypt(xl, xr, bk);
-    *xl ^= *((u_long *)&iv[0]);
-    *xr ^= *((u_long *)&iv[4]);
+    *xl ^= *((u_int32_t *)&iv[0]);
+    *xr ^= *((u_int32_t *)&iv[4]);
 
     xl += 2;
     xr += 2;
@@ -123,14 +123,14 @@ bfish_cbc_decrypt(u_char *str, u_long slen, u_char *iv, struct bfish_key *bk)
         
         bfish_decrypt(&fedbk[0], &fedbk[1], bk);        
 
-        fedbk[0] ^= *((u_long *)&last[0]);
-        fedbk[1] ^= *((u_long *)&last[4]);
+        fedbk[0] ^= *((u_int32_t *)&last[0]);
+        fedbk[1] ^= *((u_int32_t *)&last[4]);
 
         memcpy(last + slen, (u_char *)&fedbk[0] + slen, sizeof(last) - slen);
-        bfish_decrypt((u_long *)&last[0], (u_long *)&last[4], bk);
+        bfish_decrypt((u_int32_t *)&last[0], (u_int32_t *)&last[4], bk);
 
-        *(u_long *)&last[0] ^= fedbk[4];
-        *(u_long *)&last[4] ^= fedbk[5];
+        *(u_int32_t *)&last[0] ^= fedbk[4];
+        *(u_int32_t *)&last[4] ^= fedbk[5];
 
         memcpy(xl - 2, last, sizeof(last));
         memcpy(xl, &fedbk[0], slen);
@@ -49,10 +49,10 @@
  * bk    - The blowfish key initialized by bfish_keyinit()
  */
 void
-bfish_cbc_encrypt(u_char *str, u_long slen, u_char *iv, struct bfish_key *bk)
+bfish_cbc_encrypt(u_char *str, u_int32_t slen, u_char *iv, struct bfish_key *bk)
 {
-    register u_long *xl;
-    register u_long *xr;
+    register u_int32_t *xl;
+    register u_int32_t *xr;
 
 
     /* Special case, str is shorter than one block 
@@ -63,11 +63,11 @@ bfish_cbc_encrypt(u_char *str, u_long slen, u_char *iv, struct bfish_key *bk)
         return;            
     }
 
-    xl = (u_long *)str;
-    xr = (u_long *)(str +4);
+    xl = (u_int32_t *)str;
+    xr = (u_int32_t *)(str +4);
 
-    *xl ^= *((u_long *)&iv[0]);
-    *xr ^= *((u_long *)&iv[4]);
+    *xl ^= *((u_int32_t *)&iv[0]);
+    *xr ^= *((u_int32_t *)&iv[4]);
 
     bfish_encrypt(xl, xr, bk);
     xl += 2;
@@ -96,10 +96,10 @@ bfish_cbc_encrypt(u_char *str, u_long slen, u_char *iv, struct bfish_key *bk)
         memcpy(last, xl, slen);
         memcpy(prev, (xl - 2), sizeof(prev));
 
-        *((u_long *)&last[0]) ^= *((u_long *)&prev[0]);
-        *((u_long *)&last[4]) ^= *((u_long *)&prev[4]);
+        *((u_int32_t *)&last[0]) ^= *((u_int32_t *)&prev[0]);
+        *((u_int32_t *)&last[4]) ^= *((u_int32_t *)&prev[4]);
 
-        bfish_encrypt((u_long *)&last[0], (u_long *)&last[4], bk);
+        bfish_encrypt((u_int32_t *)&last[0], (u_int32_t *)&last[4], bk);
 
         memcpy(xl - 2, last, sizeof(last));
         memcpy(xl, prev, slen);
@@ -51,10 +51,10 @@
  * enc   - Encrypt if true, decrypt otherwise.
  */
 void
-bfish_cfb(u_char *str, u_long slen, u_char *iv, 
+bfish_cfb(u_char *str, u_int32_t slen, u_char *iv, 
 					u_char bsize, struct bfish_key *bk, u_char enc)
 {
-	u_long bytes;
+	u_int32_t bytes;
 	int i;
 
 	switch (bsize) {
@@ -79,7 +79,7 @@ bfish_cfb(u_char *str, u_long slen, u_char *iv,
 	while (slen >= bytes) {
 		u_char tmp[8];	/* Saved ciphertext */
 		
-		bfish_encrypt((u_long *)&iv[0], (u_long *)&iv[4], bk);
+		bfish_encrypt((u_int32_t *)&iv[0], (u_int32_t *)&iv[4], bk);
 		
 		/* Save ciphertext if we are decrypting */
 		if (!enc)
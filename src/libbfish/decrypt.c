@@ -45,10 +45,10 @@
  * bk    - The blowfish key received by bfish_keyinit()
  */
 void
-bfish_decrypt(u_long *left, u_long *right, struct bfish_key *bk)
+bfish_decrypt(u_int32_t *left, u_int32_t *right, struct bfish_key *bk)
 {
     register short i;    
-    register u_long fxl;
+    register u_int32_t fxl;
 
     
     /* Convert output to host endian */
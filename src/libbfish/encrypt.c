@@ -46,10 +46,10 @@
  * swap    - Converts encrypted blocks to big endian if this is true
  */
 void
-bfish_encrypt_swap(u_long *left, u_long *right, struct bfish_key *bk, int swap)
+bfish_encrypt_swap(u_int32_t *left, u_int32_t *right, struct bfish_key *bk, int swap)
 {
     register u_short i;
-    register u_long fxl;
+    register u_int32_t fxl;
 
 
     /* Convert to big endian */
@@ -43,7 +43,7 @@
 /*
  * P boxes
  */
-static const u_long pbox_arr[18] = {
+static const u_int32_t pbox_arr[18] = {
     0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344, 
     0xa4093822, 0x299f31d0, 0x082efa98, 0xec4e6c89, 
     0x452821e6, 0x38d01377, 0xbe5466cf, 0x34e90c6c, 
@@ -53,7 +53,7 @@ static const u_long pbox_arr[18] = {
 /*
  * S boxes
  */
-static const u_long sbox_arr[4][256] = { 
+static const u_int32_t sbox_arr[4][256] = { 
     { 0xd1310ba6, 0x98dfb5ac, 0x2ffd72db, 0xd01adfb7, 
       0xb8e1afed, 0x6a267e96, 0xba7c9045, 0xf12c7f99, 
       0x24a19947, 0xb3916cf7, 0x0801f2e2, 0x858efc16, 
@@ -313,39 +313,33 @@ static const u_long sbox_arr[4][256] = {
 
 /*
  * Initialize the blowfish key used by the encrypt
- * and/or decrypt function.
+ * and/or decrypt function in memory supplied by the caller.
  *
  * o XOR all filled P boxes with the user supplied key
  * o Recalculate the P and S boxes using the Blowfish
  *   algorithm.
  *
  * Argument(s):
+ * bk - The key structure to initialize.
  * key - The (maximum 448 bit) key supplied by the user.
  * klen - The length of key in bytes
  *
  * Return value(s):
- * A pointer to a bfish_key structure on success, NULL
- * on error.
+ * Zero on success, -1 on error.
  */
-struct bfish_key *
-bfish_keyinit(u_char *key, u_short klen)
+int
+bfish_keyinit_r(struct bfish_key *bk, u_char *key, u_short klen)
 {
-    register struct bfish_key *bk;
     register u_short i;
     register u_short j;
     register u_short k;
-    u_long left;
-    u_long right;
+    u_int32_t left;
+    u_int32_t right;
 
 
     if (klen > 56) {
         fprintf(stderr, "bfish_keyinit(): Key is to large (%u bytes)", klen);
-        return(NULL);
-    }
-
-    if ( (bk = (struct bfish_key *)malloc(sizeof(struct bfish_key))) == NULL) {
-        fprintf(stderr, "bfish_keyinit(): malloc(): %s\n", strerror(errno));
-        return(NULL);
+        return(-1);
     }
 
     /* Copy S boxes */
@@ -381,5 +375,36 @@ bfish_keyinit(u_char *key, u_short klen)
         }
     }
 
+    return(0);
+}
+
+
+/*
+ * Allocate and initialize the blowfish key, 
+ * see bfish_keyinit_r().
+ *
+ * Argument(s):
+ * key - The (maximum 448 bit) key supplied by the user.
+ * klen - The length of key in bytes
+ *
+ * Return value(s):
+ * A pointer to a bfish_key structure on success, NULL
+ * on error.
+ */
+struct bfish_key *
+bfish_keyinit(u_char *key, u_short klen)
+{
+    struct bfish_key *bk;
+
+    if ( (bk = (struct bfish_key *)malloc(sizeof(struct bfish_key))) == NULL) {
+        fprintf(stderr, "bfish_keyinit(): malloc(): %s\n", strerror(errno));
+        return(NULL);
+    }
+
+    if (bfish_keyinit_r(bk, key, klen) != 0) {
+        free(bk);
+        return(NULL);
+    }
+
     return(bk);
 }
@@ -49,10 +49,10 @@
  * bk    - The blowfish key initialized by bfish_keyinit()
  */
 void
-bfish_ofb(u_char *str, u_long slen, u_char *iv, 
+bfish_ofb(u_char *str, u_int32_t slen, u_char *iv, 
 					u_char bsize, struct bfish_key *bk)
 {
-	u_long bytes;
+	u_int32_t bytes;
 	int i;
 
 	switch (bsize) {
@@ -75,7 +75,7 @@ bfish_ofb(u_char *str, u_long slen, u_char *iv,
 	}
 
 	while (slen >= bytes) {
-		bfish_encrypt((u_long *)&iv[0], (u_long *)&iv[4], bk);
+		bfish_encrypt((u_int32_t *)&iv[0], (u_int32_t *)&iv[4], bk);
 		
 		for (i=0; i<bytes; i++) 
 			*(str++) ^= iv[i];
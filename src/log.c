@@ -0,0 +1,604 @@
+/*
+ *    File: log.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Asynchronous logging.
+ *
+ * Once log_init() have been called, andlog() does not format the
+ * message. Each thread has its own ring of binary records holding
+ * the time stamp, the level, the format string and the arguments,
+ * with strings copied into the record. The ring has a single
+ * producer, so no lock is taken when logging. A writer thread
+ * merge the rings in time order, format the records and write
+ * them out. A thread that log faster than the writer keep up
+ * drops records, which is reported, rather than blocking.
+ * When all rings are empty the writer sleeps on a futex, which
+ * a thread wakes when it puts the first record in its ring.
+ *
+ * Format strings must be constants, since only the pointer is
+ * kept. Formats with a '*' width or precision, long doubles, or
+ * more arguments than fit in a record, are formatted by the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if __ANDROID__
+#include <android/log.h>
+#endif
+
+#include "ibsschat.h"
+
+/* Records in the ring of each thread, must be a power of two */
+#define LOG_RINGLEN		256
+
+/* Arguments and string bytes in a record */
+#define LOG_MAXARGS		12
+#define LOG_STRSIZE		160
+
+/* Size of formatted message */
+#define LOG_LINESIZE	512
+
+/* Argument types */
+#define LOGARG_INT		1
+#define LOGARG_LONG		2
+#define LOGARG_LLONG	3
+#define LOGARG_DOUBLE	4
+#define LOGARG_STR		5
+#define LOGARG_PTR		6
+
+/* A log record */
+struct logrec {
+	uint64_t usec;		/* Time stamp */
+	const char *fmt;	/* Format, NULL if str hold the message */
+	uint8_t level;
+	uint8_t nargs;
+	uint8_t type[LOG_MAXARGS];
+	union {
+		long long i;
+		double d;
+		void *p;
+		uint32_t off;	/* Offset of string in str */
+	} arg[LOG_MAXARGS];
+	char str[LOG_STRSIZE];
+};
+
+/* The ring of a thread */
+struct logring {
+	volatile uint32_t head;		/* Next record to write out */
+	volatile uint32_t tail;		/* Next free record */
+	volatile uint32_t drops;	/* Records dropped */
+	volatile int dead;			/* Thread exited */
+	struct logring *next;
+	struct logrec rec[LOG_RINGLEN];
+};
+
+/* Local routines */
+static void *log_writer(void *);
+static struct logring *log_ring(void);
+static void log_ring_dead(void *);
+static int log_parse(struct logrec *, const char *, va_list);
+static void log_format(struct logrec *, char *, size_t);
+static void log_output(int, const char *);
+static int log_drain(void);
+static void log_atfork_prepare(void);
+static void log_atfork_parent(void);
+static void log_atfork_child(void);
+static void log_once(void);
+static void log_wake(void);
+
+/* Local variables */
+static lock_t loglock;				/* Held by the consumer */
+static lock_t ringslock;			/* Held when changing the list of rings */
+static struct logring * volatile rings = NULL;
+static pid_t logpid = 0;			/* Process running the writer */
+static pthread_key_t ringkey;
+static pthread_once_t logonce = PTHREAD_ONCE_INIT;
+static __thread struct logring *myring = NULL;
+static volatile uint32_t logwait = 0;	/* Writer sleeping */
+
+
+/*
+ * Called once per program.
+ */
+static void
+log_once(void)
+{
+	thread_memlock_init(&loglock);
+	thread_memlock_init(&ringslock);
+	pthread_key_create(&ringkey, log_ring_dead);
+	pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child);
+	atexit(log_flush);
+}
+
+
+/*
+ * Fork handlers, the locks are held over fork so that the
+ * child does not get rings in the middle of a drain.
+ * Records of the parent are not written by the child.
+ */
+static void
+log_atfork_prepare(void)
+{
+	thread_memlock_lock(&loglock);
+	thread_memlock_lock(&ringslock);
+}
+
+static void
+log_atfork_parent(void)
+{
+	thread_memlock_unlock(&ringslock);
+	thread_memlock_unlock(&loglock);
+}
+
+static void
+log_atfork_child(void)
+{
+	struct logring *r;
+
+	for (r = rings; r != NULL; r = r->next) {
+		r->head = r->tail;
+		r->drops = 0;
+		if (r != myring)
+			r->dead = 1;
+	}
+	logpid = 0;
+	logwait = 0;
+	thread_memlock_unlock(&ringslock);
+	thread_memlock_unlock(&loglock);
+}
+
+
+/*
+ * Start asynchronous logging in this process.
+ * Must be called again after fork() to log
+ * asynchronously in the child.
+ * Return 0 on success, -1 on error.
+ */
+int
+log_init(void)
+{
+	pthread_once(&logonce, log_once);
+
+	if (logpid == getpid())
+		return 0;
+
+	logpid = getpid();
+	if (thread_spawn(log_writer, NULL) != 0) {
+		logpid = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Thread exit, the writer free the ring once it is empty.
+ */
+static void
+log_ring_dead(void *arg)
+{
+	struct logring *r = (struct logring *)arg;
+
+	__sync_synchronize();
+	r->dead = 1;
+}
+
+
+/*
+ * Return the ring of the calling thread,
+ * NULL on error. The ring is put first in the list,
+ * which the writer may walk at the same time.
+ */
+static struct logring *
+log_ring(void)
+{
+	struct logring *r;
+
+	if (myring != NULL)
+		return myring;
+
+	if ( (r = calloc(1, sizeof(struct logring))) == NULL)
+		return NULL;
+
+	thread_memlock_lock(&ringslock);
+	r->next = rings;
+	__sync_synchronize();
+	rings = r;
+	thread_memlock_unlock(&ringslock);
+
+	pthread_setspecific(ringkey, r);
+	myring = r;
+	return r;
+}
+
+
+/*
+ * Save the arguments of format in record.
+ * Return 0 on success, -1 if the message has to
+ * be formatted by the caller.
+ */
+static int
+log_parse(struct logrec *rec, const char *fmt, va_list ap)
+{
+	const char *p;
+	size_t slen = 0;
+
+	rec->nargs = 0;
+	for (p = fmt; *p != '\0'; p++) {
+		int lng = 0;
+		int type;
+
+		if (*p != '%')
+			continue;
+
+		if (*++p == '%')
+			continue;
+
+		/* Flags, width and precision */
+		while ((*p != '\0') && (strchr("-+ #0123456789.", *p) != NULL))
+			p++;
+
+		if (*p == '*')
+			return -1;
+
+		/* Length */
+		for (;; p++) {
+			if ((*p == 'h') || (*p == 'L'))
+				lng = (*p == 'L') ? 3 : lng;
+			else if ((*p == 'l') || (*p == 'z') || (*p == 't'))
+				lng++;
+			else if ((*p == 'j') || (*p == 'q'))
+				lng = 2;
+			else
+				break;
+		}
+
+		if (*p == '\0')
+			break;
+
+		if (rec->nargs >= LOG_MAXARGS)
+			return -1;
+
+		switch (*p) {
+			case 'd': case 'i': case 'u': case 'x': case 'X':
+			case 'o': case 'c':
+				if (lng == 0) {
+					type = LOGARG_INT;
+					rec->arg[rec->nargs].i = va_arg(ap, int);
+				}
+				else if (lng == 1) {
+					type = LOGARG_LONG;
+					rec->arg[rec->nargs].i = va_arg(ap, long);
+				}
+				else {
+					type = LOGARG_LLONG;
+					rec->arg[rec->nargs].i = va_arg(ap, long long);
+				}
+				break;
+
+			case 'e': case 'E': case 'f': case 'F':
+			case 'g': case 'G': case 'a': case 'A':
+				if (lng == 3)
+					return -1;
+				type = LOGARG_DOUBLE;
+				rec->arg[rec->nargs].d = va_arg(ap, double);
+				break;
+
+			case 's': {
+				const char *s = va_arg(ap, const char *);
+				size_t len;
+
+				if (s == NULL)
+					s = "(null)";
+				len = strlen(s) + 1;
+				if (slen + len > LOG_STRSIZE)
+					return -1;
+				memcpy(&rec->str[slen], s, len);
+				type = LOGARG_STR;
+				rec->arg[rec->nargs].off = slen;
+				slen += len;
+				break;
+			}
+
+			case 'p':
+				type = LOGARG_PTR;
+				rec->arg[rec->nargs].p = va_arg(ap, void *);
+				break;
+
+			default:
+				return -1;
+		}
+
+		rec->type[rec->nargs++] = type;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Record message with level, formatted later by the
+ * writer thread.
+ * Return 0 if the message was recorded or dropped, -1 if
+ * asynchronous logging is not running and the caller
+ * should write the message.
+ */
+int
+log_record(int level, const char *fmt, va_list ap)
+{
+	struct logring *r;
+	struct logrec *rec;
+	struct timeval tv;
+	va_list cp;
+
+	if (logpid != getpid())
+		return -1;
+
+	if ( (r = log_ring()) == NULL)
+		return -1;
+
+	if ((r->tail - r->head) >= LOG_RINGLEN) {
+		__sync_fetch_and_add(&r->drops, 1);
+		return 0;
+	}
+
+	rec = &r->rec[r->tail & (LOG_RINGLEN - 1)];
+	gettimeofday(&tv, NULL);
+	rec->usec = ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+	rec->level = level;
+	rec->fmt = fmt;
+
+	va_copy(cp, ap);
+	if (log_parse(rec, fmt, cp) < 0) {
+		rec->fmt = NULL;
+		vsnprintf(rec->str, sizeof(rec->str), fmt, ap);
+	}
+	va_end(cp);
+
+	__sync_synchronize();
+	r->tail++;
+
+	/* Wake the writer if this is the only record in the ring,
+	 * otherwise it has not yet drained the ring */
+	__sync_synchronize();
+	if ((r->tail - r->head) == 1)
+		log_wake();
+	return 0;
+}
+
+
+/*
+ * Wake the writer if it is sleeping.
+ */
+static void
+log_wake(void)
+{
+	if ((logwait != 0) && __sync_bool_compare_and_swap(&logwait, 1, 0))
+		syscall(SYS_futex, &logwait, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+/*
+ * Format record into buf.
+ */
+static void
+log_format(struct logrec *rec, char *buf, size_t len)
+{
+	const char *p;
+	size_t n = 0;
+	int arg = 0;
+
+	if (rec->fmt == NULL) {
+		snprintf(buf, len, "%s", rec->str);
+		return;
+	}
+
+	for (p = rec->fmt; (*p != '\0') && (n + 1 < len); ) {
+		const char *start = p;
+		char spec[32];
+		int r = 0;
+
+		if (*p != '%') {
+			buf[n++] = *p++;
+			continue;
+		}
+
+		if (p[1] == '%') {
+			buf[n++] = '%';
+			p += 2;
+			continue;
+		}
+
+		/* Find the conversion */
+		for (p++; (*p != '\0') && (strchr("diouxXcCeEfFgGaAspn", *p) == NULL); p++)
+			;
+		if (*p == '\0')
+			break;
+		p++;
+
+		if (((size_t)(p - start) >= sizeof(spec)) || (arg >= rec->nargs))
+			break;
+		memcpy(spec, start, p - start);
+		spec[p - start] = '\0';
+
+		switch (rec->type[arg]) {
+			case LOGARG_INT:
+				r = snprintf(&buf[n], len - n, spec, (int)rec->arg[arg].i);
+				break;
+			case LOGARG_LONG:
+				r = snprintf(&buf[n], len - n, spec, (long)rec->arg[arg].i);
+				break;
+			case LOGARG_LLONG:
+				r = snprintf(&buf[n], len - n, spec, rec->arg[arg].i);
+				break;
+			case LOGARG_DOUBLE:
+				r = snprintf(&buf[n], len - n, spec, rec->arg[arg].d);
+				break;
+			case LOGARG_STR:
+				r = snprintf(&buf[n], len - n, spec, &rec->str[rec->arg[arg].off]);
+				break;
+			case LOGARG_PTR:
+				r = snprintf(&buf[n], len - n, spec, rec->arg[arg].p);
+				break;
+		}
+		arg++;
+
+		if (r < 0)
+			break;
+		n += r;
+		if (n >= len)
+			n = len - 1;
+	}
+	buf[n] = '\0';
+}
+
+
+/*
+ * Write out formatted message.
+ */
+static void
+log_output(int level, const char *msg)
+{
+#if __ANDROID__
+	__android_log_write((level == ANDLOG_DEBUG) ? ANDROID_LOG_DEBUG :
+		ANDROID_LOG_VERBOSE, ANDROID_LOG_TAG, msg);
+#else
+	fputs(msg, stdout);
+#endif
+}
+
+
+/*
+ * Write out all records in the rings in time order, and
+ * free the rings of threads that have exited.
+ * Return the number of records written.
+ * Log lock must be held when calling this function. Rings are
+ * only added first in the list, so the list is walked without
+ * the lock of the list, which is only taken to free rings.
+ */
+static int
+log_drain(void)
+{
+	char line[LOG_LINESIZE];
+	struct logring **rp;
+	struct logring *r;
+	int n = 0;
+
+	for (;;) {
+		struct logring *oldest = NULL;
+		struct logrec *rec;
+
+		for (r = rings; r != NULL; r = r->next) {
+			if (r->drops != 0) {
+				snprintf(line, sizeof(line),
+					"[log] %u messages dropped\n", r->drops);
+				__sync_fetch_and_sub(&r->drops, r->drops);
+				log_output(ANDLOG_INFO, line);
+			}
+
+			if (r->head == r->tail)
+				continue;
+			__sync_synchronize();
+
+			if ((oldest == NULL) || (r->rec[r->head & (LOG_RINGLEN - 1)].usec <
+					oldest->rec[oldest->head & (LOG_RINGLEN - 1)].usec))
+				oldest = r;
+		}
+
+		if (oldest == NULL)
+			break;
+
+		rec = &oldest->rec[oldest->head & (LOG_RINGLEN - 1)];
+		log_format(rec, line, sizeof(line));
+		log_output(rec->level, line);
+		__sync_synchronize();
+		oldest->head++;
+		n++;
+	}
+
+	/* Free rings of exited threads */
+	thread_memlock_lock(&ringslock);
+	for (rp = (struct logring **)&rings; (r = *rp) != NULL; ) {
+		if (r->dead && (r->head == r->tail)) {
+			*rp = r->next;
+			free(r);
+		}
+		else
+			rp = &r->next;
+	}
+	thread_memlock_unlock(&ringslock);
+
+#if !__ANDROID__
+	if (n > 0)
+		fflush(stdout);
+#endif
+	return n;
+}
+
+
+/*
+ * Write out all recorded messages.
+ */
+void
+log_flush(void)
+{
+	if (logpid != getpid())
+		return;
+
+	thread_memlock_lock(&loglock);
+	log_drain();
+	thread_memlock_unlock(&loglock);
+}
+
+
+/*
+ * Thread entry point.
+ * Write out recorded messages, and sleep
+ * until there are more when all rings are empty.
+ */
+static void *
+log_writer(void *arg)
+{
+	for (;;) {
+		int n;
+
+		thread_memlock_lock(&loglock);
+		n = log_drain();
+		thread_memlock_unlock(&loglock);
+
+		if (n > 0)
+			continue;
+
+		/* Announce the sleep before looking at the rings
+		 * again, so that a record put in a ring after the
+		 * drain either is seen here or wakes us up */
+		logwait = 1;
+		__sync_synchronize();
+
+		thread_memlock_lock(&loglock);
+		n = log_drain();
+		thread_memlock_unlock(&loglock);
+
+		if (n == 0)
+			syscall(SYS_futex, &logwait, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+		logwait = 0;
+	}
+
+	/* Unreached */
+	return NULL;
+}
@@ -7,6 +7,34 @@
  *    When: Spring 2018
  *
  * The chat buffer
+ *
+ * Every channel has a ring for each type of message, with the
+ * messages in the order they were stored, and each stored message
+ * get a sequence number from a counter shared by all rings. The sequence number
+ * is the cursor that clients resume from. Time stamps are
+ * taken when a message is first seen and never go backwards,
+ * so both cursor and time range are found by a binary search
+ * in the ring. Messages are also indexed on ID for the
+ * duplicate check, and chained per sender in each ring, so a
+ * query only touch the messages it return.
+ *
+ * The rings hold indexes into one pool of messages shared by
+ * all channels. The size of the pool is set in bytes with
+ * msgbuf_config(), and when it is full the oldest message of
+ * all channels is dropped.
+ *
+ * Each type of message has a time to live. Since a ring only
+ * hold one type, its oldest message is the first to expire, so
+ * expired messages are dropped from the start of the rings once
+ * a second without looking at the messages that have not.
+ *
+ * In front of the ID index is a counting Bloom filter, sized with
+ * the index and updated with it. Most new messages are ruled out
+ * by the filter, reading a single cache line, so that the check
+ * of msgbuf_exist() is done without the lock and msgbuf_add()
+ * skips the index for them. The filter is not used to skip the
+ * decryption, the multicast reader looks IDs up only after the
+ * checksum of the decrypted message has been verified.
  */
 
 #include <stdio.h>
@@ -19,135 +47,507 @@
 #include <sys/wait.h>
 #include <sys/time.h>
 
-#include "linkedlist.h"
 #include "ibsschat.h"
 
 
-/* Maximum number of messages in buffer */
-#define MAXMSGS	1000
+/* Default size of the buffer in bytes, set with msgbuf_config() */
+#define MSGBUF_BYTES	(4 * 1024 * 1024)
+
+/* Smallest size of the buffer in bytes */
+#define MSGBUF_MINBYTES	(64 * 1024)
+
+/* Memory used for each message, the entry, one bucket of the
+ * ID index, up to two slots in a channel ring and the counters
+ * of the filter */
+#define MSGBYTES	(sizeof(struct msg) + (4 * sizeof(uint32_t)))
+
+/* Slots in the ring of a channel when first used, a power of two */
+#define MSGSLOTS	64
+
+/* Entries allocated in the pool when first used */
+#define MSGPOOL		1024
+
+/* Buckets in the ID index when first used, a power of two. It
+ * grows with the pool, to at most one bucket per message */
+#define MSGHASH		4096
+
+/* Entries in the sender index, must be a power of two */
+#define MSGSENDERS	1024
+
+/* Bytes in a block of the filter, a cache line of 4 bit counters */
+#define BLOOM_BLOCK		64
+
+/* Counters set in a block for each message */
+#define BLOOM_HASHES	4
+
+/* Time to live of messages in seconds, zero for none */
+#define MSGTTL_DISCOVER	(10 * 60)
+#define MSGTTL_MSG		(24 * 60 * 60)
+
+/* Rings of each channel, one per message type */
+#define MSGTYPES	(CHAT_MSG + 1)
+#define MSGBUFS		(CHAT_MAXCHANNELS * MSGTYPES)
+
+/* Ring of channel and type */
+#define msg_buf(chan, type) ((chan) * MSGTYPES + (type))
+
+#define msg_slot(cb, n) (&pool[(cb)->ring[(n) & (cb)->mask]])
+
+/* Message number n is in the buffer of the channel */
+#define msg_valid(cb, n) \
+	((uint32_t)((n) - (cb)->first) < (uint32_t)((cb)->next - (cb)->first))
+
+/* Message number a is older than message number b */
+#define msg_before(cb, a, b) \
+	((uint32_t)((a) - (cb)->first) < (uint32_t)((b) - (cb)->first))
 
 
 /* The message structure */
 struct msg {
 
-	/* The number of times message have been seen */
+	/* The number of times message have been seen, zero if deleted */
 	uint32_t count;
 
 	/* Time stamp when message was first seen */
-	struct timeval tv;
+	uint32_t sec;
+	uint32_t usec;
+
+	/* Sequence number (cursor) of message */
+	uint32_t seq;
+
+	/* Number + 1 of the previous message from the 
+	 * same sender in the channel, zero if none */
+	uint32_t prev;
+
+	/* Index + 1 of the next message in the same bucket of
+	 * the ID index, or in the free list, zero if none */
+	uint32_t hnext;
 
 	/* The message */
 	struct message msg;
-
-} __attribute__((packed));
+};
+
+/* The buffer of a channel and message type */
+struct chanbuf {
+	uint32_t *ring;		/* Pool index of messages, allocated on first use */
+	uint32_t mask;		/* Slots in the ring - 1 */
+	uint32_t first;		/* Number of the oldest message */
+	uint32_t next;		/* Number of the next message */
+	uint32_t partial;	/* Messages stored without a sender entry */
+};
+
+/* Counting Bloom filter of the messages in the ID index, with
+ * 8 counters for each bucket. Filters replaced when the index
+ * grows are kept, since they may be read without the lock */
+struct bloom {
+	uint32_t mask;			/* Blocks - 1 */
+	uint8_t *blocks;		/* Aligned to cache line */
+	struct bloom *old;		/* The filter replaced by this one */
+};
+
+/* The newest message from a sender in a ring, the entry
+ * is removed when that message leaves the ring */
+struct msgsender {
+	uint32_t ip;		/* Sender IPv4 address, zero for free slot */
+	uint32_t buf;		/* Ring, msg_buf() of channel and type */
+	uint32_t newest;	/* Number + 1 of newest message, zero if none */
+};
+
+/* Home slot of sender of ring in the sender index */
+#define msg_sender_slot(ip, buf) \
+	((((ip) ^ (buf)) * 2654435761U) & (MSGSENDERS - 1))
 
 
 /* Local variables */
 static lock_t buflock;
-static struct linkedlist *msgbuf;
+static struct chanbuf msgbuf[MSGBUFS];	/* One per channel and type */
+static size_t msgbytes = MSGBUF_BYTES;
+static struct msg *pool;		/* The messages of all channels */
+static uint32_t poolsize;		/* Allocated entries in pool */
+static uint32_t poolfree;		/* Index + 1 of first free entry */
+static uint32_t poolused;		/* Entries in pool that has been used */
+static uint32_t maxmsgs;		/* Maximum number of messages in the buffer */
+static uint32_t nmsgs;			/* Number of messages in the buffer */
+static uint32_t *msghash;		/* Index + 1 of first message in bucket */
+static uint32_t hashmask;		/* Buckets in the ID index - 1 */
+static struct bloom * volatile bloom;	/* Filter in front of the index */
+static struct msgsender senders[MSGSENDERS];
+static uint32_t nsenders;
+static uint32_t lastseq;		/* Sequence number of newest message */
+static struct timeval lasttv;	/* Time stamp of newest message */
+static uint32_t lastsweep;		/* Time of last expiry sweep */
+static const uint32_t msgttl[MSGTYPES] = {
+	[CHAT_DISCOVER] = MSGTTL_DISCOVER,
+	[CHAT_MSG] = MSGTTL_MSG
+};
 static uint32_t myipv4;
 
-/* Maximum number of clients that receive new messages */
-#define MAXCLIENTS 20
-static lock_t socklock;
-static int socklist[MAXCLIENTS];
-
 
 /* Local routines */
-static struct msg *msgbuf_get(struct msgid *);
-static int msgcmp(const void *, const void *);
-static struct msg *msg_create(struct message *, time_t);
+static struct msg *msgbuf_get(uint8_t, struct msgid *);
+static uint32_t msg_hash(struct msgid *);
+static void msg_unhash(struct msg *);
+static int msg_rehash(uint32_t);
+static uint64_t bloom_hash(struct msgid *);
+static void bloom_update(struct bloom *, struct msgid *, int);
+static int bloom_maybe(struct msgid *);
+static struct msgsender *msg_sender(uint32_t, uint32_t, int);
+static void msg_sender_del(struct msgsender *);
+static void msg_drop(uint32_t);
 static int msgbuf_write_socklist(struct message *, int);
-static int msgbuf_append(struct msg *);
+static uint32_t msg_alloc(void);
+static void msg_free(uint32_t);
+static int msgbuf_grow(struct chanbuf *);
+static void msgbuf_evict(void);
+static void msgbuf_expire(uint32_t);
+static struct msg *msgbuf_append(struct message *, uint32_t, struct timeval *);
+static uint32_t msgbuf_search(struct chanbuf *, uint32_t, uint32_t);
+static int msgseqcmp(const void *, const void *);
+static int msgbuf_select(struct chatquery *, struct chatfilter *,
+	struct message **, uint32_t *, int);
+
 
 /*
- * Message compare function.
+ * Hash of message ID.
  */
-static int
-msgcmp(const void *a, const void *b)
+static uint32_t
+msg_hash(struct msgid *id)
 {
-	struct message *m1;
-	struct message *m2;
+	uint8_t *p = (uint8_t *)id;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i=0; i < sizeof(struct msgid); i++)
+		h = (h ^ p[i]) * 16777619U;
+
+	return h & hashmask;
+}
 
-	struct msgid *i1 = NULL;
-	struct msgid *i2 = NULL;
 
+/*
+ * Hash of message ID for the filter, the upper half selects
+ * the block and the lower the counters in the block.
+ */
+static uint64_t
+bloom_hash(struct msgid *id)
+{
+	uint64_t h;
+
+	h = ((uint64_t)id->ip << 32) | id->sec;
+	h ^= (((uint64_t)id->usec << 16) | id->sum) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
 
-	/* Shut up compiler */
-	i1++; i2++; i1 = NULL; i2 = NULL;
 
-	/* Find the ID structure */
-	m1 = &(((struct msg *)a)->msg);
-	m2 = &(((struct msg *)b)->msg);
-	i1 = &m1->id;
-	i2 = &m2->id;
+/*
+ * Add message ID to the filter if add is non zero,
+ * remove it otherwise. Counters that reach the maximum
+ * stay there, since what they count is no longer known.
+ * Buffer must be locked when calling this function.
+ */
+static void
+bloom_update(struct bloom *bf, struct msgid *id, int add)
+{
+	uint64_t h = bloom_hash(id);
+	uint8_t *blk = &bf->blocks[((h >> 32) & bf->mask) * BLOOM_BLOCK];
+	int i;
 
-#if 0
-	andlog("Comparing %08x%08x%02x%02x and %08x%08x%02x%02x\n",
-		i1->ip, i1->sec, i1->usec, i1->sum,
-		i2->ip, i2->sec, i2->usec, i2->sum);
-#endif
+	for (i=0; i < BLOOM_HASHES; i++, h >>= 7) {
+		uint8_t *p = &blk[(h & 0x7f) >> 1];
+		int shift = (h & 1) << 2;
+		uint8_t c = (*p >> shift) & 0x0f;
 
-	return memcmp((const void *)&m1->id, (const void *)&m2->id, sizeof(struct msgid));
+		if (add && (c < 0x0f))
+			c++;
+		else if (!add && (c > 0) && (c < 0x0f))
+			c--;
+		*p = (*p & ~(0x0f << shift)) | (c << shift);
+	}
 }
 
 
 /*
- * Create a message entry.
- * Returns the pointer to the allocated
- * memory on success, NULL on error.
+ * Check message ID against the filter.
+ * Return zero if the message is not in the buffer, non
+ * zero if it may be. May be called without the lock, a
+ * message being stored or removed at the same time may
+ * then be reported either way.
  */
-static struct msg *
-msg_create(struct message *m, time_t sec)
+static int
+bloom_maybe(struct msgid *id)
+{
+	struct bloom *bf = bloom;
+	uint64_t h = bloom_hash(id);
+	uint8_t *blk = &bf->blocks[((h >> 32) & bf->mask) * BLOOM_BLOCK];
+	int i;
+
+	for (i=0; i < BLOOM_HASHES; i++, h >>= 7) {
+		if (((blk[(h & 0x7f) >> 1] >> ((h & 1) << 2)) & 0x0f) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Resize the ID index to buckets, a power of two, and its
+ * filter with it, and index the messages in the buffer again.
+ * Return 0 on success, -1 on error.
+ * Buffer must be locked when calling this function.
+ */
+static int
+msg_rehash(uint32_t buckets)
 {
-	struct msg *mg;
+	struct bloom *bf;
+	uint32_t *hash;
+	uint32_t blocks;
+	void *p;
+	int b;
+
+	/* 8 counters (4 bytes) for each bucket */
+	blocks = (buckets * 4) / BLOOM_BLOCK;
+	if (blocks == 0)
+		blocks = 1;
+
+	if ( (bf = calloc(1, sizeof(struct bloom))) == NULL) {
+		anderrs("Failed to allocate memory");
+		return -1;
+	}
 
-	if ( (mg = calloc(1, sizeof(struct msg))) == NULL) {
+	if (posix_memalign(&p, BLOOM_BLOCK, blocks * BLOOM_BLOCK) != 0) {
 		anderrs("Failed to allocate memory");
-		return NULL;
+		free(bf);
+		return -1;
 	}
+	memset(p, 0x00, blocks * BLOOM_BLOCK);
+	bf->blocks = p;
+	bf->mask = blocks - 1;
 
-	if (sec == 0)
-		gettimeofday(&mg->tv, NULL);
-	else
-		mg->tv.tv_sec = sec;
+	if ( (hash = calloc(buckets, sizeof(uint32_t))) == NULL) {
+		anderrs("Failed to allocate memory");
+		free(bf->blocks);
+		free(bf);
+		return -1;
+	}
+	free(msghash);
+	msghash = hash;
+	hashmask = buckets - 1;
+
+	for (b=0; b < MSGBUFS; b++) {
+		struct chanbuf *cb = &msgbuf[b];
+		uint32_t n;
+
+		for (n = cb->first; n != cb->next; n++) {
+			uint32_t idx = cb->ring[n & cb->mask];
+			struct msg *mb = &pool[idx];
+			uint32_t h;
+
+			/* Deleted messages are not indexed */
+			if (mb->count == 0)
+				continue;
+
+			h = msg_hash(&mb->msg.id);
+			mb->hnext = msghash[h];
+			msghash[h] = idx + 1;
+			bloom_update(bf, &mb->msg.id, 1);
+		}
+	}
+
+	/* The filter is complete before it is used */
+	bf->old = bloom;
+	__sync_synchronize();
+	bloom = bf;
+	return 0;
+}
+
+
+/*
+ * Remove message from the ID index.
+ * Buffer must be locked when calling this function.
+ */
+static void
+msg_unhash(struct msg *m)
+{
+	uint32_t idx = (m - pool) + 1;
+	uint32_t *pp;
+
+	for (pp = &msghash[msg_hash(&m->msg.id)]; *pp != 0; 
+			pp = &pool[*pp - 1].hnext) {
+		if (*pp == idx) {
+			*pp = m->hnext;
+			break;
+		}
+	}
+	m->hnext = 0;
+	bloom_update(bloom, &m->msg.id, 0);
+}
+
+
+/*
+ * Find sender of ring buf in the sender index,
+ * add it if create is non zero.
+ * Return a pointer to the entry on success, NULL if
+ * not found or if the index is full.
+ * Buffer must be locked when calling this function.
+ */
+static struct msgsender *
+msg_sender(uint32_t ip, uint32_t buf, int create)
+{
+	uint32_t i;
+	uint32_t n;
+
+	i = msg_sender_slot(ip, buf);
+	for (n=0; n < MSGSENDERS; n++) {
+		struct msgsender *s = &senders[(i + n) & (MSGSENDERS - 1)];
+
+		if ((s->ip == ip) && (s->buf == buf))
+			return s;
+
+		if (s->ip == 0) {
+			if (create == 0)
+				return NULL;
+
+			/* Keep a few free slots to bound probing */
+			if (nsenders >= (MSGSENDERS - (MSGSENDERS >> 3)))
+				return NULL;
+
+			s->ip = ip;
+			s->buf = buf;
+			s->newest = 0;
+			nsenders++;
+			return s;
+		}
+	}
+
+	return NULL;
+}
 
-	mg->count = 1;
-	memcpy(&(mg->msg), m, sizeof(struct message));
-	return mg;
+
+/*
+ * Remove entry from the sender index, moving the entries
+ * after it back so that they are found without it.
+ * Buffer must be locked when calling this function.
+ */
+static void
+msg_sender_del(struct msgsender *s)
+{
+	uint32_t i = s - senders;
+	uint32_t j = i;
+
+	for (;;) {
+		struct msgsender *t;
+
+		j = (j + 1) & (MSGSENDERS - 1);
+		t = &senders[j];
+		if (t->ip == 0)
+			break;
+
+		/* Move the entry into the hole if the hole is
+		 * between its home slot and where it is */
+		if (((j - msg_sender_slot(t->ip, t->buf)) & (MSGSENDERS - 1)) >=
+				((j - i) & (MSGSENDERS - 1))) {
+			senders[i] = *t;
+			i = j;
+		}
+	}
+
+	memset(&senders[i], 0x00, sizeof(struct msgsender));
+	nsenders--;
+}
+
+
+/*
+ * Set the size of the message buffer in bytes,
+ * used by msgbuf_init().
+ * Return 0 on success, -1 if the size is too small.
+ */
+int
+msgbuf_config(size_t bytes)
+{
+	if (bytes < MSGBUF_MINBYTES) {
+		anderr("** Error: Message buffer must be at least %u bytes\n",
+			MSGBUF_MINBYTES);
+		return -1;
+	}
+	msgbytes = bytes;
+	return 0;
 }
 
+
 /*
  * Initialize the message buffer.
+ * Return 0 on success, -1 on error.
  */
-void
+int
 msgbuf_init(uint32_t ip)
 {
-	int i=0;
+	uint32_t buckets;
+	size_t max;
+	int b;
 
 	/* Initialize lock */
-	thread_memlock_init(buflock);
-	thread_memlock_init(socklock);
-	msgbuf = NULL;
+	thread_memlock_init(&buflock);
+
+	for (b=0; b < MSGBUFS; b++)
+		free(msgbuf[b].ring);
+	free(pool);
+	while (bloom != NULL) {
+		struct bloom *bf = bloom;
+
+		bloom = bf->old;
+		free(bf->blocks);
+		free(bf);
+	}
+	memset(msgbuf, 0x00, sizeof(msgbuf));
+	memset(senders, 0x00, sizeof(senders));
+	memset(&lasttv, 0x00, sizeof(lasttv));
+	pool = NULL;
+	poolsize = 0;
+	poolfree = 0;
+	poolused = 0;
+	nmsgs = 0;
+	nsenders = 0;
+	lastseq = 0;
+	lastsweep = 0;
 	myipv4 = ip;
 
-	/* Initialize client sockets */
-	for (i=0; i<MAXCLIENTS; i++)
-		socklist[i] = -1;
+	/* Messages in the budget */
+	max = msgbytes / MSGBYTES;
+	if (max > (1U << 30))
+		max = (1U << 30);
+	maxmsgs = max;
+
+	for (buckets = 1; ((buckets << 1) <= maxmsgs) && (buckets < MSGHASH); 
+		buckets <<= 1);
+	if (msg_rehash(buckets) < 0)
+		return -1;
+
+	andlog("[+] Message buffer of %lu bytes hold %u messages\n",
+		(unsigned long)msgbytes, maxmsgs);
+	return 0;
 }
 
 /*
  * Synchronize by connecting to another node
- * and download messages.
+ * and download the messages of the channels in chans.
+ * If since is non zero, only the messages the node first
+ * saw at or after since (seconds) are asked for.
  * Returns the number of messages read on
  * success, -1 on error.
  */
 int
-msgbuf_sync(uint32_t ip, uint16_t port)
+msgbuf_sync(uint32_t ip, uint16_t port, uint32_t chans, uint32_t since)
 {
-	struct message msg;
+	struct chatqueryres res;
+	struct chatquery q;
 	struct in_addr sad;
-	int count = 0;
+	size_t len;
+	int count;
 	int sock;
 
 	sad.s_addr = ip;
@@ -161,176 +561,404 @@ msgbuf_sync(uint32_t ip, uint16_t port)
 		return -1;
 	}
 
-	/* Wait for data to be written on the other end
-	 * to avoid getting blocked on the fd until next message 
-	 * if the buffer is empty on the other side (very rare though ...)*/	
-	sleep(1);
+	/* Tell the other node which channels we want, 
+	 * and from when if only part of them are missing */
+	memset(&q, 0x00, sizeof(q));
+	len = sizeof(struct chatsub);
+	q.channels = htonl(chans);
+	if (since != 0) {
+		q.channels = htonl(chans | CHAT_SUB_QUERY);
+		q.since = htonl(since);
+		len = sizeof(q);
+	}
+
+	if (writen(sock, &q, len) != len) {
+		anderrs("Failed to write channel subscription to sync client");
+		close(sock);
+		return -1;
+	}
+
+	if (since != 0) {
+		if (readn(sock, &res, sizeof(res)) != sizeof(res)) {
+			anderrs("Failed to read query result from sync client");
+			close(sock);
+			return -1;
+		}
+		andlog("[SYNC] %s has %u messages since %u\n", inet_ntoa(sad),
+			ntohl(res.count), since);
+	}
+	else {
+		/* Wait for data to be written on the other end
+		 * to avoid getting blocked on the fd until next message 
+		 * if the buffer is empty on the other side (very rare though ...)*/	
+		sleep(1);
+	}
+
+	count = msgbuf_sync_read(sock, chans);
+	close(sock);
+	return count;
+}
+
 
-	while (readn(sock, &msg, sizeof(msg)) == sizeof(msg)) {
-		struct msg *mb;
+/*
+ * Read encrypted messages of the channels in chans from
+ * fd until end of file, and store the ones not in the buffer.
+ * Returns the number of valid messages read.
+ */
+int
+msgbuf_sync_read(int fd, uint32_t chans)
+{
+	struct message msg;
+	int stored = 0;
+	int count = 0;
+
+	while (readn(fd, &msg, sizeof(msg)) == sizeof(msg)) {
+		if (!msgchan_valid(&msg) || ((chans & (1 << msg.channel)) == 0))
+			continue;
 
 		/* Decrypt */
-		chat_crypto_decrypt(&msg);
+		if ((chat_crypto_decrypt(&msg) < 0) || (msgbuf_verify(&msg) == 0))
+			continue;
+		count++;
 
-		thread_memlock_lock(buflock);
+		thread_memlock_lock(&buflock);
 
 		/* Message does not exist */
-		if ( (mb = msgbuf_get(&msg.id)) == NULL) {
-
-			andlog("[SYNC] Read buffered message %u from %s:%u\n",
-				count + 1, inet_ntoa(sad), ntohs(port));
+		if (msgbuf_get(msg.channel, &msg.id) == NULL) {
 
-			/* Create the message */
-			if ( (mb = msg_create(&msg, msg.id.sec)) == NULL) {
-				thread_memlock_unlock(buflock);
-				return count;
-			}
+			anddebug("[SYNC] Read buffered message %u\n", stored + 1);
 
-			/* Make sure the messages have been seen */
-			mb->count = 2;
+			stats_add(STATS_SYNC_RX, sizeof(struct message));
 
-			/* Append it */
-			msgbuf_append(mb);
-			count++;
+			/* Store it, the messages have been seen */
+			if (msgbuf_append(&msg, 2, NULL) == NULL) {
+				thread_memlock_unlock(&buflock);
+				break;
+			}
+			stored++;
 		}
 		
-		thread_memlock_unlock(buflock);
+		thread_memlock_unlock(&buflock);
 	}
 
-	close(sock);
+	andlog("[SYNC] Stored %d of %d messages read\n", stored, count);
 	return count;
 }
 
 /*
- * Add socket to list of descriptors.
- * Returns 0 on success, -1 on error.
+ * Publish message to the message ring and queue it 
+ * for all clients subscribing to the channel of the message.
+ * Return the number of socket clients queued for.
+ * Buffer must be locked when calling this function, so that
+ * a client registered by a query get every message that
+ * is not part of the result.
  */
-int
-msgbuf_addsock(int sock)
+static int
+msgbuf_write_socklist(struct message *m, int count)
 {
-	int ret = -1;
-	int i;
+	int n;
 
-	thread_memlock_lock(socklock);
-	
-	/* Check if socket already exist */
-	for(i=0; i < MAXCLIENTS; i++) {
-		if (socklist[i] == sock) {
-			ret = 0;
-			goto finished;
+	/* Require local messages to be acknowledged, 
+	 * as in seen at least twice */
+	if (m->id.ip == myipv4) {
+		if (count <= 1) {
+			return 0;
 		}
 	}
 
-	for(i=0; i < MAXCLIENTS; i++) {
-		if (socklist[i] == -1) {
-			socklist[i] = sock;
-			ret = 0;
-			break;
+	ring_publish(m);
+	n = client_queue(m);
+	trace_event(TRACE_DELIVER, 0, m, 0, n);
+	return n;
+}
+
+
+/*
+ * Take an entry from the pool, growing it if
+ * no entry is free.
+ * Return the index + 1 of the entry on success,
+ * zero on error.
+ * Buffer must be locked when calling this function.
+ */
+static uint32_t
+msg_alloc(void)
+{
+	uint32_t idx;
+
+	if (poolfree != 0) {
+		idx = poolfree;
+		poolfree = pool[idx - 1].hnext;
+		return idx;
+	}
+
+	/* Entries are referred to by index, so the pool can move */
+	if (poolused == poolsize) {
+		struct msg *p;
+		uint32_t size;
+
+		size = (poolsize == 0) ? MSGPOOL : (poolsize << 1);
+		if (size > maxmsgs)
+			size = maxmsgs;
+		if (size <= poolsize)
+			return 0;
+
+		if ( (p = realloc(pool, size * sizeof(struct msg))) == NULL) {
+			anderrs("Failed to allocate memory");
+			return 0;
 		}
+		pool = p;
+		poolsize = size;
+
+		/* Keep the index small while the buffer is, so that it
+		 * stays in cache, and grow it with the pool. The old
+		 * index is kept if it can not be resized */
+		if ((poolsize > (hashmask + 1)) && 
+				(((hashmask + 1) << 1) <= maxmsgs))
+			msg_rehash((hashmask + 1) << 1);
 	}
 
-	finished:
-	
-	thread_memlock_unlock(socklock);
+	return ++poolused;
+}
 
-	if (ret == -1)
-		andlog("** Error: Could not find empty slot for client socket\n");
 
-	return ret;
+/*
+ * Put entry with index + 1 back in the pool.
+ * Buffer must be locked when calling this function.
+ */
+static void
+msg_free(uint32_t idx)
+{
+	struct msg *mb = &pool[idx - 1];
+
+	if (mb->count != 0)
+		msg_unhash(mb);
+	mb->count = 0;
+	mb->hnext = poolfree;
+	poolfree = idx;
+	nmsgs--;
 }
 
+
 /*
- * Delete socket from list.
+ * Double the ring of channel, or allocate it on first use.
  * Return 0 on success, -1 on error.
+ * Buffer must be locked when calling this function.
  */
-int
-msgbuf_delsock(int sock)
+static int
+msgbuf_grow(struct chanbuf *cb)
 {
-	int ret = -1;
-	int i;
+	uint32_t slots;
+	uint32_t *ring;
+	uint32_t n;
 
-	thread_memlock_lock(socklock);
-	for(i=0; i < MAXCLIENTS; i++) {
-		if (socklist[i] == sock) {
-			socklist[i] = -1;
-			ret = 0;
-			break;
-		}
+	slots = (cb->ring == NULL) ? MSGSLOTS : ((cb->mask + 1) << 1);
+	if ( (ring = malloc(slots * sizeof(uint32_t))) == NULL) {
+		anderrs("Failed to allocate memory");
+		return -1;
 	}
-	thread_memlock_unlock(socklock);
 
-	if (ret == -1)
-		andlog("** Error: Could not find client socket in list\n");
-	return ret;
+	for (n = cb->first; n != cb->next; n++)
+		ring[n & (slots - 1)] = cb->ring[n & cb->mask];
+
+	free(cb->ring);
+	cb->ring = ring;
+	cb->mask = slots - 1;
+	return 0;
 }
 
 
 /*
- * Write message to all clients in socket list.
- * Return the number of sockets written to.
+ * Drop the oldest message of ring buf, and the entry of its
+ * sender if it was the newest message from the sender.
+ * Buffer must be locked when calling this function.
  */
-static int
-msgbuf_write_socklist(struct message *m, int count)
+static void
+msg_drop(uint32_t buf)
 {
-	int ret = 0;
-	int i;
+	struct chanbuf *cb = &msgbuf[buf];
+	uint32_t idx = cb->ring[cb->first & cb->mask];
+	struct msgsender *s;
+
+	if (((s = msg_sender(pool[idx].msg.id.ip, buf, 0)) != NULL) &&
+			(s->newest == (cb->first + 1)))
+		msg_sender_del(s);
+
+	msg_free(idx + 1);
+	cb->first++;
+	if (cb->first == cb->next)
+		cb->partial = 0;
+}
 
-	/* Require local messages to be acknowledged, 
-	 * as in seen at least twice */
-	if (m->id.ip == myipv4) {
-		if (count <= 1) {
-			return 0;
+
+/*
+ * Drop the oldest message of all channels.
+ * Buffer must be locked when calling this function.
+ */
+static void
+msgbuf_evict(void)
+{
+	uint32_t age = 0;
+	int oldest = -1;
+	int b;
+
+	for (b=0; b < MSGBUFS; b++) {
+		struct chanbuf *cb = &msgbuf[b];
+
+		if (cb->first == cb->next)
+			continue;
+
+		if ((oldest < 0) || ((lastseq - msg_slot(cb, cb->first)->seq) > age)) {
+			oldest = b;
+			age = lastseq - msg_slot(cb, cb->first)->seq;
 		}
 	}
 
-	
-	thread_memlock_lock(socklock);
-	for(i=0; i < MAXCLIENTS; i++) {
-		if (socklist[i] != -1) {
-			if (writen(socklist[i], m, sizeof(struct message)) !=
-					sizeof(struct message)) {
-				anderrs("msgbuf_write_socklist() Failed to write to socket");
-				andlog("Deleting socket %u because of failed write\n", 
-					socklist[i]);
-				close(socklist[i]);
-				socklist[i] = -1;
-			}
-			ret++;
+	if (oldest >= 0)
+		msg_drop(oldest);
+}
+
+
+/*
+ * Drop the messages that have lived longer than the time to
+ * live of their type at time now (seconds), once a second.
+ * Buffer must be locked when calling this function.
+ */
+static void
+msgbuf_expire(uint32_t now)
+{
+	uint32_t expired = 0;
+	int b;
+
+	if (now == lastsweep)
+		return;
+	lastsweep = now;
+
+	for (b=0; b < MSGBUFS; b++) {
+		struct chanbuf *cb = &msgbuf[b];
+		uint32_t ttl = msgttl[b % MSGTYPES];
+
+		if (ttl == 0)
+			continue;
+
+		/* Messages of a ring are in the order they were first seen */
+		while ((cb->first != cb->next) &&
+				((now - msg_slot(cb, cb->first)->sec) >= ttl)) {
+			msg_drop(b);
+			expired++;
 		}
 	}
-	thread_memlock_unlock(socklock);
-	return ret;
+
+	if (expired != 0) {
+		stats_add(STATS_EXPIRED, expired);
+		anddebug("%u messages expired from the message buffer\n", expired);
+	}
 }
 
 
 /*
- * Append message to buffer,
- * delete first message if 
- * buffer is full.
- * Return 0 on success, -1 on error.
+ * Append message to the buffer of its channel, the oldest
+ * message of all channels is dropped if the buffer is full.
+ * The message is first seen now, or at seen if it is not NULL.
+ * Return a pointer to the stored message on success,
+ * NULL on error.
  * Buffer must be locked when calling this function.
  */
-static int
-msgbuf_append(struct msg *m)
+static struct msg *
+msgbuf_append(struct message *m, uint32_t count, struct timeval *seen)
 {
-	/* Append it to the list */
-	msgbuf = linkedlist_append(msgbuf, m);
+	uint32_t buf = msg_buf(m->channel, m->type);
+	struct chanbuf *cb = &msgbuf[buf];
+	struct msgsender *s;
+	struct timeval tv;
+	struct msg *mb;
+	uint32_t idx;
+	uint32_t h;
+
+	/* Time stamps never go backwards, so that they
+	 * can be searched just as the sequence numbers */
+	if (seen != NULL)
+		tv = *seen;
+	else
+		gettimeofday(&tv, NULL);
+	if (timercmp(&tv, &lasttv, <))
+		tv = lasttv;
+	lasttv = tv;
+
+	/* Drop expired messages, and the oldest 
+	 * message if the buffer is still full */
+	msgbuf_expire(tv.tv_sec);
+	if (nmsgs >= maxmsgs)
+		msgbuf_evict();
+
+	if ((cb->ring == NULL) || ((cb->next - cb->first) > cb->mask)) {
+		if (msgbuf_grow(cb) < 0)
+			return NULL;
+	}
 
-	/* Delete first (oldest) entry 
-     * If we reached the maximum number of messages */
-	if (linkedlist_elements(msgbuf) > MAXMSGS) {
-		if ((msgbuf->head == NULL) || (msgbuf->head->data == NULL)) {
-			andlog("** Error: head of list is NULL!!!");
-		}
-		else {
-			free(msgbuf->head->data);
-			msgbuf = linkedlist_unlink(msgbuf, msgbuf->head);	
-		}
+	if ( (idx = msg_alloc()) == 0)
+		return NULL;
+	nmsgs++;
+
+	if (++lastseq == 0)
+		lastseq = 1;
+
+	mb = &pool[idx - 1];
+	memset(mb, 0x00, sizeof(struct msg));
+	mb->count = count;
+	mb->sec = tv.tv_sec;
+	mb->usec = tv.tv_usec;
+	mb->seq = lastseq;
+	memcpy(&mb->msg, m, sizeof(struct message));
+	cb->ring[cb->next & cb->mask] = idx - 1;
+
+	/* Index on ID */
+	h = msg_hash(&m->id);
+	mb->hnext = msghash[h];
+	msghash[h] = idx;
+	bloom_update(bloom, &m->id, 1);
+
+	/* Chain to previous message from sender */
+	if ( (s = msg_sender(m->id.ip, buf, 1)) != NULL) {
+		if ((s->newest != 0) && msg_valid(cb, s->newest - 1))
+			mb->prev = s->newest;
+		s->newest = cb->next + 1;
 	}
+	else
+		cb->partial++;
 
-	andlog("%u messages in message buffer\n", 
-		linkedlist_elements(msgbuf));
-	return 0;
+	cb->next++;
+	msglog_add(&mb->msg, &tv, count);
+
+	anddebug("%u messages in message buffer of channel %u\n", 
+		cb->next - cb->first, m->channel);
+	return mb;
+}
+
+
+/*
+ * Delete all messages in the buffer of channel.
+ */
+void
+msgbuf_flush(uint8_t chan)
+{
+	int t;
+
+	if (chan >= CHAT_MAXCHANNELS)
+		return;
+
+	thread_memlock_lock(&buflock);
+	for (t=0; t < MSGTYPES; t++) {
+		struct chanbuf *cb = &msgbuf[msg_buf(chan, t)];
+
+		while (cb->first != cb->next)
+			msg_drop(msg_buf(chan, t));
+		free(cb->ring);
+		cb->ring = NULL;
+		cb->mask = 0;
+		cb->first = cb->next;
+	}
+	msglog_flush(chan);
+	thread_memlock_unlock(&buflock);
 }
 
 /*
@@ -355,42 +983,60 @@ msgbuf_add(struct message *m)
 		return -1;
 	}
 
-	thread_memlock_lock(buflock);
+	if (!msgchan_valid(m)) {
+		andlog("Refusing to add message with invalid channel\n");
+		return -1;
+	}
+
+	thread_memlock_lock(&buflock);
 
 	/* Message exist, increase counter */
-	if ( (mb = msgbuf_get(&m->id)) != NULL) {
+	if ( (mb = msgbuf_get(m->channel, &m->id)) != NULL) {
 		mb->count = mb->count + 1;
 		count = mb->count;
 
-		thread_memlock_unlock(buflock);
-
-		andlog("msgbuf_add(): Message %08x%08x%02x%02x: seen %u times\n",
-			m->id.ip, m->id.sec, m->id.usec, m->id.sum, count);
-
 		/* If this is a message from us, we write it
-         * to connected clients when seen two times */
-		if ((count == 2) && (m->id.ip == myipv4))
+		 * to connected clients when seen two times.
+		 * It is stored again to get a new cursor, since
+		 * clients could not see it at the old one. */
+		if ((count == 2) && (m->id.ip == myipv4)) {
+			struct message ms;
+			struct timeval tv;
+
+			gettimeofday(&tv, NULL);
+			tv.tv_sec -= mb->sec;
+			tv.tv_usec -= mb->usec;
+			stats_record(STATS_ACK_USEC, (tv.tv_sec * 1000000) + tv.tv_usec);
+
+			memcpy(&ms, &mb->msg, sizeof(struct message));
+			msg_unhash(mb);
+			mb->count = 0;
+			msgbuf_append(&ms, count, NULL);
 			msgbuf_write_socklist(m, count);
+		}
+
+		thread_memlock_unlock(&buflock);
+
+		anddebug("msgbuf_add(): Message %08x%08x%02x%02x: seen %u times\n",
+			m->id.ip, m->id.sec, m->id.usec, m->id.sum, count);
 
 		return count;
 	}
 
 	/* Append message */
-	andlog("msgbuf_add(): Adding messsage %08x%08x%02x%02x\n", 
+	anddebug("msgbuf_add(): Adding messsage %08x%08x%02x%02x\n", 
 		m->id.ip, m->id.sec, m->id.usec, m->id.sum);
 
-	/* Create the new message */
-	if ( (mb = msg_create(m, 0)) == NULL) {
-		thread_memlock_unlock(buflock);
+	if (msgbuf_append(m, count, NULL) == NULL) {
+		thread_memlock_unlock(&buflock);
 		return -1;
 	}
 
-	/* Append it to the list */
-	msgbuf_append(mb);
-
+	/* Write the message to all connected clients */
+	msgbuf_write_socklist(m, count);
 
 	/* Unlock and return counter */
-	thread_memlock_unlock(buflock);
+	thread_memlock_unlock(&buflock);
 
 	{
 		struct chatmsg *cm = NULL;
@@ -402,12 +1048,12 @@ msgbuf_add(struct message *m)
 		switch (m->type) {
 
 			case CHAT_DISCOVER:
-				andlog("Discovery from %s\n", inet_ntoa(sad));
+				anddebug("Discovery from %s\n", inet_ntoa(sad));
 				break;
 
 			case CHAT_MSG:
 				cm = (struct chatmsg *)m;
-				andlog("Text from %s (%08x%08x%04x%04x): \"%s\"\n",
+				anddebug("Text from %s (%08x%08x%04x%04x): \"%s\"\n",
 					inet_ntoa(sad), cm->id.ip, cm->id.sec,
 					cm->id.usec, cm->id.sum, cm->txt.msg);
 				break;
@@ -415,14 +1061,52 @@ msgbuf_add(struct message *m)
 		}
 	}
 
-	/* Write the message to all connected clients */
-	msgbuf_write_socklist(m, count);
 	return count;
 }
 
 
 /*
- * Get the message if it exist in buffer.
+ * Store message m, first seen at tv and seen count times,
+ * from the message log. Clients are not written to, since
+ * the buffer is restored before any client can connect.
+ * If the message exist its count is raised to count.
+ * Returns 1 if the message was stored, 0 if it existed
+ * and -1 on error.
+ */
+int
+msgbuf_restore(struct message *m, struct timeval *tv, uint32_t count)
+{
+	struct msg *mb;
+	int ret = 1;
+
+	if (!msgchan_valid(m) || (msgtype_valid(m) == 0) || (count == 0))
+		return -1;
+
+	thread_memlock_lock(&buflock);
+	if ( (mb = msgbuf_get(m->channel, &m->id)) != NULL) {
+		if (mb->count < count)
+			mb->count = count;
+		ret = 0;
+	}
+	else if (msgbuf_append(m, count, tv) == NULL)
+		ret = -1;
+	thread_memlock_unlock(&buflock);
+	return ret;
+}
+
+
+/*
+ * Return the maximum number of messages in the buffer.
+ */
+uint32_t
+msgbuf_capacity(void)
+{
+	return maxmsgs;
+}
+
+
+/*
+ * Get the message if it exist in the buffer of channel.
  * Return a pointer on success, NULL if the
  * message does not exist.
  *
@@ -430,15 +1114,20 @@ msgbuf_add(struct message *m)
  * this function.
  */
 static struct msg *
-msgbuf_get(struct msgid *id)
+msgbuf_get(uint8_t chan, struct msgid *id)
 {
-	struct listent *ent;
-	struct msg m;
+	struct msg *mb;
+	uint32_t idx;
+
+	if (bloom_maybe(id) == 0)
+		return NULL;
 
-	memcpy(&m.msg.id, id, sizeof(struct msgid));
-	ent = linkedlist_exists(msgbuf, &m, msgcmp);
-	if (ent != NULL)
-		return (struct msg *)ent->data;	
+	for (idx = msghash[msg_hash(id)]; idx != 0; idx = mb->hnext) {
+		mb = &pool[idx - 1];
+		if ((mb->msg.channel == chan) && 
+				(memcmp(&mb->msg.id, id, sizeof(struct msgid)) == 0))
+			return mb;
+	}
 
 	return NULL;
 }
@@ -451,8 +1140,7 @@ msgbuf_get(struct msgid *id)
 int
 msgbuf_exist(struct message *m)
 {
-	struct listent *ent;
-	struct msg ms;
+	struct msg *mb;
 	int count = 0;
 
 	if (m == NULL) {
@@ -460,57 +1148,77 @@ msgbuf_exist(struct message *m)
 		return -1;
 	}
 
-	memcpy(&ms.msg, m, sizeof(struct message));
-	andlog("Checking if message %08x%08x%02x%02x exist.\n", 
+	if (!msgchan_valid(m))
+		return 0;
+
+	anddebug("Checking if message %08x%08x%02x%02x exist.\n", 
 		m->id.ip, m->id.sec, m->id.usec, m->id.sum);
 
-	thread_memlock_lock(buflock);
-	ent = linkedlist_exists(msgbuf, &ms, msgcmp);
-	if (ent != NULL) {
-		struct msg *md;
+	/* Most new messages are ruled out without the lock */
+	if (bloom_maybe(&m->id) == 0)
+		return 0;
 
-		md = (struct msg *)ent->data;
-		count = md->count;
-	}
-
-	thread_memlock_unlock(buflock);
+	thread_memlock_lock(&buflock);
+	if ( (mb = msgbuf_get(m->channel, &m->id)) != NULL)
+		count = mb->count;
+	thread_memlock_unlock(&buflock);
 	return count;
 }
 
 /*
- * Delete a specific message from the list.
+ * Delete a specific message from the buffer.
+ * The slot is kept in the ring, but the message
+ * is no longer found or returned by queries.
  * Return 1 if message was found and deleted,
  * 0 otherwise.
  */
 int
 msgbuf_delete(struct message *m)
 {
-    struct listent *ent;
-    struct msg ms;
-    int ret = 0;
+	struct msg *mb;
+	int ret = 0;
 
-    if (m == NULL) {
-        anderrs("msgbuf_exist() Received NULL pointer!");
-        return -1;
-    }
+	if (m == NULL) {
+		anderrs("msgbuf_delete() Received NULL pointer!");
+		return -1;
+	}
 
-    memcpy(&ms.msg, m, sizeof(struct message));
+	if (!msgchan_valid(m))
+		return 0;
 
-    thread_memlock_lock(buflock);
+	thread_memlock_lock(&buflock);
 
-    ent = linkedlist_exists(msgbuf, &ms, msgcmp);
-    if (ent != NULL) {
-	    andlog("Deleting message %08x%08x%02x%02x\n",
-    	    m->id.ip, m->id.sec, m->id.usec, m->id.sum);
-		free(ent->data);
-		msgbuf = linkedlist_unlink(msgbuf, ent);	
-     	ret = 1;
-    }
+	if ( (mb = msgbuf_get(m->channel, &m->id)) != NULL) {
+		anddebug("Deleting message %08x%08x%02x%02x\n",
+			m->id.ip, m->id.sec, m->id.usec, m->id.sum);
+		msg_unhash(mb);
+		mb->count = 0;
+		msglog_delete(m);
+		ret = 1;
+	}
 
-    thread_memlock_unlock(buflock);
-    return ret;
+	thread_memlock_unlock(&buflock);
+	return ret;
 }
 
+/*
+ * Checksum of message in network byte order.
+ * The key epoch and IV are set when the message is encrypted,
+ * after the checksum, and are not covered by it.
+ */
+static uint16_t
+msg_chksum(struct message *m)
+{
+	struct message c;
+
+	memcpy(&c, m, sizeof(struct message));
+	c.epoch = 0;
+	c.id.sum = 0;
+	memset(c.iv, 0x00, sizeof(c.iv));
+	return htons(chksum((uint16_t *)&c, (sizeof(struct message) >> 1)));
+}
+
+
 /*
  * Compute and set the message identifier.
  */
@@ -525,65 +1233,313 @@ msgbuf_setid(struct message *m)
     gettimeofday(&tv, NULL);
     m->id.sec = htonl(tv.tv_sec);
     m->id.usec = htons((uint16_t)(tv.tv_usec & 0xffff));
-	m->id.sum = 0;
 
     /* Add checksum */
-    m->id.sum = chksum((uint16_t *)m, (sizeof(struct message) >> 1));
-    m->id.sum = htons(m->id.sum);
+    msgbuf_setsum(m);
 }
 
 
 /*
- * Write messages in buffer to file
- * descriptor. Returns the number of 
- * written messages on success, -1 on error.
+ * Set the checksum of a message with the identifier
+ * and the rest of the cleartext already filled in.
+ */
+void
+msgbuf_setsum(struct message *m)
+{
+	m->id.sum = msg_chksum(m);
+}
+
+
+/*
+ * Verify the checksum of a decrypted message. The cleartext
+ * header is chained into the encryption of the message, so a
+ * header changed in transit decrypts to a body that fail this.
+ * Return 1 if the checksum is valid, 0 otherwise.
  */
 int
-msgbuf_dump(int fd, int encrypt)
+msgbuf_verify(struct message *m)
 {
-	int ret = 0;
-	struct listent *ent;
+	return (msg_chksum(m) == m->id.sum);
+}
+
+
+/*
+ * Find the first message in the buffer of channel stored
+ * after cursor and first seen at or after since (seconds).
+ * Return the number of the message, or the number of
+ * the next message if there is none.
+ * Buffer must be locked when calling this function.
+ */
+static uint32_t
+msgbuf_search(struct chanbuf *cb, uint32_t cursor, uint32_t since)
+{
+	uint32_t lo = cb->first;
+	uint32_t hi = cb->next;
+
+	while (lo != hi) {
+		uint32_t mid = lo + ((hi - lo) >> 1);
+		struct msg *mb = msg_slot(cb, mid);
+
+		if (((mb->seq - cursor - 1) < (lastseq - cursor)) &&
+				(mb->sec >= since))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
 
-	andlog("[+] Attempting to dump all messages to descriptor %d\n", fd);
-	thread_memlock_lock(buflock);
+/*
+ * Sort messages on sequence number.
+ */
+static int
+msgseqcmp(const void *a, const void *b)
+{
+	const struct msg *m1 = *(const struct msg **)a;
+	const struct msg *m2 = *(const struct msg **)b;
+
+	return (int32_t)(m1->seq - m2->seq);
+}
+
+
+/*
+ * Copy the messages matching query and filter (NULL for
+ * none) out of the buffer, in the
+ * order they were stored, to an allocated array in out.
+ * The cursor to resume from is returned in cursor.
+ * If live is non zero, the socket in live is registered
+ * for new messages, before any new message is stored.
+ * Return the number of messages on success, -1 on error.
+ */
+static int
+msgbuf_select(struct chatquery *q, struct chatfilter *f,
+	struct message **out, uint32_t *cursor, int live)
+{
+	struct msg **sel = NULL;
+	uint32_t start[MSGBUFS];
+	uint32_t end[MSGBUFS];
+	struct timeval tv;
+	uint32_t from;
+	size_t max = 0;
+	size_t num = 0;
+	size_t n = 0;
+	size_t i;
+	int b;
+
+	*out = NULL;
+	gettimeofday(&tv, NULL);
+	thread_memlock_lock(&buflock);
+	msgbuf_expire(tv.tv_sec);
+	*cursor = lastseq;
+
+	/* A cursor from before the chat process was restarted */
+	from = q->cursor;
+	if ((from - 1) >= lastseq)
+		from = 0;
+
+	/* The slice of each ring, skipping the types not in the filter */
+	for (b=0; b < MSGBUFS; b++) {
+		struct chanbuf *cb = &msgbuf[b];
+
+		start[b] = end[b] = cb->next;
+		if (((q->channels & (1 << (b / MSGTYPES))) == 0) || (cb->ring == NULL))
+			continue;
+		if ((f != NULL) && (f->types != 0) && 
+				((f->types & (1 << (b % MSGTYPES))) == 0))
+			continue;
+
+		start[b] = msgbuf_search(cb, from, q->since);
+		if (q->until != 0)
+			end[b] = msgbuf_search(cb, 0, q->until);
+		if (msg_before(cb, end[b], start[b]))
+			end[b] = start[b];
+
+		n = end[b] - start[b];
+		if ((q->max != 0) && (n > q->max))
+			n = q->max;
+		max += n;
+	}
 
-	andlog("[**] msgbuf_dump(): Got lock!, dumping %u messages\n",
-		linkedlist_elements(msgbuf));
+	if (max == 0)
+		goto done;
 
-	ent = msgbuf->head;
-	while (ent != NULL) {
-		struct message mc;
-		struct msg *m = (struct msg *)ent->data;
+	if ( (sel = malloc(max * sizeof(struct msg *))) == NULL) {
+		thread_memlock_unlock(&buflock);
+		anderrs("Failed to allocate memory");
+		return -1;
+	}
 
-		/* Require local messages to be acknowledged, 
-		 * as in seen twice */
-		if (m->msg.id.ip == myipv4) {
-			if (m->count <= 1) {
-				ent = ent->next;
+	/* Select the newest matching messages of each ring,
+	 * following the sender chain if there is a sender. If
+	 * the sender index was full when messages were stored
+	 * in the ring, it is scanned for the sender instead */
+	for (b=0; b < MSGBUFS; b++) {
+		struct chanbuf *cb = &msgbuf[b];
+		struct msgsender *s = NULL;
+		uint32_t cnt = 0;
+		uint32_t m;
+
+		if (start[b] == end[b])
+			continue;
+
+		if ((q->sender != 0) && (cb->partial == 0)) {
+			if ( (s = msg_sender(q->sender, b, 0)) == NULL)
 				continue;
+			m = s->newest;
+		}
+		else
+			m = end[b];
+
+		while ((q->max == 0) || (cnt < q->max)) {
+			struct msg *mb;
+
+			if (s != NULL) {
+				uint32_t k;
+
+				if ((m == 0) || !msg_valid(cb, m - 1))
+					break;
+				k = m - 1;
+				mb = msg_slot(cb, k);
+				m = mb->prev;
+				if (msg_before(cb, k, start[b]))
+					break;
+				if (!msg_before(cb, k, end[b]))
+					continue;
+			}
+			else {
+				if (m == start[b])
+					break;
+				mb = msg_slot(cb, --m);
+				if ((q->sender != 0) && (mb->msg.id.ip != q->sender))
+					continue;
 			}
+
+			if (mb->count == 0)
+				continue;
+
+			/* Require local messages to be acknowledged, 
+			 * as in seen twice */
+			if ((mb->msg.id.ip == myipv4) && (mb->count <= 1))
+				continue;
+
+			if (filter_match(f, &mb->msg) == 0)
+				continue;
+
+			sel[num++] = mb;
+			cnt++;
 		}
+	}
+
+	if (num == 0)
+		goto done;
+
+	/* Keep the newest max messages of all rings */
+	qsort(sel, num, sizeof(struct msg *), msgseqcmp);
+	i = 0;
+	if ((q->max != 0) && (num > q->max))
+		i = num - q->max;
+
+	if ( (*out = malloc((num - i) * sizeof(struct message))) == NULL) {
+		thread_memlock_unlock(&buflock);
+		free(sel);
+		anderrs("Failed to allocate memory");
+		return -1;
+	}
+
+	for (n=0; i < num; i++, n++)
+		memcpy(&(*out)[n], &sel[i]->msg, sizeof(struct message));
+	num = n;
 
-		/* Copy and encrypt message */
-		memcpy(&mc, &m->msg, sizeof(struct message));
-		if (encrypt)
-			chat_crypto_encrypt(&mc);		
+	done:
+	if ((live >= 0) && (client_add(live, q->channels & CHAT_CHAN_ALL, f, 1) < 0)) {
+		thread_memlock_unlock(&buflock);
+		free(sel);
+		free(*out);
+		*out = NULL;
+		return -1;
+	}
+	thread_memlock_unlock(&buflock);
+	free(sel);
+	return num;
+}
 
-		/* Send message to client */
-		if (writen(fd, &mc, sizeof(struct message)) != 
+
+/*
+ * Write the messages matching query and filter (NULL
+ * for none) to file descriptor.
+ * Fields of the query are in host byte order. A reply
+ * header with the number of messages and the cursor to
+ * resume from is written first if CHAT_SUB_QUERY is set
+ * in the channels of the query. If live is non zero, the
+ * descriptor is registered for new messages matching the
+ * filter once the matching messages are written.
+ * The messages are copied out of the buffer first so that
+ * a slow reader does not hold the buffer lock.
+ * Returns the number of written messages on success,
+ * -1 on error.
+ */
+int
+msgbuf_query(int fd, int encrypt, struct chatquery *q,
+	struct chatfilter *f, int live)
+{
+	struct chatqueryres res;
+	struct message *out;
+	uint32_t cursor;
+	int num;
+	int ret = 0;
+	int i;
+
+	anddebug("[+] Query for messages after cursor %u to descriptor %d\n", 
+		q->cursor, fd);
+
+	if ( (num = msgbuf_select(q, f, &out, &cursor, live ? fd : -1)) < 0)
+		return -1;
+
+	/* Encrypt messages, dropping the ones we no longer have a key for */
+	if (encrypt) {
+		for (i=0; i < num; i++) {
+			if (chat_crypto_encrypt(&out[i]) < 0)
+				continue;
+			if (ret != i)
+				memcpy(&out[ret], &out[i], sizeof(struct message));
+			ret++;
+		}
+		num = ret;
+	}
+
+	anddebug("[**] msgbuf_query(): Writing %d messages\n", num);
+
+	ret = 0;
+	if (q->channels & CHAT_SUB_QUERY) {
+		res.count = htonl(num);
+		res.cursor = htonl(cursor);
+		if (writen(fd, &res, sizeof(res)) != sizeof(res)) {
+			anderrs("Failed to write query result to file descriptor");
+			ret = -1;
+		}
+	}
+
+	for (i=0; (ret >= 0) && (i < num); i++) {
+		if (writen(fd, &out[i], sizeof(struct message)) != 
 				sizeof(struct message)) {
 			anderrs("Failed to write message to file descriptor");
+			ret = -1;
 			break;
 		}
-
-		ent = ent->next;
 		ret++;
 	}
+	free(out);
 
-	thread_memlock_unlock(buflock);
-	andlog("[**] msgbuf_dump(): Released lock!\n");
+	if (live) {
+		if (ret < 0) {
+			client_del(fd);
+			return -1;
+		}
+		if (client_resume(fd) < 0)
+			return -1;
+	}
 	return ret;
-
 }
 
 /*
@@ -609,6 +1565,10 @@ msgbuf_print(struct message *msg)
 	if (msg->type == CHAT_MSG) {
 		struct chatmsg *cm;
 		cm = (struct chatmsg *)msg;
-		printf("[%s %s] %s\n", inet_ntoa(sad), tbuf, cm->txt.msg);
+		if (cm->channel != CHAT_CHAN_DEFAULT)
+			printf("[#%u %s %s] %s\n", cm->channel, inet_ntoa(sad), 
+				tbuf, cm->txt.msg);
+		else
+			printf("[%s %s] %s\n", inet_ntoa(sad), tbuf, cm->txt.msg);
 	}
 }
@@ -0,0 +1,416 @@
+/*
+ *    File: msglog.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Persistent message log.
+ *
+ * When the daemon is started with a log directory, every message
+ * stored in the message buffer, and every delete and flush, is
+ * appended as a fixed size record to a segment file mapped from
+ * the directory. A segment holds MSGLOG_RECORDS records, and
+ * segments are numbered in the order they were written. When a
+ * segment is full the next one is started, and the oldest segments
+ * are removed once the newer ones hold more messages than the
+ * buffer can. As with the trace, nothing is written per record, so
+ * a killed chat process lose nothing, while a power loss may lose
+ * the pages not yet written back by the kernel.
+ *
+ * When the chat process starts, the segments are mapped read only
+ * and replayed into the message buffer, which rebuilds its index,
+ * so only the messages first seen by other nodes since the newest
+ * restored one need to be synchronized from them.
+ *
+ * Messages are stored in clear text, as in the buffer, since the
+ * keys are not known until the configuration daemon send them and
+ * messages of older key epochs could not be decrypted anyway. The
+ * log is therefore only written when a directory is given, and the
+ * directory must not be accessible by other users.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+
+#include "ibsschat.h"
+
+/* Local routines */
+static void msglog_path(char *, size_t, uint32_t);
+static struct msglog_hdr *msglog_map(uint32_t, int);
+static int msglog_replay(struct msglog_hdr *);
+static int msglog_next(void);
+static void msglog_write(uint8_t, uint8_t, struct message *,
+	struct timeval *, uint32_t);
+
+/* Local variables */
+static char *logdir = NULL;
+static struct msglog_hdr *seg = NULL;	/* Segment written to */
+static uint32_t first;					/* Number of oldest segment */
+static uint32_t last;					/* Number of newest segment */
+static uint32_t keep;					/* Messages to keep */
+static uint32_t restored;				/* Messages restored on open */
+static uint32_t newest;					/* Newest restored message (seconds) */
+
+
+/*
+ * Set the log directory, to be opened by msglog_open().
+ * Called before the chat process is forked.
+ */
+void
+msglog_config(const char *dir)
+{
+	free(logdir);
+	logdir = (dir != NULL) ? strdup(dir) : NULL;
+}
+
+
+/*
+ * Path of segment number n.
+ */
+static void
+msglog_path(char *path, size_t len, uint32_t n)
+{
+	snprintf(path, len, "%s/%08u.log", logdir, n);
+}
+
+
+/*
+ * Map segment number n, read only unless write is non zero,
+ * in which case it is created if it does not exist.
+ * Return a pointer to the segment on success, NULL on error.
+ */
+static struct msglog_hdr *
+msglog_map(uint32_t n, int write)
+{
+	struct msglog_hdr *hdr;
+	char path[1024];
+	struct stat sb;
+	int fd;
+
+	msglog_path(path, sizeof(path), n);
+	if ( (fd = open(path, write ? (O_RDWR | O_CREAT) : O_RDONLY, 0600)) < 0) {
+		anderrs("Failed to open message log segment");
+		return NULL;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		anderrs("Failed to stat message log segment");
+		close(fd);
+		return NULL;
+	}
+
+	if (sb.st_size != MSGLOG_SIZE) {
+		if ((write == 0) || (sb.st_size != 0)) {
+			anderr("** Error: Message log segment %s has wrong size\n", path);
+			close(fd);
+			return NULL;
+		}
+
+		if (ftruncate(fd, MSGLOG_SIZE) < 0) {
+			anderrs("Failed to set size of message log segment");
+			close(fd);
+			return NULL;
+		}
+	}
+
+	hdr = mmap(NULL, MSGLOG_SIZE, write ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		anderrs("Failed to map message log segment");
+		return NULL;
+	}
+
+	/* A new segment */
+	if (write && (sb.st_size == 0)) {
+		hdr->magic = MSGLOG_MAGIC;
+		hdr->version = MSGLOG_VERSION;
+		hdr->records = MSGLOG_RECORDS;
+		hdr->recsize = sizeof(struct msglog_rec);
+		hdr->number = n;
+		hdr->count = 0;
+		return hdr;
+	}
+
+	if ((hdr->magic != MSGLOG_MAGIC) || (hdr->version != MSGLOG_VERSION) ||
+			(hdr->records != MSGLOG_RECORDS) || (hdr->number != n) ||
+			(hdr->recsize != sizeof(struct msglog_rec)) ||
+			(hdr->count > MSGLOG_RECORDS)) {
+		anderr("** Error: Message log segment %s is not valid\n", path);
+		munmap(hdr, MSGLOG_SIZE);
+		return NULL;
+	}
+
+	return hdr;
+}
+
+
+/*
+ * Replay the records of segment into the message buffer.
+ * Return the number of messages restored.
+ */
+static int
+msglog_replay(struct msglog_hdr *hdr)
+{
+	struct msglog_rec *rec = (struct msglog_rec *)(hdr + 1);
+	struct timeval tv;
+	int count = 0;
+	uint32_t i;
+
+	for (i=0; i < hdr->count; i++, rec++) {
+		struct message m;
+
+		memcpy(&m, &rec->msg, sizeof(struct message));
+
+		switch (rec->op) {
+			case MSGLOG_ADD:
+				tv.tv_sec = rec->sec;
+				tv.tv_usec = rec->usec;
+				if (msgbuf_restore(&m, &tv, rec->count) > 0)
+					count++;
+				if (rec->sec > newest)
+					newest = rec->sec;
+				break;
+
+			case MSGLOG_DELETE:
+				msgbuf_delete(&m);
+				break;
+
+			case MSGLOG_FLUSH:
+				msgbuf_flush(m.channel);
+				break;
+		}
+	}
+
+	return count;
+}
+
+
+/*
+ * Start the next segment, and remove the oldest ones
+ * that are no longer needed to fill the buffer.
+ * Return 0 on success, -1 on error.
+ */
+static int
+msglog_next(void)
+{
+	char path[1024];
+
+	if (seg != NULL) {
+		munmap(seg, MSGLOG_SIZE);
+		last++;
+	}
+
+	if ( (seg = msglog_map(last, 1)) == NULL)
+		return -1;
+
+	while ((last != first) &&
+			(((uint64_t)(last - first - 1) * MSGLOG_RECORDS) >= keep)) {
+		msglog_path(path, sizeof(path), first);
+		if ((unlink(path) < 0) && (errno != ENOENT))
+			anderrs("Failed to remove message log segment");
+		first++;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Open the log directory, if one is configured, replay its
+ * segments into the message buffer and continue the log
+ * after the last record. The message buffer must be
+ * initialized before calling this function.
+ * Return 0 on success, -1 on error.
+ */
+int
+msglog_open(void)
+{
+	struct timespec start;
+	struct timespec end;
+	struct dirent *de;
+	struct stat sb;
+	uint32_t segs = 0;
+	uint32_t n;
+	DIR *dp;
+
+	if (logdir == NULL)
+		return 0;
+
+	if ((mkdir(logdir, 0700) < 0) && (errno != EEXIST)) {
+		anderrs("Failed to create message log directory");
+		return -1;
+	}
+
+	/* The messages are stored in clear text */
+	if (stat(logdir, &sb) < 0) {
+		anderrs("Failed to stat message log directory");
+		return -1;
+	}
+
+	if (sb.st_mode & (S_IRWXG | S_IRWXO)) {
+		anderr("** Error: Message log directory %s is accessible by "
+			"other users, not logging messages\n", logdir);
+		return -1;
+	}
+
+	if ( (dp = opendir(logdir)) == NULL) {
+		anderrs("Failed to open message log directory");
+		return -1;
+	}
+
+	/* Segments are numbered from zero without gaps,
+	 * except for the ones removed at the start */
+	first = 0xffffffff;
+	last = 0;
+	while ( (de = readdir(dp)) != NULL) {
+		int len = 0;
+
+		if ((sscanf(de->d_name, "%8u.log%n", &n, &len) != 1) || (len != 12) ||
+				(de->d_name[len] != '\0'))
+			continue;
+
+		if (n < first)
+			first = n;
+		if (n > last)
+			last = n;
+		segs++;
+	}
+	closedir(dp);
+
+	keep = msgbuf_capacity();
+	restored = 0;
+	newest = 0;
+
+	if (segs == 0) {
+		first = 0;
+		andlog("Logging messages to %s\n", logdir);
+		return msglog_next();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = first; n - first <= last - first; n++) {
+		struct msglog_hdr *hdr;
+
+		if ( (hdr = msglog_map(n, 0)) == NULL)
+			continue;
+
+		restored += msglog_replay(hdr);
+		munmap(hdr, MSGLOG_SIZE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	andlog("[+] Restored %u messages from %u segments in %s in %lu ms\n",
+		restored, last - first + 1, logdir,
+		(unsigned long)(((end.tv_sec - start.tv_sec) * 1000) +
+		((end.tv_nsec - start.tv_nsec) / 1000000)));
+
+	/* Continue the last segment, or start a new one if it is
+	 * full or broken */
+	if ( (seg = msglog_map(last, 1)) != NULL) {
+		if (seg->count < MSGLOG_RECORDS)
+			return 0;
+	}
+	else
+		last++;
+
+	return msglog_next();
+}
+
+
+/*
+ * Return the time, in seconds, from which messages should be
+ * synchronized from other nodes after msglog_open(), or zero
+ * if no messages were restored and all should be.
+ */
+uint32_t
+msglog_since(void)
+{
+	if ((restored == 0) || (newest <= MSGLOG_SYNC_SLACK))
+		return 0;
+	return newest - MSGLOG_SYNC_SLACK;
+}
+
+
+/*
+ * Append a record to the log.
+ * Buffer must be locked when calling this function,
+ * which serialize the writers.
+ */
+static void
+msglog_write(uint8_t op, uint8_t chan, struct message *m,
+	struct timeval *tv, uint32_t count)
+{
+	struct msglog_rec *rec;
+
+	if (seg == NULL)
+		return;
+
+	rec = &((struct msglog_rec *)(seg + 1))[seg->count];
+	memset(rec, 0x00, sizeof(struct msglog_rec));
+	rec->op = op;
+	rec->count = count;
+	if (tv != NULL) {
+		rec->sec = tv->tv_sec;
+		rec->usec = tv->tv_usec;
+	}
+	if (m != NULL)
+		memcpy(&rec->msg, m, sizeof(struct message));
+	rec->msg.channel = chan;
+
+	/* The record is written before it is counted */
+	__sync_synchronize();
+	seg->count++;
+
+	if ((seg->count == MSGLOG_RECORDS) && (msglog_next() < 0)) {
+		anderr("** Error: Message log stopped\n");
+		seg = NULL;
+	}
+}
+
+
+/*
+ * Log message m first seen at tv and seen count times,
+ * as stored in the buffer.
+ * Buffer must be locked when calling this function.
+ */
+void
+msglog_add(struct message *m, struct timeval *tv, uint32_t count)
+{
+	msglog_write(MSGLOG_ADD, m->channel, m, tv, count);
+}
+
+
+/*
+ * Log that message m was deleted from the buffer.
+ * Buffer must be locked when calling this function.
+ */
+void
+msglog_delete(struct message *m)
+{
+	msglog_write(MSGLOG_DELETE, m->channel, m, NULL, 0);
+}
+
+
+/*
+ * Log that the buffer of channel was flushed.
+ * Buffer must be locked when calling this function.
+ */
+void
+msglog_flush(uint8_t chan)
+{
+	msglog_write(MSGLOG_FLUSH, chan, NULL, NULL, 0);
+}
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
@@ -69,20 +70,46 @@ chksum(uint16_t *addr, int len)
 
 
 /*
- * Create a listening UNIX socket.
+ * Set up UNIX socket address for file in dir, or for
+ * the name file in the abstract namespace if dir is NULL.
+ * Returns the length of the address.
+ */
+static socklen_t
+unix_socket_addr(struct sockaddr_un *un, const char *dir, const char *file)
+{
+    memset(un, 0x00, sizeof(struct sockaddr_un));
+    un->sun_family = AF_LOCAL;
+
+    if (dir != NULL) {
+        snprintf(un->sun_path, sizeof(un->sun_path),
+            "%s/%s", dir, file);
+        return sizeof(struct sockaddr_un);
+    }
+
+    snprintf(&un->sun_path[1], sizeof(un->sun_path) - 1, "%s", file);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + 
+        strlen(&un->sun_path[1]);
+}
+
+
+/*
+ * Create a listening UNIX socket of type (SOCK_STREAM,
+ * SOCK_SEQPACKET) for file in dir, or in the abstract
+ * namespace if dir is NULL.
  * Returns a socket descriptor on success, -1 on error.
  */
 int
-unix_socket_listen(const char *dir, const char *file)
+unix_socket_listen(const char *dir, const char *file, int type)
 {
     struct sockaddr_un un;
+    socklen_t len;
     int sd;
 
     sd = -1;
 
     /* Create the socket */
     andlog("Creating UNIX socket\n");
-    if ( (sd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0) {
+    if ( (sd = socket(AF_LOCAL, type, 0)) < 0) {
         anderrs("Failed to create socket");
         goto err;
     }
@@ -94,30 +121,32 @@ unix_socket_listen(const char *dir, const char *file)
     }
 
     /* Set up the socket path */
-    memset(&un, 0x00, sizeof(struct sockaddr_un));
-    un.sun_family = AF_LOCAL;
-    snprintf(un.sun_path, sizeof(un.sun_path),
-        "%s/%s", dir, file);
+    len = unix_socket_addr(&un, dir, file);
 
+    if (dir != NULL) {
 
-    /* Remove any old socket */
-    unlink(un.sun_path);
-    unlink(dir);
+        /* Remove any old socket */
+        unlink(un.sun_path);
+        unlink(dir);
 
-    /* Create the directory, assumes that the 
-     * directory structure already exist */
-    mkdir(dir, 0755);
+        /* Create the directory, assumes that the 
+         * directory structure already exist */
+        mkdir(dir, 0755);
+    }
 
     /* Bind path to socket */
-    andlog("Bind socket to %s\n", un.sun_path);
-    if (bind(sd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+    andlog("Bind socket to %s%s\n", dir ? "" : "@", 
+        dir ? un.sun_path : &un.sun_path[1]);
+    if (bind(sd, (struct sockaddr *)&un, len) < 0) {
         anderrs("Failed to bind socket");
         goto err;
     }
 
     /* Set permissions */
-    chmod(dir, 0755);
-    chmod(un.sun_path, 0666);
+    if (dir != NULL) {
+        chmod(dir, 0755);
+        chmod(un.sun_path, 0666);
+    }
 
     /* Start listening on the socket with a queue of 5 clients */
     if (listen(sd, 5) < 0) {
@@ -135,27 +164,26 @@ unix_socket_listen(const char *dir, const char *file)
 
 
 /*
- * Connect to UNIX socket.
+ * Connect to UNIX socket of type, sockname is in the
+ * abstract namespace if dir is NULL.
  * Returns file descriptor on success, -1 on error.
  */
 int
-unix_socket_connect(const char *dir, const char *sockname)
+unix_socket_connect(const char *dir, const char *sockname, int type)
 {
     struct sockaddr_un un;
+    socklen_t len;
     int sfd = -1;
 
     /* Create socket */
-    if ( (sfd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0) {
+    if ( (sfd = socket(AF_LOCAL, type, 0)) < 0) {
         fprintf(stderr, "** Error: Failed to create socket: %s\n",
             strerror(errno));
         goto err;
     }
 
     /* Set up address, path to the socket */
-    memset(&un, 0x00, sizeof(un));
-    un.sun_family = AF_LOCAL;
-    snprintf(un.sun_path, sizeof(un.sun_path),
-        "%s/%s", dir, sockname);
+    len = unix_socket_addr(&un, dir, sockname);
 
     /* Set close on exec */ 
     if (fcntl(sfd, F_SETFD, FD_CLOEXEC)) {
@@ -164,9 +192,10 @@ unix_socket_connect(const char *dir, const char *sockname)
     }
 
     /* Connect */
-    if (connect(sfd, (struct sockaddr *)&un, sizeof(un)) != 0) {
-        fprintf(stderr, "** Error: Failed to connect to %s: %s\n",
-            un.sun_path, strerror(errno));
+    if (connect(sfd, (struct sockaddr *)&un, len) != 0) {
+        fprintf(stderr, "** Error: Failed to connect to %s%s: %s\n",
+            dir ? "" : "@", dir ? un.sun_path : &un.sun_path[1], 
+            strerror(errno));
         fprintf(stderr, "** Error: is daemon started? (ibsschat --daemon)\n");
         goto err;
     }
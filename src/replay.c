@@ -0,0 +1,216 @@
+/*
+ *    File: replay.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Replay protection.
+ *
+ * For each known sender we keep the newest message ID seen,
+ * as the sender time in seconds followed by the part of the
+ * micro seconds carried in the ID. Message IDs are created from
+ * the clock of the sender, so they form a sequence per sender,
+ * and any message more than REPLAY_WINDOW seconds older than the
+ * newest message from the same sender, and than our own clock,
+ * is dropped before it is decrypted. Messages inside the window
+ * are duplicates that the message buffer keep track of.
+ *
+ * The window is only moved by messages that have been decrypted
+ * and passed the checksum, which cover the cleartext header, and
+ * never further than REPLAY_FUTURE seconds ahead of our own clock,
+ * so a forged ID can not silence a sender. A sender that has not
+ * moved its window for REPLAY_STALE seconds, for example since it
+ * stepped its clock back, is removed from the table. Messages from
+ * senders that are not in the table, for example since they were
+ * removed or the table was full, are dropped if they are more than
+ * REPLAY_WINDOW seconds older than our own clock.
+ *
+ * The table is only used by the multicast reader thread and
+ * is therefore not locked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ibsschat.h"
+
+/* Number of senders in table, must be a power of two */
+#define REPLAY_MAXSENDERS	1024
+
+/* A known sender, sixteen bytes */
+struct sender {
+	uint32_t ip;		/* Sender IPv4 address, zero for free slot */
+	uint32_t seen;		/* Local time the window was last moved */
+	uint64_t newest;	/* Newest message ID seen, see replay_stamp() */
+};
+
+/* Local routines */
+static uint64_t replay_stamp(struct msgid *);
+static struct sender *replay_find(uint32_t, int);
+static void replay_sweep(time_t);
+
+/* Local variables */
+static struct sender senders[REPLAY_MAXSENDERS];
+static uint32_t nsenders = 0;
+static time_t swept = 0;
+
+
+/*
+ * Reset the replay window of all senders.
+ */
+void
+replay_init(void)
+{
+	memset(senders, 0x00, sizeof(senders));
+	nsenders = 0;
+	swept = time(NULL);
+}
+
+
+/*
+ * The position of message ID in the sequence of its sender,
+ * sender seconds in the upper bits, followed by the part of
+ * the micro seconds.
+ */
+static uint64_t
+replay_stamp(struct msgid *id)
+{
+	return ((uint64_t)ntohl(id->sec) << 16) | ntohs(id->usec);
+}
+
+
+/*
+ * Find sender in table, add it if create is non zero.
+ * Return a pointer to the sender on success, NULL if
+ * not found or if the table is full.
+ */
+static struct sender *
+replay_find(uint32_t ip, int create)
+{
+	uint32_t i;
+	uint32_t n;
+
+	i = (ip * 2654435761U) & (REPLAY_MAXSENDERS - 1);
+	for (n=0; n < REPLAY_MAXSENDERS; n++) {
+		struct sender *s = &senders[(i + n) & (REPLAY_MAXSENDERS - 1)];
+
+		if (s->ip == ip)
+			return s;
+
+		if (s->ip == 0) {
+			if (create == 0)
+				return NULL;
+
+			/* Keep a few free slots to bound probing */
+			if (nsenders >= (REPLAY_MAXSENDERS - (REPLAY_MAXSENDERS >> 3))) {
+				andlog("** Error: Replay table full\n");
+				return NULL;
+			}
+
+			s->ip = ip;
+			s->seen = 0;
+			s->newest = 0;
+			nsenders++;
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Remove the senders that have not moved their window
+ * for REPLAY_STALE seconds, by inserting the others into
+ * an empty table.
+ */
+static void
+replay_sweep(time_t now)
+{
+	static struct sender old[REPLAY_MAXSENDERS];
+	uint32_t n;
+
+	memcpy(old, senders, sizeof(senders));
+	memset(senders, 0x00, sizeof(senders));
+	nsenders = 0;
+
+	for (n=0; n < REPLAY_MAXSENDERS; n++) {
+		struct sender *s;
+
+		if ((old[n].ip == 0) || ((old[n].seen + REPLAY_STALE) < now))
+			continue;
+
+		if ( (s = replay_find(old[n].ip, 1)) != NULL)
+			*s = old[n];
+	}
+}
+
+
+/*
+ * Check if message ID is outside of the replay
+ * window of the sender.
+ * Return 1 if the message is a replay and should be
+ * dropped, 0 otherwise.
+ */
+int
+replay_check(struct msgid *id)
+{
+	struct sender *s;
+
+	/* Recent by our own clock, the sender may have
+	 * stepped its clock back */
+	if (((uint64_t)ntohl(id->sec) + REPLAY_WINDOW) >= (uint64_t)time(NULL))
+		return 0;
+
+	/* Old by our own clock and no window to compare with,
+	 * the sender may have been swept or evicted */
+	if ( (s = replay_find(id->ip, 0)) == NULL)
+		return 1;
+
+	if ((replay_stamp(id) + ((uint64_t)REPLAY_WINDOW << 16)) < s->newest)
+		return 1;
+
+	return 0;
+}
+
+
+/*
+ * Move the replay window of the sender forward.
+ * Should be called once the message have been
+ * decrypted and its checksum found to be valid.
+ */
+void
+replay_update(struct msgid *id)
+{
+	struct sender *s;
+	uint64_t stamp;
+	uint64_t limit;
+	time_t now;
+
+	now = time(NULL);
+	if (now >= (swept + REPLAY_WINDOW)) {
+		replay_sweep(now);
+		swept = now;
+	}
+
+	if ( (s = replay_find(id->ip, 1)) == NULL)
+		return;
+
+	/* Never move the window further ahead of our own clock
+	 * than a sender with a fast clock is allowed to be */
+	stamp = replay_stamp(id);
+	limit = (uint64_t)(now + REPLAY_FUTURE) << 16;
+	if (stamp > limit)
+		stamp = limit;
+
+	if (stamp > s->newest)
+		s->newest = stamp;
+	s->seen = now;
+}
@@ -0,0 +1,498 @@
+/*
+ *    File: ring.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Shared memory ring of new messages for local clients.
+ *
+ * The chat process publish every new message into a ring in a
+ * memfd that local clients map read-only, so any number of
+ * readers on the device can follow the traffic without a copy
+ * or a system call per message. The descriptor is handed out
+ * over an abstract UNIX socket (RING_SOCKNAME).
+ *
+ * The ring has a single writer. Each slot carry the sequence
+ * number of the message in it (plus one), which is cleared before
+ * the slot is overwritten and set again when the message is in
+ * place, so a reader can tell if the writer lapped it while copying.
+ * Readers that have caught up sleep on a futex on the sequence
+ * number in the header. They count themselves in a separate
+ * doorbell memfd that clients map writable, and the writer only
+ * makes the wake up system call when someone is counted there.
+ * A client that corrupt the count can at worst make the others
+ * fall back to checking the ring every RING_WAIT_SEC seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ibsschat.h"
+
+#define RING_MAGIC		0x49425352	/* "IBSR" */
+#define RING_VERSION	2
+
+/* Number of messages in ring, must be a power of two */
+#define RING_SLOTS		1024
+
+/* Seconds between checks that the writer is alive */
+#define RING_WAIT_SEC	5
+
+/* Name of the abstract UNIX socket handing out the ring */
+#define RING_SOCKNAME	"ibsschat-ring"
+
+/* The ring header, followed by the slots */
+struct ringhdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slotsize;
+	uint32_t pid;			/* The chat process writing the ring */
+	volatile uint32_t seq;	/* Sequence number of next message */
+};
+
+/* The doorbell, shared writable with the readers */
+struct ringbell {
+	volatile uint32_t waiters;	/* Readers sleeping on the futex */
+};
+
+/* A message in the ring */
+struct ringslot {
+	volatile uint32_t seq;	/* Sequence number + 1, zero while written */
+	struct message msg;
+};
+
+#define RING_SIZE \
+	(sizeof(struct ringhdr) + (RING_SLOTS * sizeof(struct ringslot)))
+
+#define ring_slot(hdr, n) \
+	(&((struct ringslot *)((uint8_t *)(hdr) + \
+		sizeof(struct ringhdr)))[(n) & ((hdr)->slots - 1)])
+
+/* Local routines */
+static void *ring_accept(void *);
+static int ring_sockaddr(struct sockaddr_un *);
+static void *ring_map(const char *, size_t, int, int *);
+static int futex(volatile uint32_t *, int, uint32_t, struct timespec *);
+
+/* Local variables */
+static struct ringhdr *ring = NULL;
+static struct ringbell *bell = NULL;
+static int ringfd = -1;		/* Read-only descriptor handed to clients */
+static int bellfd = -1;		/* Doorbell descriptor handed to clients */
+static lock_t ringlock;
+
+
+/*
+ * Futex system call.
+ */
+static int
+futex(volatile uint32_t *addr, int op, uint32_t val, struct timespec *ts)
+{
+	return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+
+/*
+ * Set up address of the abstract ring socket.
+ * Return the length of the address.
+ */
+static int
+ring_sockaddr(struct sockaddr_un *un)
+{
+	memset(un, 0x00, sizeof(struct sockaddr_un));
+	un->sun_family = AF_LOCAL;
+	memcpy(&un->sun_path[1], RING_SOCKNAME, strlen(RING_SOCKNAME));
+	return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(RING_SOCKNAME);
+}
+
+
+/*
+ * Create a memfd of size bytes and map it writable. The
+ * descriptor handed to clients is reopened with mode and stored
+ * in fdp. The ring is handed out read-only so clients can not
+ * map it writable, nor change its size.
+ * Return a pointer to the mapping on success, NULL on error.
+ */
+static void *
+ring_map(const char *name, size_t size, int mode, int *fdp)
+{
+#ifdef SYS_memfd_create
+	char path[64];
+	void *p;
+	int fd;
+
+	if ( (fd = syscall(SYS_memfd_create, name, 0)) < 0) {
+		anderrs("Failed to create message ring");
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		anderrs("Failed to set size of message ring");
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		anderrs("Failed to map message ring");
+		close(fd);
+		return NULL;
+	}
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	*fdp = open(path, mode | O_CLOEXEC);
+	close(fd);
+	if (*fdp < 0) {
+		anderrs("Failed to reopen message ring");
+		munmap(p, size);
+		return NULL;
+	}
+
+	memset(p, 0x00, size);
+	return p;
+#else
+	return NULL;
+#endif
+}
+
+
+/*
+ * Create the ring and start handing it out to clients.
+ * Return 0 on success, -1 on error.
+ */
+int
+ring_init(void)
+{
+#ifdef SYS_memfd_create
+	thread_memlock_init(&ringlock);
+
+	bell = ring_map("ibsschat-bell", sizeof(struct ringbell), O_RDWR, &bellfd);
+	if (bell == NULL)
+		return -1;
+
+	ring = ring_map("ibsschat-ring", RING_SIZE, O_RDONLY, &ringfd);
+	if (ring == NULL)
+		return -1;
+
+	ring->magic = RING_MAGIC;
+	ring->version = RING_VERSION;
+	ring->slots = RING_SLOTS;
+	ring->slotsize = sizeof(struct ringslot);
+	ring->pid = getpid();
+
+	if (thread_spawn(ring_accept, NULL) != 0)
+		return -1;
+
+	andlog("Message ring of %u messages (%u bytes) created\n",
+		RING_SLOTS, (unsigned int)RING_SIZE);
+	return 0;
+#else
+	andlog("No memfd support, message ring disabled\n");
+	return -1;
+#endif
+}
+
+
+/*
+ * Thread entry point.
+ * Pass the ring and doorbell descriptors to connecting clients.
+ */
+static void *
+ring_accept(void *arg)
+{
+	struct sockaddr_un un;
+	socklen_t len;
+	int sd;
+	int cfd;
+
+	if ( (sd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0) {
+		anderrs("Failed to create ring socket");
+		return NULL;
+	}
+
+	len = ring_sockaddr(&un);
+	if (bind(sd, (struct sockaddr *)&un, len) < 0) {
+		anderrs("Failed to bind ring socket");
+		close(sd);
+		return NULL;
+	}
+
+	if (listen(sd, 5) < 0) {
+		anderrs("Failed to listen on ring socket");
+		close(sd);
+		return NULL;
+	}
+
+	while ( (cfd = accept(sd, NULL, NULL)) >= 0) {
+		uint8_t cbuf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr *cmsg;
+		struct msghdr msg;
+		struct iovec iov;
+		uint32_t size = RING_SIZE;
+		int fds[2];
+
+		memset(&msg, 0x00, sizeof(msg));
+		memset(cbuf, 0x00, sizeof(cbuf));
+		iov.iov_base = &size;
+		iov.iov_len = sizeof(size);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		fds[0] = ringfd;
+		fds[1] = bellfd;
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+		if (sendmsg(cfd, &msg, 0) < 0)
+			anderrs("Failed to pass message ring to client");
+		else
+			andlog("Passed message ring to local client\n");
+		close(cfd);
+	}
+
+	anderrs("Failed to accept ring clients");
+	close(sd);
+	return NULL;
+}
+
+
+/*
+ * Publish message to the ring and wake up
+ * sleeping readers, if there are any.
+ */
+void
+ring_publish(struct message *m)
+{
+	struct ringslot *slot;
+	uint32_t seq;
+
+	if (ring == NULL)
+		return;
+
+	thread_memlock_lock(&ringlock);
+	seq = ring->seq;
+	slot = ring_slot(ring, seq);
+
+	slot->seq = 0;
+	__sync_synchronize();
+	memcpy(&slot->msg, m, sizeof(struct message));
+	__sync_synchronize();
+	slot->seq = seq + 1;
+	__sync_synchronize();
+	ring->seq = seq + 1;
+	thread_memlock_unlock(&ringlock);
+
+	/* Pairs with the barrier between counting a waiter
+	 * and checking the sequence number in ring_read() */
+	__sync_synchronize();
+	if (bell->waiters != 0)
+		futex(&ring->seq, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+
+/*
+ * Map the message ring of the local chat process.
+ * Reading start at the next published message.
+ * Return 0 on success, -1 on error.
+ */
+int
+ring_attach(struct ringreader *r)
+{
+	uint8_t cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct sockaddr_un un;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	uint32_t size = 0;
+	socklen_t len;
+	int sd;
+	int fds[2] = { -1, -1 };
+
+	memset(r, 0x00, sizeof(struct ringreader));
+
+	if ( (sd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	len = ring_sockaddr(&un);
+	if (connect(sd, (struct sockaddr *)&un, len) < 0) {
+		close(sd);
+		return -1;
+	}
+
+	memset(&msg, 0x00, sizeof(msg));
+	iov.iov_base = &size;
+	iov.iov_len = sizeof(size);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(sd, &msg, 0) != sizeof(size)) {
+		close(sd);
+		return -1;
+	}
+	close(sd);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		/* Older versions only pass the ring */
+		if ((cmsg->cmsg_level == SOL_SOCKET) &&
+				(cmsg->cmsg_type == SCM_RIGHTS)) {
+			size_t n = cmsg->cmsg_len - CMSG_LEN(0);
+
+			if (n > sizeof(fds))
+				n = sizeof(fds);
+			memcpy(fds, CMSG_DATA(cmsg), n);
+		}
+	}
+
+	if ((fds[0] < 0) || (fds[1] < 0)) {
+		if (fds[0] >= 0)
+			close(fds[0]);
+		fprintf(stderr, "** Error: Message ring version mismatch\n");
+		return -1;
+	}
+
+	r->hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fds[0], 0);
+	r->bell = mmap(NULL, sizeof(struct ringbell), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fds[1], 0);
+	close(fds[0]);
+	close(fds[1]);
+	if ((r->hdr == MAP_FAILED) || (r->bell == MAP_FAILED)) {
+		if (r->hdr != MAP_FAILED)
+			munmap(r->hdr, size);
+		if (r->bell != MAP_FAILED)
+			munmap(r->bell, sizeof(struct ringbell));
+		r->hdr = NULL;
+		r->bell = NULL;
+		return -1;
+	}
+
+	if ((r->hdr->magic != RING_MAGIC) || (r->hdr->version != RING_VERSION) ||
+			(r->hdr->slotsize != sizeof(struct ringslot)) ||
+			(size < sizeof(struct ringhdr) +
+				(r->hdr->slots * sizeof(struct ringslot)))) {
+		fprintf(stderr, "** Error: Message ring version mismatch\n");
+		munmap(r->hdr, size);
+		munmap(r->bell, sizeof(struct ringbell));
+		r->hdr = NULL;
+		r->bell = NULL;
+		return -1;
+	}
+
+	r->size = size;
+	r->seq = r->hdr->seq;
+	return 0;
+}
+
+
+/*
+ * Unmap the message ring.
+ */
+void
+ring_detach(struct ringreader *r)
+{
+	if (r->hdr != NULL) {
+		munmap(r->hdr, r->size);
+		munmap(r->bell, sizeof(struct ringbell));
+	}
+	r->hdr = NULL;
+	r->bell = NULL;
+}
+
+
+/*
+ * Read the next message from the ring into m, sleeping until
+ * one is published if wait is non zero. Messages that were
+ * overwritten before they were read are counted in r->lost.
+ * Return 1 if a message was read, 0 if there was none and
+ * -1 if the chat process writing the ring is gone.
+ */
+int
+ring_read(struct ringreader *r, struct message *m, int wait)
+{
+	struct ringhdr *hdr = r->hdr;
+
+	for (;;) {
+		struct ringslot *slot;
+		uint32_t head;
+		uint32_t s1;
+		uint32_t s2;
+		int ret;
+
+		head = hdr->seq;
+		__sync_synchronize();
+
+		if (head == r->seq) {
+			struct timespec ts;
+
+			if (wait == 0)
+				return 0;
+
+			/* Count us as waiting before the last check of the
+			 * sequence number, so the writer either sees us
+			 * or we see the new message */
+			__sync_fetch_and_add(&r->bell->waiters, 1);
+			if (hdr->seq != head) {
+				__sync_fetch_and_sub(&r->bell->waiters, 1);
+				continue;
+			}
+
+			ts.tv_sec = RING_WAIT_SEC;
+			ts.tv_nsec = 0;
+			ret = futex(&hdr->seq, FUTEX_WAIT, head, &ts);
+			__sync_fetch_and_sub(&r->bell->waiters, 1);
+			if ((ret < 0) && (errno == ETIMEDOUT)) {
+				if ((kill(hdr->pid, 0) < 0) && (errno == ESRCH))
+					return -1;
+			}
+			continue;
+		}
+
+		/* The writer lapped us */
+		if ((head - r->seq) > hdr->slots) {
+			r->lost += (head - r->seq) - hdr->slots;
+			r->seq = head - hdr->slots;
+		}
+
+		slot = ring_slot(hdr, r->seq);
+		s1 = slot->seq;
+		__sync_synchronize();
+		memcpy(m, (const void *)&slot->msg, sizeof(struct message));
+		__sync_synchronize();
+		s2 = slot->seq;
+
+		if ((s1 != r->seq + 1) || (s2 != s1)) {
+			r->lost++;
+			r->seq++;
+			continue;
+		}
+
+		r->seq++;
+		return 1;
+	}
+}
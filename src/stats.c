@@ -0,0 +1,285 @@
+/*
+ *    File: stats.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Runtime metrics of the chat process.
+ *
+ * Counters and histograms are updated with atomic adds from
+ * any thread, without locks. The histograms have log-linear
+ * buckets like HDR histograms, each power of two is split in
+ * STATS_SUB buckets so the relative error is bounded by
+ * 1/STATS_SUB over the whole 32 bit range.
+ *
+ * The metrics are written in the Prometheus text format to
+ * anyone connecting to an abstract UNIX socket (STATS_SOCKNAME),
+ * --metrics print them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ibsschat.h"
+
+/* Number of buckets per power of two, as a power of two */
+#define STATS_SUBBITS	3
+#define STATS_SUB		(1 << STATS_SUBBITS)
+
+/* Number of buckets to hold any 32 bit value */
+#define STATS_BUCKETS	((32 - STATS_SUBBITS + 1) * STATS_SUB)
+
+/* Name of the abstract UNIX socket serving the metrics */
+#define STATS_SOCKNAME	"ibsschat-stats"
+
+struct histogram {
+	uint64_t count[STATS_BUCKETS];
+	uint64_t sum;
+};
+
+/* Local routines */
+static void *stats_accept(void *);
+static int stats_sockaddr(struct sockaddr_un *);
+static uint32_t stats_bucket(uint32_t);
+static uint32_t stats_bucket_max(uint32_t);
+static void stats_write(FILE *);
+
+/* Local variables */
+static uint64_t counters[STATS_COUNTERS];
+static struct histogram hists[STATS_HISTS];
+
+static const struct {
+	const char *name;
+	const char *help;
+} counter_info[STATS_COUNTERS] = {
+	{ "ibsschat_packets_received_total", "Multicast packets received" },
+	{ "ibsschat_packets_sent_total", "Transmissions of local messages, including retransmissions" },
+	{ "ibsschat_packets_forwarded_total", "Messages forwarded" },
+	{ "ibsschat_duplicates_dropped_total", "Messages seen before and not forwarded" },
+	{ "ibsschat_replays_dropped_total", "Messages dropped by the replay window" },
+	{ "ibsschat_decrypt_failures_total", "Messages that failed to decrypt" },
+	{ "ibsschat_messages_unacked_total", "Local messages never acknowledged" },
+	{ "ibsschat_sync_received_bytes_total", "Bytes of messages read when synchronizing" },
+	{ "ibsschat_sync_sent_bytes_total", "Bytes of messages written to synchronizing nodes" },
+	{ "ibsschat_client_drops_total", "Messages not queued for slow clients" },
+	{ "ibsschat_messages_expired_total", "Messages dropped from the buffer when their time to live ran out" },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} hist_info[STATS_HISTS] = {
+	{ "ibsschat_ack_latency_microseconds", "Time from first transmission to acknowledge of local messages" },
+	{ "ibsschat_transmissions_per_message", "Transmissions of each local message" },
+	{ "ibsschat_client_queue_depth", "Messages queued for a client when a message is added" },
+};
+
+
+/*
+ * Set up address of the abstract stats socket.
+ * Return the length of the address.
+ */
+static int
+stats_sockaddr(struct sockaddr_un *un)
+{
+	memset(un, 0x00, sizeof(struct sockaddr_un));
+	un->sun_family = AF_LOCAL;
+	memcpy(&un->sun_path[1], STATS_SOCKNAME, strlen(STATS_SOCKNAME));
+	return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(STATS_SOCKNAME);
+}
+
+
+/*
+ * Start serving metrics.
+ * Return 0 on success, -1 on error.
+ */
+int
+stats_init(void)
+{
+	return thread_spawn(stats_accept, NULL);
+}
+
+
+/*
+ * Add n to counter.
+ */
+void
+stats_add(int counter, uint64_t n)
+{
+	__sync_fetch_and_add(&counters[counter], n);
+}
+
+
+/*
+ * Bucket of value.
+ */
+static uint32_t
+stats_bucket(uint32_t v)
+{
+	uint32_t shift;
+
+	if (v < STATS_SUB)
+		return v;
+
+	shift = (31 - __builtin_clz(v)) - STATS_SUBBITS;
+	return ((shift + 1) * STATS_SUB) + ((v >> shift) - STATS_SUB);
+}
+
+
+/*
+ * Largest value in bucket.
+ */
+static uint32_t
+stats_bucket_max(uint32_t b)
+{
+	uint32_t shift;
+	uint64_t mant;
+
+	if (b < STATS_SUB)
+		return b;
+
+	shift = (b / STATS_SUB) - 1;
+	mant = STATS_SUB + (b % STATS_SUB);
+	return (uint32_t)(((mant + 1) << shift) - 1);
+}
+
+
+/*
+ * Record value in histogram.
+ */
+void
+stats_record(int hist, uint32_t v)
+{
+	__sync_fetch_and_add(&hists[hist].count[stats_bucket(v)], 1);
+	__sync_fetch_and_add(&hists[hist].sum, v);
+}
+
+
+/*
+ * Write metrics in Prometheus text format.
+ * Only the buckets that have seen a value are written.
+ */
+static void
+stats_write(FILE *fp)
+{
+	int i;
+
+	for (i = 0; i < STATS_COUNTERS; i++) {
+		fprintf(fp, "# HELP %s %s\n", counter_info[i].name, counter_info[i].help);
+		fprintf(fp, "# TYPE %s counter\n", counter_info[i].name);
+		fprintf(fp, "%s %llu\n", counter_info[i].name,
+			(unsigned long long)counters[i]);
+	}
+
+	for (i = 0; i < STATS_HISTS; i++) {
+		const char *name = hist_info[i].name;
+		uint64_t total = 0;
+		uint32_t b;
+
+		fprintf(fp, "# HELP %s %s\n", name, hist_info[i].help);
+		fprintf(fp, "# TYPE %s histogram\n", name);
+
+		for (b = 0; b < STATS_BUCKETS; b++) {
+			if (hists[i].count[b] == 0)
+				continue;
+			total += hists[i].count[b];
+			fprintf(fp, "%s_bucket{le=\"%u\"} %llu\n", name,
+				stats_bucket_max(b), (unsigned long long)total);
+		}
+		fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+			(unsigned long long)total);
+		fprintf(fp, "%s_sum %llu\n", name, (unsigned long long)hists[i].sum);
+		fprintf(fp, "%s_count %llu\n", name, (unsigned long long)total);
+	}
+}
+
+
+/*
+ * Thread entry point.
+ * Write the metrics to connecting clients.
+ */
+static void *
+stats_accept(void *arg)
+{
+	struct sockaddr_un un;
+	socklen_t len;
+	int sd;
+	int cfd;
+
+	if ( (sd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0) {
+		anderrs("Failed to create stats socket");
+		return NULL;
+	}
+
+	len = stats_sockaddr(&un);
+	if (bind(sd, (struct sockaddr *)&un, len) < 0) {
+		anderrs("Failed to bind stats socket");
+		close(sd);
+		return NULL;
+	}
+
+	if (listen(sd, 5) < 0) {
+		anderrs("Failed to listen on stats socket");
+		close(sd);
+		return NULL;
+	}
+
+	while ( (cfd = accept(sd, NULL, NULL)) >= 0) {
+		FILE *fp;
+
+		if ( (fp = fdopen(cfd, "w")) == NULL) {
+			close(cfd);
+			continue;
+		}
+		stats_write(fp);
+		fclose(fp);
+	}
+
+	anderrs("Failed to accept stats clients");
+	close(sd);
+	return NULL;
+}
+
+
+/*
+ * Print the metrics of the local chat process.
+ * Return 0 on success, -1 on error.
+ */
+int
+stats_print(void)
+{
+	struct sockaddr_un un;
+	char buf[4096];
+	socklen_t len;
+	ssize_t n;
+	int sd;
+
+	if ( (sd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	len = stats_sockaddr(&un);
+	if (connect(sd, (struct sockaddr *)&un, len) < 0) {
+		fprintf(stderr, "** Error: Failed to connect to chat process: %s\n",
+			strerror(errno));
+		close(sd);
+		return -1;
+	}
+
+	while ( (n = read(sd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+
+	close(sd);
+	return (n < 0) ? -1 : 0;
+}
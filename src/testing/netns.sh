@@ -0,0 +1,341 @@
+#!/bin/bash
+
+#
+# Run a test network of ibsschat daemons on one Linux host.
+#
+# Each node runs in its own network namespace with a veth interface
+# on a common bridge. The topology is enforced by dropping packets
+# from non-neighbors with iptables in each node, as iptables-block.sh
+# does on the phones, and tc netem add loss and delay on the bridge
+# port of each node. All nodes then send messages at the same time
+# and the delivery ratio (as in data.txt), metrics and packet traces
+# (analyzed with tools/ibstrace) are collected.
+#
+# With -r, every node instead offer an open loop load of the given
+# rate (--chat-load) while all nodes measure the end-to-end latency
+# of the messages they receive (--chat-load-recv). Increase the rate
+# between runs to find the saturation point of the mesh.
+#
+# Requires root, ip, tc with netem (when loss or delay is set) and
+# iptables (for line and grid topologies).
+#
+
+NODES=6
+TOPO="line"
+WIDTH=0
+LOSS=0
+DELAY=0
+COUNT=150
+SENDDELAY=0
+RATE=0
+DURATION=10
+SENDERS=4
+SETTLE=10
+BUFSIZE=""
+MSGLOG=0
+OUT="netns-out"
+KEY="cryptokey"
+KEEP=0
+
+BINDIR="$(cd "$(dirname "$0")/.." && pwd)"
+IBSSCHAT="${BINDIR}/ibsschat"
+IBSTRACE="${BINDIR}/tools/ibstrace"
+IBSDATA="${BINDIR}/tools/ibsdata"
+
+HUB="ibss-hub"
+PREFIX="ibss-"
+
+usage()
+{
+	echo "Usage: $0 [options]"
+	echo "  -n <nodes>     Number of nodes, at most 150 ($NODES)"
+	echo "  -t <topology>  line, grid or clique ($TOPO)"
+	echo "  -w <width>     Width of grid (square root of nodes)"
+	echo "  -l <loss>      Packet loss in percent on each node ($LOSS)"
+	echo "  -d <ms>        Delay in milli seconds on each node ($DELAY)"
+	echo "  -m <count>     Messages sent by each node ($COUNT)"
+	echo "  -s <sec>       Delay between messages ($SENDDELAY)"
+	echo "  -r <msgs/sec>  Open loop load offered by each node, instead of -m"
+	echo "  -D <sec>       Duration of the open loop load ($DURATION)"
+	echo "  -L <senders>   Logical senders on each node ($SENDERS)"
+	echo "  -S <sec>       Time to wait for the network to settle ($SETTLE)"
+	echo "  -b <bytes>     Size of the message buffer of each node, K, M or G suffix"
+	echo "  -p             Log the messages of each node to <dir>/log-N"
+	echo "  -o <dir>       Output directory ($OUT)"
+	echo "  -k             Keep namespaces and daemons running"
+	echo "  -c             Clean up namespaces of an earlier run and exit"
+	exit 1
+}
+
+# Node IPv4 address
+ip_of()
+{
+	echo "10.10.0.$((100 + $1))"
+}
+
+# Return success if node $1 and $2 are neighbors
+neighbors()
+{
+	local a=$1
+	local b=$2
+	local w=$WIDTH
+
+	case "$TOPO" in
+		clique)
+			return 0
+			;;
+		line)
+			[ $((a - b)) -eq 1 ] || [ $((b - a)) -eq 1 ]
+			return
+			;;
+		grid)
+			a=$((a - 1)); b=$((b - 1))
+			if [ $((a / w)) -eq $((b / w)) ]; then
+				[ $((a - b)) -eq 1 ] || [ $((b - a)) -eq 1 ]
+				return
+			fi
+			[ $((a - b)) -eq $w ] || [ $((b - a)) -eq $w ]
+			return
+			;;
+	esac
+	return 1
+}
+
+cleanup()
+{
+	for ns in $(ip netns list | cut -d' ' -f1 | grep "^${PREFIX}"); do
+		ip netns pids "$ns" 2>/dev/null | xargs -r kill -9 2>/dev/null
+		ip netns del "$ns"
+	done
+}
+
+# Delivery and latency per sender and hop distance from the traces
+delivery()
+{
+	local topo=$TOPO
+
+	[ "$TOPO" = "clique" ] && topo="mesh"
+	if [ -x "$IBSDATA" ]; then
+		"$IBSDATA" -t $topo -w $WIDTH "$OUT" > "$OUT/delivery.txt" 2>&1
+	fi
+}
+
+while getopts "n:t:w:l:d:m:s:r:D:L:S:b:po:kch" opt; do
+	case "$opt" in
+		n) NODES=$OPTARG ;;
+		t) TOPO=$OPTARG ;;
+		w) WIDTH=$OPTARG ;;
+		l) LOSS=$OPTARG ;;
+		d) DELAY=$OPTARG ;;
+		m) COUNT=$OPTARG ;;
+		s) SENDDELAY=$OPTARG ;;
+		r) RATE=$OPTARG ;;
+		D) DURATION=$OPTARG ;;
+		L) SENDERS=$OPTARG ;;
+		S) SETTLE=$OPTARG ;;
+		b) BUFSIZE=$OPTARG ;;
+		p) MSGLOG=1 ;;
+		o) OUT=$OPTARG ;;
+		k) KEEP=1 ;;
+		c) cleanup; exit 0 ;;
+		*) usage ;;
+	esac
+done
+
+if [ "$(id -u)" != "0" ]; then
+	echo "** Error: root privileges required!"
+	exit 1
+fi
+
+if [ $NODES -lt 2 ] || [ $NODES -gt 150 ]; then
+	usage
+fi
+
+case "$TOPO" in
+	line|grid|clique) ;;
+	*) usage ;;
+esac
+
+if [ "$TOPO" = "grid" ] && [ $WIDTH -eq 0 ]; then
+	WIDTH=1
+	while [ $((WIDTH * WIDTH)) -lt $NODES ]; do
+		WIDTH=$((WIDTH + 1))
+	done
+fi
+
+if [ ! -x "$IBSSCHAT" ]; then
+	echo "** Error: $IBSSCHAT not found, run make linux"
+	exit 1
+fi
+
+if [ "$TOPO" != "clique" ] && ! which iptables >/dev/null 2>&1; then
+	echo "** Error: iptables is required for the $TOPO topology"
+	exit 1
+fi
+
+cleanup
+rm -rf "$OUT"
+mkdir -p "$OUT"
+OUT="$(cd "$OUT" && pwd)"
+
+if [ $KEEP -eq 0 ]; then
+	trap cleanup EXIT
+fi
+
+echo "[+] Creating $NODES nodes in $TOPO topology (loss ${LOSS}%, delay ${DELAY}ms)"
+ip netns add $HUB || exit 1
+ip -n $HUB link add br0 type bridge
+ip -n $HUB link set br0 up
+
+for i in $(seq 1 $NODES); do
+	ns="${PREFIX}$i"
+	ip netns add $ns
+	ip -n $HUB link add p$i type veth peer name eth0 netns $ns
+	ip -n $HUB link set p$i master br0
+	ip -n $HUB link set p$i up
+	ip -n $ns link set lo up
+	ip -n $ns link set eth0 up
+
+	# Loss and delay of packets to the node
+	if [ "$LOSS" != "0" ] || [ "$DELAY" != "0" ]; then
+		if ! ip netns exec $HUB tc qdisc add dev p$i root netem \
+				delay ${DELAY}ms loss ${LOSS}%; then
+			echo "** Error: tc netem is not available"
+			exit 1
+		fi
+	fi
+
+	# Drop everything from nodes out of range
+	if [ "$TOPO" != "clique" ]; then
+		for j in $(seq 1 $NODES); do
+			if [ $i -ne $j ] && ! neighbors $i $j; then
+				ip netns exec $ns iptables -A INPUT -s $(ip_of $j) -j DROP
+			fi
+		done
+	fi
+done
+
+echo "[+] Starting daemons"
+for i in $(seq 1 $NODES); do
+	if [ $MSGLOG -eq 1 ]; then
+		set -- "${BUFSIZE:--}" "$OUT/log-$i"
+	else
+		set -- $BUFSIZE
+	fi
+	ip netns exec ${PREFIX}$i "$IBSSCHAT" --daemon-nofork eth0 "$OUT/trace-$i" "$@" \
+		> "$OUT/node-$i.log" 2>&1 &
+	disown $!
+done
+sleep 2
+
+for i in $(seq 1 $NODES); do
+	if ! ip netns exec ${PREFIX}$i "$IBSSCHAT" --conf eth0 $(ip_of $i) \
+			255.255.255.0 ibss 1 "$KEY" > /dev/null; then
+		echo "** Error: Failed to configure node $i, see $OUT/node-$i.log"
+		exit 1
+	fi
+done
+sleep 3
+
+if [ "$RATE" != "0" ]; then
+	echo "[+] Offering $RATE messages/s from each node for $DURATION seconds"
+	for i in $(seq 1 $NODES); do
+		ip netns exec ${PREFIX}$i "$IBSSCHAT" --chat-load-recv eth0 \
+			$((DURATION + SETTLE + 1)) > "$OUT/latency-$i.txt" 2>&1 &
+		disown $!
+	done
+	sleep 1
+
+	PIDS=""
+	for i in $(seq 1 $NODES); do
+		ip netns exec ${PREFIX}$i "$IBSSCHAT" --chat-load eth0 $RATE $DURATION \
+			$SENDERS poisson > "$OUT/load-$i.txt" 2>&1 &
+		PIDS="$PIDS $!"
+	done
+	wait $PIDS
+	echo "[+] Load done, waiting $SETTLE seconds"
+	sleep $((SETTLE + 1))
+
+	printf "\nHost| received |  lost | p50 ms   | p99 ms\n"
+	echo "----+----------+-------+----------+----------"
+	for i in $(seq 1 $NODES); do
+		awk -v i=$i '/^Received/ { r = $2 } /^Lost/ { l = $2 } \
+			/^End-to-end latency/ { p50 = $6; p99 = $10 } \
+			END { printf "%3d | %8d | %5d | %8s | %8s\n", i, r, l, p50, p99 }' \
+			"$OUT/latency-$i.txt"
+	done
+
+	{
+		echo "nodes $NODES"
+		echo "topology $TOPO"
+		echo "loss $LOSS"
+		echo "delay $DELAY"
+		echo "offered_rate $(awk "BEGIN { print $RATE * $NODES }")"
+		cat "$OUT"/load-*.txt | awk '/^Sent / { s += $2 } /^Not acknowledged/ { f += $3 } \
+			END { printf "sent %d\nunacked %d\n", s, f }'
+		cat "$OUT"/latency-*.txt | awk '/^Received/ { r += $2 } /^Lost/ { l += $2 } \
+			/^Receive rate/ { t += $3 } \
+			/^End-to-end latency/ { if ($6 > p50) p50 = $6; if ($10 > p99) p99 = $10 } \
+			END { printf "received %d\nlost %d\nreceive_rate %.1f\n", r, l, t; \
+			printf "e2e_latency_p50_ms_max %s\ne2e_latency_p99_ms_max %s\n", p50, p99 }'
+	} > "$OUT/summary.txt"
+	echo
+	cat "$OUT/summary.txt"
+	delivery
+	echo "[+] Results in $OUT"
+	exit 0
+fi
+
+echo "[+] Sending $COUNT messages from each node"
+START=$(date +%s)
+SENDERS=""
+for i in $(seq 1 $NODES); do
+	ip netns exec ${PREFIX}$i "$IBSSCHAT" --chat-send-rand eth0 $COUNT $SENDDELAY \
+		> "$OUT/send-$i.log" 2>&1 &
+	SENDERS="$SENDERS $!"
+done
+wait $SENDERS
+echo "[+] Sent in $(($(date +%s) - START)) seconds, waiting $SETTLE seconds"
+sleep $SETTLE
+
+# Collect buffered messages, metrics and traces
+TOTAL=$((NODES * COUNT))
+SUM=0
+printf "\nHost| received | dropped%%\n"
+echo "----+----------+---------"
+for i in $(seq 1 $NODES); do
+	ns="${PREFIX}$i"
+	ip netns exec $ns "$IBSSCHAT" --chat-history eth0 > "$OUT/history-$i.txt" 2>&1
+	ip netns exec $ns "$IBSSCHAT" --metrics > "$OUT/metrics-$i.txt" 2>&1
+	n=$(grep '^\[' "$OUT/history-$i.txt" | grep -v -e '^\[cursor' -e '^\[discovered' | wc -l)
+	SUM=$((SUM + n))
+	printf "%3d | %8d | %7.2f\n" $i $n $(awk "BEGIN { print 100 * ($TOTAL - $n) / $TOTAL }")
+done
+
+RATIO=$(awk "BEGIN { print $SUM / ($TOTAL * $NODES) }")
+FWD=$(cat "$OUT"/metrics-*.txt | awk '/^ibsschat_packets_forwarded_total/ { s += $2 } END { print s + 0 }')
+DUPS=$(cat "$OUT"/metrics-*.txt | awk '/^ibsschat_duplicates_dropped_total/ { s += $2 } END { print s + 0 }')
+
+{
+	echo "nodes $NODES"
+	echo "topology $TOPO"
+	echo "loss $LOSS"
+	echo "delay $DELAY"
+	echo "messages $TOTAL"
+	printf "delivery_ratio %.4f\n" $RATIO
+	echo "forwarded $FWD"
+	echo "duplicates $DUPS"
+} > "$OUT/summary.txt"
+
+printf "\nDelivery ratio %.4f, %s forwarded, %s duplicates\n" $RATIO $FWD $DUPS
+
+if [ -x "$IBSTRACE" ]; then
+	"$IBSTRACE" stats "$OUT"/trace-* > "$OUT/trace-stats.txt" 2>&1
+	grep -e "duplicate ratio" -e "latency" "$OUT/trace-stats.txt"
+	awk '/^(Hop|Delivery|Ack) latency/ { n = tolower($1); \
+		printf "%s_latency_p50_ms %s\n%s_latency_p99_ms %s\n", n, $6, n, $10 }' \
+		"$OUT/trace-stats.txt" >> "$OUT/summary.txt"
+fi
+
+delivery
+echo "[+] Results in $OUT"
@@ -66,9 +66,9 @@ thread_spawn(void *(*start_func)(void *), void *arg)
  * Return 0 on success, -1 on error.
  */
 int
-thread_memlock_init(lock_t lock)
+thread_memlock_init(lock_t *lock)
 {
-	if (pthread_mutex_init(&lock, NULL) != 0) {
+	if (pthread_mutex_init(lock, NULL) != 0) {
 		anderrs("pthread_mutex_init failed");
 		return -1;
 	}
@@ -81,9 +81,9 @@ thread_memlock_init(lock_t lock)
  * Return 0 on success, -1 on error.
  */
 int
-thread_memlock_fini(lock_t lock)
+thread_memlock_fini(lock_t *lock)
 {
-	if (pthread_mutex_destroy(&lock) != 0) {
+	if (pthread_mutex_destroy(lock) != 0) {
 		anderrs("pthread_mutex_destroy failed");
 		return -1;
 	}
@@ -96,9 +96,9 @@ thread_memlock_fini(lock_t lock)
  * Return 0 on success, -1 on error.
  */
 int
-thread_memlock_lock(lock_t lock)
+thread_memlock_lock(lock_t *lock)
 {
-	if (pthread_mutex_destroy(&lock) != 0) {
+	if (pthread_mutex_lock(lock) != 0) {
 		anderrs("pthread_mutex_lock failed");
 		return -1;
 	}
@@ -111,9 +111,9 @@ thread_memlock_lock(lock_t lock)
  * Return 0 on success, -1 on error.
  */
 int
-thread_memlock_unlock(lock_t lock)
+thread_memlock_unlock(lock_t *lock)
 {
-	if (pthread_mutex_unlock(&lock) != 0) {
+	if (pthread_mutex_unlock(lock) != 0) {
 		anderrs("pthread_mutex_unlock failed");
 		return -1;
 	}
@@ -19,10 +19,10 @@ typedef pthread_mutex_t lock_t;
 
 /* thread.c */
 extern int thread_spawn(void *(*)(void *), void *);
-extern int thread_memlock_init(lock_t);
-extern int thread_memlock_fini(lock_t);
-extern int thread_memlock_lock(lock_t);
-extern int thread_memlock_unlock(lock_t);
+extern int thread_memlock_init(lock_t *);
+extern int thread_memlock_fini(lock_t *);
+extern int thread_memlock_lock(lock_t *);
+extern int thread_memlock_unlock(lock_t *);
 
 
 #endif /* _THREAD_H */
@@ -0,0 +1,1110 @@
+/*
+ *    File: ibsdata.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Delivery and latency analysis of test runs.
+ *
+ * A run is the output of every node in one experiment, either
+ * the transcripts of received messages (as printed by the chat
+ * client and kept in testing/data/<device>/<experiment>.txt),
+ * or the packet traces of the daemons (trace.c). A run
+ * is given as one of
+ *
+ *  - <dir>/<experiment>, the file <experiment> in every sub
+ *    directory of <dir>, named by the device that wrote it
+ *  - A directory, every transcript and trace file in it,
+ *    transcripts named by the file name without extension
+ *  - A single transcript or trace file
+ *
+ * Transcripts only tell what node they are from by name, the
+ * map file (-p, as testing/phones.txt) give the address of each
+ * name, and the order of the hosts in the tables.
+ *
+ * For each run the delivery ratio, duplicates (a message listed
+ * again in a transcript, or received again from the network in a
+ * trace), ordering inversions (messages received after a later
+ * message from the same sender) and latency are computed per
+ * sender and per hop distance (-t, by the order of the hosts), and
+ * a table of messages received per host and run is printed in the
+ * format of testing/data.txt. Latency require traces, transcripts
+ * do not hold the time a message was received.
+ *
+ * Usage: ibsdata [-p map] [-t line|grid|mesh] [-w width] [-m count] [-q] <run> ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "ibsschat.h"
+
+#define MAXNODES	256
+#define MAXRUNS		32
+#define MAXHOPS		32
+#define KEYLEN		96
+
+/* Files read of a receiver */
+#define FILE_TRANSCRIPT	1
+#define FILE_TRACE		2
+
+/* Hop distance when it is not known */
+#define HOP_NONE	-1
+
+/* A node, by IPv4 address */
+struct node {
+	uint32_t ip;
+	char name[64];		/* Name in the map file */
+	int host;			/* Row in tables, -1 until ordered */
+};
+
+/* A distinct message of a run */
+struct msg {
+	uint8_t key[KEYLEN];
+	uint8_t keylen;
+	uint8_t node;		/* Sender */
+	uint32_t seq;		/* Sequence number in text, 0 if none */
+	uint64_t sent;		/* First send at the origin (traces), 0 if unknown */
+};
+
+/* A message received by a node */
+struct receipt {
+	uint32_t msg;
+	uint8_t node;
+	uint8_t dup;		/* Duplicate reception (traces) */
+	uint64_t usec;		/* Time received (traces), 0 if unknown */
+};
+
+/* Latency samples */
+struct samples {
+	uint64_t *v;
+	size_t n;
+	size_t size;
+};
+
+struct run {
+	char label[64];
+	struct msg *msgs;
+	uint32_t nmsgs;
+	uint32_t msize;
+	uint32_t *hash;		/* Message index + 1, open addressing */
+	uint32_t hsize;
+	struct receipt *rcpts;
+	uint32_t nrcpts;
+	uint32_t rsize;
+	uint8_t files[MAXNODES];	/* FILE_ of receivers */
+};
+
+/* Local routines */
+static int node_get(uint32_t);
+static int node_byname(const char *);
+static int map_load(const char *);
+static void hosts_order(void);
+static int hops(int, int);
+static uint32_t fnv(const uint8_t *, size_t);
+static uint32_t msg_get(struct run *, const uint8_t *, size_t, int, int *);
+static void receipt_add(struct run *, int, uint32_t, uint64_t, int);
+static int transcript_load(struct run *, const char *, const char *);
+static int trace_load(struct run *, const char *);
+static int file_load(struct run *, const char *, const char *, int);
+static int run_load(struct run *, const char *);
+static void run_sent(struct run *, uint32_t *);
+static void run_received(struct run *, uint32_t *);
+static void run_report(struct run *);
+static void summary(void);
+static int u64cmp(const void *, const void *);
+static int nodecmp(const void *, const void *);
+static void sample_add(struct samples *, uint64_t);
+static uint64_t percentile(struct samples *, int);
+static void usage(const char *);
+
+/* Local variables */
+static struct node nodes[MAXNODES];
+static int nnodes = 0;
+static int nhosts = 0;
+static struct run runs[MAXRUNS];
+static int nruns = 0;
+static const char *topology = NULL;
+static int width = 0;
+static uint32_t count = 0;
+
+
+/*
+ * Index of node with address ip, added if new.
+ * Return -1 when there are too many nodes.
+ */
+static int
+node_get(uint32_t ip)
+{
+	int i;
+
+	for (i = 0; i < nnodes; i++) {
+		if (nodes[i].ip == ip)
+			return i;
+	}
+
+	if (nnodes == MAXNODES) {
+		fprintf(stderr, "** Error: More than %d nodes\n", MAXNODES);
+		return -1;
+	}
+
+	nodes[nnodes].ip = ip;
+	nodes[nnodes].name[0] = '\0';
+	nodes[nnodes].host = -1;
+	return nnodes++;
+}
+
+
+/*
+ * Index of node named name in the map, -1 if none.
+ */
+static int
+node_byname(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nnodes; i++) {
+		if (strcmp(nodes[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+/*
+ * Read map file with lines of "<ipv4> <name>".
+ * The hosts are ordered as in the file.
+ * Return 0 on success, -1 on error.
+ */
+static int
+map_load(const char *path)
+{
+	char line[256];
+	char name[64];
+	char ip[16];
+	FILE *fp;
+	int i;
+
+	if ( (fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "** Error: Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%15s %63s", ip, name) != 2)
+			continue;
+
+		if ((inet_addr(ip) == INADDR_NONE) ||
+				((i = node_get(inet_addr(ip))) < 0)) {
+			fprintf(stderr, "** Error: Invalid address '%s' in %s\n", ip, path);
+			fclose(fp);
+			return -1;
+		}
+		snprintf(nodes[i].name, sizeof(nodes[i].name), "%s", name);
+		nodes[i].host = nhosts++;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+
+/*
+ * Give the nodes that received messages in any run, and are not
+ * in the map, a row after the mapped hosts in address order.
+ */
+static void
+hosts_order(void)
+{
+	int i;
+	int r;
+
+	for (;;) {
+		int best = -1;
+
+		for (i = 0; i < nnodes; i++) {
+			if (nodes[i].host >= 0)
+				continue;
+
+			for (r = 0; r < nruns; r++) {
+				if (runs[r].files[i])
+					break;
+			}
+			if (r == nruns)
+				continue;
+
+			if ((best < 0) || (ntohl(nodes[i].ip) < ntohl(nodes[best].ip)))
+				best = i;
+		}
+
+		if (best < 0)
+			break;
+		nodes[best].host = nhosts++;
+	}
+}
+
+
+/*
+ * Hop distance between nodes a and b in the topology.
+ */
+static int
+hops(int a, int b)
+{
+	int ha = nodes[a].host;
+	int hb = nodes[b].host;
+
+	if ((topology == NULL) || (ha < 0) || (hb < 0))
+		return HOP_NONE;
+
+	if (strcmp(topology, "mesh") == 0)
+		return 1;
+
+	if (strcmp(topology, "line") == 0)
+		return abs(ha - hb);
+
+	/* Grid */
+	return abs((ha / width) - (hb / width)) + abs((ha % width) - (hb % width));
+}
+
+
+static uint32_t
+fnv(const uint8_t *p, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+
+/*
+ * Index of message with key in run, added with sender node if
+ * new. *added is set when the message was added.
+ */
+static uint32_t
+msg_get(struct run *r, const uint8_t *key, size_t keylen, int node, int *added)
+{
+	uint32_t h;
+	uint32_t i;
+
+	if (keylen > KEYLEN)
+		keylen = KEYLEN;
+
+	/* Keep the table at most half full */
+	if ((r->nmsgs + 1) * 2 > r->hsize) {
+		uint32_t size = (r->hsize == 0) ? 4096 : r->hsize * 2;
+		uint32_t *t;
+
+		if ( (t = calloc(size, sizeof(uint32_t))) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < r->nmsgs; i++) {
+			h = fnv(r->msgs[i].key, r->msgs[i].keylen) & (size - 1);
+			while (t[h] != 0)
+				h = (h + 1) & (size - 1);
+			t[h] = i + 1;
+		}
+		free(r->hash);
+		r->hash = t;
+		r->hsize = size;
+	}
+
+	h = fnv(key, keylen) & (r->hsize - 1);
+	while (r->hash[h] != 0) {
+		struct msg *m = &r->msgs[r->hash[h] - 1];
+
+		if ((m->keylen == keylen) && (memcmp(m->key, key, keylen) == 0)) {
+			*added = 0;
+			return r->hash[h] - 1;
+		}
+		h = (h + 1) & (r->hsize - 1);
+	}
+
+	if (r->nmsgs == r->msize) {
+		r->msize = (r->msize == 0) ? 4096 : r->msize * 2;
+		if ( (r->msgs = realloc(r->msgs, r->msize * sizeof(struct msg))) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(&r->msgs[r->nmsgs], 0x00, sizeof(struct msg));
+	memcpy(r->msgs[r->nmsgs].key, key, keylen);
+	r->msgs[r->nmsgs].keylen = keylen;
+	r->msgs[r->nmsgs].node = node;
+	r->hash[h] = ++r->nmsgs;
+	*added = 1;
+	return r->nmsgs - 1;
+}
+
+
+/*
+ * Add reception of message by node.
+ */
+static void
+receipt_add(struct run *r, int node, uint32_t msg, uint64_t usec, int dup)
+{
+	if (r->nrcpts == r->rsize) {
+		r->rsize = (r->rsize == 0) ? 4096 : r->rsize * 2;
+		if ( (r->rcpts = realloc(r->rcpts,
+				r->rsize * sizeof(struct receipt))) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	r->rcpts[r->nrcpts].msg = msg;
+	r->rcpts[r->nrcpts].node = node;
+	r->rcpts[r->nrcpts].dup = dup;
+	r->rcpts[r->nrcpts].usec = usec;
+	r->nrcpts++;
+}
+
+
+/*
+ * Read transcript of messages received by the node named name.
+ * Messages are lines of "[<ipv4> <hh:mm:ss>] <text>", where the
+ * text of test messages (--chat-send-rand) start with "<seq>_".
+ * Return 0 on success, -1 on error.
+ */
+static int
+transcript_load(struct run *r, const char *path, const char *name)
+{
+	uint8_t key[KEYLEN];
+	char line[512];
+	FILE *fp;
+	int recv;
+
+	if ( (recv = node_byname(name)) < 0) {
+		fprintf(stderr, "[+] %s: No address of %s in map, skipped\n", path, name);
+		return 0;
+	}
+
+	if ( (fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "** Error: Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	r->files[recv] = FILE_TRANSCRIPT;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		unsigned int h, m, s;
+		unsigned int seq;
+		uint32_t ip;
+		uint32_t i;
+		char ipbuf[16];
+		char *text;
+		int sender;
+		int added;
+		int off = 0;
+		size_t len;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		if ((sscanf(line, "[%15[0-9.] %u:%u:%u] %n", ipbuf, &h, &m, &s, &off) != 4) ||
+				(off == 0) || ((ip = inet_addr(ipbuf)) == INADDR_NONE))
+			continue;
+		text = &line[off];
+
+		if ( (sender = node_get(ip)) < 0) {
+			fclose(fp);
+			return -1;
+		}
+
+		len = strlen(text);
+		if (len + sizeof(ip) > KEYLEN)
+			len = KEYLEN - sizeof(ip);
+		memcpy(key, &ip, sizeof(ip));
+		memcpy(&key[sizeof(ip)], text, len);
+
+		i = msg_get(r, key, sizeof(ip) + len, sender, &added);
+		if (added) {
+			off = 0;
+			if ((sscanf(text, "%u%n", &seq, &off) == 1) && (text[off] == '_'))
+				r->msgs[i].seq = seq;
+		}
+		receipt_add(r, recv, i, 0, 0);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+
+/*
+ * Read the records of trace file path.
+ * Messages sent by the node count as received by it, messages
+ * queued for clients on other nodes are the receptions, and
+ * repeated receptions from the network are the duplicates.
+ * Return 0 on success, -1 on error.
+ */
+static int
+trace_load(struct run *r, const char *path)
+{
+	struct tracehdr *hdr;
+	struct tracerec *t;
+	struct stat sb;
+	uint32_t next;
+	uint32_t i;
+	int node;
+	int fd;
+
+	if ( (fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "** Error: Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if ((fstat(fd, &sb) < 0) || (sb.st_size < sizeof(struct tracehdr))) {
+		fprintf(stderr, "** Error: %s is not a trace file\n", path);
+		close(fd);
+		return -1;
+	}
+
+	hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		fprintf(stderr, "** Error: Failed to map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if ((hdr->magic != TRACE_MAGIC) || (hdr->version != TRACE_VERSION) ||
+			(hdr->recsize != sizeof(struct tracerec)) || (hdr->records == 0) ||
+			((hdr->records & (hdr->records - 1)) != 0) ||
+			(sb.st_size < sizeof(struct tracehdr) +
+				((uint64_t)hdr->records * sizeof(struct tracerec)))) {
+		fprintf(stderr, "** Error: %s is not a trace file of version %u\n",
+			path, TRACE_VERSION);
+		munmap(hdr, sb.st_size);
+		return -1;
+	}
+
+	if ( (node = node_get(hdr->node)) < 0) {
+		munmap(hdr, sb.st_size);
+		return -1;
+	}
+	r->files[node] = FILE_TRACE;
+
+	t = (struct tracerec *)(hdr + 1);
+	next = hdr->next;
+	i = (next > hdr->records) ? next - hdr->records : 0;
+
+	if (next > hdr->records)
+		fprintf(stderr, "[+] %s: %u oldest records overwritten\n",
+			path, next - hdr->records);
+
+	for (; i != next; i++) {
+		struct tracerec *rec = &t[i & (hdr->records - 1)];
+		uint32_t m;
+		int sender;
+		int added;
+
+		if ((rec->seq != i + 1) || (rec->type != CHAT_MSG))
+			continue;
+
+		if ( (sender = node_get(rec->id.ip)) < 0) {
+			munmap(hdr, sb.st_size);
+			return -1;
+		}
+
+		switch (rec->event) {
+			case TRACE_SEND:
+				m = msg_get(r, (uint8_t *)&rec->id, sizeof(struct msgid),
+					sender, &added);
+				if ((r->msgs[m].sent == 0) || (rec->usec < r->msgs[m].sent))
+					r->msgs[m].sent = rec->usec;
+				receipt_add(r, node, m, rec->usec, 0);
+				break;
+
+			case TRACE_DELIVER:
+				if (sender == node)
+					break;
+				m = msg_get(r, (uint8_t *)&rec->id, sizeof(struct msgid),
+					sender, &added);
+				receipt_add(r, node, m, rec->usec, 0);
+				break;
+
+			case TRACE_RECV:
+				if ((sender == node) || (rec->n < 2))
+					break;
+				m = msg_get(r, (uint8_t *)&rec->id, sizeof(struct msgid),
+					sender, &added);
+				receipt_add(r, node, m, rec->usec, 1);
+				break;
+		}
+	}
+
+	munmap(hdr, sb.st_size);
+	return 0;
+}
+
+
+/*
+ * Read trace in the first pass, or transcript in the second,
+ * other files are ignored. Transcripts of a run with traces
+ * are ignored, they tell messages apart by text and traces
+ * by message ID.
+ * Return 0 on success, -1 on error.
+ */
+static int
+file_load(struct run *r, const char *path, const char *name, int pass)
+{
+	uint8_t buf[sizeof(uint32_t)];
+	uint32_t magic;
+	FILE *fp;
+	int i;
+
+	if ( (fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "** Error: Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(buf, 0x00, sizeof(buf));
+	if (fread(buf, 1, sizeof(buf), fp) == 0)
+		buf[0] = '\0';
+	fclose(fp);
+
+	memcpy(&magic, buf, sizeof(magic));
+	if (magic == TRACE_MAGIC)
+		return (pass == 0) ? trace_load(r, path) : 0;
+	if (pass == 0)
+		return 0;
+
+	for (i = 0; i < nnodes; i++) {
+		if (r->files[i] == FILE_TRACE)
+			return 0;
+	}
+
+	/* Not a transcript either, such as the "[+]" output
+	 * of the sending client */
+	if ((buf[0] != '[') || (buf[1] == '+'))
+		return 0;
+	return transcript_load(r, path, name);
+}
+
+
+/*
+ * Read the files of run.
+ * Return 0 on success, -1 on error.
+ */
+static int
+run_load(struct run *r, const char *spec)
+{
+	char path[PATH_MAX * 2 + 256];
+	char name[PATH_MAX];
+	char dir[PATH_MAX];
+	char base[PATH_MAX];
+	char tmp[PATH_MAX];
+	struct dirent *de;
+	struct stat sb;
+	char *p;
+	DIR *dp;
+	int dirmode;
+	int files = 0;
+	int pass;
+
+	snprintf(tmp, sizeof(tmp), "%s", spec);
+	snprintf(dir, sizeof(dir), "%s", dirname(tmp));
+	snprintf(tmp, sizeof(tmp), "%s", spec);
+	snprintf(base, sizeof(base), "%s", basename(tmp));
+
+	snprintf(r->label, sizeof(r->label), "%.*s", (int)sizeof(r->label) - 1, base);
+	if (((p = strrchr(r->label, '.')) != NULL) && (strcmp(p, ".txt") == 0))
+		*p = '\0';
+
+	/* A single file, named by the file if it is in the
+	 * map, otherwise by its directory */
+	if ((stat(spec, &sb) == 0) && S_ISREG(sb.st_mode)) {
+		snprintf(name, sizeof(name), "%s", base);
+		if ( (p = strrchr(name, '.')) != NULL)
+			*p = '\0';
+		if (node_byname(name) < 0) {
+			snprintf(tmp, sizeof(tmp), "%s", dir);
+			snprintf(name, sizeof(name), "%s", basename(tmp));
+		}
+		if (file_load(r, spec, name, 0) < 0)
+			return -1;
+		return file_load(r, spec, name, 1);
+	}
+
+	/* Every file in directory, named by the file, or the
+	 * experiment in every device directory */
+	dirmode = (stat(spec, &sb) == 0) && S_ISDIR(sb.st_mode);
+	if ( (dp = opendir(dirmode ? spec : dir)) == NULL) {
+		fprintf(stderr, "** Error: Failed to open %s: %s\n",
+			dirmode ? spec : dir, strerror(errno));
+		return -1;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		rewinddir(dp);
+
+		while ( (de = readdir(dp)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+
+			if (dirmode)
+				snprintf(path, sizeof(path), "%s/%s", spec, de->d_name);
+			else
+				snprintf(path, sizeof(path), "%s/%s/%s", dir, de->d_name, base);
+			if ((stat(path, &sb) < 0) || !S_ISREG(sb.st_mode))
+				continue;
+
+			snprintf(name, sizeof(name), "%s", de->d_name);
+			if (dirmode && ((p = strrchr(name, '.')) != NULL))
+				*p = '\0';
+
+			if (file_load(r, path, name, pass) < 0) {
+				closedir(dp);
+				return -1;
+			}
+			files++;
+		}
+	}
+	closedir(dp);
+
+	if (files == 0) {
+		fprintf(stderr, "** Error: No files of %s\n", spec);
+		return -1;
+	}
+	return 0;
+}
+
+
+static int
+u64cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+/*
+ * Order node indexes by host, then address.
+ */
+static int
+nodecmp(const void *a, const void *b)
+{
+	const struct node *x = &nodes[*(const int *)a];
+	const struct node *y = &nodes[*(const int *)b];
+
+	if ((x->host >= 0) && (y->host >= 0))
+		return x->host - y->host;
+	if ((x->host >= 0) || (y->host >= 0))
+		return (x->host >= 0) ? -1 : 1;
+	return (ntohl(x->ip) < ntohl(y->ip)) ? -1 : (ntohl(x->ip) > ntohl(y->ip));
+}
+
+
+/*
+ * Add latency sample, in micro seconds.
+ */
+static void
+sample_add(struct samples *s, uint64_t usec)
+{
+	if (s->n == s->size) {
+		s->size = (s->size == 0) ? 1024 : s->size * 2;
+		if ( (s->v = realloc(s->v, s->size * sizeof(uint64_t))) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	s->v[s->n++] = usec;
+}
+
+
+/*
+ * Percentile p of sorted samples.
+ */
+static uint64_t
+percentile(struct samples *s, int p)
+{
+	return s->v[(s->n - 1) * p / 100];
+}
+
+
+/*
+ * Number of messages that each sender sent in run, the
+ * messages seen or the highest sequence number, unless
+ * given with -m.
+ */
+static void
+run_sent(struct run *r, uint32_t *sent)
+{
+	uint32_t *maxseq;
+	uint32_t i;
+
+	memset(sent, 0x00, MAXNODES * sizeof(uint32_t));
+	if ( (maxseq = calloc(MAXNODES, sizeof(uint32_t))) == NULL) {
+		fprintf(stderr, "** Error: Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < r->nmsgs; i++) {
+		sent[r->msgs[i].node]++;
+		if (r->msgs[i].seq > maxseq[r->msgs[i].node])
+			maxseq[r->msgs[i].node] = r->msgs[i].seq;
+	}
+
+	for (i = 0; i < MAXNODES; i++) {
+		if (maxseq[i] > sent[i])
+			sent[i] = maxseq[i];
+		if (count && sent[i])
+			sent[i] = count;
+	}
+	free(maxseq);
+}
+
+
+/*
+ * Received messages of each receiver in run, including their own.
+ */
+static void
+run_received(struct run *r, uint32_t *received)
+{
+	uint8_t *seen;
+	uint32_t i;
+
+	if ( (seen = calloc(r->nmsgs, MAXNODES)) == NULL) {
+		fprintf(stderr, "** Error: Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(received, 0x00, MAXNODES * sizeof(uint32_t));
+	for (i = 0; i < r->nrcpts; i++) {
+		struct receipt *rc = &r->rcpts[i];
+		uint8_t *s = &seen[(size_t)rc->msg * MAXNODES + rc->node];
+
+		if ((rc->dup == 0) && (*s == 0)) {
+			received[rc->node]++;
+			*s = 1;
+		}
+	}
+	free(seen);
+}
+
+
+/*
+ * Print delivery, duplicates, inversions and latency of run
+ * per sender and per hop distance.
+ */
+static void
+run_report(struct run *r)
+{
+	struct samples lat[MAXNODES];
+	struct samples hoplat[MAXHOPS];
+	uint32_t sent[MAXNODES];
+	uint32_t delivered[MAXNODES];
+	uint32_t expected[MAXNODES];
+	uint32_t dups[MAXNODES];
+	uint32_t inversions[MAXNODES];
+	uint64_t hopdelivered[MAXHOPS];
+	uint64_t hopexpected[MAXHOPS];
+	uint32_t *maxseq;
+	uint64_t *maxsent;
+	uint8_t *seen;
+	uint32_t total = 0;
+	int receivers = 0;
+	int order[MAXNODES];
+	uint32_t i;
+	int a;
+	int b;
+
+	run_sent(r, sent);
+	memset(lat, 0x00, sizeof(lat));
+	memset(hoplat, 0x00, sizeof(hoplat));
+	memset(delivered, 0x00, sizeof(delivered));
+	memset(expected, 0x00, sizeof(expected));
+	memset(dups, 0x00, sizeof(dups));
+	memset(inversions, 0x00, sizeof(inversions));
+	memset(hopdelivered, 0x00, sizeof(hopdelivered));
+	memset(hopexpected, 0x00, sizeof(hopexpected));
+
+	seen = calloc(r->nmsgs, MAXNODES);
+	maxseq = calloc(MAXNODES * MAXNODES, sizeof(uint32_t));
+	maxsent = calloc(MAXNODES * MAXNODES, sizeof(uint64_t));
+	if ((seen == NULL) || (maxseq == NULL) || (maxsent == NULL)) {
+		fprintf(stderr, "** Error: Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Messages each receiver should have got from each sender */
+	for (a = 0; a < nnodes; a++) {
+		if (r->files[a] == 0)
+			continue;
+		receivers++;
+
+		for (b = 0; b < nnodes; b++) {
+			int h = hops(a, b);
+
+			if ((a == b) || (sent[b] == 0))
+				continue;
+
+			expected[b] += sent[b];
+			if ((h >= 0) && (h < MAXHOPS))
+				hopexpected[h] += sent[b];
+		}
+	}
+
+	for (i = 0; i < r->nrcpts; i++) {
+		struct receipt *rc = &r->rcpts[i];
+		struct msg *m = &r->msgs[rc->msg];
+		uint8_t *s = &seen[(size_t)rc->msg * MAXNODES + rc->node];
+		size_t pair = (size_t)rc->node * MAXNODES + m->node;
+		int h;
+
+		if (rc->node == m->node)
+			continue;
+
+		if (rc->dup || *s) {
+			dups[m->node]++;
+			continue;
+		}
+		*s = 1;
+		delivered[m->node]++;
+
+		/* Received after a later message from the same sender */
+		if (m->seq) {
+			if (m->seq < maxseq[pair])
+				inversions[m->node]++;
+			else
+				maxseq[pair] = m->seq;
+		}
+		else if (m->sent) {
+			if (m->sent < maxsent[pair])
+				inversions[m->node]++;
+			else
+				maxsent[pair] = m->sent;
+		}
+
+		h = hops(rc->node, m->node);
+		if ((h >= 0) && (h < MAXHOPS))
+			hopdelivered[h]++;
+
+		if (m->sent && rc->usec && (rc->usec >= m->sent)) {
+			sample_add(&lat[m->node], rc->usec - m->sent);
+			if ((h >= 0) && (h < MAXHOPS))
+				sample_add(&hoplat[h], rc->usec - m->sent);
+		}
+	}
+
+	for (a = 0; a < nnodes; a++)
+		total += sent[a];
+
+	printf("\n%s: %d receivers, %u messages\n\n", r->label, receivers, total);
+	printf("Sender          |  sent | delivery |  dups | inversions | p50 ms   | p99 ms\n");
+	printf("----------------+-------+----------+-------+------------+----------+----------\n");
+	for (a = 0; a < nnodes; a++)
+		order[a] = a;
+	qsort(order, nnodes, sizeof(int), nodecmp);
+
+	for (a = 0; a < nnodes; a++) {
+		struct in_addr in;
+
+		b = order[a];
+		if (sent[b] == 0)
+			continue;
+
+		in.s_addr = nodes[b].ip;
+		printf("%-15s | %5u | %8.4f | %5u | %10u |", inet_ntoa(in), sent[b],
+			expected[b] ? (double)delivered[b] / expected[b] : 0.0,
+			dups[b], inversions[b]);
+
+		if (lat[b].n) {
+			qsort(lat[b].v, lat[b].n, sizeof(uint64_t), u64cmp);
+			printf(" %8.3f | %8.3f\n", percentile(&lat[b], 50) / 1000.0,
+				percentile(&lat[b], 99) / 1000.0);
+		}
+		else
+			printf(" %8s | %8s\n", "-", "-");
+		free(lat[b].v);
+	}
+
+	if (topology != NULL) {
+		printf("\nHops | delivery | p50 ms   | p90 ms   | p99 ms\n");
+		printf("-----+----------+----------+----------+----------\n");
+		for (a = 0; a < MAXHOPS; a++) {
+			if (hopexpected[a] == 0)
+				continue;
+
+			printf("%4d | %8.4f |", a, (double)hopdelivered[a] / hopexpected[a]);
+			if (hoplat[a].n) {
+				qsort(hoplat[a].v, hoplat[a].n, sizeof(uint64_t), u64cmp);
+				printf(" %8.3f | %8.3f | %8.3f\n",
+					percentile(&hoplat[a], 50) / 1000.0,
+					percentile(&hoplat[a], 90) / 1000.0,
+					percentile(&hoplat[a], 99) / 1000.0);
+			}
+			else
+				printf(" %8s | %8s | %8s\n", "-", "-", "-");
+			free(hoplat[a].v);
+		}
+	}
+
+	free(seen);
+	free(maxseq);
+	free(maxsent);
+}
+
+
+/*
+ * Print received messages per host and run,
+ * as the tables in testing/data.txt.
+ */
+static void
+summary(void)
+{
+	uint32_t received[MAXRUNS][MAXNODES];
+	uint32_t sent[MAXNODES];
+	uint32_t total[MAXRUNS];
+	int w[MAXRUNS];
+	int host;
+	int r;
+	int i;
+
+	for (r = 0; r < nruns; r++) {
+		run_sent(&runs[r], sent);
+		run_received(&runs[r], received[r]);
+
+		for (total[r] = 0, i = 0; i < nnodes; i++)
+			total[r] += sent[i];
+
+		w[r] = strlen(runs[r].label) + 2;
+		if (w[r] < 5)
+			w[r] = 5;
+	}
+
+	printf("Host|");
+	for (r = 0; r < nruns; r++)
+		printf(" %-*s|", w[r] - 1, runs[r].label);
+	printf("\n----+");
+	for (r = 0; r < nruns; r++)
+		printf("%.*s+", w[r], "----------------------------------------------------------------");
+	printf("\n");
+
+	for (host = 0; host < nhosts; host++) {
+		for (i = 0; nodes[i].host != host; i++)
+			;
+
+		printf("%3d |", host + 1);
+		for (r = 0; r < nruns; r++) {
+			if (runs[r].files[i])
+				printf(" %*u |", w[r] - 2, received[r][i]);
+			else
+				printf(" %*s |", w[r] - 2, "-");
+		}
+		printf("\n");
+	}
+
+	printf("avg |");
+	for (r = 0; r < nruns; r++) {
+		uint64_t sum = 0;
+		int n = 0;
+
+		for (i = 0; i < nnodes; i++) {
+			if (runs[r].files[i]) {
+				sum += received[r][i];
+				n++;
+			}
+		}
+		printf("%*.1f|", w[r], n ? (double)sum / n : 0.0);
+	}
+	printf(" (received msgs)\n");
+
+	printf("avg%%|");
+	for (r = 0; r < nruns; r++) {
+		double sum = 0;
+		int n = 0;
+
+		for (i = 0; i < nnodes; i++) {
+			if (runs[r].files[i] && total[r]) {
+				sum += 100.0 * (total[r] - received[r][i]) / total[r];
+				n++;
+			}
+		}
+		printf("%*.2f|", w[r], n ? sum / n : 0.0);
+	}
+	printf(" (dropped)\n");
+}
+
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr, "Usage: %s [options] <run> [run ...]\n", pname);
+	fprintf(stderr, "Run is <dir>/<experiment>, a directory or a file of transcripts or traces\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -p <map>       File of \"<ipv4> <name>\" lines giving the address\n");
+	fprintf(stderr, "                 of transcripts and the order of the hosts\n");
+	fprintf(stderr, "  -t <topology>  line, grid or mesh, for the hop distance of hosts\n");
+	fprintf(stderr, "  -w <width>     Width of grid (square root of hosts)\n");
+	fprintf(stderr, "  -m <count>     Messages sent by each sender\n");
+	fprintf(stderr, "  -q             Only print the table of received messages\n");
+	exit(EXIT_FAILURE);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int quiet = 0;
+	int opt;
+	int i;
+
+	while ( (opt = getopt(argc, argv, "p:t:w:m:qh")) != -1) {
+		switch (opt) {
+			case 'p':
+				if (map_load(optarg) < 0)
+					exit(EXIT_FAILURE);
+				break;
+			case 't': topology = optarg; break;
+			case 'w': width = atoi(optarg); break;
+			case 'm': count = strtoul(optarg, NULL, 0); break;
+			case 'q': quiet = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if ((optind == argc) || (argc - optind > MAXRUNS))
+		usage(argv[0]);
+
+	if ((topology != NULL) && (strcmp(topology, "line") != 0) &&
+			(strcmp(topology, "grid") != 0) && (strcmp(topology, "mesh") != 0))
+		usage(argv[0]);
+
+	for (i = optind; i < argc; i++) {
+		if (run_load(&runs[nruns++], argv[i]) < 0)
+			exit(EXIT_FAILURE);
+	}
+	hosts_order();
+
+	if ((topology != NULL) && (strcmp(topology, "grid") == 0) && (width == 0)) {
+		for (width = 1; width * width < nhosts; width++)
+			;
+	}
+
+	summary();
+	if (quiet == 0) {
+		for (i = 0; i < nruns; i++)
+			run_report(&runs[i]);
+	}
+
+	exit(EXIT_SUCCESS);
+}
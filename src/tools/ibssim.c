@@ -0,0 +1,800 @@
+/*
+ *    File: ibssim.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Mesh simulator.
+ *
+ * Runs any number of chat nodes in one process on a virtual
+ * clock, connected by a virtual radio with a configurable
+ * topology, per link loss and delay. The nodes use the real
+ * forwarding policy and resend schedule (mcast_forward(),
+ * mcast_resend_delay()) and the real message encryption, so
+ * changes to those can be evaluated here before field trials.
+ * The message buffer of each node is reduced to the number of
+ * times each message has been seen, which is all the forwarding
+ * decision depends on.
+ *
+ * Radio model: a node sends one message at a time, holding the
+ * medium for the airtime of a message. A node does not start
+ * sending while itself or a neighbor is sending (carrier sense),
+ * messages wait in a queue of limited length. Each neighbor gets
+ * a sent message with the loss probability and after the delay
+ * of the link. Nodes hear their own forwards, as they do through
+ * multicast loopback.
+ *
+ * Runs are deterministic for a given seed.
+ *
+ * Usage: ibssim [options]
+ *   -n <nodes>       Number of nodes (6)
+ *   -t <topology>    line, ring, mesh, grid, random or a file with
+ *                    one link per line: <node> <node> [loss] [delay-ms]
+ *                    with nodes numbered from 1 (line)
+ *   -w <width>       Width of grid (square root of nodes)
+ *   -r <radius>      Radio range of random topology in the unit square (0.3)
+ *   -m <messages>    Messages sent by each node (150)
+ *   -i <ms>          Interval between messages of a node (1000)
+ *   -l <loss>        Loss probability of links (0.0)
+ *   -d <ms>          Delay of links (1)
+ *   -j <ms>          Uniform random jitter added to the delay (1)
+ *   -a <usec>        Airtime of a message (1000)
+ *   -q <messages>    Length of send queue of nodes (256)
+ *   -N               Do not wait for acknowledgements
+ *   -s <seed>        Random seed (1)
+ *   -v               Print the table of nodes for any number of nodes
+ *
+ * Reproduce the line topology experiments in testing/data.txt with
+ * ibssim -t line -n 6 -m 150 -i <0|1000|2000>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "ibsschat.h"
+
+/* Simulator key */
+#define SIM_KEY		"ibssim"
+
+/* Print node table by default up to this many nodes */
+#define SIM_TABLE_NODES	32
+
+/* Events */
+#define EV_ORIGINATE	1	/* Node send new message */
+#define EV_TXTRY		2	/* Node try to start sending */
+#define EV_TXDONE		3	/* Node finished sending */
+#define EV_RX			4	/* Node received message */
+#define EV_ACKCHECK		5	/* Node check for acknowledge */
+
+struct event {
+	uint64_t t;		/* Virtual time in micro seconds */
+	uint64_t seq;	/* Order of events at the same time */
+	uint8_t type;
+	uint32_t node;
+	uint32_t from;
+	uint32_t msg;
+	uint32_t retry;
+};
+
+struct link {
+	uint32_t to;
+	double loss;
+	uint32_t delay;	/* Micro seconds */
+};
+
+struct node {
+	uint32_t ip;
+	struct link *links;
+	uint32_t nlinks;
+
+	/* Send queue of message indexes */
+	uint32_t *q;
+	uint32_t qhead;
+	uint32_t qtail;
+	int sending;
+	int trying;
+	uint64_t busy;	/* Medium busy until */
+
+	/* Statistics */
+	uint32_t received;	/* Remote messages received */
+	uint32_t acked;		/* Own messages acknowledged */
+	uint32_t noack;
+	uint32_t sent;		/* Transmissions of own messages */
+	uint32_t fwd;
+	uint32_t dups;		/* Copies of already seen messages */
+	uint32_t qdrops;
+	uint32_t baddec;
+};
+
+struct simmsg {
+	uint32_t origin;
+	uint64_t created;
+	struct message enc;	/* Encrypted message as sent */
+};
+
+/* Latency samples */
+struct samples {
+	uint64_t *v;
+	size_t n;
+	size_t size;
+};
+
+/* Local routines */
+static void ev_push(struct event *);
+static int ev_pop(struct event *);
+static void ev_add(uint64_t, uint8_t, uint32_t, uint32_t, uint32_t, uint32_t);
+static void link_add(uint32_t, uint32_t, double, uint32_t);
+static int topology(const char *, uint32_t, double);
+static void transmit(uint32_t, uint32_t);
+static void originate(uint32_t, uint32_t);
+static void txtry(uint32_t);
+static void txdone(uint32_t, uint32_t);
+static void rx(uint32_t, uint32_t, uint32_t);
+static void ackcheck(uint32_t, uint32_t, uint32_t);
+static double rnd(void);
+static void sample_add(struct samples *, uint64_t);
+static void sample_print(const char *, struct samples *);
+static int u64cmp(const void *, const void *);
+static void usage(const char *);
+
+/* Local variables */
+static struct event *heap;
+static size_t nheap;
+static size_t heapsize;
+static uint64_t evseq;
+static uint64_t events;
+static uint64_t now;
+
+static struct node *nodes;
+static uint32_t nnodes = 6;
+static struct simmsg *msgs;
+static uint32_t nmsgs;
+static uint32_t msgs_per_node = 150;
+static uint8_t *seen;	/* Times seen, nnodes x nmsgs */
+
+static double loss = 0.0;
+static uint32_t delay = 1000;
+static uint32_t jitter = 1000;
+static uint32_t airtime = 1000;
+static uint32_t qlen = 256;
+static int wantack = 1;
+
+static struct samples deliver = { NULL, 0, 0 };
+static struct samples ack = { NULL, 0, 0 };
+
+#define seen_of(n, m) seen[((size_t)(n) * nmsgs) + (m)]
+
+
+/*
+ * Uniform random number in [0, 1).
+ */
+static double
+rnd(void)
+{
+	return rand() / ((double)RAND_MAX + 1);
+}
+
+
+/*
+ * Event queue, a binary heap ordered on time.
+ */
+static void
+ev_push(struct event *e)
+{
+	size_t i;
+
+	if (nheap == heapsize) {
+		heapsize = (heapsize == 0) ? 4096 : heapsize * 2;
+		if ( (heap = realloc(heap, heapsize * sizeof(struct event))) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	i = nheap++;
+	while (i > 0) {
+		size_t p = (i - 1) / 2;
+
+		if ((heap[p].t < e->t) || ((heap[p].t == e->t) && (heap[p].seq < e->seq)))
+			break;
+		heap[i] = heap[p];
+		i = p;
+	}
+	heap[i] = *e;
+}
+
+static int
+ev_pop(struct event *e)
+{
+	struct event last;
+	size_t i = 0;
+
+	if (nheap == 0)
+		return 0;
+
+	*e = heap[0];
+	last = heap[--nheap];
+
+	for (;;) {
+		size_t c = (2 * i) + 1;
+
+		if (c >= nheap)
+			break;
+		if ((c + 1 < nheap) && ((heap[c + 1].t < heap[c].t) ||
+				((heap[c + 1].t == heap[c].t) && (heap[c + 1].seq < heap[c].seq))))
+			c++;
+		if ((last.t < heap[c].t) || ((last.t == heap[c].t) && (last.seq < heap[c].seq)))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+	return 1;
+}
+
+static void
+ev_add(uint64_t t, uint8_t type, uint32_t node, uint32_t from,
+	uint32_t msg, uint32_t retry)
+{
+	struct event e;
+
+	e.t = t;
+	e.seq = evseq++;
+	e.type = type;
+	e.node = node;
+	e.from = from;
+	e.msg = msg;
+	e.retry = retry;
+	ev_push(&e);
+}
+
+
+/*
+ * Add link in both directions.
+ */
+static void
+link_add(uint32_t a, uint32_t b, double l, uint32_t d)
+{
+	uint32_t i;
+
+	if (a == b)
+		return;
+
+	for (i = 0; i < nodes[a].nlinks; i++) {
+		if (nodes[a].links[i].to == b)
+			return;
+	}
+
+	nodes[a].links = realloc(nodes[a].links, (nodes[a].nlinks + 1) * sizeof(struct link));
+	nodes[b].links = realloc(nodes[b].links, (nodes[b].nlinks + 1) * sizeof(struct link));
+	if ((nodes[a].links == NULL) || (nodes[b].links == NULL)) {
+		fprintf(stderr, "** Error: Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	nodes[a].links[nodes[a].nlinks].to = b;
+	nodes[a].links[nodes[a].nlinks].loss = l;
+	nodes[a].links[nodes[a].nlinks].delay = d;
+	nodes[a].nlinks++;
+	nodes[b].links[nodes[b].nlinks].to = a;
+	nodes[b].links[nodes[b].nlinks].loss = l;
+	nodes[b].links[nodes[b].nlinks].delay = d;
+	nodes[b].nlinks++;
+}
+
+
+/*
+ * Create links of topology.
+ * Return 0 on success, -1 on error.
+ */
+static int
+topology(const char *name, uint32_t width, double radius)
+{
+	uint32_t i;
+	uint32_t j;
+
+	if (strcmp(name, "line") == 0) {
+		for (i = 1; i < nnodes; i++)
+			link_add(i - 1, i, loss, delay);
+		return 0;
+	}
+
+	if (strcmp(name, "ring") == 0) {
+		for (i = 0; i < nnodes; i++)
+			link_add(i, (i + 1) % nnodes, loss, delay);
+		return 0;
+	}
+
+	if (strcmp(name, "mesh") == 0) {
+		for (i = 0; i < nnodes; i++) {
+			for (j = i + 1; j < nnodes; j++)
+				link_add(i, j, loss, delay);
+		}
+		return 0;
+	}
+
+	if (strcmp(name, "grid") == 0) {
+		if (width == 0)
+			width = (uint32_t)ceil(sqrt(nnodes));
+		for (i = 0; i < nnodes; i++) {
+			if (((i % width) + 1 < width) && (i + 1 < nnodes))
+				link_add(i, i + 1, loss, delay);
+			if (i + width < nnodes)
+				link_add(i, i + width, loss, delay);
+		}
+		return 0;
+	}
+
+	if (strcmp(name, "random") == 0) {
+		double *x;
+		double *y;
+
+		x = calloc(nnodes, sizeof(double));
+		y = calloc(nnodes, sizeof(double));
+		if ((x == NULL) || (y == NULL)) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < nnodes; i++) {
+			x[i] = rnd();
+			y[i] = rnd();
+		}
+
+		for (i = 0; i < nnodes; i++) {
+			for (j = i + 1; j < nnodes; j++) {
+				double dx = x[i] - x[j];
+				double dy = y[i] - y[j];
+
+				if ((dx * dx) + (dy * dy) <= radius * radius)
+					link_add(i, j, loss, delay);
+			}
+		}
+		free(x);
+		free(y);
+		return 0;
+	}
+
+	/* Read links from file */
+	{
+		char line[256];
+		FILE *fp;
+		int lineno = 0;
+
+		if ( (fp = fopen(name, "r")) == NULL) {
+			fprintf(stderr, "** Error: Failed to open topology %s: %s\n",
+				name, strerror(errno));
+			return -1;
+		}
+
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			unsigned int a;
+			unsigned int b;
+			double l = loss;
+			double d = delay / 1000.0;
+			int n;
+
+			lineno++;
+			if ((line[0] == '#') || (line[0] == '\n'))
+				continue;
+
+			n = sscanf(line, "%u %u %lf %lf", &a, &b, &l, &d);
+			if ((n < 2) || (a < 1) || (b < 1) || (a > nnodes) || (b > nnodes)) {
+				fprintf(stderr, "** Error: %s:%d: Invalid link\n", name, lineno);
+				fclose(fp);
+				return -1;
+			}
+			link_add(a - 1, b - 1, l, (uint32_t)(d * 1000));
+		}
+		fclose(fp);
+	}
+	return 0;
+}
+
+
+/*
+ * Queue message for sending by node.
+ */
+static void
+transmit(uint32_t n, uint32_t m)
+{
+	struct node *nd = &nodes[n];
+
+	if ((nd->qtail - nd->qhead) >= qlen) {
+		nd->qdrops++;
+		return;
+	}
+
+	nd->q[nd->qtail++ % qlen] = m;
+	if ((nd->sending == 0) && (nd->trying == 0)) {
+		nd->trying = 1;
+		ev_add(now, EV_TXTRY, n, 0, 0, 0);
+	}
+}
+
+
+/*
+ * Node start sending if the medium is free.
+ */
+static void
+txtry(uint32_t n)
+{
+	struct node *nd = &nodes[n];
+	uint32_t m;
+	uint32_t i;
+
+	nd->trying = 0;
+	if (nd->sending || (nd->qtail == nd->qhead))
+		return;
+
+	if (nd->busy > now) {
+		nd->trying = 1;
+		ev_add(nd->busy, EV_TXTRY, n, 0, 0, 0);
+		return;
+	}
+
+	m = nd->q[nd->qhead++ % qlen];
+	nd->sending = 1;
+
+	/* Hold the medium of the node and its neighbors */
+	nd->busy = now + airtime;
+	for (i = 0; i < nd->nlinks; i++) {
+		struct node *nb = &nodes[nd->links[i].to];
+
+		if (nb->busy < now + airtime)
+			nb->busy = now + airtime;
+	}
+
+	ev_add(now + airtime, EV_TXDONE, n, 0, m, 0);
+}
+
+
+/*
+ * Node finished sending message, hand it to the neighbors.
+ */
+static void
+txdone(uint32_t n, uint32_t m)
+{
+	struct node *nd = &nodes[n];
+	uint32_t i;
+
+	for (i = 0; i < nd->nlinks; i++) {
+		struct link *l = &nd->links[i];
+		uint64_t t = now + l->delay;
+
+		if ((l->loss > 0) && (rnd() < l->loss))
+			continue;
+		if (jitter > 0)
+			t += rand() % jitter;
+		ev_add(t, EV_RX, l->to, n, m, 0);
+	}
+
+	/* Forwards come back through multicast loopback and are
+	 * added to the buffer, our own messages are ignored */
+	if ((msgs[m].origin != n) && (seen_of(n, m) != 0) && (seen_of(n, m) < 0xff))
+		seen_of(n, m)++;
+
+	nd->sending = 0;
+	if ((nd->qtail != nd->qhead) && (nd->trying == 0)) {
+		nd->trying = 1;
+		ev_add(now, EV_TXTRY, n, 0, 0, 0);
+	}
+}
+
+
+/*
+ * Node send a new message.
+ */
+static void
+originate(uint32_t n, uint32_t m)
+{
+	struct simmsg *sm = &msgs[m];
+	struct chatmsg *cm = (struct chatmsg *)&sm->enc;
+
+	memset(sm, 0x00, sizeof(struct simmsg));
+	sm->origin = n;
+	sm->created = now;
+	cm->type = CHAT_MSG;
+	cm->channel = CHAT_CHAN_DEFAULT;
+	cm->id.ip = nodes[n].ip;
+	cm->id.sec = htonl(m);
+	cm->id.usec = htons(n & 0xffff);
+	snprintf(cm->txt.msg, sizeof(cm->txt.msg), "%u_%u", n, m);
+
+	if (chat_crypto_encrypt(&sm->enc) < 0)
+		exit(EXIT_FAILURE);
+
+	seen_of(n, m) = 1;
+	nodes[n].sent++;
+	transmit(n, m);
+	if (wantack)
+		ev_add(now + mcast_resend_delay(1), EV_ACKCHECK, n, 0, m, 1);
+}
+
+
+/*
+ * Resend message until it has been seen twice,
+ * as mcast_send() does.
+ */
+static void
+ackcheck(uint32_t n, uint32_t m, uint32_t retry)
+{
+	if (seen_of(n, m) > 1)
+		return;
+
+	if (retry >= MSG_RESEND_TIMES) {
+		nodes[n].noack++;
+		seen_of(n, m) = 0;	/* Deleted from the buffer */
+		return;
+	}
+
+	retry++;
+	nodes[n].sent++;
+	transmit(n, m);
+	ev_add(now + mcast_resend_delay(retry), EV_ACKCHECK, n, 0, m, retry);
+}
+
+
+/*
+ * Node received message from neighbor.
+ */
+static void
+rx(uint32_t n, uint32_t from, uint32_t m)
+{
+	struct node *nd = &nodes[n];
+	struct chatmsg cm;
+	char expect[sizeof(cm.txt.msg)];
+	int s;
+	int fwd;
+
+	memcpy(&cm, &msgs[m].enc, sizeof(struct message));
+	snprintf(expect, sizeof(expect), "%u_%u", msgs[m].origin, m);
+	if ((chat_crypto_decrypt((struct message *)&cm) < 0) ||
+			(strcmp(cm.txt.msg, expect) != 0)) {
+		nd->baddec++;
+		return;
+	}
+
+	if (seen_of(n, m) < 0xff)
+		seen_of(n, m)++;
+	s = seen_of(n, m);
+
+	if (s > 1)
+		nd->dups++;
+	else if (msgs[m].origin != n) {
+		nd->received++;
+		sample_add(&deliver, now - msgs[m].created);
+	}
+
+	/* Own message acknowledged */
+	if ((msgs[m].origin == n) && (s == 2)) {
+		nd->acked++;
+		sample_add(&ack, now - msgs[m].created);
+	}
+
+	if ( (fwd = mcast_forward(s, from == msgs[m].origin)) != 0) {
+		nd->fwd++;
+		transmit(n, m);
+	}
+}
+
+
+static int
+u64cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+static void
+sample_add(struct samples *s, uint64_t usec)
+{
+	if (s->n == s->size) {
+		s->size = (s->size == 0) ? 1024 : s->size * 2;
+		if ( (s->v = realloc(s->v, s->size * sizeof(uint64_t))) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	s->v[s->n++] = usec;
+}
+
+
+/*
+ * Print percentiles of samples in milli seconds.
+ */
+static void
+sample_print(const char *name, struct samples *s)
+{
+	if (s->n == 0) {
+		printf("%-18s %8u samples\n", name, 0);
+		return;
+	}
+
+	qsort(s->v, s->n, sizeof(uint64_t), u64cmp);
+	printf("%-18s %8lu samples  p50 %9.3f  p90 %9.3f  p99 %9.3f  max %9.3f ms\n",
+		name, (unsigned long)s->n,
+		s->v[(s->n - 1) * 50 / 100] / 1000.0,
+		s->v[(s->n - 1) * 90 / 100] / 1000.0,
+		s->v[(s->n - 1) * 99 / 100] / 1000.0,
+		s->v[s->n - 1] / 1000.0);
+}
+
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr, "Usage: %s [options]\n", pname);
+	fprintf(stderr, "  -n <nodes>     Number of nodes (6)\n");
+	fprintf(stderr, "  -t <topology>  line, ring, mesh, grid, random or link file (line)\n");
+	fprintf(stderr, "  -w <width>     Width of grid\n");
+	fprintf(stderr, "  -r <radius>    Radio range of random topology (0.3)\n");
+	fprintf(stderr, "  -m <messages>  Messages sent by each node (150)\n");
+	fprintf(stderr, "  -i <ms>        Interval between messages of a node (1000)\n");
+	fprintf(stderr, "  -l <loss>      Loss probability of links (0.0)\n");
+	fprintf(stderr, "  -d <ms>        Delay of links (1)\n");
+	fprintf(stderr, "  -j <ms>        Random jitter added to delay (1)\n");
+	fprintf(stderr, "  -a <usec>      Airtime of a message (1000)\n");
+	fprintf(stderr, "  -q <messages>  Send queue length (256)\n");
+	fprintf(stderr, "  -N             Do not wait for acknowledgements\n");
+	fprintf(stderr, "  -s <seed>      Random seed (1)\n");
+	fprintf(stderr, "  -v             Print node table for any number of nodes\n");
+	exit(EXIT_FAILURE);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	const char *topo = "line";
+	struct timespec t0;
+	struct timespec t1;
+	struct event e;
+	uint64_t interval = 1000000;
+	uint64_t totsent = 0;
+	uint64_t totfwd = 0;
+	uint64_t totrecv = 0;
+	uint64_t totdups = 0;
+	uint64_t totqdrops = 0;
+	uint64_t totnoack = 0;
+	uint64_t totbad = 0;
+	double radius = 0.3;
+	unsigned int seed = 1;
+	uint32_t width = 0;
+	uint32_t i;
+	int verbose = 0;
+	int c;
+
+	while ( (c = getopt(argc, argv, "n:t:w:r:m:i:l:d:j:a:q:Ns:vh")) != -1) {
+		switch (c) {
+			case 'n': nnodes = strtoul(optarg, NULL, 0); break;
+			case 't': topo = optarg; break;
+			case 'w': width = strtoul(optarg, NULL, 0); break;
+			case 'r': radius = atof(optarg); break;
+			case 'm': msgs_per_node = strtoul(optarg, NULL, 0); break;
+			case 'i': interval = (uint64_t)(atof(optarg) * 1000); break;
+			case 'l': loss = atof(optarg); break;
+			case 'd': delay = (uint32_t)(atof(optarg) * 1000); break;
+			case 'j': jitter = (uint32_t)(atof(optarg) * 1000); break;
+			case 'a': airtime = strtoul(optarg, NULL, 0); break;
+			case 'q': qlen = strtoul(optarg, NULL, 0); break;
+			case 'N': wantack = 0; break;
+			case 's': seed = strtoul(optarg, NULL, 0); break;
+			case 'v': verbose = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if ((nnodes < 1) || (nnodes > 0xffff) || (msgs_per_node < 1) || (qlen < 1))
+		usage(argv[0]);
+
+	srand(seed);
+	nmsgs = nnodes * msgs_per_node;
+	nodes = calloc(nnodes, sizeof(struct node));
+	msgs = calloc(nmsgs, sizeof(struct simmsg));
+	seen = calloc((size_t)nnodes * nmsgs, 1);
+	if ((nodes == NULL) || (msgs == NULL) || (seen == NULL)) {
+		fprintf(stderr, "** Error: Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nnodes; i++) {
+		nodes[i].ip = htonl(0x0a000001 + i);
+		if ( (nodes[i].q = calloc(qlen, sizeof(uint32_t))) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (topology(topo, width, radius) < 0)
+		exit(EXIT_FAILURE);
+
+	if ((chat_crypto_init() < 0) || (chat_crypto_set_key(CHAT_CHAN_DEFAULT,
+			(uint8_t *)SIM_KEY, strlen(SIM_KEY), 0) < 0))
+		exit(EXIT_FAILURE);
+
+	/* Nodes start at random offsets within the first interval */
+	for (i = 0; i < nnodes; i++) {
+		uint64_t start = (interval > 0) ? (uint64_t)(rnd() * interval) : 0;
+		uint32_t k;
+
+		for (k = 0; k < msgs_per_node; k++)
+			ev_add(start + (k * interval), EV_ORIGINATE, i, 0,
+				(i * msgs_per_node) + k, 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (ev_pop(&e)) {
+		now = e.t;
+		events++;
+
+		switch (e.type) {
+			case EV_ORIGINATE: originate(e.node, e.msg); break;
+			case EV_TXTRY: txtry(e.node); break;
+			case EV_TXDONE: txdone(e.node, e.msg); break;
+			case EV_RX: rx(e.node, e.from, e.msg); break;
+			case EV_ACKCHECK: ackcheck(e.node, e.msg, e.retry); break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	printf("Nodes %u, topology %s, %u messages per node every %.3f s, %s\n",
+		nnodes, topo, msgs_per_node, interval / 1e6,
+		wantack ? "ACK required" : "no ACK");
+	printf("Loss %.3f, delay %.3f ms, jitter %.3f ms, airtime %u usec, seed %u\n",
+		loss, delay / 1000.0, jitter / 1000.0, airtime, seed);
+	printf("Virtual time %.3f s, %llu events in %.3f s\n\n", now / 1e6,
+		(unsigned long long)events, (t1.tv_sec - t0.tv_sec) +
+		((t1.tv_nsec - t0.tv_nsec) / 1e9));
+
+	/* Received messages counted as in testing/data.txt, own
+	 * messages when they are acknowledged */
+	if (verbose || (nnodes <= SIM_TABLE_NODES))
+		printf("Host | received | dropped%% |  sent | fwd   | dups  | noack | qdrops\n");
+
+	for (i = 0; i < nnodes; i++) {
+		struct node *nd = &nodes[i];
+		uint32_t got = nd->received + (wantack ? nd->acked : msgs_per_node);
+
+		if (verbose || (nnodes <= SIM_TABLE_NODES))
+			printf("%4u | %8u | %8.2f | %5u | %5u | %5u | %5u | %5u\n",
+				i + 1, got, 100.0 * (nmsgs - got) / nmsgs, nd->sent,
+				nd->fwd, nd->dups, nd->noack, nd->qdrops);
+
+		totrecv += got;
+		totsent += nd->sent;
+		totfwd += nd->fwd;
+		totdups += nd->dups;
+		totqdrops += nd->qdrops;
+		totnoack += nd->noack;
+		totbad += nd->baddec;
+	}
+
+	printf("\nReceived (avg)       %.1f of %u, %.2f%% dropped\n",
+		(double)totrecv / nnodes, nmsgs,
+		100.0 * (1.0 - ((double)totrecv / ((double)nnodes * nmsgs))));
+	printf("Transmissions        %llu sent, %llu forwarded, %.2f per message\n",
+		(unsigned long long)totsent, (unsigned long long)totfwd,
+		(double)(totsent + totfwd) / nmsgs);
+	printf("Duplicates           %llu, %.2f per message and node\n",
+		(unsigned long long)totdups, (double)totdups / ((double)nmsgs * nnodes));
+	printf("Not acknowledged     %llu\n", (unsigned long long)totnoack);
+	printf("Send queue drops     %llu\n", (unsigned long long)totqdrops);
+	if (totbad > 0)
+		printf("Decryption failures  %llu\n", (unsigned long long)totbad);
+
+	sample_print("Delivery latency", &deliver);
+	sample_print("Ack latency", &ack);
+	return 0;
+}
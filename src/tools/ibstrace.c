@@ -0,0 +1,505 @@
+/*
+ *    File: ibstrace.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Offline reader of the binary packet traces written by
+ * the chat process (trace.c).
+ *
+ * The dump command print the records of one trace in order.
+ * The stats command merge the traces of every node in a test
+ * and follow each message through the network:
+ *
+ *  - Hop latency, from the send or forward of a message by a
+ *    traced node to each reception of it from that node
+ *  - Delivery latency, from the first send at the origin to
+ *    the message being queued for clients on each other node
+ *  - Acknowledge latency, from the first send at the origin to
+ *    the origin seeing the message forwarded back
+ *  - Duplicates, receptions of a message after the first one
+ *    on the same node
+ *  - Forwards and drops by reason
+ *
+ * Latencies across nodes compare the clocks of the nodes, so
+ * they are only meaningful with synchronized clocks, as when
+ * all nodes run on the same host.
+ *
+ * Usage: ibstrace dump <trace-file>
+ *        ibstrace stats <trace-file> [trace-file ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ibsschat.h"
+
+/* A record read from a trace, with the node that wrote it */
+struct rec {
+	uint32_t node;
+	struct tracerec t;
+};
+
+/* Latency samples */
+struct samples {
+	uint64_t *v;
+	size_t n;
+	size_t size;
+};
+
+/* Local routines */
+static int trace_load(const char *, struct rec **, size_t *, size_t *);
+static int reccmp_time(const void *, const void *);
+static int reccmp_msg(const void *, const void *);
+static int u64cmp(const void *, const void *);
+static void sample_add(struct samples *, uint64_t);
+static void sample_print(const char *, struct samples *);
+static const char *event_name(uint8_t);
+static const char *reason_name(uint8_t, uint8_t);
+static int dump(const char *);
+static int stats(int, char **);
+static void usage(const char *);
+
+/* Local variables */
+static const char *fwd_reasons[] = {
+	"-", "first", "origin", "prob" };
+static const char *drop_reasons[] = {
+	"-", "size", "channel", "replay", "decrypt", "type", "self" };
+
+
+/*
+ * Read the records of trace file path and append them to recs.
+ * Records being written or overwritten when the trace was
+ * copied are skipped.
+ * Return 0 on success, -1 on error.
+ */
+static int
+trace_load(const char *path, struct rec **recs, size_t *n, size_t *size)
+{
+	struct tracehdr *hdr;
+	struct tracerec *t;
+	struct stat sb;
+	uint32_t next;
+	uint32_t i;
+	int fd;
+
+	if ( (fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "** Error: Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if ((fstat(fd, &sb) < 0) || (sb.st_size < sizeof(struct tracehdr))) {
+		fprintf(stderr, "** Error: %s is not a trace file\n", path);
+		close(fd);
+		return -1;
+	}
+
+	hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		fprintf(stderr, "** Error: Failed to map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if ((hdr->magic != TRACE_MAGIC) || (hdr->version != TRACE_VERSION) ||
+			(hdr->recsize != sizeof(struct tracerec)) || (hdr->records == 0) ||
+			((hdr->records & (hdr->records - 1)) != 0) ||
+			(sb.st_size < sizeof(struct tracehdr) +
+				((uint64_t)hdr->records * sizeof(struct tracerec)))) {
+		fprintf(stderr, "** Error: %s is not a trace file of version %u\n",
+			path, TRACE_VERSION);
+		munmap(hdr, sb.st_size);
+		return -1;
+	}
+
+	t = (struct tracerec *)(hdr + 1);
+	next = hdr->next;
+	i = (next > hdr->records) ? next - hdr->records : 0;
+
+	for (; i != next; i++) {
+		struct tracerec *r = &t[i & (hdr->records - 1)];
+
+		if (r->seq != i + 1)
+			continue;
+
+		if (*n == *size) {
+			*size = (*size == 0) ? 4096 : *size * 2;
+			if ( (*recs = realloc(*recs, *size * sizeof(struct rec))) == NULL) {
+				fprintf(stderr, "** Error: Out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		(*recs)[*n].node = hdr->node;
+		memcpy(&(*recs)[*n].t, r, sizeof(struct tracerec));
+		(*n)++;
+	}
+
+	if (next > hdr->records)
+		fprintf(stderr, "[+] %s: %u oldest records overwritten\n",
+			path, next - hdr->records);
+
+	munmap(hdr, sb.st_size);
+	return 0;
+}
+
+
+/*
+ * Order records by time.
+ */
+static int
+reccmp_time(const void *a, const void *b)
+{
+	const struct rec *ra = a;
+	const struct rec *rb = b;
+
+	if (ra->t.usec != rb->t.usec)
+		return (ra->t.usec < rb->t.usec) ? -1 : 1;
+	return 0;
+}
+
+
+/*
+ * Order records by message ID, then time.
+ */
+static int
+reccmp_msg(const void *a, const void *b)
+{
+	const struct rec *ra = a;
+	const struct rec *rb = b;
+	int ret;
+
+	if ( (ret = memcmp(&ra->t.id, &rb->t.id, sizeof(struct msgid))) != 0)
+		return ret;
+	return reccmp_time(a, b);
+}
+
+
+static int
+u64cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+
+/*
+ * Add latency sample, in micro seconds.
+ */
+static void
+sample_add(struct samples *s, uint64_t usec)
+{
+	if (s->n == s->size) {
+		s->size = (s->size == 0) ? 1024 : s->size * 2;
+		if ( (s->v = realloc(s->v, s->size * sizeof(uint64_t))) == NULL) {
+			fprintf(stderr, "** Error: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	s->v[s->n++] = usec;
+}
+
+
+/*
+ * Print percentiles of samples in milli seconds.
+ */
+static void
+sample_print(const char *name, struct samples *s)
+{
+	if (s->n == 0) {
+		printf("%-20s %8u samples\n", name, 0);
+		return;
+	}
+
+	qsort(s->v, s->n, sizeof(uint64_t), u64cmp);
+	printf("%-20s %8lu samples  p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n",
+		name, (unsigned long)s->n,
+		s->v[(s->n - 1) * 50 / 100] / 1000.0,
+		s->v[(s->n - 1) * 90 / 100] / 1000.0,
+		s->v[(s->n - 1) * 99 / 100] / 1000.0,
+		s->v[s->n - 1] / 1000.0);
+}
+
+
+static const char *
+event_name(uint8_t event)
+{
+	switch (event) {
+		case TRACE_SEND: return "send";
+		case TRACE_NOACK: return "noack";
+		case TRACE_RECV: return "recv";
+		case TRACE_FWD: return "fwd";
+		case TRACE_DROP: return "drop";
+		case TRACE_DELIVER: return "deliver";
+	}
+	return "?";
+}
+
+
+static const char *
+reason_name(uint8_t event, uint8_t reason)
+{
+	if ((event == TRACE_FWD) &&
+			(reason < sizeof(fwd_reasons) / sizeof(fwd_reasons[0])))
+		return fwd_reasons[reason];
+
+	if ((event == TRACE_DROP) &&
+			(reason < sizeof(drop_reasons) / sizeof(drop_reasons[0])))
+		return drop_reasons[reason];
+
+	return "-";
+}
+
+
+/*
+ * Print the records of a trace.
+ */
+static int
+dump(const char *path)
+{
+	struct rec *recs = NULL;
+	size_t size = 0;
+	size_t n = 0;
+	size_t i;
+
+	if (trace_load(path, &recs, &n, &size) < 0)
+		return -1;
+
+	qsort(recs, n, sizeof(struct rec), reccmp_time);
+
+	printf("# time node event reason msgid from channel type n\n");
+	for (i = 0; i < n; i++) {
+		struct tracerec *t = &recs[i].t;
+		struct in_addr node;
+		struct in_addr from;
+		char nbuf[INET_ADDRSTRLEN];
+		char fbuf[INET_ADDRSTRLEN];
+
+		node.s_addr = recs[i].node;
+		from.s_addr = t->from;
+		inet_ntop(AF_INET, &node, nbuf, sizeof(nbuf));
+		inet_ntop(AF_INET, &from, fbuf, sizeof(fbuf));
+
+		printf("%lu.%06lu %s %s %s %08x%08x%04x%04x %s %u %u %u\n",
+			(unsigned long)(t->usec / 1000000), (unsigned long)(t->usec % 1000000),
+			nbuf, event_name(t->event), reason_name(t->event, t->reason),
+			t->id.ip, t->id.sec, t->id.usec, t->id.sum,
+			(t->from != 0) ? fbuf : "-", t->channel, t->type, t->n);
+	}
+
+	free(recs);
+	return 0;
+}
+
+
+/*
+ * Merge traces and print statistics.
+ */
+static int
+stats(int nfiles, char **files)
+{
+	struct samples hop = { NULL, 0, 0 };
+	struct samples deliver = { NULL, 0, 0 };
+	struct samples ack = { NULL, 0, 0 };
+	unsigned long events[TRACE_DELIVER + 1];
+	unsigned long fwds[sizeof(fwd_reasons) / sizeof(fwd_reasons[0])];
+	unsigned long drops[sizeof(drop_reasons) / sizeof(drop_reasons[0])];
+	unsigned long msgs = 0;
+	unsigned long recvs = 0;
+	unsigned long uniq = 0;
+	unsigned long delivered = 0;
+	unsigned long nolink = 0;
+	unsigned long skew = 0;
+	struct rec *recs = NULL;
+	size_t size = 0;
+	size_t n = 0;
+	size_t i;
+	size_t j;
+	int f;
+
+	for (f = 0; f < nfiles; f++) {
+		if (trace_load(files[f], &recs, &n, &size) < 0)
+			return -1;
+	}
+
+	memset(events, 0x00, sizeof(events));
+	memset(fwds, 0x00, sizeof(fwds));
+	memset(drops, 0x00, sizeof(drops));
+
+	qsort(recs, n, sizeof(struct rec), reccmp_msg);
+
+	/* Each run of records with the same ID is one message,
+	 * in time order across all nodes */
+	for (i = 0; i < n; i = j) {
+		uint64_t sent = 0;
+		int origin = 0;
+		size_t k;
+
+		for (j = i; (j < n) && (memcmp(&recs[j].t.id,
+				&recs[i].t.id, sizeof(struct msgid)) == 0); j++) {
+			struct tracerec *t = &recs[j].t;
+
+			if (t->event <= TRACE_DELIVER)
+				events[t->event]++;
+			if ((t->event == TRACE_FWD) &&
+					(t->reason < sizeof(fwds) / sizeof(fwds[0])))
+				fwds[t->reason]++;
+			if ((t->event == TRACE_DROP) &&
+					(t->reason < sizeof(drops) / sizeof(drops[0])))
+				drops[t->reason]++;
+
+			/* First transmission at the origin */
+			if ((t->event == TRACE_SEND) && (sent == 0)) {
+				sent = t->usec;
+				origin = 1;
+			}
+		}
+
+		/* Dropped records, such as decryption failures,
+		 * are not part of the message statistics */
+		for (k = i; k < j; k++) {
+			if (recs[k].t.event != TRACE_DROP)
+				break;
+		}
+		if (k == j)
+			continue;
+		msgs++;
+
+		for (k = i; k < j; k++) {
+			struct tracerec *t = &recs[k].t;
+			size_t l;
+
+			if (t->event == TRACE_DELIVER) {
+				if (origin == 0)
+					continue;
+				if (t->usec < sent)
+					skew++;
+				else if (recs[k].node == t->id.ip)
+					sample_add(&ack, t->usec - sent);
+				else {
+					sample_add(&deliver, t->usec - sent);
+					delivered++;
+				}
+				continue;
+			}
+
+			if (t->event != TRACE_RECV)
+				continue;
+
+			/* Own transmissions heard back */
+			if (t->from == recs[k].node)
+				continue;
+
+			recvs++;
+
+			/* First reception on this node */
+			for (l = i; l < k; l++) {
+				if ((recs[l].node == recs[k].node) &&
+						(recs[l].t.event == TRACE_RECV) &&
+						(recs[l].t.from != recs[l].node))
+					break;
+			}
+			if (l == k)
+				uniq++;
+
+			/* The last transmission of the forwarder before the
+			 * reception, any later one is another copy */
+			for (l = k; l > i; l--) {
+				struct rec *s = &recs[l - 1];
+
+				if ((s->node == t->from) && ((s->t.event == TRACE_SEND) ||
+						(s->t.event == TRACE_FWD)))
+					break;
+			}
+
+			if (l > i)
+				sample_add(&hop, t->usec - recs[l - 1].t.usec);
+			else {
+				/* Forwarder not traced, or its clock is
+				 * ahead of the clock of this node */
+				for (l = k + 1; l < j; l++) {
+					if ((recs[l].node == t->from) &&
+							((recs[l].t.event == TRACE_SEND) ||
+							(recs[l].t.event == TRACE_FWD)))
+						break;
+				}
+				if (l < j)
+					skew++;
+				else
+					nolink++;
+			}
+		}
+	}
+
+	printf("Traces                %8d\n", nfiles);
+	printf("Records               %8lu\n", (unsigned long)n);
+	printf("Messages              %8lu\n", msgs);
+	for (f = TRACE_SEND; f <= TRACE_DELIVER; f++)
+		printf("  %-19s %8lu\n", event_name(f), events[f]);
+
+	printf("Forwards by reason\n");
+	for (f = 1; f < sizeof(fwds) / sizeof(fwds[0]); f++)
+		printf("  %-19s %8lu\n", fwd_reasons[f], fwds[f]);
+
+	printf("Drops by reason\n");
+	for (f = 1; f < sizeof(drops) / sizeof(drops[0]); f++)
+		printf("  %-19s %8lu\n", drop_reasons[f], drops[f]);
+
+	printf("Receptions            %8lu\n", recvs);
+	printf("  first on node       %8lu\n", uniq);
+	printf("  duplicate           %8lu\n", recvs - uniq);
+	printf("  duplicate ratio     %8.3f\n",
+		(recvs > 0) ? (double)(recvs - uniq) / recvs : 0.0);
+	printf("  forwarder untraced  %8lu\n", nolink);
+	printf("  clock skew          %8lu\n", skew);
+	printf("Remote deliveries     %8lu\n", delivered);
+
+	sample_print("Hop latency", &hop);
+	sample_print("Delivery latency", &deliver);
+	sample_print("Ack latency", &ack);
+
+	free(hop.v);
+	free(deliver.v);
+	free(ack.v);
+	free(recs);
+	return 0;
+}
+
+
+static void
+usage(const char *pname)
+{
+	fprintf(stderr, "Usage: %s dump <trace-file>\n", pname);
+	fprintf(stderr, "       %s stats <trace-file> [trace-file ...]\n", pname);
+	exit(EXIT_FAILURE);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 3)
+		usage(argv[0]);
+
+	if ((strcmp(argv[1], "dump") == 0) && (argc == 3))
+		exit(dump(argv[2]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if (strcmp(argv[1], "stats") == 0)
+		exit(stats(argc - 2, &argv[2]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	usage(argv[0]);
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ *    File: trace.c
+ * Version: 1.0
+ *    What: Part of IBSS Chat program
+ *  Author: Claes M. Nyberg
+ *   Where: Naval Postgraduate School
+ *    When: Spring 2018
+ *
+ * Binary packet trace.
+ *
+ * When the daemon is started with a trace file, the chat process
+ * record every message it sends, receives, forwards, drops and
+ * delivers to local clients as a fixed size record in a ring
+ * mapped from the file. Nothing is written or flushed per record,
+ * the kernel write the pages back, so tracing is cheap enough to
+ * leave on during test runs. The traces of all nodes in a test
+ * are analyzed offline with tools/ibstrace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ibsschat.h"
+
+/* Local variables */
+static char *tracepath = NULL;
+static struct tracehdr *trace = NULL;
+
+
+/*
+ * Set the trace file, to be opened by trace_open().
+ * Called before the chat process is forked.
+ */
+void
+trace_config(const char *path)
+{
+	free(tracepath);
+	tracepath = (path != NULL) ? strdup(path) : NULL;
+}
+
+
+/*
+ * Open the trace file, if one is configured, and map it.
+ * A trace of the same node is continued, so that a restarted
+ * chat process append to it, otherwise the file is created.
+ * node is the IPv4 address of this node.
+ * Return 0 on success, -1 on error.
+ */
+int
+trace_open(uint32_t node)
+{
+	struct timespec ts;
+	struct stat sb;
+	int fd;
+
+	if (tracepath == NULL)
+		return 0;
+
+	if ( (fd = open(tracepath, O_RDWR | O_CREAT, 0644)) < 0) {
+		anderrs("Failed to open trace file");
+		return -1;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		anderrs("Failed to stat trace file");
+		close(fd);
+		return -1;
+	}
+
+	if ((sb.st_size != TRACE_SIZE) && (ftruncate(fd, TRACE_SIZE) < 0)) {
+		anderrs("Failed to set size of trace file");
+		close(fd);
+		return -1;
+	}
+
+	trace = mmap(NULL, TRACE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		anderrs("Failed to map trace file");
+		trace = NULL;
+		return -1;
+	}
+
+	if ((sb.st_size == TRACE_SIZE) && (trace->magic == TRACE_MAGIC) &&
+			(trace->version == TRACE_VERSION) && (trace->node == node) &&
+			(trace->records == TRACE_RECORDS) &&
+			(trace->recsize == sizeof(struct tracerec))) {
+		andlog("Tracing messages to %s, continuing after %u records\n",
+			tracepath, trace->next);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(trace, 0x00, TRACE_SIZE);
+	trace->magic = TRACE_MAGIC;
+	trace->version = TRACE_VERSION;
+	trace->records = TRACE_RECORDS;
+	trace->recsize = sizeof(struct tracerec);
+	trace->node = node;
+	trace->start = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+	trace->next = 0;
+
+	andlog("Tracing messages to %s\n", tracepath);
+	return 0;
+}
+
+
+/*
+ * Record event for message m, which may be encrypted since
+ * only the cleartext header is used. from is the address
+ * of the node the message was received from, n is the number
+ * of times the message have been seen (or sent, or the number
+ * of clients it was delivered to).
+ */
+void
+trace_event(uint8_t event, uint8_t reason, struct message *m,
+	uint32_t from, uint32_t n)
+{
+	struct tracerec *t;
+	struct timespec ts;
+	uint32_t i;
+
+	if (trace == NULL)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	i = __sync_fetch_and_add(&trace->next, 1);
+	t = &((struct tracerec *)(trace + 1))[i & (TRACE_RECORDS - 1)];
+
+	/* Invalidate record while it is written */
+	t->seq = 0;
+	__sync_synchronize();
+	t->usec = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+	memcpy(&t->id, &m->id, sizeof(struct msgid));
+	t->from = from;
+	t->n = (n > 0xffff) ? 0xffff : n;
+	t->event = event;
+	t->reason = reason;
+	t->channel = m->channel;
+	t->type = m->type;
+	__sync_synchronize();
+	t->seq = i + 1;
+}
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 
@@ -28,7 +29,8 @@
 
 
 /*
- * Write to Android log
+ * Write to Android log, or record the message
+ * if asynchronous logging is running
  */
 void
 andlog(const char *fmt, ...)
@@ -36,6 +38,13 @@ andlog(const char *fmt, ...)
 	va_list ap;
 
 	va_start(ap, fmt);
+	if (log_record(ANDLOG_INFO, fmt, ap) == 0) {
+		va_end(ap);
+		return;
+	}
+	va_end(ap);
+
+	va_start(ap, fmt);
 
 #if __ANDROID__
 	__android_log_vprint(ANDROID_LOG_VERBOSE, 
@@ -48,6 +57,35 @@ andlog(const char *fmt, ...)
 #endif
 }
 
+/*
+ * Write debug message, called through anddebug()
+ * which is compiled away below ANDLOG_DEBUG
+ */
+void
+andlog_debug(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (log_record(ANDLOG_DEBUG, fmt, ap) == 0) {
+		va_end(ap);
+		return;
+	}
+	va_end(ap);
+
+	va_start(ap, fmt);
+
+#if __ANDROID__
+	__android_log_vprint(ANDROID_LOG_DEBUG, 
+		ANDROID_LOG_TAG, fmt, ap);
+	va_end(ap);
+#else
+	vprintf(fmt, ap);
+	va_end(ap);
+
+#endif
+}
+
 /*
  * Write error message to Android log
  * and append the error string for the
@@ -189,36 +227,35 @@ fork_twice()
 }
 
 
+
 /*
- * read random bytes non blocking.
- * Returns the number of bytes read on success.
+ * Parse a size in bytes, with an optional K, M or G suffix.
+ * Return the size on success, zero on error.
  */
-int
-getrand_nonblock(uint8_t *buf, size_t len)
+size_t
+size_parse(const char *str)
 {
-	int fd;
-	size_t n = 0;
-
-	if ( (fd = open("/dev/urandom", O_RDONLY)) > 0) 
-		n = read(fd, buf, len);
-	else {
-		anderrs("Failed to open /dev/urandom");
-	}
-
-
-	/* Fallback if /dev/urandom fail */
-	if ((fd < 0) || (n != len)) {
-		struct timeval tv;
-		size_t i;
-
-		gettimeofday(&tv, NULL);
-		srand(tv.tv_sec ^tv.tv_usec ^ getpid());
-		for (i=0; i < len; i++)
-			buf[i] = rand() & 0xff;
-	}
+    unsigned long long n;
+    int shift = 0;
+    char *end;
+
+    errno = 0;
+    n = strtoull(str, &end, 10);
+    if ((errno != 0) || (end == str))
+        return 0;
+
+    switch (*end) {
+        case 'G': case 'g': shift = 30; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'K': case 'k': shift = 10; end++; break;
+    }
 
-	if (fd >= 0)
-		close(fd);
+    /* Reject sizes that do not fit after the suffix is applied */
+    if ((*end != '\0') || (n > (ULLONG_MAX >> shift)))
+        return 0;
 
-	return len;
+    n <<= shift;
+    if (n > SIZE_MAX)
+        return 0;
+    return (size_t)n;
 }
@@ -278,7 +278,7 @@ wiface_status(int ifd, struct wiface *w)
     	w->mode = wrq.u.mode;
 
 	/* Get the encryption key */
-	if (chat_crypto_get_key(w->key) == 0) {
+	if (chat_crypto_get_key(CHAT_CHAN_DEFAULT, w->key, &w->key_epoch) == 0) {
 		anderr("** Error: Failed to get encryption key for interface %s\n",
 			w->iface);
 	}
@@ -315,6 +315,14 @@ wiface_conf(int ifd, struct wiface *w)
 	ifconfig_set(w->iface, w->ipv4, w->mask);
 	ifconfig_up(w->iface);
 
+	/* Wired and virtual interfaces, as in testing/netns.sh,
+	 * only get the address and key */
+	if (ioctl(ifd, SIOCGIWNAME, &wrq) < 0) {
+		andlog("%s is not a wireless interface, skipping wireless configuration\n",
+			w->iface);
+		goto setkey;
+	}
+
 	/* Set mode */
 	wrq.u.mode = w->mode;
 	andlog("Setting mode to %d for %s\n", w->mode, w->iface);
@@ -366,7 +374,9 @@ wiface_conf(int ifd, struct wiface *w)
 	}
 
 	/* Set the encryption key */
-	chat_crypto_set_key(w->key, strlen((char *)w->key));
+	setkey:
+	chat_crypto_set_key(CHAT_CHAN_DEFAULT, w->key, strlen((char *)w->key), 
+		w->key_epoch);
 
 	finished:
 		wlock = 0;